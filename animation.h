@@ -0,0 +1,377 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "camera.h"
+#include "color.h"
+#include "denoise.h"
+#include "image.h"
+#include "render.h"
+#include "scene.h"
+#include "scenefile.h"
+#include "threadpool.h"
+#include "vec3.h"
+
+// Animations: a run of frames rendered in one process, the camera and any
+// number of spheres moving between keyframes. Everything that doesn't
+// change between frames is set up once: the thread pool, the film and tile
+// buffers (render_args_t), two frame buffers and the BVH, which is refit
+// around the spheres' new positions each frame rather than rebuilt. Frames
+// are written by a thread of their own, so encoding frame n overlaps
+// rendering frame n + 1.
+//
+// An animation file has one keyframe per line, and values in between are
+// interpolated linearly (and held before the first and after the last):
+//
+//   frames 48
+//   camera <frame> <lookfrom x y z> <lookat x y z> <vfov> <defocus angle> <focus dist>
+//   sphere <frame> <sphere> <center x y z>
+//
+// spheres are numbered in the order the scene added them (or the scene
+// file lists them). without camera lines the camera stays where it was.
+
+#define ANIMATION_LINE_MAX 256
+
+typedef struct {
+  int frame;
+  point3_t lookfrom;
+  point3_t lookat;
+  float vfov;
+  float defocus_angle;
+  float focus_dist;
+} camera_key_t;
+
+typedef struct {
+  int frame;
+  uint32_t sphere;
+  point3_t center;
+} sphere_key_t;
+
+typedef struct {
+  int n_frames;
+  // sorted by frame
+  camera_key_t *camera_keys;
+  size_t n_camera_keys;
+  // sorted by sphere, then frame
+  sphere_key_t *sphere_keys;
+  size_t n_sphere_keys;
+} animation_t;
+
+int compare_camera_keys(const void *a, const void *b) {
+  return ((const camera_key_t *)a)->frame - ((const camera_key_t *)b)->frame;
+}
+
+int compare_sphere_keys(const void *a, const void *b) {
+  const sphere_key_t *ka = a, *kb = b;
+  if (ka->sphere != kb->sphere) {
+    return ka->sphere < kb->sphere ? -1 : 1;
+  }
+  return ka->frame - kb->frame;
+}
+
+void free_animation(animation_t *animation) {
+  free(animation->camera_keys);
+  free(animation->sphere_keys);
+  free(animation);
+}
+
+// reads an animation file for a scene of n_spheres spheres. NULL, having
+// said what's wrong, if it can't.
+animation_t *load_animation(const char *path, size_t n_spheres) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    printf("couldn't open %s\n", path);
+    return NULL;
+  }
+  animation_t *animation = malloc(sizeof(animation_t));
+  *animation = (animation_t){.n_frames = 1};
+  size_t camera_capacity = 0, sphere_capacity = 0;
+  char line[ANIMATION_LINE_MAX];
+  int line_number = 0;
+  bool ok = true;
+  while (ok && fgets(line, sizeof(line), fp) != NULL) {
+    line_number++;
+    if (blank_scene_line(line)) {
+      continue;
+    }
+    camera_key_t camera;
+    sphere_key_t sphere;
+    float *from = camera.lookfrom.e, *at = camera.lookat.e, *c = sphere.center.e;
+    char extra;
+    if (sscanf(line, " frames %d %c", &animation->n_frames, &extra) == 1 && animation->n_frames > 0) {
+      continue;
+    }
+    if (sscanf(line, " camera %d %f %f %f %f %f %f %f %f %f %c", &camera.frame, &from[0], &from[1], &from[2], &at[0], &at[1], &at[2],
+               &camera.vfov, &camera.defocus_angle, &camera.focus_dist, &extra) == 10) {
+      if (animation->n_camera_keys == camera_capacity) {
+        camera_capacity = camera_capacity > 0 ? 2 * camera_capacity : 16;
+        animation->camera_keys = realloc(animation->camera_keys, camera_capacity * sizeof(camera_key_t));
+      }
+      animation->camera_keys[animation->n_camera_keys++] = camera;
+      continue;
+    }
+    if (sscanf(line, " sphere %d %u %f %f %f %c", &sphere.frame, &sphere.sphere, &c[0], &c[1], &c[2], &extra) == 5
+        && sphere.sphere < n_spheres) {
+      if (animation->n_sphere_keys == sphere_capacity) {
+        sphere_capacity = sphere_capacity > 0 ? 2 * sphere_capacity : 64;
+        animation->sphere_keys = realloc(animation->sphere_keys, sphere_capacity * sizeof(sphere_key_t));
+      }
+      animation->sphere_keys[animation->n_sphere_keys++] = sphere;
+      continue;
+    }
+    printf("%s:%d: expected \"frames n\", \"camera frame lookfrom lookat vfov defocus_angle focus_dist\" "
+           "or \"sphere frame index x y z\" with index below %zu\n", path, line_number, n_spheres);
+    ok = false;
+  }
+  fclose(fp);
+  if (!ok) {
+    free_animation(animation);
+    return NULL;
+  }
+  qsort(animation->camera_keys, animation->n_camera_keys, sizeof(camera_key_t), compare_camera_keys);
+  qsort(animation->sphere_keys, animation->n_sphere_keys, sizeof(sphere_key_t), compare_sphere_keys);
+  return animation;
+}
+
+// how far frame is from key a (at 0) to key b (at 1), clamped
+float key_blend(int a, int b, int frame) {
+  if (b <= a) {
+    return 0.0f;
+  }
+  float t = (float)(frame - a) / (b - a);
+  return t < 0 ? 0.0f : (t > 1 ? 1.0f : t);
+}
+
+point3_t lerp_point(point3_t a, point3_t b, float t) {
+  return add(a, scale(subtract(b, a), t));
+}
+
+// points camera where the keyframes have it at frame
+void animate_camera(const animation_t *animation, camera_t *camera, int frame) {
+  size_t n = animation->n_camera_keys;
+  if (n == 0) {
+    return;
+  }
+  // the last key at or before frame, or the first if they're all after it
+  size_t k = 0;
+  while (k + 1 < n && animation->camera_keys[k + 1].frame <= frame) {
+    k++;
+  }
+  const camera_key_t *a = &animation->camera_keys[k];
+  const camera_key_t *b = &animation->camera_keys[k + 1 < n ? k + 1 : k];
+  float t = key_blend(a->frame, b->frame, frame);
+  camera_look(camera, lerp_point(a->lookfrom, b->lookfrom, t), lerp_point(a->lookat, b->lookat, t), new_vec3(0, 1, 0),
+              a->vfov + (b->vfov - a->vfov) * t, a->defocus_angle + (b->defocus_angle - a->defocus_angle) * t,
+              a->focus_dist + (b->focus_dist - a->focus_dist) * t);
+}
+
+// moves every keyframed sphere to where it is at frame. slots is
+// scene_sphere_slots(scene). the acceleration structure needs a refit after.
+void animate_spheres(const animation_t *animation, const uint32_t *slots, scene_t *scene, int frame) {
+  sphere_list_t *spheres = scene->sphere_list;
+  size_t first = 0;
+  while (first < animation->n_sphere_keys) {
+    // this sphere's keys are [first, end)
+    size_t end = first + 1;
+    while (end < animation->n_sphere_keys && animation->sphere_keys[end].sphere == animation->sphere_keys[first].sphere) {
+      end++;
+    }
+    const sphere_key_t *keys = &animation->sphere_keys[first];
+    size_t n = end - first;
+    size_t k = 0;
+    while (k + 1 < n && keys[k + 1].frame <= frame) {
+      k++;
+    }
+    const sphere_key_t *b = &keys[k + 1 < n ? k + 1 : k];
+    point3_t center = lerp_point(keys[k].center, b->center, key_blend(keys[k].frame, b->frame, frame));
+    uint32_t slot = slots[keys[k].sphere];
+    spheres->xs[slot] = center.e[0];
+    spheres->ys[slot] = center.e[1];
+    spheres->zs[slot] = center.e[2];
+    first = end;
+  }
+}
+
+// writes finished frames on a thread of its own, so the next frame can be
+// rendered meanwhile. one frame at a time: handing over the next waits for
+// the last to be written.
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t idle;
+  // the frame being written, only touched by the writer while pending
+  const color_t *pixels;
+  int width;
+  int height;
+  image_format_t format;
+  char path[4096];
+  bool pending;
+  bool shutdown;
+  // frames that couldn't be written
+  int failures;
+} frame_writer_t;
+
+void *frame_writer_main(void *args) {
+  frame_writer_t *writer = (frame_writer_t *)args;
+  pthread_mutex_lock(&writer->lock);
+  for (;;) {
+    while (!writer->pending && !writer->shutdown) {
+      pthread_cond_wait(&writer->wake, &writer->lock);
+    }
+    if (!writer->pending) {
+      break;
+    }
+    pthread_mutex_unlock(&writer->lock);
+
+    // the pool is busy with the next frame, so this encodes on this thread
+    bool ok = write_image(writer->path, writer->format, writer->pixels, writer->width, writer->height, NULL);
+    if (!ok) {
+      printf("couldn't write %s\n", writer->path);
+    }
+
+    pthread_mutex_lock(&writer->lock);
+    writer->failures += !ok;
+    writer->pending = false;
+    pthread_cond_broadcast(&writer->idle);
+  }
+  pthread_mutex_unlock(&writer->lock);
+  return NULL;
+}
+
+frame_writer_t *new_frame_writer(int width, int height, image_format_t format) {
+  frame_writer_t *writer = malloc(sizeof(frame_writer_t));
+  writer->width = width;
+  writer->height = height;
+  writer->format = format;
+  writer->pending = false;
+  writer->shutdown = false;
+  writer->failures = 0;
+  pthread_mutex_init(&writer->lock, NULL);
+  pthread_cond_init(&writer->wake, NULL);
+  pthread_cond_init(&writer->idle, NULL);
+  if (pthread_create(&writer->thread, NULL, frame_writer_main, writer) != 0) {
+    printf("**************** problem creating thread *****************\n");
+    abort();
+  }
+  return writer;
+}
+
+// waits for the previous frame to be written, then hands pixels over. they
+// mustn't change until the next frame_writer_submit or
+// free_frame_writer returns.
+void frame_writer_submit(frame_writer_t *writer, const color_t *pixels, const char *path) {
+  pthread_mutex_lock(&writer->lock);
+  while (writer->pending) {
+    pthread_cond_wait(&writer->idle, &writer->lock);
+  }
+  writer->pixels = pixels;
+  snprintf(writer->path, sizeof(writer->path), "%s", path);
+  writer->pending = true;
+  pthread_cond_signal(&writer->wake);
+  pthread_mutex_unlock(&writer->lock);
+}
+
+// finishes the frame being written and stops the thread. returns how many
+// frames couldn't be written.
+int free_frame_writer(frame_writer_t *writer) {
+  pthread_mutex_lock(&writer->lock);
+  writer->shutdown = true;
+  pthread_cond_signal(&writer->wake);
+  pthread_mutex_unlock(&writer->lock);
+  pthread_join(writer->thread, NULL);
+
+  int failures = writer->failures;
+  pthread_mutex_destroy(&writer->lock);
+  pthread_cond_destroy(&writer->wake);
+  pthread_cond_destroy(&writer->idle);
+  free(writer);
+  return failures;
+}
+
+// the printf pattern for the frames' paths. output may have one %d (with a
+// width, say %04d) for the frame number, otherwise %04d goes in before its
+// extension. false if it has some other % in it.
+bool frame_path_pattern(const char *output, char *pattern, size_t size) {
+  const char *percent = strchr(output, '%');
+  if (percent != NULL) {
+    const char *d = percent + 1 + strspn(percent + 1, "0123456789");
+    snprintf(pattern, size, "%s", output);
+    return *d == 'd' && strchr(d, '%') == NULL;
+  }
+  const char *dot = strrchr(output, '.');
+  const char *slash = strrchr(output, '/');
+  int stem = dot != NULL && (slash == NULL || dot > slash) ? (int)(dot - output) : (int)strlen(output);
+  snprintf(pattern, size, "%.*s%%04d%s", stem, output, output + stem);
+  return true;
+}
+
+// renders every frame of animation, frame n going to camera's output path
+// with n worked in, see frame_path_pattern. the spheres are left where the
+// last frame put them. returns false if any frame couldn't be written.
+bool render_animation(const camera_t *base, scene_t *scene, thread_pool_t *pool, const animation_t *animation) {
+  char path_pattern[4096];
+  if (!frame_path_pattern(base->output_path, path_pattern, sizeof(path_pattern))) {
+    printf("%s: expected at most one %%d for the frame number\n", base->output_path);
+    return false;
+  }
+  camera_t camera = *base;
+  int width = camera.image_width, height = camera.image_height;
+  int n_pixels = width * height;
+  render_args_t args;
+  init_render_args(&args, &camera, scene, pool->n_threads, 0, 0, width, height, malloc(n_pixels * sizeof(pixel_stats_t)));
+  color_t *frames[2] = {malloc(n_pixels * sizeof(color_t)), malloc(n_pixels * sizeof(color_t))};
+  uint32_t *slots = scene_sphere_slots(scene);
+  frame_writer_t *writer = new_frame_writer(width, height, camera.output_format);
+
+  double start = now_seconds();
+  for (int frame = 0; frame < animation->n_frames; frame++) {
+    double frame_start = now_seconds();
+    animate_camera(animation, &camera, frame);
+    animate_spheres(animation, slots, scene, frame);
+    scene_refit(scene);
+    // keyframes can open or close the lens
+    args.sample_pixel = select_render_variant(&camera, scene)->sample_pixel;
+    double refit_seconds = now_seconds() - frame_start;
+
+    memset(args.film, 0, n_pixels * sizeof(pixel_stats_t));
+    args.limit = camera.samples_per_pixel;
+    atomic_init(&args.tiles_done, 0);
+    thread_pool_run(pool, args.tiles_x * args.tiles_y, render_tile, &args);
+    // the writer may still have the other buffer
+    color_t *pixels = frames[frame % 2];
+    for (int p = 0; p < n_pixels; p++) {
+      pixels[p] = pixel_color(&args.film[p]);
+    }
+    if (camera.denoise) {
+      aov_buffers_t *aovs = render_aovs(&camera, scene, pool);
+      denoise(pixels, aovs, pool);
+      free_aov_buffers(aovs);
+    }
+
+    char path[4096];
+    snprintf(path, sizeof(path), path_pattern, frame);
+    frame_writer_submit(writer, pixels, path);
+    printf("frame %d/%d: %.2fs, refit in %.2fms -> %s\n", frame + 1, animation->n_frames, now_seconds() - frame_start,
+           1e3 * refit_seconds, path);
+  }
+  bool ok = free_frame_writer(writer) == 0;
+  double seconds = now_seconds() - start;
+  printf("%d frames in %.2fs, %.2fs each\n", animation->n_frames, seconds, seconds / animation->n_frames);
+
+  free_render_args(&args, pool->n_threads, NULL);
+  free(args.film);
+  free(frames[0]);
+  free(frames[1]);
+  free(slots);
+  return ok;
+}
+
+#endif // !ANIMATION_H
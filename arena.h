@@ -0,0 +1,109 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+// Arena (bump) allocator for scene memory. Allocations are carved off the
+// end of a chain of blocks, 64-byte aligned like the sphere arrays want,
+// and never freed one by one: arena_reset hands the whole lot back at once
+// and keeps the blocks for the next scene, free_arena returns them to the
+// heap. A scene built in an arena costs a few pointer bumps to set up and
+// nothing to tear down, and can't leak.
+//
+// Lists that grow (add_sphere, add_material) leave their old arrays behind
+// in the arena, so size them for the whole scene up front where possible.
+
+#define ARENA_ALIGN 64
+#define ARENA_BLOCK_SIZE (1 << 20)
+
+typedef struct arena_block_t {
+  struct arena_block_t *next;
+  size_t size;
+  size_t used;
+  // followed by size bytes, starting ARENA_ALIGN bytes in
+} arena_block_t;
+
+typedef struct {
+  arena_block_t *blocks;
+  // the block allocations come from, the ones after it are free
+  arena_block_t *current;
+  // the smallest block, bigger allocations get blocks of their own size
+  size_t block_size;
+  // what's been handed out since the last reset, and what's held
+  size_t used;
+  size_t reserved;
+} arena_t;
+
+arena_t *new_arena(size_t block_size) {
+  arena_t *arena = malloc(sizeof(arena_t));
+  *arena = (arena_t){.block_size = block_size > 0 ? block_size : ARENA_BLOCK_SIZE};
+  return arena;
+}
+
+char *arena_block_data(arena_block_t *block) {
+  return (char *)block + ARENA_ALIGN;
+}
+
+// size bytes, ARENA_ALIGN aligned, valid until the arena is reset or freed
+void *arena_alloc(arena_t *arena, size_t size) {
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  // first fit from the current block on, the blocks kept by a reset are
+  // reused in order
+  arena_block_t **link = arena->current != NULL ? &arena->current : &arena->blocks;
+  while (*link != NULL && (*link)->used + size > (*link)->size) {
+    link = &(*link)->next;
+  }
+  if (*link == NULL) {
+    size_t block_size = size > arena->block_size ? size : arena->block_size;
+    arena_block_t *block = aligned_alloc(ARENA_ALIGN, ARENA_ALIGN + block_size);
+    *block = (arena_block_t){.next = NULL, .size = block_size, .used = 0};
+    *link = block;
+    arena->reserved += block_size;
+  }
+  arena_block_t *block = *link;
+  arena->current = block;
+  void *p = arena_block_data(block) + block->used;
+  block->used += size;
+  arena->used += size;
+  return p;
+}
+
+// everything allocated so far is gone, the blocks stay for reuse
+void arena_reset(arena_t *arena) {
+  for (arena_block_t *block = arena->blocks; block != NULL; block = block->next) {
+    block->used = 0;
+  }
+  arena->current = NULL;
+  arena->used = 0;
+}
+
+void free_arena(arena_t *arena) {
+  arena_block_t *block = arena->blocks;
+  while (block != NULL) {
+    arena_block_t *next = block->next;
+    free(block);
+    block = next;
+  }
+  free(arena);
+}
+
+// for structures that live either in an arena or on the heap: from arena if
+// there is one, otherwise ARENA_ALIGN aligned heap memory for free()
+void *arena_or_heap(arena_t *arena, size_t size) {
+  if (arena != NULL) {
+    return arena_alloc(arena, size);
+  }
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  return aligned_alloc(ARENA_ALIGN, size > 0 ? size : ARENA_ALIGN);
+}
+
+// frees p if it came from the heap, arena memory goes with its arena
+void arena_or_heap_free(arena_t *arena, void *p) {
+  if (arena == NULL) {
+    free(p);
+  }
+}
+
+#endif // !ARENA_H
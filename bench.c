@@ -0,0 +1,706 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bvh.h"
+#include "camera.h"
+#include "image.h"
+#include "material.h"
+#include "packet.h"
+#include "render.h"
+#include "rng.h"
+#include "rtweekend.h"
+#include "scene.h"
+#include "simd.h"
+#include "threadpool.h"
+#include "vec3.h"
+#include "vectorized.h"
+#include "wbvh.h"
+
+// Benchmarks for the hot paths, each on its own, then the whole renderer.
+//
+// Once: scatter() per material, fastmath.h against libm, each render
+// variant against the generic one (camera.h), the rng (scalar and each backend's batched
+// fill) and image encoding. Then for each random scene (new_random_scene)
+// from 10 to 10M spheres: the closest-hit kernels over the whole list for
+// every backend the cpu has against scalar, BVH build time and closest-hit
+// throughput for brute force, the binary tree and its 4 and 8 wide
+// collapses, coherent camera rays one at a time (cam1) and in packets of the
+// backend's width (packet), and rays/sec rendering a small image of the
+// scene end to end.
+//
+// Then triangle meshes (add_bumpy_sphere) of 100k to 10M triangles, also
+// capped by max_spheres: the Moller-Trumbore kernels brute force over the
+// smallest mesh for every backend, and BVH build time and closest-hit
+// throughput for each.
+//
+// visits/ray counts the nodes whose children get slab tested, KB/ray is
+// visits times the bytes that costs (a 64 byte sibling pair for the binary
+// tree, a whole wide node).
+//
+// usage: ./bench [max_spheres] [--json path]
+// --json also writes every number to path, with the commit, arch and
+// backend, for comparing runs across commits and machines.
+
+#define BENCH_RAYS 200000
+// brute force gets too slow to bother with past this many spheres
+#define BENCH_MAX_LINEAR 50000
+// the kernel benchmark traces about this many ray-sphere tests per backend
+#define BENCH_KERNEL_TESTS 200000000
+// the triangle meshes, and the biggest the kernels brute force over
+#define BENCH_MIN_TRIANGLES 100000
+#define BENCH_MAX_TRIANGLES 10000000
+#define BENCH_MAX_LINEAR_TRIANGLES 100000
+#define BENCH_SCATTERS 2000000
+#define BENCH_RANDOMS 20000000
+#define BENCH_ENCODES 10
+// the end to end render
+#define BENCH_RENDER_WIDTH 160
+#define BENCH_RENDER_SPP 4
+#define BENCH_RENDER_DEPTH 16
+// the render variants' scenes, small so the shading shows over the
+// intersection
+#define BENCH_VARIANT_SPHERES 100
+#define BENCH_VARIANT_RUNS 3
+
+#ifndef BENCH_COMMIT
+#define BENCH_COMMIT "unknown"
+#endif
+
+#if defined(__aarch64__)
+#define BENCH_ARCH "aarch64"
+#elif defined(__x86_64__)
+#define BENCH_ARCH "x86_64"
+#else
+#define BENCH_ARCH "unknown"
+#endif
+
+// the JSON results: one object per number, in a flat list
+typedef struct {
+  FILE *fp;
+  int n_results;
+} bench_json_t;
+
+bench_json_t open_bench_json(const char *path, int n_threads) {
+  bench_json_t json = {.fp = NULL, .n_results = 0};
+  if (path == NULL) {
+    return json;
+  }
+  json.fp = fopen(path, "w");
+  if (json.fp == NULL) {
+    printf("couldn't write %s\n", path);
+    return json;
+  }
+  fprintf(json.fp, "{\n  \"commit\": \"%s\",\n  \"arch\": \"%s\",\n  \"simd_backend\": \"%s\",\n  \"threads\": %d,\n  \"time\": %ld,\n  \"results\": [",
+          BENCH_COMMIT, BENCH_ARCH, simd_backend_name(g_simd_backend), n_threads, (long)time(NULL));
+  return json;
+}
+
+// variant is the backend, accelerator or material measured. spheres is 0
+// for the benchmarks that don't have a scene.
+void bench_result(bench_json_t *json, const char *bench, const char *variant, size_t spheres, const char *unit, double value) {
+  if (json->fp == NULL) {
+    return;
+  }
+  fprintf(json->fp, "%s\n    {\"bench\": \"%s\", \"variant\": \"%s\", \"spheres\": %zu, \"unit\": \"%s\", \"value\": ",
+          json->n_results > 0 ? "," : "", bench, variant, spheres, unit);
+  // JSON has no nan or inf
+  if (isfinite(value)) {
+    fprintf(json->fp, "%.6g}", value);
+  } else {
+    fprintf(json->fp, "null}");
+  }
+  json->n_results++;
+}
+
+void close_bench_json(bench_json_t *json) {
+  if (json->fp != NULL) {
+    fprintf(json->fp, "\n  ]\n}\n");
+    fclose(json->fp);
+  }
+}
+
+// keeps the compiler from throwing away results nobody looks at
+volatile float g_bench_sink;
+
+// rays start on a sphere around the scene and aim at random points inside
+// it, so every ray has to get through the cloud
+ray_t *random_rays(size_t n_rays, size_t n_spheres) {
+  float side = 2.0 * cbrtf((float)n_spheres);
+  ray_t *rays = malloc(n_rays * sizeof(ray_t));
+  for (size_t i = 0; i < n_rays; i++) {
+    point3_t origin = scale(random_vec3_on_unit_sphere(), side);
+    point3_t target = random_vec3(-side/4, side/4);
+    rays[i] = new_ray(origin, normalize(subtract(target, origin)));
+  }
+  return rays;
+}
+
+// scatter() for one material over and over off the same hit, ns per call
+double bench_scatter(material_t *material) {
+  hit_record_t rec = {
+    .p = new_vec3(0, 0, 0),
+    .normal = new_vec3(0, 1, 0),
+    .mat = material,
+    .t = 1.0,
+    .front_face = true
+  };
+  ray_t ray_in = new_ray(new_vec3(-1, 1, 0), normalize(new_vec3(1, -1, 0)));
+  float sink = 0;
+  rng_begin_sample(0, 0);
+  double start = now_seconds();
+  for (int i = 0; i < BENCH_SCATTERS; i++) {
+    rng_begin_bounce(i);
+    color_t attenuation;
+    ray_t scattered = ray_in;
+    if (scatter(material, &ray_in, &rec, &attenuation, &scattered)) {
+      sink += scattered.direction.e[0];
+    }
+  }
+  double seconds = now_seconds() - start;
+  g_bench_sink = sink;
+  return seconds / BENCH_SCATTERS * 1e9;
+}
+
+void bench_scatters(bench_json_t *json) {
+  material_t materials[] = {
+    new_lambertian(new_vec3(0.5, 0.5, 0.5)),
+    new_metal(new_vec3(0.7, 0.6, 0.5), 0.3),
+    new_dielectric(1.5)
+  };
+  const char *names[] = {"lambertian", "metal", "dielectric"};
+  for (int m = 0; m < 3; m++) {
+    double ns = bench_scatter(&materials[m]);
+    printf("scatter %-10s %8.1f ns\n", names[m], ns);
+    bench_result(json, "scatter", names[m], 0, "ns", ns);
+  }
+}
+
+// fastmath.h against the libm calls it replaced: normalize and the Schlick
+// term one at a time, each call waiting on the last like a path's bounces
+// do, then normalize_floats over SoA arrays against the vectorized
+// 1/sqrtf loop the wavefront kernels had
+void bench_fastmath(bench_json_t *json) {
+  vec3_t v = new_vec3(0.3, 0.4, 0.5);
+  vec3_t step = new_vec3(0.1, 0.2, 0.3);
+  double start = now_seconds();
+  for (int i = 0; i < BENCH_RANDOMS; i++) {
+    vec3_t a = add(v, step);
+    v = scale(a, 1 / (float)sqrt(length_squared(&a)));
+  }
+  double libm_ns = (now_seconds() - start) / BENCH_RANDOMS * 1e9;
+  float sink = v.e[0];
+  v = new_vec3(0.3, 0.4, 0.5);
+  start = now_seconds();
+  for (int i = 0; i < BENCH_RANDOMS; i++) {
+    v = normalize(add(v, step));
+  }
+  double fast_ns = (now_seconds() - start) / BENCH_RANDOMS * 1e9;
+  sink += v.e[0];
+  printf("normalize libm %8.2f ns, fast %.2f ns\n", libm_ns, fast_ns);
+  bench_result(json, "normalize", "libm", 0, "ns", libm_ns);
+  bench_result(json, "normalize", "fast", 0, "ns", fast_ns);
+
+  float c = 0.5f;
+  start = now_seconds();
+  for (int i = 0; i < BENCH_RANDOMS; i++) {
+    c = 0.25f + 0.5f * (float)pow(1 - c, 5);
+  }
+  libm_ns = (now_seconds() - start) / BENCH_RANDOMS * 1e9;
+  sink += c;
+  c = 0.5f;
+  start = now_seconds();
+  for (int i = 0; i < BENCH_RANDOMS; i++) {
+    c = 0.25f + 0.5f * schlick_weight(c);
+  }
+  fast_ns = (now_seconds() - start) / BENCH_RANDOMS * 1e9;
+  sink += c;
+  printf("schlick libm   %8.2f ns, fast %.2f ns\n", libm_ns, fast_ns);
+  bench_result(json, "schlick", "libm", 0, "ns", libm_ns);
+  bench_result(json, "schlick", "fast", 0, "ns", fast_ns);
+
+  enum { BATCH = 4096 };
+  float *x = aligned_alloc(64, BATCH * sizeof(float));
+  float *y = aligned_alloc(64, BATCH * sizeof(float));
+  float *z = aligned_alloc(64, BATCH * sizeof(float));
+  for (int i = 0; i < BATCH; i++) {
+    x[i] = random_float_range(-1, 1);
+    y[i] = random_float_range(-1, 1);
+    z[i] = 1.0f;
+  }
+  start = now_seconds();
+  for (int k = 0; k < BENCH_RANDOMS / BATCH; k++) {
+    #pragma GCC ivdep
+    for (int i = 0; i < BATCH; i++) {
+      float inv_len = 1.0f / sqrtf(x[i]*x[i] + y[i]*y[i] + z[i]*z[i]);
+      x[i] *= inv_len;
+      y[i] *= inv_len;
+      z[i] *= inv_len;
+    }
+  }
+  libm_ns = (now_seconds() - start) / (BENCH_RANDOMS / BATCH * BATCH) * 1e9;
+  start = now_seconds();
+  for (int k = 0; k < BENCH_RANDOMS / BATCH; k++) {
+    normalize_floats(x, y, z, BATCH);
+  }
+  fast_ns = (now_seconds() - start) / (BENCH_RANDOMS / BATCH * BATCH) * 1e9;
+  sink += x[0];
+  printf("normalize SoA  %8.2f ns, fast %.2f ns\n", libm_ns, fast_ns);
+  bench_result(json, "normalize_soa", "sqrtf", 0, "ns", libm_ns);
+  bench_result(json, "normalize_soa", "fast", 0, "ns", fast_ns);
+  g_bench_sink = sink;
+  free(x);
+  free(y);
+  free(z);
+}
+
+// random_float one at a time, then every backend's rng_uniform_fill, which
+// the packet and wavefront paths use
+void bench_rng(bench_json_t *json) {
+  float sink = 0;
+  rng_begin_sample(0, 0);
+  double start = now_seconds();
+  for (int i = 0; i < BENCH_RANDOMS; i++) {
+    sink += random_float();
+  }
+  double ns = (now_seconds() - start) / BENCH_RANDOMS * 1e9;
+  printf("rng %-14s %8.2f ns\n", "random_float", ns);
+  bench_result(json, "rng", "random_float", 0, "ns", ns);
+
+  enum { BATCH = 4096 };
+  uint32_t *streams = malloc(BATCH * sizeof(uint32_t));
+  float *out = aligned_alloc(64, BATCH * sizeof(float));
+  for (int i = 0; i < BATCH; i++) {
+    streams[i] = rng_bounce_stream(rng_sample_key(i, 0), 1);
+  }
+  for (simd_backend_t b = SIMD_SCALAR; b <= SIMD_AVX512; b++) {
+    if (!simd_backend_supported(b)) {
+      continue;
+    }
+    select_rng_backend(b);
+    start = now_seconds();
+    for (int k = 0; k < BENCH_RANDOMS / BATCH; k++) {
+      rng_uniform_fill(streams, k, out, BATCH);
+      sink += out[k % BATCH];
+    }
+    double ns = (now_seconds() - start) / (BENCH_RANDOMS / BATCH * BATCH) * 1e9;
+    printf("rng fill %-9s %8.2f ns\n", simd_backend_name(b), ns);
+    bench_result(json, "rng_fill", simd_backend_name(b), 0, "ns", ns);
+  }
+  select_rng_backend(g_simd_backend);
+  g_bench_sink = sink;
+  free(streams);
+  free(out);
+}
+
+// a 1080p image through each encoder, not counting the write
+void bench_encode(bench_json_t *json, thread_pool_t *pool) {
+  int width = 1920, height = 1080;
+  color_t *pixels = malloc((size_t)width * height * sizeof(color_t));
+  for (int p = 0; p < width * height; p++) {
+    pixels[p] = random_vec3(0, 1);
+  }
+  image_format_t formats[] = {IMAGE_P6, IMAGE_PFM};
+  for (int f = 0; f < 2; f++) {
+    size_t size = 0;
+    double start = now_seconds();
+    for (int k = 0; k < BENCH_ENCODES; k++) {
+      free(encode_image(formats[f], pixels, width, height, pool, &size));
+    }
+    double ms = (now_seconds() - start) / BENCH_ENCODES * 1e3;
+    printf("encode %-11s %8.2f ms %8.0f MB/s\n", image_format_name(formats[f]), ms, size / ms / 1e3);
+    bench_result(json, "encode_1080p", image_format_name(formats[f]), 0, "ms", ms);
+  }
+  free(pixels);
+}
+
+// hit_sphere_list_vectorized over the whole list with each backend's
+// kernel in turn, against scalar
+void bench_kernels(bench_json_t *json, const scene_t *scene, const ray_t *rays) {
+  size_t n = scene->sphere_list->nth_sphere;
+  size_t n_rays = BENCH_KERNEL_TESTS / n;
+  n_rays = n_rays < 1000 ? 1000 : (n_rays > BENCH_RAYS ? BENCH_RAYS : n_rays);
+  closest_sphere_fn_t selected = closest_sphere;
+  double scalar = 0;
+  for (simd_backend_t b = SIMD_SCALAR; b <= SIMD_AVX512; b++) {
+    if (!simd_backend_supported(b)) {
+      continue;
+    }
+    closest_sphere = closest_sphere_kernel(b);
+    float sink = 0;
+    double start = now_seconds();
+    for (size_t i = 0; i < n_rays; i++) {
+      interval_t interval = {.min = 0.001, .max = INFINITY};
+      hit_record_t rec;
+      if (hit_sphere_list_vectorized(scene->sphere_list, scene->material_list, &rays[i], &interval, &rec)) {
+        sink += rec.t;
+      }
+    }
+    double mrays = n_rays / (now_seconds() - start) / 1e6;
+    g_bench_sink = sink;
+    if (b == SIMD_SCALAR) {
+      scalar = mrays;
+    }
+    printf("%10zu %8s %8s %8s %9s %8.2f %10s %10s  %.1fx scalar\n", n, simd_backend_name(b), "", "", "", mrays, "", "", mrays / scalar);
+    bench_result(json, "closest_sphere", simd_backend_name(b), n, "Mrays/s", mrays);
+  }
+  closest_sphere = selected;
+}
+
+typedef enum {
+  ACCEL_LINEAR,
+  ACCEL_BVH2,
+  ACCEL_BVH4,
+  ACCEL_BVH8
+} accel_t;
+
+typedef struct {
+  double mrays_per_second;
+  double visits_per_ray;
+  double kb_per_ray;
+  double hit_fraction;
+} trace_result_t;
+
+trace_result_t trace_rays(const scene_t *scene, const wbvh_t *wbvh, accel_t accel, const ray_t *rays, size_t n_rays) {
+  g_bvh_node_visits = 0;
+  size_t hits = 0;
+  double start = now_seconds();
+  for (size_t i = 0; i < n_rays; i++) {
+    interval_t interval = {.min = 0.001, .max = INFINITY};
+    size_t closest = 0;
+    bool hit;
+    if (accel == ACCEL_BVH2) {
+      hit = closest_sphere_bvh(scene->bvh, scene->sphere_list, &rays[i], &interval, &closest);
+    } else if (accel == ACCEL_LINEAR) {
+      hit = closest_sphere(scene->sphere_list, 0, scene->sphere_list->nth_sphere, &rays[i], &interval, &closest);
+    } else {
+      hit = closest_sphere_wbvh(wbvh, scene->sphere_list, &rays[i], &interval, &closest);
+    }
+    hits += hit;
+  }
+  double seconds = now_seconds() - start;
+
+  size_t node_bytes = accel == ACCEL_BVH2 ? 2 * sizeof(bvh_node_t) : (accel == ACCEL_LINEAR ? 0 : wbvh->node_stride * sizeof(float));
+  trace_result_t result = {
+    .mrays_per_second = n_rays / seconds / 1e6,
+    .visits_per_ray = (double)g_bvh_node_visits / n_rays,
+    .kb_per_ray = (double)g_bvh_node_visits * node_bytes / n_rays / 1024.0,
+    .hit_fraction = (double)hits / n_rays
+  };
+  return result;
+}
+
+// a pinhole camera's primary rays, looking at the scene from outside it.
+// consecutive rays are neighbouring pixels, so each packet is a short run of
+// a row.
+ray_t *camera_rays(size_t n_rays, size_t n_spheres) {
+  float side = 2.0 * cbrtf((float)n_spheres);
+  int width = (int)sqrtf((float)n_rays);
+  point3_t origin = new_vec3(0.0, 0.0, 1.5 * side);
+  ray_t *rays = malloc(n_rays * sizeof(ray_t));
+  for (size_t i = 0; i < n_rays; i++) {
+    float u = ((float)(i % width) / width - 0.5f) * side;
+    float v = ((float)(i / width) / width - 0.5f) * side;
+    rays[i] = new_ray(origin, normalize(new_vec3(u, v, -side)));
+  }
+  return rays;
+}
+
+double trace_camera_rays(const scene_t *scene, const ray_t *rays, size_t n_rays, bool packets) {
+  double start = now_seconds();
+  if (!packets) {
+    for (size_t i = 0; i < n_rays; i++) {
+      interval_t interval = {.min = 0.001, .max = INFINITY};
+      size_t closest = 0;
+      closest_sphere_bvh(scene->bvh, scene->sphere_list, &rays[i], &interval, &closest);
+    }
+  } else {
+    ray_packet_t packet;
+    packet.width = packet_width;
+    interval_t interval = {.min = 0.001, .max = INFINITY};
+    for (size_t i = 0; i + packet.width <= n_rays; i += packet.width) {
+      for (int l = 0; l < packet.width; l++) {
+        packet_set_ray(&packet, l, &rays[i + l]);
+      }
+      packet_begin(&packet, &interval);
+      trace_packet(scene->bvh, scene->sphere_list, &packet);
+    }
+  }
+  return n_rays / (now_seconds() - start) / 1e6;
+}
+
+// renders a small image of the scene from just outside it through the
+// normal render path, every ray counted (camera rays and bounces). the
+// scene is traced the way main would, so small ones without their BVH.
+double bench_render(const scene_t *scene, thread_pool_t *pool, float defocus_angle, bool specialize) {
+  size_t n = scene->sphere_list->nth_sphere;
+  float side = 2.0 * cbrtf((float)n);
+  camera_t camera = initialize_camera(16.0 / 9.0, BENCH_RENDER_WIDTH, BENCH_RENDER_SPP, BENCH_RENDER_DEPTH,
+                                      60, new_vec3(0, 0, side), new_vec3(0, 0, 0), new_vec3(0, 1, 0), defocus_angle, side);
+  camera.specialize = specialize;
+  // one pass with no checkpoint, which also keeps the progress quiet
+  camera.pass_samples = camera.samples_per_pixel;
+  camera.checkpoint_path = NULL;
+  scene_t view = *scene;
+  if (n < BVH_MIN_SPHERES) {
+    view.bvh = NULL;
+    view.wbvh = NULL;
+  }
+
+  color_t *pixels = malloc((size_t)camera.image_width * camera.image_height * sizeof(color_t));
+  double start = now_seconds();
+  render_to_buffer(&camera, &view, pool, pixels, NULL, NULL);
+  double seconds = now_seconds() - start;
+
+  // the rays, counted afterwards so the timed render has no counters in it:
+  // the wavefront engine traces the same paths and tallies them a queue at
+  // a time
+  wavefront_t *wavefront = new_wavefront();
+  wavefront_render_tile(wavefront, &camera, &view, 0, 0, camera.image_width, camera.image_height, 0,
+                        camera.samples_per_pixel, pixels);
+  unsigned long rays = wavefront->rays;
+  free_wavefront(wavefront);
+  free(pixels);
+  return rays / seconds / 1e6;
+}
+
+// a random scene like new_random_scene's with materials of the first n_types
+// types only: lambertian, then metal, glass and lights
+scene_t new_variant_scene(size_t n_spheres, int n_types) {
+  sphere_list_t *sphere_list = new_sphere_list(n_spheres);
+  material_list_t *material_list = new_material_list(n_spheres);
+  float side = 2.0 * cbrtf((float)n_spheres);
+  for (size_t i = 0; i < n_spheres; i++) {
+    add_sphere(sphere_list, random_vec3(-side/2, side/2), random_float_range(0.2, 0.5));
+    float choose_mat = random_float();
+    material_t mat;
+    if (n_types < 2 || choose_mat < 0.7) {
+      mat = new_lambertian(multiply(random_vec3(0, 1), random_vec3(0, 1)));
+    } else if (n_types < 3 || choose_mat < 0.85) {
+      mat = new_metal(random_vec3(0.5, 1.0), random_float_range(0, 0.5));
+    } else if (n_types < 4 || choose_mat < 0.95) {
+      mat = new_dielectric(1.5);
+    } else {
+      mat = new_emissive(random_vec3(2, 8));
+    }
+    add_material(material_list, mat);
+  }
+  return new_scene(sphere_list, material_list);
+}
+
+// every render variant against the generic sample_pixel, on a scene and
+// camera it's picked for. the images are the same, this is what the
+// specialization buys.
+void bench_render_variants(bench_json_t *json, thread_pool_t *pool) {
+  printf("%16s %9s %9s %8s\n", "variant", "generic", "Mrays/s", "speedup");
+  for (int lens = 0; lens < 2; lens++) {
+    for (int n_types = 1; n_types <= 4; n_types++) {
+      fast_srand(123456);
+      scene_t scene = new_variant_scene(BENCH_VARIANT_SPHERES, n_types);
+      float defocus_angle = lens ? 2.0 : 0;
+      camera_t camera = initialize_camera(16.0 / 9.0, BENCH_RENDER_WIDTH, BENCH_RENDER_SPP, BENCH_RENDER_DEPTH,
+                                          60, new_vec3(0, 0, 1), new_vec3(0, 0, 0), new_vec3(0, 1, 0), defocus_angle, 1);
+      const char *name = select_render_variant(&camera, &scene)->name;
+      // best of a few, the renders are short
+      double generic = 0, specialized = 0;
+      for (int k = 0; k < BENCH_VARIANT_RUNS; k++) {
+        double g = bench_render(&scene, pool, defocus_angle, false);
+        double s = bench_render(&scene, pool, defocus_angle, true);
+        generic = g > generic ? g : generic;
+        specialized = s > specialized ? s : specialized;
+      }
+      printf("%16s %9.2f %9.2f %7.2fx\n", name, generic, specialized, specialized / generic);
+      fflush(stdout);
+      bench_result(json, "render_variant", name, BENCH_VARIANT_SPHERES, "Mrays/s", specialized);
+      bench_result(json, "render_variant_speedup", name, BENCH_VARIANT_SPHERES, "x", specialized / generic);
+      free_scene(&scene);
+    }
+  }
+}
+
+// rays from well outside a mesh around the origin at random points inside
+// its unit ball
+ray_t *mesh_rays(size_t n_rays) {
+  ray_t *rays = malloc(n_rays * sizeof(ray_t));
+  for (size_t i = 0; i < n_rays; i++) {
+    point3_t origin = scale(random_vec3_on_unit_sphere(), 3.0);
+    point3_t target = random_vec3(-0.5, 0.5);
+    rays[i] = new_ray(origin, normalize(subtract(target, origin)));
+  }
+  return rays;
+}
+
+// closest_triangle over the whole mesh with each backend's kernel in turn,
+// against scalar. in millions of ray-triangle tests a second, a ray through
+// a whole mesh being too slow for Mrays/s to say much.
+void bench_triangle_kernels(bench_json_t *json, const triangle_list_t *triangles, const ray_t *rays) {
+  size_t n = triangles->n_triangles;
+  size_t n_rays = BENCH_KERNEL_TESTS / n;
+  n_rays = n_rays < 1000 ? 1000 : (n_rays > BENCH_RAYS ? BENCH_RAYS : n_rays);
+  closest_triangle_fn_t selected = closest_triangle;
+  double scalar = 0;
+  for (simd_backend_t b = SIMD_SCALAR; b <= SIMD_AVX512; b++) {
+    if (!simd_backend_supported(b)) {
+      continue;
+    }
+    closest_triangle = closest_triangle_kernel(b);
+    float sink = 0;
+    double start = now_seconds();
+    for (size_t i = 0; i < n_rays; i++) {
+      interval_t interval = {.min = 0.001, .max = INFINITY};
+      size_t closest;
+      if (closest_triangle(triangles, 0, n, &rays[i], &interval, &closest)) {
+        sink += interval.max;
+      }
+    }
+    double mtests = (double)n_rays * n / (now_seconds() - start) / 1e6;
+    g_bench_sink = sink;
+    if (b == SIMD_SCALAR) {
+      scalar = mtests;
+    }
+    printf("%10zu %8s %8s %8s %9s %8.1f %10s  Mtests/s, %.1fx scalar\n", n, simd_backend_name(b), "", "", "", mtests, "", mtests / scalar);
+    bench_result(json, "closest_triangle", simd_backend_name(b), n, "Mtests/s", mtests);
+  }
+  closest_triangle = selected;
+}
+
+void bench_triangles(bench_json_t *json, size_t max_triangles) {
+  if (max_triangles < BENCH_MIN_TRIANGLES) {
+    return;
+  }
+  printf("%10s %8s %8s %8s %9s %8s %10s\n", "triangles", "accel", "build_s", "nodes", "hit_frac", "Mrays/s", "visits/ray");
+  material_t material = new_lambertian(new_vec3(0.5, 0.5, 0.5));
+  ray_t *rays = mesh_rays(BENCH_RAYS);
+  for (size_t n = BENCH_MIN_TRIANGLES; n <= max_triangles && n <= BENCH_MAX_TRIANGLES; n *= 10) {
+    triangle_list_t *triangles = new_triangle_list(n / 2 + 1000, n + 1000);
+    add_bumpy_sphere(triangles, new_vec3(0, 0, 0), 1.0, n, material);
+    scene_t scene = new_scene(new_sphere_list(0), new_material_list(0));
+    scene_set_triangles(&scene, triangles);
+    if (n <= BENCH_MAX_LINEAR_TRIANGLES) {
+      bench_triangle_kernels(json, triangles, rays);
+    }
+    scene_build_bvh(&scene);
+
+    g_bvh_node_visits = 0;
+    size_t hits = 0;
+    double start = now_seconds();
+    for (size_t i = 0; i < BENCH_RAYS; i++) {
+      interval_t interval = {.min = 0.001, .max = INFINITY};
+      size_t closest;
+      hits += closest_triangle_bvh(scene.triangle_bvh, triangles, &rays[i], &interval, &closest);
+    }
+    double mrays = BENCH_RAYS / (now_seconds() - start) / 1e6;
+    double visits = (double)g_bvh_node_visits / BENCH_RAYS;
+
+    printf("%10zu %8s %8.3f %8zu %9.3f %8.2f %10.1f\n", triangles->n_triangles, "bvh2", scene.triangle_bvh->build_seconds,
+           scene.triangle_bvh->n_nodes, (double)hits / BENCH_RAYS, mrays, visits);
+    fflush(stdout);
+    bench_result(json, "triangle_build", "bvh2", triangles->n_triangles, "s", scene.triangle_bvh->build_seconds);
+    bench_result(json, "triangle_trace", "bvh2", triangles->n_triangles, "Mrays/s", mrays);
+    bench_result(json, "triangle_visits_per_ray", "bvh2", triangles->n_triangles, "nodes", visits);
+    free_scene(&scene);
+  }
+  free(rays);
+}
+
+int main(int argc, char **argv) {
+  size_t max_spheres = 10000000;
+  const char *json_path = NULL;
+  for (int k = 1; k < argc; k++) {
+    if (strcmp(argv[k], "--json") == 0 && k + 1 < argc) {
+      json_path = argv[++k];
+    } else {
+      max_spheres = strtoull(argv[k], NULL, 10);
+    }
+  }
+  fast_srand(123456);
+  select_simd_backend(simd_backend_from_env());
+  printf("simd backend: %s\n", simd_backend_name(g_simd_backend));
+  // RT_THREADS as for the renderer
+  const char *threads = getenv("RT_THREADS");
+  thread_pool_t *pool = new_thread_pool(threads != NULL ? atoi(threads) : 0);
+  printf("threads: %d\n", pool->n_threads);
+  bench_json_t json = open_bench_json(json_path, pool->n_threads);
+
+  bench_scatters(&json);
+  bench_fastmath(&json);
+  bench_rng(&json);
+  bench_encode(&json, pool);
+  bench_render_variants(&json, pool);
+
+  printf("%10s %8s %8s %8s %9s %8s %10s %10s\n", "spheres", "accel", "build_s", "nodes", "hit_frac", "Mrays/s", "visits/ray", "KB/ray");
+  const char *accel_names[] = {"linear", "bvh2", "bvh4", "bvh8"};
+  for (size_t n = 10; n <= max_spheres && n <= 10000000; n *= 10) {
+    scene_t scene = new_random_scene(n);
+    ray_t *rays = random_rays(BENCH_RAYS, n);
+    if (n <= BENCH_MAX_LINEAR) {
+      bench_kernels(&json, &scene, rays);
+    }
+    scene_build_bvh(&scene);
+
+    for (accel_t accel = ACCEL_LINEAR; accel <= ACCEL_BVH8; accel++) {
+      if (accel == ACCEL_LINEAR && n > BENCH_MAX_LINEAR) {
+        continue;
+      }
+      wbvh_t *wbvh = NULL;
+      double build_seconds = 0.0;
+      size_t n_nodes = 0;
+      if (accel == ACCEL_BVH2) {
+        build_seconds = scene.bvh->build_seconds;
+        n_nodes = scene.bvh->n_nodes;
+      } else if (accel != ACCEL_LINEAR) {
+        wbvh = build_wbvh(scene.bvh, accel == ACCEL_BVH4 ? 4 : 8);
+        build_seconds = scene.bvh->build_seconds + wbvh->build_seconds;
+        n_nodes = wbvh->n_nodes;
+      }
+      // brute force only gets a tenth of the rays, it's that slow
+      size_t n_rays = accel == ACCEL_LINEAR ? BENCH_RAYS / 10 : BENCH_RAYS;
+      trace_result_t result = trace_rays(&scene, wbvh, accel, rays, n_rays);
+
+      printf("%10zu %8s %8.3f %8zu %9.3f %8.2f %10.1f %10.2f\n",
+             n, accel_names[accel], build_seconds, n_nodes, result.hit_fraction,
+             result.mrays_per_second, result.visits_per_ray, result.kb_per_ray);
+      fflush(stdout);
+      bench_result(&json, "trace", accel_names[accel], n, "Mrays/s", result.mrays_per_second);
+      bench_result(&json, "visits_per_ray", accel_names[accel], n, "nodes", result.visits_per_ray);
+      bench_result(&json, "kb_per_ray", accel_names[accel], n, "KB", result.kb_per_ray);
+      if (accel != ACCEL_LINEAR) {
+        bench_result(&json, "build", accel_names[accel], n, "s", build_seconds);
+        // what an animation pays per frame instead of the build
+        double start = now_seconds();
+        refit_bvh(scene.bvh, scene.sphere_list);
+        if (wbvh != NULL) {
+          refit_wbvh(wbvh, scene.sphere_list);
+        }
+        bench_result(&json, "refit", accel_names[accel], n, "s", now_seconds() - start);
+      }
+      if (wbvh != NULL) {
+        free_wbvh(wbvh);
+      }
+    }
+
+    ray_t *cam_rays = camera_rays(BENCH_RAYS, n);
+    double single = trace_camera_rays(&scene, cam_rays, BENCH_RAYS, false);
+    double packets = trace_camera_rays(&scene, cam_rays, BENCH_RAYS, true);
+    printf("%10zu %8s %8s %8s %9s %8.2f %10s %10s\n", n, "cam1", "", "", "", single, "", "");
+    printf("%10zu %8s %8s %8s %9s %8.2f %10s %10s\n", n, "packet", "", "", "", packets, "", "");
+    bench_result(&json, "camera_rays", "cam1", n, "Mrays/s", single);
+    bench_result(&json, "camera_rays", "packet", n, "Mrays/s", packets);
+    free(cam_rays);
+
+    double render_mrays = bench_render(&scene, pool, 0, true);
+    printf("%10zu %8s %8s %8s %9s %8.2f %10s %10s\n", n, "render", "", "", "", render_mrays, "", "");
+    bench_result(&json, "render", "megakernel", n, "Mrays/s", render_mrays);
+    fflush(stdout);
+
+    free(rays);
+    free_scene(&scene);
+  }
+
+  bench_triangles(&json, max_spheres);
+
+  close_bench_json(&json);
+  free_thread_pool(pool);
+  return 0;
+}
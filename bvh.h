@@ -0,0 +1,582 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "hittable.h"
+#include "interval.h"
+#include "material.h"
+#include "ray.h"
+#include "rtweekend.h"
+#include "stats.h"
+#include "vec3.h"
+#include "vectorized.h"
+
+// Bounding volume hierarchy over a sphere_list_t, built with the surface area
+// heuristic. Nodes live in one flat 64-byte-aligned array. A node is 32 bytes
+// and siblings are allocated as an (even, odd) pair, so both children of a
+// node sit in the same cache line and get pulled in by a single miss. The
+// root is node 0 and node 1 is left unused to keep that pairing.
+//
+// Building reorders the spheres (and their materials) so each leaf owns a
+// contiguous [first, first + count) run of the SoA arrays, which means the
+// leaves are tested with the same closest_sphere() SIMD kernels as the flat
+// list.
+
+#define BVH_BINS 16
+#define BVH_MAX_LEAF 8
+// SAH costs relative to one traversal step. the leaf kernels test a whole
+// SIMD block of spheres at once, so a sphere test is much cheaper than a
+// node visit and we let leaves get a bit fatter than a scalar tracer would.
+#ifndef BVH_TRAVERSAL_COST
+#define BVH_TRAVERSAL_COST 1.0f
+#endif
+#ifndef BVH_INTERSECT_COST
+#define BVH_INTERSECT_COST 0.3f
+#endif
+// past this depth the builder stops looking for SAH splits and halves the
+// node instead, which keeps the traversal stack below bounded
+#define BVH_SAH_MAX_DEPTH 32
+#define BVH_STACK_SIZE 64
+// below this many spheres the SIMD linear scan beats walking the tree
+#define BVH_MIN_SPHERES 2000
+
+// build with -DBVH_STATS to count how many nodes each thread's traversals
+// touch (bench does); otherwise the counting compiles away
+#ifdef BVH_STATS
+__thread unsigned long g_bvh_node_visits;
+#define BVH_COUNT_VISIT() (g_bvh_node_visits++)
+#else
+#define BVH_COUNT_VISIT()
+#endif
+
+typedef struct {
+  float min[3];
+  float max[3];
+  // inner node: index of left child, right child is left_first + 1
+  // leaf: index of first sphere
+  uint32_t left_first;
+  // number of spheres in a leaf, 0 for inner nodes
+  uint32_t count;
+} bvh_node_t;
+
+typedef struct {
+  bvh_node_t *nodes;
+  size_t n_nodes;
+  // prim_ids[i] is the original index of the sphere now stored at slot i
+  uint32_t *prim_ids;
+  size_t n_prims;
+  int depth;
+  double build_seconds;
+  // nodes live in a mapped scene file (scenefile.h) rather than on the heap,
+  // and there are no prim_ids
+  bool mapped;
+  // the sphere list's arena, which the tree is in if it's set
+  arena_t *arena;
+} bvh_t;
+
+typedef struct {
+  float min[3];
+  float max[3];
+} aabb_t;
+
+void aabb_reset(aabb_t *box) {
+  for (int a = 0; a < 3; a++) {
+    box->min[a] = INFINITY;
+    box->max[a] = -INFINITY;
+  }
+}
+
+void aabb_grow(aabb_t *box, const aabb_t *other) {
+  for (int a = 0; a < 3; a++) {
+    box->min[a] = min_float(box->min[a], other->min[a]);
+    box->max[a] = max_float(box->max[a], other->max[a]);
+  }
+}
+
+// half the surface area, the factor of 2 cancels out in the SAH anyway
+float aabb_half_area(const aabb_t *box) {
+  float dx = box->max[0] - box->min[0];
+  float dy = box->max[1] - box->min[1];
+  float dz = box->max[2] - box->min[2];
+  if (dx < 0 || dy < 0 || dz < 0) {
+    return 0.0f;
+  }
+  return dx*dy + dy*dz + dz*dx;
+}
+
+aabb_t sphere_aabb(const sphere_list_t *sphere_list, size_t i) {
+  float r = sqrtf(sphere_list->r2s[i]);
+  aabb_t box = {
+    .min = {sphere_list->xs[i] - r, sphere_list->ys[i] - r, sphere_list->zs[i] - r},
+    .max = {sphere_list->xs[i] + r, sphere_list->ys[i] + r, sphere_list->zs[i] + r},
+  };
+  return box;
+}
+
+// what the builder knows about each primitive. computed once up front so the
+// binning loops don't have to go back to the sphere arrays.
+typedef struct {
+  aabb_t bounds;
+  float centroid[3];
+} bvh_prim_t;
+
+typedef struct {
+  uint32_t node;
+  uint32_t start;
+  uint32_t end;
+  int depth;
+} bvh_build_task_t;
+
+typedef struct {
+  aabb_t bounds;
+  uint32_t count;
+} bvh_bin_t;
+
+// picks the cheapest binned SAH split for prims [start, end). returns false if
+// no split beats making a leaf (or the centroids are all on top of each other)
+bool bvh_find_split(const bvh_prim_t *prims, const uint32_t *ids, uint32_t start, uint32_t end, const aabb_t *bounds, int *best_axis, int *best_bin, float *cmin_out, float *cscale_out) {
+  aabb_t centroid_bounds;
+  aabb_reset(&centroid_bounds);
+  for (uint32_t i = start; i < end; i++) {
+    for (int a = 0; a < 3; a++) {
+      float c = prims[ids[i]].centroid[a];
+      centroid_bounds.min[a] = min_float(centroid_bounds.min[a], c);
+      centroid_bounds.max[a] = max_float(centroid_bounds.max[a], c);
+    }
+  }
+
+  uint32_t n = end - start;
+  float parent_area = aabb_half_area(bounds);
+  float best_cost = n * BVH_INTERSECT_COST;
+  bool found = false;
+
+  for (int a = 0; a < 3; a++) {
+    float extent = centroid_bounds.max[a] - centroid_bounds.min[a];
+    if (extent <= 0.0f) {
+      continue;
+    }
+    float cscale = BVH_BINS / extent;
+
+    bvh_bin_t bins[BVH_BINS];
+    for (int b = 0; b < BVH_BINS; b++) {
+      aabb_reset(&bins[b].bounds);
+      bins[b].count = 0;
+    }
+    for (uint32_t i = start; i < end; i++) {
+      const bvh_prim_t *prim = &prims[ids[i]];
+      int b = (int)((prim->centroid[a] - centroid_bounds.min[a]) * cscale);
+      b = b < BVH_BINS ? b : BVH_BINS - 1;
+      aabb_grow(&bins[b].bounds, &prim->bounds);
+      bins[b].count++;
+    }
+
+    // sweep from the right to get the cost of everything right of each plane
+    float right_area[BVH_BINS - 1];
+    uint32_t right_count[BVH_BINS - 1];
+    aabb_t acc;
+    aabb_reset(&acc);
+    uint32_t count = 0;
+    for (int b = BVH_BINS - 1; b > 0; b--) {
+      aabb_grow(&acc, &bins[b].bounds);
+      count += bins[b].count;
+      right_area[b - 1] = aabb_half_area(&acc);
+      right_count[b - 1] = count;
+    }
+
+    aabb_reset(&acc);
+    count = 0;
+    for (int b = 0; b < BVH_BINS - 1; b++) {
+      aabb_grow(&acc, &bins[b].bounds);
+      count += bins[b].count;
+      if (count == 0 || right_count[b] == 0) {
+        continue;
+      }
+      float cost = BVH_TRAVERSAL_COST + BVH_INTERSECT_COST * (aabb_half_area(&acc) * count + right_area[b] * right_count[b]) / parent_area;
+      if (cost < best_cost) {
+        best_cost = cost;
+        *best_axis = a;
+        *best_bin = b;
+        *cmin_out = centroid_bounds.min[a];
+        *cscale_out = cscale;
+        found = true;
+      }
+    }
+  }
+  return found;
+}
+
+// nth_element on ids[0, n) by centroid: ids[k] ends up as the k-th smallest
+// on axis, with nothing bigger before it and nothing smaller after. all the
+// state is on the stack, so scenes can be built on several threads at once.
+void bvh_select_nth(const bvh_prim_t *prims, uint32_t *ids, uint32_t n, uint32_t k, int axis) {
+  int64_t lo = 0, hi = (int64_t)n - 1;
+  while (lo < hi) {
+    float pivot = prims[ids[lo + (hi - lo) / 2]].centroid[axis];
+    int64_t i = lo, j = hi;
+    while (i <= j) {
+      while (prims[ids[i]].centroid[axis] < pivot) {
+        i++;
+      }
+      while (prims[ids[j]].centroid[axis] > pivot) {
+        j--;
+      }
+      if (i <= j) {
+        uint32_t tmp = ids[i];
+        ids[i++] = ids[j];
+        ids[j--] = tmp;
+      }
+    }
+    // [lo, j] <= pivot <= [i, hi], and anything between is the pivot
+    if ((int64_t)k <= j) {
+      hi = j;
+    } else if ((int64_t)k >= i) {
+      lo = i;
+    } else {
+      break;
+    }
+  }
+}
+
+void bvh_set_bounds(bvh_node_t *node, const aabb_t *box) {
+  memcpy(node->min, box->min, sizeof(node->min));
+  memcpy(node->max, box->max, sizeof(node->max));
+}
+
+// applies the permutation prim_ids to the sphere and material arrays
+void bvh_reorder_spheres(sphere_list_t *sphere_list, material_list_t *material_list, const uint32_t *prim_ids, size_t n) {
+  float *tmp = malloc(n * sizeof(float));
+  float *arrays[] = {sphere_list->xs, sphere_list->ys, sphere_list->zs, sphere_list->r2s, sphere_list->recip_r};
+  for (size_t k = 0; k < sizeof(arrays) / sizeof(arrays[0]); k++) {
+    for (size_t i = 0; i < n; i++) {
+      tmp[i] = arrays[k][prim_ids[i]];
+    }
+    memcpy(arrays[k], tmp, n * sizeof(float));
+  }
+  free(tmp);
+
+  // only the spheres' indices move, the material table stays as it is
+  material_index_t *tmp_index = malloc(n * sizeof(material_index_t));
+  for (size_t i = 0; i < n; i++) {
+    tmp_index[i] = material_list->indices[prim_ids[i]];
+  }
+  memcpy(material_list->indices, tmp_index, n * sizeof(material_index_t));
+  free(tmp_index);
+}
+
+// builds the tree over n primitives with the given bounds, in arena if
+// that's set. the primitives themselves aren't touched: leaves index
+// bvh->prim_ids, and it's up to the caller to put the primitives in that
+// order so each leaf's run is contiguous.
+bvh_t *build_bvh_over(arena_t *arena, const bvh_prim_t *prims, size_t n) {
+  bvh_t *bvh = arena_or_heap(arena, sizeof(bvh_t));
+  bvh->arena = arena;
+  bvh->n_prims = n;
+  bvh->prim_ids = arena_or_heap(bvh->arena, (n > 0 ? n : 1) * sizeof(uint32_t));
+  for (size_t i = 0; i < n; i++) {
+    bvh->prim_ids[i] = i;
+  }
+
+  // a binary tree with n leaves has 2n - 1 nodes, plus the unused node 1
+  size_t max_nodes = 2 * n + 2;
+  size_t node_bytes = (max_nodes * sizeof(bvh_node_t) + 63) & ~(size_t)63;
+  bvh->nodes = aligned_alloc(64, node_bytes);
+  memset(bvh->nodes, 0, node_bytes);
+  bvh->n_nodes = 2;
+  bvh->depth = 0;
+  bvh->mapped = false;
+
+  bvh_build_task_t *stack = malloc((BVH_STACK_SIZE + 2) * sizeof(bvh_build_task_t));
+  int sp = 0;
+  stack[sp++] = (bvh_build_task_t){.node = 0, .start = 0, .end = n, .depth = 0};
+
+  while (sp > 0) {
+    bvh_build_task_t task = stack[--sp];
+    bvh_node_t *node = &bvh->nodes[task.node];
+    uint32_t count = task.end - task.start;
+
+    aabb_t bounds;
+    aabb_reset(&bounds);
+    for (uint32_t i = task.start; i < task.end; i++) {
+      aabb_grow(&bounds, &prims[bvh->prim_ids[i]].bounds);
+    }
+    bvh_set_bounds(node, &bounds);
+    bvh->depth = task.depth > bvh->depth ? task.depth : bvh->depth;
+
+    uint32_t mid = task.start;
+    int axis = 0, bin = 0;
+    float cmin = 0.0f, cscale = 0.0f;
+    if (count <= 1) {
+      mid = task.start;
+    } else if (task.depth < BVH_SAH_MAX_DEPTH && bvh_find_split(prims, bvh->prim_ids, task.start, task.end, &bounds, &axis, &bin, &cmin, &cscale)) {
+      // partition prims so everything in bins <= bin ends up on the left
+      uint32_t i = task.start, j = task.end;
+      while (i < j) {
+        int b = (int)((prims[bvh->prim_ids[i]].centroid[axis] - cmin) * cscale);
+        b = b < BVH_BINS ? b : BVH_BINS - 1;
+        if (b <= bin) {
+          i++;
+        } else {
+          j--;
+          uint32_t tmp = bvh->prim_ids[i];
+          bvh->prim_ids[i] = bvh->prim_ids[j];
+          bvh->prim_ids[j] = tmp;
+        }
+      }
+      mid = i;
+    } else if (count > BVH_MAX_LEAF) {
+      // SAH gave up but the leaf would be too big, so split at the
+      // median of the longest axis
+      float best_extent = -1.0f;
+      for (int a = 0; a < 3; a++) {
+        float extent = bounds.max[a] - bounds.min[a];
+        if (extent > best_extent) {
+          best_extent = extent;
+          axis = a;
+        }
+      }
+      mid = task.start + count / 2;
+      bvh_select_nth(prims, bvh->prim_ids + task.start, count, count / 2, axis);
+    }
+
+    if (mid == task.start || mid == task.end) {
+      node->left_first = task.start;
+      node->count = count;
+      continue;
+    }
+
+    uint32_t left = bvh->n_nodes;
+    bvh->n_nodes += 2;
+    node->left_first = left;
+    node->count = 0;
+    stack[sp++] = (bvh_build_task_t){.node = left + 1, .start = mid, .end = task.end, .depth = task.depth + 1};
+    stack[sp++] = (bvh_build_task_t){.node = left, .start = task.start, .end = mid, .depth = task.depth + 1};
+  }
+  free(stack);
+
+  // give back the nodes we reserved but didn't need
+  size_t used_bytes = (bvh->n_nodes * sizeof(bvh_node_t) + 63) & ~(size_t)63;
+  bvh_node_t *nodes = arena_or_heap(bvh->arena, used_bytes);
+  memcpy(nodes, bvh->nodes, used_bytes);
+  free(bvh->nodes);
+  bvh->nodes = nodes;
+  return bvh;
+}
+
+// builds a BVH over every sphere in the list. NB: this permutes sphere_list
+// and material_list in place, so any indices into them taken before the build
+// are stale afterwards; bvh->prim_ids maps back to the original order.
+bvh_t *build_bvh(sphere_list_t *sphere_list, material_list_t *material_list) {
+  double start_time = now_seconds();
+
+  size_t n = sphere_list->nth_sphere;
+  bvh_prim_t *prims = malloc((n > 0 ? n : 1) * sizeof(bvh_prim_t));
+  for (size_t i = 0; i < n; i++) {
+    prims[i].bounds = sphere_aabb(sphere_list, i);
+    prims[i].centroid[0] = sphere_list->xs[i];
+    prims[i].centroid[1] = sphere_list->ys[i];
+    prims[i].centroid[2] = sphere_list->zs[i];
+  }
+  bvh_t *bvh = build_bvh_over(sphere_list->arena, prims, n);
+  free(prims);
+
+  bvh_reorder_spheres(sphere_list, material_list, bvh->prim_ids, n);
+  bvh->build_seconds = now_seconds() - start_time;
+  return bvh;
+}
+
+void free_bvh(bvh_t *bvh) {
+  if (!bvh->mapped) {
+    arena_or_heap_free(bvh->arena, bvh->nodes);
+    arena_or_heap_free(bvh->arena, bvh->prim_ids);
+  }
+  arena_or_heap_free(bvh->arena, bvh);
+}
+
+// recomputes every node's bounds from the spheres as they are now, keeping
+// the tree's shape, for spheres that have moved (or grown) since the build.
+// children always come after their parent in the array, so one sweep from
+// the back sees every child before its parent. much cheaper than a rebuild,
+// but the tree is only as good as the split it was built with: spheres that
+// move a long way leave the boxes loose and overlapping.
+void refit_bvh(bvh_t *bvh, const sphere_list_t *sphere_list) {
+  if (bvh->n_prims == 0) {
+    return;
+  }
+  for (size_t i = bvh->n_nodes - 1; i != (size_t)-1; i--) {
+    // node 1 is the unused half of the root's pair
+    if (i == 1) {
+      continue;
+    }
+    bvh_node_t *node = &bvh->nodes[i];
+    aabb_t bounds;
+    aabb_reset(&bounds);
+    if (node->count > 0) {
+      for (uint32_t k = node->left_first; k < node->left_first + node->count; k++) {
+        aabb_t box = sphere_aabb(sphere_list, k);
+        aabb_grow(&bounds, &box);
+      }
+    } else {
+      for (uint32_t c = node->left_first; c <= node->left_first + 1; c++) {
+        aabb_t box;
+        memcpy(box.min, bvh->nodes[c].min, sizeof(box.min));
+        memcpy(box.max, bvh->nodes[c].max, sizeof(box.max));
+        aabb_grow(&bounds, &box);
+      }
+    }
+    bvh_set_bounds(node, &bounds);
+  }
+}
+
+// slab test, returns the entry distance in *t_near if the ray hits the box
+// somewhere inside [interval->min, interval->max]
+bool hit_bvh_node(const bvh_node_t *node, const ray_t *ray, const vec3_t *inv_dir, const interval_t *interval, float *t_near) {
+  float t_min = interval->min;
+  float t_max = interval->max;
+  for (int a = 0; a < 3; a++) {
+    float t0 = (node->min[a] - ray->origin.e[a]) * inv_dir->e[a];
+    float t1 = (node->max[a] - ray->origin.e[a]) * inv_dir->e[a];
+    t_min = max_float(t_min, min_float(t0, t1));
+    t_max = min_float(t_max, max_float(t0, t1));
+  }
+  *t_near = t_min;
+  return t_min <= t_max;
+}
+
+// what a leaf is tested with: closest hit among prims [start, end), with the
+// contract of closest_sphere(). prims is the list the tree was built over.
+typedef bool (*bvh_leaf_fn_t)(const void *prims, size_t start, size_t end, const ray_t *ray, interval_t *interval, size_t *closest);
+
+bool closest_sphere_leaf(const void *sphere_list, size_t start, size_t end, const ray_t *ray, interval_t *interval, size_t *closest) {
+  STATS_ADD(sphere_tests, end - start);
+  return closest_sphere(sphere_list, start, end, ray, interval, closest);
+}
+
+// same contract as closest_sphere(): shrinks interval->max and sets *closest
+// on a hit, testing the leaves with leaf
+bool closest_prim_bvh(const bvh_t *bvh, bvh_leaf_fn_t leaf, const void *prims, const ray_t *ray, interval_t *interval, size_t *closest) {
+  if (bvh->n_prims == 0) {
+    return false;
+  }
+
+  vec3_t inv_dir = new_vec3(1.0f / ray->direction.e[0], 1.0f / ray->direction.e[1], 1.0f / ray->direction.e[2]);
+  uint32_t stack[BVH_STACK_SIZE];
+  float stack_t[BVH_STACK_SIZE];
+  int sp = 0;
+  bool hit = false;
+
+  float t_root;
+  if (!hit_bvh_node(&bvh->nodes[0], ray, &inv_dir, interval, &t_root)) {
+    return false;
+  }
+
+  uint32_t current = 0;
+  for (;;) {
+    const bvh_node_t *node = &bvh->nodes[current];
+    BVH_COUNT_VISIT();
+    if (node->count > 0) {
+      if (leaf(prims, node->left_first, node->left_first + node->count, ray, interval, closest)) {
+        hit = true;
+      }
+    } else {
+      uint32_t near = node->left_first;
+      uint32_t far = near + 1;
+      float t_near, t_far;
+      bool hit_near = hit_bvh_node(&bvh->nodes[near], ray, &inv_dir, interval, &t_near);
+      bool hit_far = hit_bvh_node(&bvh->nodes[far], ray, &inv_dir, interval, &t_far);
+      if (hit_near && hit_far) {
+        if (t_far < t_near) {
+          uint32_t tmp = near;
+          near = far;
+          far = tmp;
+          float tmp_t = t_near;
+          t_near = t_far;
+          t_far = tmp_t;
+        }
+        stack[sp] = far;
+        stack_t[sp] = t_far;
+        sp++;
+        current = near;
+        continue;
+      } else if (hit_near) {
+        current = near;
+        continue;
+      } else if (hit_far) {
+        current = far;
+        continue;
+      }
+    }
+
+    // pop the next subtree that can still contain something closer
+    // than what we've found so far
+    for (;;) {
+      if (sp == 0) {
+        return hit;
+      }
+      sp--;
+      if (stack_t[sp] <= interval->max) {
+        break;
+      }
+    }
+    current = stack[sp];
+  }
+}
+
+bool closest_sphere_bvh(const bvh_t *bvh, const sphere_list_t *sphere_list, const ray_t *ray, interval_t *interval, size_t *closest) {
+  return closest_prim_bvh(bvh, closest_sphere_leaf, sphere_list, ray, interval, closest);
+}
+
+// true as soon as anything inside interval is hit, for shadow rays. with no
+// closest hit to look for, children are visited in whatever order.
+bool occluded_prim_bvh(const bvh_t *bvh, bvh_leaf_fn_t leaf, const void *prims, const ray_t *ray, const interval_t *interval) {
+  if (bvh->n_prims == 0) {
+    return false;
+  }
+
+  vec3_t inv_dir = new_vec3(1.0f / ray->direction.e[0], 1.0f / ray->direction.e[1], 1.0f / ray->direction.e[2]);
+  uint32_t stack[BVH_STACK_SIZE];
+  int sp = 0;
+  stack[sp++] = 0;
+
+  while (sp > 0) {
+    const bvh_node_t *node = &bvh->nodes[stack[--sp]];
+    float t_near;
+    if (!hit_bvh_node(node, ray, &inv_dir, interval, &t_near)) {
+      continue;
+    }
+    BVH_COUNT_VISIT();
+    if (node->count > 0) {
+      interval_t leaf_interval = *interval;
+      size_t closest;
+      if (leaf(prims, node->left_first, node->left_first + node->count, ray, &leaf_interval, &closest)) {
+        return true;
+      }
+    } else {
+      stack[sp++] = node->left_first;
+      stack[sp++] = node->left_first + 1;
+    }
+  }
+  return false;
+}
+
+bool occluded_bvh(const bvh_t *bvh, const sphere_list_t *sphere_list, const ray_t *ray, const interval_t *interval) {
+  return occluded_prim_bvh(bvh, closest_sphere_leaf, sphere_list, ray, interval);
+}
+
+bool hit_bvh(const bvh_t *bvh, sphere_list_t *sphere_list, material_list_t *material_list, const ray_t *ray, const interval_t *interval, hit_record_t *rec) {
+  interval_t this_interval = *interval;
+  size_t closest_hit_sphere = 0;
+
+  if (closest_sphere_bvh(bvh, sphere_list, ray, &this_interval, &closest_hit_sphere)) {
+    set_sphere_hit_record(sphere_list, material_list, closest_hit_sphere, this_interval.max, ray, rec);
+    return true;
+  }
+  return false;
+}
+
+#endif // !BVH_H
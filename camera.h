@@ -1,19 +1,39 @@
 #ifndef CAMERA_H
 #define CAMERA_H
 
-#include <pthread.h>
-#include <string.h>
-
 #include "color.h"
 #include "hittable.h"
+#include "image.h"
 #include "material.h"
-#include "vectorized.h"
+#include "packet.h"
+#include "scene.h"
 #include "ray.h"
+#include "rng.h"
 #include "rtweekend.h"
+#include "sampling.h"
+#include "stats.h"
 #include "vec3.h"
 
-#define THREADED
-#define NUM_THREADS 10
+// Russian roulette: once a path has traced roulette_depth rays, each bounce
+// it carries on with probability p, its throughput's largest component (at
+// most ROULETTE_MAX_SURVIVAL), and has its throughput divided by p if it
+// does. that keeps the estimate unbiased while dark paths, which add next to
+// nothing, mostly stop early. the cap means even glass paths that lose
+// nothing get cut short eventually.
+#define ROULETTE_MIN_DEPTH 3
+#define ROULETTE_MAX_SURVIVAL 0.95f
+// the number of a bounce's rng stream the roulette draws, well clear of
+// the ones scatter takes
+#define ROULETTE_DIMENSION 16
+
+// the chance a path with throughput (r, g, b) survives a round
+float roulette_survival(float r, float g, float b) {
+  return min_float(max_float(r, max_float(g, b)), ROULETTE_MAX_SURVIVAL);
+}
+
+// next event estimation draws the light from this dimension of a bounce's
+// stream and the direction toward it from the two after
+#define LIGHT_DIMENSION 8
 
 typedef struct {
   float aspect_ratio;
@@ -25,11 +45,51 @@ typedef struct {
   point3_t pixel_delta_v;
   int samples_per_pixel;
   int max_depth;
+  // russian roulette from this many rays into a path on, 0 for none
+  int roulette_depth;
+  // next event estimation at diffuse hits, see direct_light. without it
+  // lights are only found by bouncing into them.
+  bool light_sampling;
 
   float defocus_angle;
   vec3_t defocus_disk_u;
   vec3_t defocus_disk_v;
 
+  // trace primary rays in packets, see render_pixel
+  bool packets;
+  // render with the wavefront engine (wavefront.h) instead of render_pixel
+  bool wavefront;
+  // render with the variant of sample_pixel compiled for this camera and
+  // scene, see select_render_variant. off, every render takes the generic
+  // one.
+  bool specialize;
+  // adaptive sampling, off when 0. samples_per_pixel is then the most a
+  // pixel gets and min_samples the least, see pixel_converged
+  float adaptive_threshold;
+  int min_samples;
+
+  // progressive rendering: passes of pass_samples samples per pixel until
+  // every pixel has samples_per_pixel (or converged), 0 for a single pass.
+  // the running sums are checkpointed to checkpoint_path (if set) after
+  // every pass, and resume picks up from there.
+  int pass_samples;
+  const char *checkpoint_path;
+  bool resume;
+
+  // where render() writes the image and how, see image.h
+  const char *output_path;
+  image_format_t output_format;
+  // where render() writes its statistics as JSON in a RENDER_STATS build,
+  // none if NULL
+  const char *stats_path;
+  // run the denoiser (denoise.h) over the image before it's written
+  bool denoise;
+  // if set, render() writes the denoiser's guide buffers to
+  // <aov_prefix>albedo.pfm, normal.pfm and depth.pfm
+  const char *aov_prefix;
+  // where render() writes how many samples each pixel took when sampling
+  // adaptively, none if NULL
+  const char *samples_path;
 } camera_t;
 
 camera_t initialize_camera(float aspect_ratio, int image_width, int samples_per_pixel, int max_depth, float vfov, point3_t lookfrom, point3_t lookat, point3_t vup, float defocus_angle, float focus_dist) {
@@ -74,181 +134,502 @@ camera_t initialize_camera(float aspect_ratio, int image_width, int samples_per_
     .pixel_delta_v = pixel_delta_v,
     .samples_per_pixel = samples_per_pixel,
     .max_depth = max_depth,
+    .roulette_depth = ROULETTE_MIN_DEPTH,
+    .light_sampling = true,
     .defocus_angle = defocus_angle,
     .defocus_disk_u = defocus_disk_u,
-    .defocus_disk_v = defocus_disk_v
+    .defocus_disk_v = defocus_disk_v,
+    .packets = false,
+    .wavefront = false,
+    .specialize = true,
+    .adaptive_threshold = 0,
+    .min_samples = samples_per_pixel,
+    .pass_samples = 0,
+    .checkpoint_path = NULL,
+    .resume = false,
+    .output_path = "output.ppm",
+    .output_format = IMAGE_P6,
+    .samples_path = "samples.pgm"
   };
   
   return camera;
 }
 
-color_t ray_color(ray_t *r, int depth, sphere_list_t *sphere_list, material_list_t *material_list) {
-  if (depth == 0) {
+// points camera from lookfrom at lookat with a new field of view and focus,
+// keeping its image size and every render setting
+void camera_look(camera_t *camera, point3_t lookfrom, point3_t lookat, point3_t vup, float vfov, float defocus_angle, float focus_dist) {
+  camera_t view = initialize_camera(camera->aspect_ratio, camera->image_width, camera->samples_per_pixel, camera->max_depth,
+                                    vfov, lookfrom, lookat, vup, defocus_angle, focus_dist);
+  camera->center = view.center;
+  camera->pixel00_loc = view.pixel00_loc;
+  camera->pixel_delta_u = view.pixel_delta_u;
+  camera->pixel_delta_v = view.pixel_delta_v;
+  camera->defocus_angle = view.defocus_angle;
+  camera->defocus_disk_u = view.defocus_disk_u;
+  camera->defocus_disk_v = view.defocus_disk_v;
+}
+
+// true if the camera samples the scene's lights at diffuse hits
+bool samples_lights(const camera_t *camera, const scene_t *scene) {
+  return camera->light_sampling && scene->lights != NULL && scene->lights->n_lights > 0;
+}
+
+// next event estimation at a diffuse hit at p with normal n (facing the way
+// the ray came from): a light and a direction toward it sampled with the
+// numbers at LIGHT_DIMENSION of stream, and a shadow ray that only has to
+// find out whether anything is in the way. returns the light's radiance
+// times cos / (pi * pdf), which is what the albedo gets multiplied by, and
+// weighted against the cosine weighted bounce that could have found the same
+// light. see trace_path for the other half.
+color_t direct_light(const scene_t *scene, point3_t p, vec3_t n, uint32_t stream) {
+  color_t black = new_vec3(0.0, 0.0, 0.0);
+  float dx, dy, dz, t, pdf;
+  uint32_t s;
+  if (!sample_light(scene->lights, scene->sphere_list, p.e[0], p.e[1], p.e[2],
+                    rng_uniform(stream, LIGHT_DIMENSION), rng_uniform(stream, LIGHT_DIMENSION + 1), rng_uniform(stream, LIGHT_DIMENSION + 2),
+                    &dx, &dy, &dz, &t, &pdf, &s)) {
+    return black;
+  }
+  float cos_theta = dx*n.e[0] + dy*n.e[1] + dz*n.e[2];
+  if (cos_theta <= 0) {
+    return black;
+  }
+  // stopping just short of the light so it doesn't shadow itself
+  ray_t shadow = new_ray(p, new_vec3(dx, dy, dz));
+  interval_t interval = {.min = 0.001, .max = t * 0.999f};
+  STATS_ADD(shadow_rays, 1);
+  if (occluded_scene(scene, &shadow, &interval)) {
+    return black;
+  }
+  float weight = power_heuristic(pdf, cos_theta / pi);
+  return scale(sphere_material(scene->material_list, s)->data.emissive.emit, weight * cos_theta / (pi * pdf));
+}
+
+// the radiance a ray picks up from a light it hits, from origin after a
+// bounce whose direction had pdf bounce_pdf, 0 if it wasn't a diffuse
+// bounce next event estimation could have done instead (or there was none)
+color_t light_hit(const scene_t *scene, const hit_record_t *rec, point3_t origin, float bounce_pdf) {
+  if (!rec->front_face) {
     return new_vec3(0.0, 0.0, 0.0);
   }
+  color_t emit = rec->mat->data.emissive.emit;
+  // emissive triangles aren't in the light list, so nothing else finds them
+  if (bounce_pdf <= 0 || rec->sphere == HIT_TRIANGLE) {
+    return emit;
+  }
+  float pdf = light_pdf(scene->lights, scene->sphere_list, rec->sphere, origin.e[0], origin.e[1], origin.e[2]);
+  return scale(emit, power_heuristic(bounce_pdf, pdf));
+}
 
-  hit_record_t rec;
+// follows a path whose first intersection is already known: hit says if r
+// hit anything, and if so rec describes it. lets packet tracing do the
+// primary rays and hand each lane over for the bounces. random numbers come
+// from the sample rng_begin_sample last set up, bounce n of the path drawing
+// from stream n.
+//
+// light comes from the sky, from lights the path hits, and with light
+// sampling on from direct_light at each diffuse hit that still has a bounce
+// to trace after it. a light hit straight after such a bounce is weighted
+// against direct_light's chance of having found it, so the two add up to
+// one estimate between them.
+//
+// trace_path_in is the same for a scene whose materials are all of the
+// types in materials. without lights to sample there are no emissive
+// materials, since the lights are the emissive spheres.
+ALWAYS_INLINE color_t trace_path_in(const camera_t *camera, const scene_t *scene, ray_t *r, bool hit, hit_record_t *rec, uint32_t materials) {
   interval_t interval = {.min = 0.001, .max = INFINITY};
-  ray_t *nray = r;
-  color_t attenuation = {1.0, 1.0, 1.0};
-
+  color_t radiance = new_vec3(0.0, 0.0, 0.0);
+  color_t attenuation = new_vec3(1.0, 1.0, 1.0);
+  int depth = camera->max_depth;
+  bool sample_lights = (materials & MATERIAL_BIT(EMISSIVE)) && samples_lights(camera, scene);
+  float bounce_pdf = 0;
+  uint32_t bounce = 1;
+
+  // bounce is also how many rays the path has traced so far
   while (depth > 0) {
-    if (hit_sphere_list_vectorized(sphere_list, material_list, nray, &interval, &rec)) {
-      color_t new_attenuation;
-      if (scatter(rec.mat, nray, &rec, &new_attenuation, nray)) {
-        attenuation = multiply(attenuation, new_attenuation);
-        depth -= 1;
-      } else {
-        return new_vec3(0.0, 0.0, 0.0);
-      }
-    } else {
+    if (!hit) {
+      STATS_PATH_END(PATH_ESCAPED, bounce);
       float a = 0.5 * (1.0 + normalize(r->direction).e[1]);
       color_t white = new_vec3(1.0, 1.0, 1.0);
       color_t blue = new_vec3(0.5, 0.7, 1.0);
-      return multiply(attenuation, add(scale(white, 1-a), scale(blue, a)));
+      color_t sky = multiply(scene->sky, add(scale(white, 1-a), scale(blue, a)));
+      return add(radiance, multiply(attenuation, sky));
+    }
+    STATS_ADD(material_hits[rec->mat->type], 1);
+    if (material_is(rec->mat, EMISSIVE, materials)) {
+      STATS_PATH_END(PATH_LIGHT, bounce);
+      return add(radiance, multiply(attenuation, light_hit(scene, rec, r->origin, bounce_pdf)));
+    }
+    rng_begin_bounce(bounce);
+    bool diffuse = material_is(rec->mat, LAMBERTIAN, materials);
+    if (sample_lights && diffuse && depth > 1) {
+      color_t direct = multiply(rec->mat->data.lambertian.albedo, direct_light(scene, rec->p, rec->normal, g_rng.stream));
+      add_equals(&radiance, multiply(attenuation, direct));
+    }
+    color_t new_attenuation = new_vec3(1.0, 1.0, 1.0);
+    if (!scatter_in(rec->mat, r, rec, &new_attenuation, r, materials)) {
+      STATS_PATH_END(PATH_ABSORBED, bounce);
+      return radiance;
+    }
+    bounce_pdf = sample_lights && diffuse ? max_float(0.0f, dot(r->direction, rec->normal)) / pi : 0.0f;
+    attenuation = multiply(attenuation, new_attenuation);
+    depth -= 1;
+    if (depth > 0 && camera->roulette_depth > 0 && bounce >= (uint32_t)camera->roulette_depth) {
+      float p = roulette_survival(attenuation.e[0], attenuation.e[1], attenuation.e[2]);
+      if (rng_uniform(g_rng.stream, ROULETTE_DIMENSION) >= p) {
+        STATS_PATH_END(PATH_ROULETTE, bounce);
+        return radiance;
+      }
+      attenuation = scale(attenuation, 1.0f / p);
+    }
+    if (depth > 0) {
+      STATS_ADD(secondary_rays, 1);
+      hit = hit_scene(scene, r, &interval, rec);
+      bounce++;
     }
   }
-  return new_vec3(0.0, 0.0, 0.0);
+  STATS_PATH_END(PATH_CUT_OFF, bounce);
+  return radiance;
 }
 
-point3_t defocus_disk_sample(const camera_t *camera) {
-  point3_t r = random_vec3_in_unit_disk();
+color_t trace_path(const camera_t *camera, const scene_t *scene, ray_t *r, bool hit, hit_record_t *rec) {
+  return trace_path_in(camera, scene, r, hit, rec, ALL_MATERIAL_TYPES);
+}
+
+ALWAYS_INLINE color_t ray_color_in(const camera_t *camera, const scene_t *scene, ray_t *r, uint32_t materials) {
+  if (camera->max_depth == 0) {
+    return new_vec3(0.0, 0.0, 0.0);
+  }
+
+  hit_record_t rec;
+  interval_t interval = {.min = 0.001, .max = INFINITY};
+  STATS_ADD(primary_rays, 1);
+  bool hit = hit_scene(scene, r, &interval, &rec);
+  return trace_path_in(camera, scene, r, hit, &rec, materials);
+}
+
+color_t ray_color(const camera_t *camera, const scene_t *scene, ray_t *r) {
+  return ray_color_in(camera, scene, r, ALL_MATERIAL_TYPES);
+}
+
+// the point of the lens at (x, y) in the unit disk
+point3_t defocus_disk_point(const camera_t *camera, float x, float y) {
   point3_t out = camera->center;
-  add_equals(&out, scale(camera->defocus_disk_u, r.e[0]));
-  add_equals(&out, scale(camera->defocus_disk_v, r.e[1]));
+  add_equals(&out, scale(camera->defocus_disk_u, x));
+  add_equals(&out, scale(camera->defocus_disk_v, y));
   return out;
 }
 
-typedef struct render_args_t {
-  const camera_t *camera;
-  sphere_list_t *sphere_list;
-  material_list_t *material_list;
-  int scanline_start;
-  int num_threads;
-  color_t *pixels;
-} render_args_t;
+point3_t defocus_disk_sample(const camera_t *camera) {
+  point3_t r = random_vec3_in_unit_disk();
+  return defocus_disk_point(camera, r.e[0], r.e[1]);
+}
 
-void *render_scanline(void *args) {
-  render_args_t *rargs = (render_args_t *)args;
-  const camera_t *camera = rargs->camera;
+// the ray from origin through the pixel centred on pixel_center, offset by
+// (u, v) in [0, 1) pixels from its corner
+ray_t jittered_ray(const camera_t *camera, point3_t pixel_center, float u, float v, point3_t origin) {
+  point3_t pixel_sample = add(
+    pixel_center,
+    scale(camera->pixel_delta_u, (-0.5 + u))
+  );
+  add_equals(&pixel_sample,
+             scale(camera->pixel_delta_v, (-0.5 + v)));
+
+  vec3_t ray_direction = normalize(subtract(pixel_sample, origin));
+  return new_ray(origin, ray_direction);
+}
 
-  for (int scanline = rargs->scanline_start; scanline < camera->image_height; scanline+=rargs->num_threads) {
-    if (scanline % 10 == 0) {
-      printf("Thread %d Scanline %d\n", rargs->scanline_start, scanline);
-    }
-    for (int i = 0; i < camera->image_width; i++) {
-      point3_t pixel_center = add(camera->pixel00_loc, scale(camera->pixel_delta_u, i));
-      add_equals(&pixel_center, scale(camera->pixel_delta_v, scanline));
-      color_t color_sum = new_vec3(0.0, 0.0, 0.0);
-
-      for (int k=0; k < camera->samples_per_pixel; k++) {
-        point3_t pixel_sample = add(
-          pixel_center,
-          scale(camera->pixel_delta_u, (-0.5 + random_float()))
-        );
-        add_equals(&pixel_sample,
-                   scale(camera->pixel_delta_v, (-0.5 + random_float())));
-
-        point3_t ray_origin = (camera->defocus_angle <= 0) ? camera->center: defocus_disk_sample(camera);
-        vec3_t ray_direction = normalize(subtract(pixel_sample, ray_origin));
-        ray_t ray = new_ray(ray_origin, ray_direction);
-
-        color_t sample_color = ray_color(&ray, camera->max_depth, rargs->sphere_list, rargs->material_list);
-        add_equals(&color_sum, sample_color);
-      }
+// a jittered ray through the pixel centred on pixel_center. the jitter is
+// dimensions 0 and 1 of the camera ray's stream, the lens sample 2 and 3.
+// thin_lens says whether the camera has a lens (defocus_angle > 0) or is a
+// pinhole.
+ALWAYS_INLINE ray_t sample_ray_in(const camera_t *camera, point3_t pixel_center, bool thin_lens) {
+  float u = random_float();
+  float v = random_float();
+  point3_t origin = thin_lens ? defocus_disk_sample(camera) : camera->center;
+  return jittered_ray(camera, pixel_center, u, v, origin);
+}
 
-      color_t pixel_color = scale(color_sum, 1.0/camera->samples_per_pixel);
-      int current_pixel_num = scanline * camera->image_width + i;
-      //*(rargs->pixels + current_pixel_num) = pixel_color;
-      memcpy(rargs->pixels + current_pixel_num, &pixel_color, sizeof(color_t));
-    }
-  }
-  return NULL;
+ray_t sample_ray(const camera_t *camera, point3_t pixel_center) {
+  return sample_ray_in(camera, pixel_center, camera->defocus_angle > 0);
 }
 
-void render(camera_t *camera, sphere_list_t *sphere_list, material_list_t *material_list) {
-  FILE *fp;
-  fp = fopen("output.ppm", "w");
+// adaptive sampling: a pixel stops once the standard error of its mean
+// luminance is below adaptive_threshold times the mean. the mean gets
+// ADAPTIVE_DARK_BIAS added so near-black pixels aren't chased to the maximum
+// for noise nobody can see.
+#define ADAPTIVE_DARK_BIAS 1e-2f
+// samples taken between convergence checks (packet_width with packets on)
+#define ADAPTIVE_BATCH 8
 
-  fprintf(fp, "P3\n");
-  fprintf(fp, "%d %d\n", camera->image_width, camera->image_height);
-  fprintf(fp, "255\n");
+// running sums for one pixel
+typedef struct {
+  color_t sum;
+  // mean and sum of squared deviations of the luminance (Welford)
+  float mean;
+  float m2;
+  int n;
+} pixel_stats_t;
+
+float luminance(color_t c) {
+  return 0.2126f*c.e[0] + 0.7152f*c.e[1] + 0.0722f*c.e[2];
+}
 
-  #ifdef THREADED
+void pixel_add_sample(pixel_stats_t *stats, color_t c) {
+  add_equals(&stats->sum, c);
+  stats->n++;
+  float y = luminance(c);
+  float delta = y - stats->mean;
+  stats->mean += delta / stats->n;
+  stats->m2 += delta * (y - stats->mean);
+}
 
-  int n_pixels = camera->image_height * camera->image_width;
-  color_t *pixels = (color_t *)malloc(sizeof(color_t) * n_pixels);
-  render_args_t *thread_args = (render_args_t *)malloc(sizeof(render_args_t) * NUM_THREADS);
-  render_args_t render_args_base = {
-    .camera = camera,
-    .sphere_list = sphere_list,
-    .material_list = material_list,
-    .scanline_start = 0, // to be filled in on each thread creation
-    .num_threads = NUM_THREADS,
-    .pixels = pixels
-  };
+color_t pixel_color(const pixel_stats_t *stats) {
+  return stats->n > 0 ? scale(stats->sum, 1.0/stats->n) : new_vec3(0.0, 0.0, 0.0);
+}
 
-  for (int i = 0; i < NUM_THREADS; i++) {
-    memcpy(thread_args + i, &render_args_base, sizeof(render_args_t));
+// true once the pixel needs no more samples
+bool pixel_converged(const camera_t *camera, const pixel_stats_t *stats) {
+  if (stats->n >= camera->samples_per_pixel) {
+    return true;
   }
-
-  pthread_t threads[NUM_THREADS];
-  for (int k = 0; k < NUM_THREADS; k++) {
-    render_args_t *this_thread_args = thread_args + k;
-    this_thread_args->scanline_start = k;
-
-    int result_code = pthread_create(&threads[k], NULL, render_scanline, this_thread_args);
-    if(result_code != 0) {
-      printf("**************** problem creating thread *****************\n");
-    }
+  if (camera->adaptive_threshold <= 0 || stats->n < camera->min_samples || stats->n < 2) {
+    return false;
   }
+  float variance = stats->m2 / (stats->n - 1);
+  float std_error = sqrtf(variance / stats->n);
+  return std_error <= camera->adaptive_threshold * (stats->mean + ADAPTIVE_DARK_BIAS);
+}
 
-  for (int k = 0; k < NUM_THREADS; k++) {
-    int result_code = pthread_join(threads[k], NULL);
-    if(result_code != 0) {
-      printf("*************** problem joining thread *****************\n");
-      printf("%d\n", result_code);
-      abort();
+// adds n samples of pixel (i, j) to stats, numbered on from the ones it
+// already has. with packets on, the samples go out packet_width at a time:
+// they all start at the camera and head through the same pixel, about as
+// coherent as rays get. the leftovers that don't fill a packet go one at a
+// time.
+//
+// sample_pixel_in does it for a camera with or without a lens, as thin_lens
+// says, and a scene whose materials are of the types in materials. the
+// render variants below are it with those constant.
+ALWAYS_INLINE void sample_pixel_in(const camera_t *camera, const scene_t *scene, int i, int j, int n, pixel_stats_t *stats, bool thin_lens, uint32_t materials) {
+  point3_t pixel_center = add(camera->pixel00_loc, scale(camera->pixel_delta_u, i));
+  add_equals(&pixel_center, scale(camera->pixel_delta_v, j));
+  uint32_t pixel = (uint32_t)j * camera->image_width + i;
+  uint32_t first = stats->n;
+
+  int k = 0;
+  if (camera->packets && camera->max_depth > 0) {
+    ray_packet_t packet;
+    packet.width = packet_width;
+    interval_t interval = {.min = 0.001, .max = INFINITY};
+    uint32_t streams[PACKET_MAX_WIDTH];
+    float jitter_u[PACKET_MAX_WIDTH], jitter_v[PACKET_MAX_WIDTH];
+    float lens_x[PACKET_MAX_WIDTH], lens_y[PACKET_MAX_WIDTH];
+    for (; k + packet.width <= n; k += packet.width) {
+      // every lane's jitter and lens sample in batched draws, the same
+      // numbers sample_ray would draw one at a time
+      for (int l = 0; l < packet.width; l++) {
+        streams[l] = rng_bounce_stream(rng_sample_key(pixel, first + k + l), 0);
+      }
+      rng_uniform_fill(streams, 0, jitter_u, packet.width);
+      rng_uniform_fill(streams, 1, jitter_v, packet.width);
+      if (thin_lens) {
+        rng_uniform_fill(streams, 2, lens_x, packet.width);
+        rng_uniform_fill(streams, 3, lens_y, packet.width);
+        concentric_disk_points(lens_x, lens_y, lens_x, lens_y, packet.width);
+      }
+      for (int l = 0; l < packet.width; l++) {
+        point3_t origin = thin_lens ? defocus_disk_point(camera, lens_x[l], lens_y[l]) : camera->center;
+        ray_t ray = jittered_ray(camera, pixel_center, jitter_u[l], jitter_v[l], origin);
+        packet_set_ray(&packet, l, &ray);
+      }
+      packet_begin(&packet, &interval);
+      // packets always walk the binary tree, the wide one is collapsed from
+      // it so it's still there when a wide BVH is in use
+      trace_packet(scene->bvh, scene->sphere_list, &packet);
+      STATS_ADD(primary_rays, packet.width);
+
+      for (int l = 0; l < packet.width; l++) {
+        ray_t ray = packet_get_ray(&packet, l);
+        hit_record_t rec;
+        bool hit = packet.sphere[l] >= 0;
+        if (hit) {
+          set_sphere_hit_record(scene->sphere_list, scene->material_list, packet.sphere[l], packet.t_max[l], &ray, &rec);
+        }
+        // packets only cover the spheres, each lane's triangles are
+        // searched on their own
+        interval_t triangle_interval = {.min = interval.min, .max = hit ? packet.t_max[l] : interval.max};
+        size_t triangle;
+        if (closest_triangle_scene(scene, &ray, &triangle_interval, &triangle)) {
+          set_triangle_hit_record(scene->triangles, triangle, triangle_interval.max, &ray, &rec);
+          hit = true;
+        }
+        rng_begin_sample(pixel, first + k + l);
+        pixel_add_sample(stats, trace_path_in(camera, scene, &ray, hit, &rec, materials));
+      }
     }
   }
 
-  write_pixels(fp, pixels, n_pixels);
+  for (; k < n; k++) {
+    rng_begin_sample(pixel, first + k);
+    ray_t ray = sample_ray_in(camera, pixel_center, thin_lens);
+    pixel_add_sample(stats, ray_color_in(camera, scene, &ray, materials));
+  }
+}
 
-  #else
+// the generic variant, which checks everything as it goes
+void sample_pixel(const camera_t *camera, const scene_t *scene, int i, int j, int n, pixel_stats_t *stats) {
+  sample_pixel_in(camera, scene, i, j, n, stats, camera->defocus_angle > 0, ALL_MATERIAL_TYPES);
+}
 
-  for (int j = 0; j < camera->image_height; j++) {
-    printf("Scanlines remaining: %d\n", camera->image_height - j);
-    for (int i = 0; i < camera->image_width; i++) {
-      point3_t pixel_center = add(camera->pixel00_loc, scale(camera->pixel_delta_u, i));
-      add_equals(&pixel_center, scale(camera->pixel_delta_v, j));
-      color_t color_sum = new_vec3(0.0, 0.0, 0.0);
+// Render variants: sample_pixel compiled for one kind of camera and set of
+// material types, with the checks for the others folded away. each is
+// sample_pixel_in stamped out by RENDER_VARIANT with constant arguments.
+// the statistics counters are already in or out at compile time
+// (RENDER_STATS), and the packet width is the SIMD backend's, picked at
+// startup.
+typedef void (*sample_pixel_fn_t)(const camera_t *camera, const scene_t *scene, int i, int j, int n, pixel_stats_t *stats);
 
-      for (int k=0; k < camera->samples_per_pixel; k++) {
-        point3_t pixel_sample = add(
-          pixel_center,
-          scale(camera->pixel_delta_u, (-0.5 + random_float()))
-        );
-        add_equals(&pixel_sample,
-                   scale(camera->pixel_delta_v, (-0.5 + random_float())));
+typedef struct {
+  const char *name;
+  bool thin_lens;
+  uint32_t materials;
+  sample_pixel_fn_t sample_pixel;
+} render_variant_t;
+
+#define RENDER_VARIANT(name, thin_lens, materials) \
+  void sample_pixel_##name(const camera_t *camera, const scene_t *scene, int i, int j, int n, pixel_stats_t *stats) { \
+    sample_pixel_in(camera, scene, i, j, n, stats, thin_lens, materials); \
+  }
 
-        point3_t ray_origin = (camera->defocus_angle <= 0) ? camera->center: defocus_disk_sample(camera);
-        vec3_t ray_direction = normalize(subtract(pixel_sample, ray_origin));
-        ray_t ray = new_ray(ray_origin, ray_direction);
+#define DIFFUSE_MATERIALS MATERIAL_BIT(LAMBERTIAN)
+#define OPAQUE_MATERIALS (MATERIAL_BIT(LAMBERTIAN) | MATERIAL_BIT(METAL))
+#define UNLIT_MATERIALS (MATERIAL_BIT(LAMBERTIAN) | MATERIAL_BIT(METAL) | MATERIAL_BIT(DIELECTRIC))
+
+RENDER_VARIANT(pinhole_diffuse, false, DIFFUSE_MATERIALS)
+RENDER_VARIANT(pinhole_opaque, false, OPAQUE_MATERIALS)
+RENDER_VARIANT(pinhole_unlit, false, UNLIT_MATERIALS)
+RENDER_VARIANT(pinhole_all, false, ALL_MATERIAL_TYPES)
+RENDER_VARIANT(lens_diffuse, true, DIFFUSE_MATERIALS)
+RENDER_VARIANT(lens_opaque, true, OPAQUE_MATERIALS)
+RENDER_VARIANT(lens_unlit, true, UNLIT_MATERIALS)
+RENDER_VARIANT(lens_all, true, ALL_MATERIAL_TYPES)
+
+// most specific first, select_render_variant takes the first that fits
+const render_variant_t render_variants[] = {
+  {"pinhole_diffuse", false, DIFFUSE_MATERIALS, sample_pixel_pinhole_diffuse},
+  {"pinhole_opaque", false, OPAQUE_MATERIALS, sample_pixel_pinhole_opaque},
+  {"pinhole_unlit", false, UNLIT_MATERIALS, sample_pixel_pinhole_unlit},
+  {"pinhole_all", false, ALL_MATERIAL_TYPES, sample_pixel_pinhole_all},
+  {"lens_diffuse", true, DIFFUSE_MATERIALS, sample_pixel_lens_diffuse},
+  {"lens_opaque", true, OPAQUE_MATERIALS, sample_pixel_lens_opaque},
+  {"lens_unlit", true, UNLIT_MATERIALS, sample_pixel_lens_unlit},
+  {"lens_all", true, ALL_MATERIAL_TYPES, sample_pixel_lens_all}
+};
+#define N_RENDER_VARIANTS (sizeof(render_variants) / sizeof(render_variants[0]))
+
+const render_variant_t generic_render_variant = {"generic", false, ALL_MATERIAL_TYPES, sample_pixel};
+
+// the variant to render the scene through camera with, picked once per
+// render: the first whose lens matches and whose material types cover the
+// scene's. every variant draws the same random numbers as the generic one,
+// so the image doesn't change, it just comes sooner.
+const render_variant_t *select_render_variant(const camera_t *camera, const scene_t *scene) {
+  if (!camera->specialize) {
+    return &generic_render_variant;
+  }
+  bool thin_lens = camera->defocus_angle > 0;
+  uint32_t types = scene_material_types(scene);
+  for (size_t v = 0; v < N_RENDER_VARIANTS; v++) {
+    if (render_variants[v].thin_lens == thin_lens && (types & ~render_variants[v].materials) == 0) {
+      return &render_variants[v];
+    }
+  }
+  return &generic_render_variant;
+}
 
-        color_t sample_color = ray_color(&ray, camera->max_depth, sphere_list, material_list);
-        add_equals(&color_sum, sample_color);
-      }
+// samples pixel (i, j) until it converges: samples_per_pixel samples, or in
+// adaptive mode anywhere from min_samples up to that. stops early if it
+// reaches limit samples, so a progressive render can do it a pass at a time.
+// the samples are taken with sample, one of the render variants.
+void sample_pixel_adaptive(const camera_t *camera, const scene_t *scene, sample_pixel_fn_t sample, int i, int j, int limit, pixel_stats_t *stats) {
+  limit = limit < camera->samples_per_pixel ? limit : camera->samples_per_pixel;
+  int batch = camera->packets ? packet_width : ADAPTIVE_BATCH;
+  int first = camera->adaptive_threshold > 0 ? camera->min_samples : camera->samples_per_pixel;
+  first = first < limit ? first : limit;
+  if (stats->n < first) {
+    sample(camera, scene, i, j, first - stats->n, stats);
+  }
+  while (stats->n < limit && !pixel_converged(camera, stats)) {
+    int left = limit - stats->n;
+    sample(camera, scene, i, j, left < batch ? left : batch, stats);
+  }
+}
 
-      color_t pixel_color = scale(color_sum, 1.0/camera->samples_per_pixel);
+// the first hits of the camera rays of a pixel's first AOV_SAMPLES samples,
+// for the denoiser's guide buffers
+#define AOV_SAMPLES 8
+// mirrors and glass are looked through, up to this many bounces, so the
+// guides describe what they show. metal is a mirror up to this much fuzz.
+#define AOV_MAX_BOUNCES 4
+#define AOV_MIRROR_FUZZ 0.1f
 
-      write_one_pixel(fp, pixel_color);
+bool aov_looks_through(const material_t *mat) {
+  return mat->type == DIELECTRIC || (mat->type == METAL && mat->data.metal.fuzz <= AOV_MIRROR_FUZZ);
+}
 
+// the albedo, normal (facing the camera) and depth of pixel (i, j)'s first
+// rough hits, averaged over AOV_SAMPLES of its camera rays. the rays are the
+// ones the render's first samples trace. a mirror or glass is followed to
+// whatever it reflects or refracts, the albedo tinted by the bounces on the
+// way, so a reflection keeps its own edges to guide the filter rather than
+// the mirror's smooth normals smudging it. the sky has albedo 1 and a zero
+// normal, and depth 0 unless it's seen in a mirror.
+void pixel_aovs(const camera_t *camera, const scene_t *scene, int i, int j, color_t *albedo, vec3_t *normal, float *depth) {
+  point3_t pixel_center = add(camera->pixel00_loc, scale(camera->pixel_delta_u, i));
+  add_equals(&pixel_center, scale(camera->pixel_delta_v, j));
+  uint32_t pixel = (uint32_t)j * camera->image_width + i;
+  *albedo = new_vec3(0.0, 0.0, 0.0);
+  *normal = new_vec3(0.0, 0.0, 0.0);
+  *depth = 0;
+  for (int k = 0; k < AOV_SAMPLES; k++) {
+    rng_begin_sample(pixel, k);
+    ray_t ray = sample_ray(camera, pixel_center);
+    color_t tint = new_vec3(1.0, 1.0, 1.0);
+    float distance = 0;
+    for (int bounce = 0; ; bounce++) {
+      interval_t interval = {.min = 0.001, .max = INFINITY};
+      hit_record_t rec;
+      if (!hit_scene(scene, &ray, &interval, &rec)) {
+        add_equals(albedo, tint);
+        *depth += distance;
+        break;
+      }
+      distance += rec.t;
+      if (bounce + 1 < AOV_MAX_BOUNCES && aov_looks_through(rec.mat)) {
+        // numbered as trace_path numbers them, stream 0 being the camera ray's
+        rng_begin_bounce(bounce + 1);
+        color_t attenuation;
+        if (scatter(rec.mat, &ray, &rec, &attenuation, &ray)) {
+          tint = multiply(tint, attenuation);
+          continue;
+        }
+      }
+      add_equals(albedo, multiply(tint, material_albedo(rec.mat)));
+      add_equals(normal, rec.normal);
+      *depth += distance;
+      break;
     }
   }
+  *albedo = scale(*albedo, 1.0f / AOV_SAMPLES);
+  *normal = scale(*normal, 1.0f / AOV_SAMPLES);
+  *depth /= AOV_SAMPLES;
+}
 
-  #endif // THREADED
-
-  printf("Done\n");
+// samples one pixel, see sample_pixel_adaptive
+color_t render_pixel(const camera_t *camera, const scene_t *scene, int i, int j) {
+  pixel_stats_t stats = {0};
+  sample_pixel_adaptive(camera, scene, sample_pixel, i, j, camera->samples_per_pixel, &stats);
+  return pixel_color(&stats);
 }
 
 #endif // !CAMERA_H
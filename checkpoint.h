@@ -0,0 +1,254 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "camera.h"
+#include "scene.h"
+
+// Checkpoints of a progressive render: a header followed by the raw
+// pixel_stats_t of every pixel (color sum, luminance mean/variance, sample
+// count), so a resumed render carries on exactly where the last one
+// stopped, adaptive sampling included.
+//
+// A checkpoint only resumes the render it came from: the image size and
+// samples per pixel must match, and so must a fingerprint of the camera's
+// view and the scene, otherwise the passes would be summed with ones of
+// another render.
+//
+// Files are written to <path>.tmp, fsync'd and renamed over <path>, so a
+// render killed mid-write leaves the previous checkpoint intact. Writing
+// happens on a thread of its own: the render hands over a snapshot between
+// passes and goes straight on with the next one.
+
+#define CHECKPOINT_MAGIC "RTCKPT02"
+
+typedef struct {
+  char magic[8];
+  int32_t width;
+  int32_t height;
+  int32_t samples_per_pixel;
+  int32_t pass_samples;
+  // passes finished when this was written
+  int32_t passes;
+  int32_t pixel_stats_size;
+  // checkpoint_fingerprint of the render
+  uint64_t fingerprint;
+} checkpoint_header_t;
+
+// FNV-1a, 64 bit, carrying on from h
+uint64_t fingerprint_bytes(uint64_t h, const void *data, size_t size) {
+  const unsigned char *bytes = (const unsigned char *)data;
+  for (size_t k = 0; k < size; k++) {
+    h = (h ^ bytes[k]) * 1099511628211ull;
+  }
+  return h;
+}
+
+uint64_t fingerprint_materials(uint64_t h, const material_list_t *material_list, size_t n) {
+  h = fingerprint_bytes(h, material_list->indices, n * sizeof(material_index_t));
+  return fingerprint_bytes(h, material_list->materials, material_list->n_materials * sizeof(material_t));
+}
+
+// a hash of everything that decides what the passes add up to: where the
+// camera looks from and how it traces, and the scene's geometry, materials
+// and sky. field by field, camera_t has pointers and padding in it.
+uint64_t checkpoint_fingerprint(const camera_t *camera, const scene_t *scene) {
+  uint64_t h = 14695981039346656037ull;
+  h = fingerprint_bytes(h, &camera->center, sizeof(camera->center));
+  h = fingerprint_bytes(h, &camera->pixel00_loc, sizeof(camera->pixel00_loc));
+  h = fingerprint_bytes(h, &camera->pixel_delta_u, sizeof(camera->pixel_delta_u));
+  h = fingerprint_bytes(h, &camera->pixel_delta_v, sizeof(camera->pixel_delta_v));
+  h = fingerprint_bytes(h, &camera->defocus_angle, sizeof(camera->defocus_angle));
+  h = fingerprint_bytes(h, &camera->defocus_disk_u, sizeof(camera->defocus_disk_u));
+  h = fingerprint_bytes(h, &camera->defocus_disk_v, sizeof(camera->defocus_disk_v));
+  h = fingerprint_bytes(h, &camera->max_depth, sizeof(camera->max_depth));
+  h = fingerprint_bytes(h, &camera->roulette_depth, sizeof(camera->roulette_depth));
+  h = fingerprint_bytes(h, &camera->light_sampling, sizeof(camera->light_sampling));
+  h = fingerprint_bytes(h, &camera->adaptive_threshold, sizeof(camera->adaptive_threshold));
+  h = fingerprint_bytes(h, &camera->min_samples, sizeof(camera->min_samples));
+
+  const sphere_list_t *sphere_list = scene->sphere_list;
+  size_t n = sphere_list->nth_sphere;
+  h = fingerprint_bytes(h, &n, sizeof(n));
+  const float *arrays[] = {sphere_list->xs, sphere_list->ys, sphere_list->zs, sphere_list->r2s};
+  for (int k = 0; k < 4; k++) {
+    h = fingerprint_bytes(h, arrays[k], n * sizeof(float));
+  }
+  if (scene->material_list != NULL) {
+    h = fingerprint_materials(h, scene->material_list, n);
+  }
+  const triangle_list_t *triangles = scene->triangles;
+  if (triangles != NULL) {
+    h = fingerprint_bytes(h, &triangles->n_triangles, sizeof(triangles->n_triangles));
+    h = fingerprint_bytes(h, triangles->vxs, triangles->n_vertices * sizeof(float));
+    h = fingerprint_bytes(h, triangles->vys, triangles->n_vertices * sizeof(float));
+    h = fingerprint_bytes(h, triangles->vzs, triangles->n_vertices * sizeof(float));
+    h = fingerprint_bytes(h, triangles->v0s, triangles->n_triangles * sizeof(uint32_t));
+    h = fingerprint_bytes(h, triangles->v1s, triangles->n_triangles * sizeof(uint32_t));
+    h = fingerprint_bytes(h, triangles->v2s, triangles->n_triangles * sizeof(uint32_t));
+    h = fingerprint_materials(h, triangles->materials, triangles->n_triangles);
+  }
+  return fingerprint_bytes(h, &scene->sky, sizeof(scene->sky));
+}
+
+bool write_checkpoint(const char *path, const checkpoint_header_t *header, const pixel_stats_t *stats) {
+  size_t n_pixels = (size_t)header->width * header->height;
+  char tmp_path[4096];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+  FILE *fp = fopen(tmp_path, "wb");
+  if (fp == NULL) {
+    return false;
+  }
+  bool ok = fwrite(header, sizeof(checkpoint_header_t), 1, fp) == 1
+         && fwrite(stats, sizeof(pixel_stats_t), n_pixels, fp) == n_pixels
+         && fflush(fp) == 0
+         && fsync(fileno(fp)) == 0;
+  ok &= fclose(fp) == 0;
+  if (!ok || rename(tmp_path, path) != 0) {
+    remove(tmp_path);
+    return false;
+  }
+  return true;
+}
+
+// reads a checkpoint for camera's image into stats (image_width *
+// image_height of them). returns the number of passes it had finished, or
+// -1 if there's no usable checkpoint at path: none, or one of a render with
+// another size, samples_per_pixel or fingerprint.
+int load_checkpoint(const char *path, const camera_t *camera, uint64_t fingerprint, pixel_stats_t *stats, int *pass_samples) {
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) {
+    return -1;
+  }
+  checkpoint_header_t header;
+  size_t n_pixels = (size_t)camera->image_width * camera->image_height;
+  bool ok = fread(&header, sizeof(header), 1, fp) == 1
+         && memcmp(header.magic, CHECKPOINT_MAGIC, 8) == 0
+         && header.width == camera->image_width
+         && header.height == camera->image_height
+         && header.samples_per_pixel == camera->samples_per_pixel
+         && header.pass_samples > 0 && header.passes >= 0
+         && header.fingerprint == fingerprint
+         && header.pixel_stats_size == sizeof(pixel_stats_t)
+         && fread(stats, sizeof(pixel_stats_t), n_pixels, fp) == n_pixels;
+  fclose(fp);
+  if (!ok) {
+    return -1;
+  }
+  *pass_samples = header.pass_samples;
+  return header.passes;
+}
+
+checkpoint_header_t new_checkpoint_header(const camera_t *camera, uint64_t fingerprint, int pass_samples, int passes) {
+  checkpoint_header_t header = {
+    .width = camera->image_width,
+    .height = camera->image_height,
+    .samples_per_pixel = camera->samples_per_pixel,
+    .pass_samples = pass_samples,
+    .passes = passes,
+    .pixel_stats_size = sizeof(pixel_stats_t),
+    .fingerprint = fingerprint
+  };
+  memcpy(header.magic, CHECKPOINT_MAGIC, 8);
+  return header;
+}
+
+typedef struct {
+  const char *path;
+  size_t n_pixels;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t idle;
+  // the copy being written, only touched by the writer while pending
+  pixel_stats_t *snapshot;
+  checkpoint_header_t header;
+  bool pending;
+  bool shutdown;
+} checkpoint_writer_t;
+
+void *checkpoint_writer_main(void *args) {
+  checkpoint_writer_t *writer = (checkpoint_writer_t *)args;
+  pthread_mutex_lock(&writer->lock);
+  for (;;) {
+    while (!writer->pending && !writer->shutdown) {
+      pthread_cond_wait(&writer->wake, &writer->lock);
+    }
+    if (!writer->pending) {
+      break;
+    }
+    pthread_mutex_unlock(&writer->lock);
+
+    if (!write_checkpoint(writer->path, &writer->header, writer->snapshot)) {
+      printf("couldn't write checkpoint %s\n", writer->path);
+    }
+
+    pthread_mutex_lock(&writer->lock);
+    writer->pending = false;
+    pthread_cond_broadcast(&writer->idle);
+  }
+  pthread_mutex_unlock(&writer->lock);
+  return NULL;
+}
+
+checkpoint_writer_t *new_checkpoint_writer(const char *path, size_t n_pixels) {
+  checkpoint_writer_t *writer = malloc(sizeof(checkpoint_writer_t));
+  writer->path = path;
+  writer->n_pixels = n_pixels;
+  writer->snapshot = malloc(n_pixels * sizeof(pixel_stats_t));
+  writer->pending = false;
+  writer->shutdown = false;
+  pthread_mutex_init(&writer->lock, NULL);
+  pthread_cond_init(&writer->wake, NULL);
+  pthread_cond_init(&writer->idle, NULL);
+  if (pthread_create(&writer->thread, NULL, checkpoint_writer_main, writer) != 0) {
+    printf("**************** problem creating thread *****************\n");
+    abort();
+  }
+  return writer;
+}
+
+// hands a copy of stats to the writer thread. if it's still busy with the
+// previous checkpoint this one is skipped (returns false) rather than
+// making the render wait for the disk, unless wait is set.
+bool checkpoint_submit(checkpoint_writer_t *writer, const checkpoint_header_t *header, const pixel_stats_t *stats, bool wait) {
+  pthread_mutex_lock(&writer->lock);
+  if (writer->pending && !wait) {
+    pthread_mutex_unlock(&writer->lock);
+    return false;
+  }
+  while (writer->pending) {
+    pthread_cond_wait(&writer->idle, &writer->lock);
+  }
+  memcpy(writer->snapshot, stats, writer->n_pixels * sizeof(pixel_stats_t));
+  writer->header = *header;
+  writer->pending = true;
+  pthread_cond_signal(&writer->wake);
+  pthread_mutex_unlock(&writer->lock);
+  return true;
+}
+
+// finishes any write in progress and stops the thread
+void free_checkpoint_writer(checkpoint_writer_t *writer) {
+  pthread_mutex_lock(&writer->lock);
+  writer->shutdown = true;
+  pthread_cond_signal(&writer->wake);
+  pthread_mutex_unlock(&writer->lock);
+  pthread_join(writer->thread, NULL);
+
+  pthread_mutex_destroy(&writer->lock);
+  pthread_cond_destroy(&writer->wake);
+  pthread_cond_destroy(&writer->idle);
+  free(writer->snapshot);
+  free(writer);
+}
+
+#endif // !CHECKPOINT_H
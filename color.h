@@ -5,21 +5,22 @@
 #include "interval.h"
 #include "vec3.h"
 
-double encode_to_gamma(double value) {
-  return sqrt(value);
+// gamma 2, in float like the rest of the shading path (fastmath.h)
+float encode_to_gamma(float value) {
+  return value > 0 ? sqrtf(value) : 0.0f;
 }
 
 void write_one_pixel(FILE *fd, color_t c) {
   static const interval_t intensity = {.min = 0.0, .max = 0.99999};
 
-  double r = encode_to_gamma(c.e[0]);
-  double g = encode_to_gamma(c.e[1]);
-  double b = encode_to_gamma(c.e[2]);
+  float r = encode_to_gamma(c.e[0]);
+  float g = encode_to_gamma(c.e[1]);
+  float b = encode_to_gamma(c.e[2]);
 
   fprintf(fd, "%d %d %d\n",
-          (int)(clamp(r, intensity)*256.0),
-          (int)(clamp(g, intensity)*256.0),
-          (int)(clamp(b, intensity)*256.0));
+          (int)(clamp(r, intensity)*256.0f),
+          (int)(clamp(g, intensity)*256.0f),
+          (int)(clamp(b, intensity)*256.0f));
 }
 
 void write_pixels(FILE *fd, color_t *pixels, int n_pixels) {
@@ -0,0 +1,236 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rtweekend.h"
+#include "threadpool.h"
+#include "vec3.h"
+
+// Edge-avoiding a-trous wavelet denoiser (Dammertz et al. 2010), guided by
+// first-hit albedo, normal and depth buffers (AOVs). Each pass blurs with a
+// 5x5 B3 spline kernel whose taps are 2^pass pixels apart, so the five
+// passes cover a 125 pixel wide footprint for 25 taps per pixel each. A
+// tap's weight falls off with how much its guides and its colour differ
+// from the centre pixel's, which keeps edges sharp. The colour tolerance
+// halves every pass, so the later, wider passes only smooth what earlier
+// ones already left flat.
+//
+// The colour being filtered is the illumination: each pixel is divided by
+// its albedo first and multiplied back at the end, so the blur never mixes
+// one material's colour into its neighbour's.
+//
+// All buffers are SoA float planes, and a row is filtered one tap at a time
+// over contiguous x. The inner loops are straight-line float code with exp
+// replaced by a polynomial, so they vectorize. Blocks of rows are tasks for
+// the thread pool, one pass at a time, and every pixel comes out the same
+// whichever thread filters it.
+
+#define DENOISE_PASSES 5
+// rows per thread pool task
+#define DENOISE_ROWS 8
+// tolerances. colour is the illumination difference the first pass lets
+// through, depth is relative to the centre pixel's depth.
+#define DENOISE_SIGMA_COLOR 0.6f
+#define DENOISE_SIGMA_NORMAL 0.3f
+#define DENOISE_SIGMA_DEPTH 0.02f
+#define DENOISE_SIGMA_ALBEDO 0.1f
+// added to the albedo before dividing by it, so black materials don't blow
+// the illumination up
+#define DENOISE_ALBEDO_EPSILON 0.01f
+
+// first-hit guide buffers, one entry per pixel, row major. each is averaged
+// over a few of the pixel's camera rays, so edges come out anti-aliased like
+// the image. a ray that misses has albedo 1, a zero normal and depth 0, and
+// a pixel whose rays all missed is left as it is: the sky is a function of
+// direction alone, so it's never noisy, and blurring it would only flatten
+// its gradient.
+typedef struct {
+  int width;
+  int height;
+  color_t *albedo;
+  vec3_t *normal;
+  // distance along the camera ray to the first hit
+  float *depth;
+} aov_buffers_t;
+
+aov_buffers_t *new_aov_buffers(int width, int height) {
+  aov_buffers_t *aovs = malloc(sizeof(aov_buffers_t));
+  size_t n = (size_t)width * height;
+  aovs->width = width;
+  aovs->height = height;
+  aovs->albedo = malloc(n * sizeof(color_t));
+  aovs->normal = malloc(n * sizeof(vec3_t));
+  aovs->depth = malloc(n * sizeof(float));
+  return aovs;
+}
+
+void free_aov_buffers(aov_buffers_t *aovs) {
+  free(aovs->albedo);
+  free(aovs->normal);
+  free(aovs->depth);
+  free(aovs);
+}
+
+// e^-x for x >= 0 as (1 - x/16)^16, which is within 0.02 of it and hits 0
+// at x = 16 rather than a libm call the vectorizer can't inline
+float denoise_exp_neg(float x) {
+  float t = max_float(0.0f, 1.0f - x * (1.0f / 16));
+  t *= t;
+  t *= t;
+  t *= t;
+  t *= t;
+  return t;
+}
+
+typedef struct {
+  int width;
+  int height;
+  // tap spacing and the colour tolerance for this pass
+  int step;
+  float inv_sigma_color2;
+  const float *in[3];
+  float *out[3];
+  const float *albedo[3];
+  const float *normal[3];
+  const float *depth;
+  // 4 * width floats per worker: the weighted sums and the weights
+  float **scratch;
+} denoise_pass_t;
+
+void denoise_rows(void *args, int task, int thread_id) {
+  const denoise_pass_t *pass = (const denoise_pass_t *)args;
+  static const float b3[5] = {1.0f/16, 1.0f/4, 3.0f/8, 1.0f/4, 1.0f/16};
+  const float inv_sigma_normal2 = 1.0f / (DENOISE_SIGMA_NORMAL * DENOISE_SIGMA_NORMAL);
+  const float inv_sigma_depth2 = 1.0f / (DENOISE_SIGMA_DEPTH * DENOISE_SIGMA_DEPTH);
+  const float inv_sigma_albedo2 = 1.0f / (DENOISE_SIGMA_ALBEDO * DENOISE_SIGMA_ALBEDO);
+  const float inv_sigma_color2 = pass->inv_sigma_color2;
+  int w = pass->width;
+  float *sum_r = pass->scratch[thread_id];
+  float *sum_g = sum_r + w, *sum_b = sum_g + w, *sum_w = sum_b + w;
+  const float *in_r = pass->in[0], *in_g = pass->in[1], *in_b = pass->in[2];
+  const float *ar = pass->albedo[0], *ag = pass->albedo[1], *ab = pass->albedo[2];
+  const float *nx = pass->normal[0], *ny = pass->normal[1], *nz = pass->normal[2];
+  const float *depth = pass->depth;
+
+  int y0 = task * DENOISE_ROWS;
+  int y1 = y0 + DENOISE_ROWS < pass->height ? y0 + DENOISE_ROWS : pass->height;
+  for (int y = y0; y < y1; y++) {
+    memset(sum_r, 0, 4 * w * sizeof(float));
+    for (int ky = -2; ky <= 2; ky++) {
+      int qy = y + ky * pass->step;
+      if (qy < 0 || qy >= pass->height) {
+        continue;
+      }
+      for (int kx = -2; kx <= 2; kx++) {
+        // taps past the left or right edge are skipped, which leaves the
+        // rest of the row contiguous
+        int offset = kx * pass->step;
+        int x0 = offset < 0 ? -offset : 0;
+        int x1 = offset > 0 ? w - offset : w;
+        float h = b3[ky + 2] * b3[kx + 2];
+        size_t p0 = (size_t)y * w;
+        size_t q0 = (size_t)qy * w + offset;
+
+        #pragma GCC ivdep
+        for (int x = x0; x < x1; x++) {
+          size_t p = p0 + x, q = q0 + x;
+          float dr = in_r[q] - in_r[p], dg = in_g[q] - in_g[p], db = in_b[q] - in_b[p];
+          float dnx = nx[q] - nx[p], dny = ny[q] - ny[p], dnz = nz[q] - nz[p];
+          float dar = ar[q] - ar[p], dag = ag[q] - ag[p], dab = ab[q] - ab[p];
+          float dz = (depth[q] - depth[p]) / (depth[p] + 1e-3f);
+          float e = (dr*dr + dg*dg + db*db) * inv_sigma_color2
+                  + (dnx*dnx + dny*dny + dnz*dnz) * inv_sigma_normal2
+                  + dz*dz * inv_sigma_depth2
+                  + (dar*dar + dag*dag + dab*dab) * inv_sigma_albedo2;
+          float weight = h * denoise_exp_neg(e);
+          sum_r[x] += weight * in_r[q];
+          sum_g[x] += weight * in_g[q];
+          sum_b[x] += weight * in_b[q];
+          sum_w[x] += weight;
+        }
+      }
+    }
+    // the centre tap always has weight h, so sum_w is never 0
+    float *out_r = pass->out[0] + (size_t)y * w, *out_g = pass->out[1] + (size_t)y * w, *out_b = pass->out[2] + (size_t)y * w;
+    const float *row_r = in_r + (size_t)y * w, *row_g = in_g + (size_t)y * w, *row_b = in_b + (size_t)y * w;
+    const float *row_depth = depth + (size_t)y * w;
+    #pragma GCC ivdep
+    for (int x = 0; x < w; x++) {
+      float inv = 1.0f / sum_w[x];
+      bool sky = row_depth[x] == 0;
+      out_r[x] = sky ? row_r[x] : sum_r[x] * inv;
+      out_g[x] = sky ? row_g[x] : sum_g[x] * inv;
+      out_b[x] = sky ? row_b[x] : sum_b[x] * inv;
+    }
+  }
+}
+
+// denoises pixels (width * height, row major) in place, guided by aovs
+void denoise(color_t *pixels, const aov_buffers_t *aovs, thread_pool_t *pool) {
+  int width = aovs->width, height = aovs->height;
+  size_t n = (size_t)width * height;
+  // the two colour buffers, albedo, normal and depth, one float per pixel
+  // each, in one allocation
+  enum { N_PLANES = 13 };
+  size_t plane = (n + 15) & ~(size_t)15;
+  float *block = aligned_alloc(64, N_PLANES * plane * sizeof(float));
+  float *planes[N_PLANES];
+  for (int k = 0; k < N_PLANES; k++) {
+    planes[k] = block + k * plane;
+  }
+  float **color[2] = {planes, planes + 3};
+  float **albedo = planes + 6, **normal = planes + 9;
+  float *depth = planes[12];
+
+  for (size_t p = 0; p < n; p++) {
+    for (int c = 0; c < 3; c++) {
+      albedo[c][p] = aovs->albedo[p].e[c];
+      normal[c][p] = aovs->normal[p].e[c];
+      color[0][c][p] = pixels[p].e[c] / (aovs->albedo[p].e[c] + DENOISE_ALBEDO_EPSILON);
+    }
+    depth[p] = aovs->depth[p];
+  }
+
+  float **scratch = malloc(pool->n_threads * sizeof(float *));
+  for (int k = 0; k < pool->n_threads; k++) {
+    scratch[k] = aligned_alloc(64, ((4 * width * sizeof(float)) + 63) & ~(size_t)63);
+  }
+  denoise_pass_t pass = {
+    .width = width,
+    .height = height,
+    .depth = depth,
+    .scratch = scratch
+  };
+  for (int c = 0; c < 3; c++) {
+    pass.albedo[c] = albedo[c];
+    pass.normal[c] = normal[c];
+  }
+  float sigma_color = DENOISE_SIGMA_COLOR;
+  for (int k = 0; k < DENOISE_PASSES; k++) {
+    pass.step = 1 << k;
+    pass.inv_sigma_color2 = 1.0f / (sigma_color * sigma_color);
+    for (int c = 0; c < 3; c++) {
+      pass.in[c] = color[k % 2][c];
+      pass.out[c] = color[1 - k % 2][c];
+    }
+    thread_pool_run(pool, (height + DENOISE_ROWS - 1) / DENOISE_ROWS, denoise_rows, &pass);
+    sigma_color *= 0.5f;
+  }
+
+  float **result = color[DENOISE_PASSES % 2];
+  for (size_t p = 0; p < n; p++) {
+    for (int c = 0; c < 3; c++) {
+      pixels[p].e[c] = result[c][p] * (aovs->albedo[p].e[c] + DENOISE_ALBEDO_EPSILON);
+    }
+  }
+  for (int k = 0; k < pool->n_threads; k++) {
+    free(scratch[k]);
+  }
+  free(scratch);
+  free(block);
+}
+
+#endif // !DENOISE_H
@@ -0,0 +1,551 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "camera.h"
+#include "render.h"
+#include "scene.h"
+#include "scenefile.h"
+#include "stats.h"
+#include "threadpool.h"
+
+// Rendering across processes. A coordinator listens on a TCP or Unix socket
+// and sends every worker that connects the camera and the scene, as the
+// bytes of a binary scene file (BVH included, so a worker maps it and goes).
+// It then hands out DISTRIBUTED_TILE sized tiles, DISTRIBUTED_IN_FLIGHT at
+// a time so a worker never sits idle waiting for the next one. A worker
+// renders a tile with render_region on its own thread pool and sends back
+// the tile's running sums, the same pixel_stats_t the film holds, with
+// its render statistics.
+//
+// A worker that goes quiet for longer than the timeout while it has tiles,
+// or whose connection drops, is cut off and its tiles go back in the queue
+// for the others. Since the random numbers are keyed by pixel and sample,
+// a tile comes out the same whichever process renders it, so the image is
+// identical to a single process render.
+//
+// Both ends have to be the same build: structs go over the wire as they
+// sit in memory.
+//
+// Addresses are "unix:<path>" or "<host>:<port>".
+
+#define DISTRIBUTED_TILE 64
+#define DISTRIBUTED_IN_FLIGHT 2
+#define DISTRIBUTED_MAX_WORKERS 64
+// how long the coordinator waits in poll between checks for timeouts
+#define DISTRIBUTED_POLL_MS 100
+// a worker started before its coordinator keeps trying to connect this
+// many times, DISTRIBUTED_RETRY_MS apart
+#define DISTRIBUTED_CONNECT_TRIES 100
+#define DISTRIBUTED_RETRY_MS 50
+#define DISTRIBUTED_MAGIC 0x314e5452u
+
+typedef enum {
+  // coordinator to worker: a camera_t, then the scene file
+  MESSAGE_JOB = 1,
+  // coordinator to worker: a work_unit_t
+  MESSAGE_TILE,
+  // worker to coordinator: a tile_result_t, then the tile's pixel_stats_t
+  MESSAGE_RESULT,
+  // coordinator to worker: nothing left, disconnect
+  MESSAGE_DONE
+} message_type_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t type;
+  // bytes of payload after the header
+  uint64_t size;
+} message_header_t;
+
+typedef struct {
+  int32_t unit;
+  int32_t x0;
+  int32_t y0;
+  int32_t x1;
+  int32_t y1;
+} work_unit_t;
+
+typedef struct {
+  work_unit_t unit;
+  // the worker's, for rendering this tile
+  render_stats_t stats;
+} tile_result_t;
+
+bool send_all(int fd, const void *data, size_t size) {
+  const char *p = data;
+  while (size > 0) {
+    ssize_t sent = send(fd, p, size, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+    if (sent <= 0) {
+      return false;
+    }
+    p += sent;
+    size -= sent;
+  }
+  return true;
+}
+
+bool recv_all(int fd, void *data, size_t size) {
+  char *p = data;
+  while (size > 0) {
+    ssize_t got = recv(fd, p, size, 0);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      return false;
+    }
+    p += got;
+    size -= got;
+  }
+  return true;
+}
+
+// a header and a payload in up to two pieces, either of which may be empty
+bool send_message(int fd, message_type_t type, const void *a, size_t a_size, const void *b, size_t b_size) {
+  message_header_t header = {.magic = DISTRIBUTED_MAGIC, .type = type, .size = a_size + b_size};
+  return send_all(fd, &header, sizeof(header)) && send_all(fd, a, a_size) && send_all(fd, b, b_size);
+}
+
+bool recv_header(int fd, message_header_t *header) {
+  return recv_all(fd, header, sizeof(*header)) && header->magic == DISTRIBUTED_MAGIC;
+}
+
+// blocking sends and receives on fd give up after seconds
+void set_socket_timeout(int fd, double seconds) {
+  struct timeval tv = {.tv_sec = (time_t)seconds, .tv_usec = (suseconds_t)((seconds - (time_t)seconds) * 1e6)};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// a socket listening on address, or connected to it. -1 if that failed.
+int open_socket(const char *address, bool listening) {
+  if (strncmp(address, "unix:", 5) == 0) {
+    struct sockaddr_un sun = {.sun_family = AF_UNIX};
+    if (strlen(address + 5) >= sizeof(sun.sun_path)) {
+      printf("%s: path too long for a socket\n", address);
+      return -1;
+    }
+    strcpy(sun.sun_path, address + 5);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+      return -1;
+    }
+    if (listening) {
+      unlink(sun.sun_path);
+    }
+    bool ok = listening ? bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == 0 && listen(fd, DISTRIBUTED_MAX_WORKERS) == 0
+                        : connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == 0;
+    if (!ok) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  const char *colon = strrchr(address, ':');
+  if (colon == NULL) {
+    printf("%s: expected unix:<path> or <host>:<port>\n", address);
+    return -1;
+  }
+  char host[256];
+  size_t host_len = colon - address;
+  if (host_len >= sizeof(host)) {
+    return -1;
+  }
+  memcpy(host, address, host_len);
+  host[host_len] = '\0';
+  struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = listening ? AI_PASSIVE : 0};
+  struct addrinfo *found;
+  if (getaddrinfo(host_len > 0 ? host : NULL, colon + 1, &hints, &found) != 0) {
+    printf("%s: can't resolve %s\n", address, host);
+    return -1;
+  }
+  int fd = -1;
+  for (struct addrinfo *ai = found; ai != NULL && fd < 0; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    int one = 1;
+    bool ok;
+    if (listening) {
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+      ok = bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, DISTRIBUTED_MAX_WORKERS) == 0;
+    } else {
+      ok = connect(fd, ai->ai_addr, ai->ai_addrlen) == 0;
+    }
+    if (!ok) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(found);
+  return fd;
+}
+
+// the binary scene file for scene, in memory. NULL if it couldn't be
+// written.
+char *scene_file_bytes(const scene_t *scene, size_t *size) {
+  char path[] = "/tmp/rt-scene-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    return NULL;
+  }
+  close(fd);
+  char *bytes = NULL;
+  FILE *fp;
+  if (save_scene_binary(path, scene) && (fp = fopen(path, "rb")) != NULL) {
+    fseek(fp, 0, SEEK_END);
+    *size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    bytes = malloc(*size > 0 ? *size : 1);
+    if (fread(bytes, 1, *size, fp) != *size) {
+      free(bytes);
+      bytes = NULL;
+    }
+    fclose(fp);
+  }
+  unlink(path);
+  return bytes;
+}
+
+typedef struct {
+  int fd;
+  // when it was last heard from, or handed its first tile
+  double last_heard;
+  int in_flight;
+  // tiles it has sent back
+  int tiles_done;
+} worker_slot_t;
+
+typedef struct {
+  work_unit_t unit;
+  // the worker slot rendering it, -1 if nobody is
+  int owner;
+  bool done;
+} unit_state_t;
+
+// cuts a worker off and puts its unfinished tiles back in the queue.
+// returns how many went back.
+int drop_worker(worker_slot_t *workers, int w, unit_state_t *units, int n_units) {
+  int returned = 0;
+  close(workers[w].fd);
+  workers[w].fd = -1;
+  for (int u = 0; u < n_units; u++) {
+    if (units[u].owner == w && !units[u].done) {
+      units[u].owner = -1;
+      returned++;
+    }
+  }
+  return returned;
+}
+
+// hands worker w tiles from the queue until it has DISTRIBUTED_IN_FLIGHT.
+// false if the connection failed.
+bool top_up_worker(worker_slot_t *workers, int w, unit_state_t *units, int n_units) {
+  for (int u = 0; u < n_units && workers[w].in_flight < DISTRIBUTED_IN_FLIGHT; u++) {
+    if (units[u].owner >= 0 || units[u].done) {
+      continue;
+    }
+    if (!send_message(workers[w].fd, MESSAGE_TILE, &units[u].unit, sizeof(work_unit_t), NULL, 0)) {
+      return false;
+    }
+    if (workers[w].in_flight == 0) {
+      workers[w].last_heard = now_seconds();
+    }
+    units[u].owner = w;
+    workers[w].in_flight++;
+  }
+  return true;
+}
+
+// renders camera's image like render_to_buffer, but by handing tiles out to
+// workers that connect to address, and collecting their sums. stats, if not
+// NULL, gets the workers' statistics summed. a worker that hasn't answered
+// for timeout seconds while it has tiles out loses them to the others.
+// progressive passes and checkpoints don't apply: every tile is rendered to
+// samples_per_pixel in one go. returns how many tiles had to be handed out
+// again, or -1 if it couldn't listen on address or send the scene.
+int render_distributed(const camera_t *camera, const scene_t *scene, const char *address, double timeout,
+                       color_t *pixels, int *sample_counts, render_stats_t *stats) {
+  size_t scene_size;
+  char *scene_bytes = scene_file_bytes(scene, &scene_size);
+  if (scene_bytes == NULL) {
+    printf("couldn't write the scene out for the workers\n");
+    return -1;
+  }
+  int listener = open_socket(address, true);
+  if (listener < 0) {
+    printf("couldn't listen on %s\n", address);
+    free(scene_bytes);
+    return -1;
+  }
+  printf("coordinator: listening on %s, %zu byte scene\n", address, scene_size);
+
+  int width = camera->image_width, height = camera->image_height;
+  int tiles_x = (width + DISTRIBUTED_TILE - 1) / DISTRIBUTED_TILE;
+  int tiles_y = (height + DISTRIBUTED_TILE - 1) / DISTRIBUTED_TILE;
+  int n_units = tiles_x * tiles_y;
+  unit_state_t *units = malloc(n_units * sizeof(unit_state_t));
+  for (int u = 0; u < n_units; u++) {
+    int x0 = (u % tiles_x) * DISTRIBUTED_TILE, y0 = (u / tiles_x) * DISTRIBUTED_TILE;
+    units[u] = (unit_state_t){
+      .unit = {.unit = u, .x0 = x0, .y0 = y0,
+               .x1 = x0 + DISTRIBUTED_TILE < width ? x0 + DISTRIBUTED_TILE : width,
+               .y1 = y0 + DISTRIBUTED_TILE < height ? y0 + DISTRIBUTED_TILE : height},
+      .owner = -1
+    };
+  }
+  pixel_stats_t *tile = malloc(DISTRIBUTED_TILE * DISTRIBUTED_TILE * sizeof(pixel_stats_t));
+  worker_slot_t workers[DISTRIBUTED_MAX_WORKERS];
+  int n_slots = 0;
+  int units_done = 0, reassigned = 0;
+  render_stats_t total = {0};
+
+  while (units_done < n_units) {
+    struct pollfd fds[DISTRIBUTED_MAX_WORKERS + 1];
+    int slot_of[DISTRIBUTED_MAX_WORKERS + 1];
+    int n_fds = 0;
+    fds[n_fds++] = (struct pollfd){.fd = listener, .events = POLLIN};
+    for (int w = 0; w < n_slots; w++) {
+      if (workers[w].fd >= 0) {
+        slot_of[n_fds] = w;
+        fds[n_fds++] = (struct pollfd){.fd = workers[w].fd, .events = POLLIN};
+      }
+    }
+    if (poll(fds, n_fds, DISTRIBUTED_POLL_MS) < 0 && errno != EINTR) {
+      break;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      int fd = accept(listener, NULL, NULL);
+      int w = 0;
+      while (w < n_slots && workers[w].fd >= 0) {
+        w++;
+      }
+      if (fd >= 0 && w == DISTRIBUTED_MAX_WORKERS) {
+        close(fd);
+      } else if (fd >= 0) {
+        set_socket_timeout(fd, timeout);
+        if (send_message(fd, MESSAGE_JOB, camera, sizeof(camera_t), scene_bytes, scene_size)) {
+          workers[w] = (worker_slot_t){.fd = fd, .last_heard = now_seconds()};
+          n_slots = w == n_slots ? n_slots + 1 : n_slots;
+          printf("coordinator: worker %d connected\n", w);
+        } else {
+          close(fd);
+        }
+      }
+    }
+
+    for (int k = 1; k < n_fds; k++) {
+      int w = slot_of[k];
+      if (!(fds[k].revents & (POLLIN | POLLHUP | POLLERR))) {
+        continue;
+      }
+      // anything but a result for a tile it was given ends the connection
+      message_header_t header;
+      tile_result_t result;
+      work_unit_t unit;
+      bool ok = recv_header(workers[w].fd, &header) && header.type == MESSAGE_RESULT
+             && header.size >= sizeof(result)
+             && recv_all(workers[w].fd, &result, sizeof(result));
+      unit = result.unit;
+      ok = ok && unit.unit >= 0 && unit.unit < n_units
+              && memcmp(&unit, &units[unit.unit].unit, sizeof(unit)) == 0
+              && header.size == sizeof(result) + (size_t)(unit.x1 - unit.x0) * (unit.y1 - unit.y0) * sizeof(pixel_stats_t)
+              && recv_all(workers[w].fd, tile, header.size - sizeof(result));
+      if (!ok) {
+        int returned = drop_worker(workers, w, units, n_units);
+        reassigned += returned;
+        printf("coordinator: lost worker %d, %d tiles back in the queue\n", w, returned);
+        continue;
+      }
+      workers[w].last_heard = now_seconds();
+      workers[w].in_flight--;
+      workers[w].tiles_done++;
+      // a tile that was handed out again may come back twice
+      if (!units[unit.unit].done) {
+        int tile_width = unit.x1 - unit.x0;
+        for (int j = unit.y0; j < unit.y1; j++) {
+          for (int i = unit.x0; i < unit.x1; i++) {
+            pixel_stats_t *p = &tile[(j - unit.y0) * tile_width + (i - unit.x0)];
+            pixels[j * width + i] = pixel_color(p);
+            if (sample_counts != NULL) {
+              sample_counts[j * width + i] = p->n;
+            }
+          }
+        }
+        merge_render_stats(&total, &result.stats);
+        units[unit.unit].done = true;
+        units_done++;
+      }
+      if (units[unit.unit].owner == w) {
+        units[unit.unit].owner = -1;
+      }
+    }
+
+    double now = now_seconds();
+    for (int w = 0; w < n_slots; w++) {
+      if (workers[w].fd < 0) {
+        continue;
+      }
+      if (workers[w].in_flight > 0 && now - workers[w].last_heard > timeout) {
+        int returned = drop_worker(workers, w, units, n_units);
+        reassigned += returned;
+        printf("coordinator: worker %d timed out, %d tiles back in the queue\n", w, returned);
+      } else if (!top_up_worker(workers, w, units, n_units)) {
+        reassigned += drop_worker(workers, w, units, n_units);
+      }
+    }
+  }
+
+  for (int w = 0; w < n_slots; w++) {
+    if (workers[w].fd >= 0) {
+      printf("coordinator: worker %d rendered %d tiles\n", w, workers[w].tiles_done);
+      send_message(workers[w].fd, MESSAGE_DONE, NULL, 0, NULL, 0);
+      close(workers[w].fd);
+    }
+  }
+  close(listener);
+  if (strncmp(address, "unix:", 5) == 0) {
+    unlink(address + 5);
+  }
+  if (stats != NULL) {
+    *stats = total;
+  }
+  free(tile);
+  free(units);
+  free(scene_bytes);
+  return units_done == n_units ? reassigned : -1;
+}
+
+// render() with the rendering itself handed out to workers, see
+// render_distributed. pool does the denoising and the image encoding.
+void render_coordinated(camera_t *camera, const scene_t *scene, thread_pool_t *pool, const char *address, double timeout) {
+  int n_pixels = camera->image_height * camera->image_width;
+  color_t *pixels = (color_t *)malloc(sizeof(color_t) * n_pixels);
+  int *sample_counts = camera->adaptive_threshold > 0 ? malloc(n_pixels * sizeof(int)) : NULL;
+  render_stats_t *stats = aligned_alloc(64, sizeof(render_stats_t));
+  double render_start = now_seconds();
+  int reassigned = render_distributed(camera, scene, address, timeout, pixels, sample_counts, stats);
+  if (reassigned < 0) {
+    free(pixels);
+    free(sample_counts);
+  } else {
+    if (reassigned > 0) {
+      printf("coordinator: %d tiles handed out again\n", reassigned);
+    }
+    finish_render(camera, scene, pool, pixels, sample_counts, stats, 1, now_seconds() - render_start);
+  }
+  free(stats);
+}
+
+// receives the scene file of a job into a temporary file and maps it
+bool recv_scene(int fd, size_t size, scene_t *scene) {
+  char path[] = "/tmp/rt-scene-XXXXXX";
+  int out = mkstemp(path);
+  if (out < 0) {
+    return false;
+  }
+  char buffer[1 << 16];
+  bool ok = true;
+  while (size > 0 && ok) {
+    size_t chunk = size < sizeof(buffer) ? size : sizeof(buffer);
+    ok = recv_all(fd, buffer, chunk) && write(out, buffer, chunk) == (ssize_t)chunk;
+    size -= chunk;
+  }
+  close(out);
+  // the mapping outlives the file's name
+  ok = ok && load_scene_binary(path, scene);
+  unlink(path);
+  return ok;
+}
+
+// connects to the coordinator at address and renders the tiles it hands
+// out on pool until it says it's done. false if it couldn't connect or the
+// connection broke first.
+bool run_worker(const char *address, thread_pool_t *pool) {
+  int fd = -1;
+  for (int attempt = 0; attempt < DISTRIBUTED_CONNECT_TRIES && fd < 0; attempt++) {
+    fd = open_socket(address, false);
+    if (fd < 0) {
+      usleep(DISTRIBUTED_RETRY_MS * 1000);
+    }
+  }
+  if (fd < 0) {
+    printf("worker: couldn't connect to %s\n", address);
+    return false;
+  }
+
+  message_header_t header;
+  camera_t camera;
+  scene_t scene;
+  if (!recv_header(fd, &header) || header.type != MESSAGE_JOB || header.size < sizeof(camera_t)
+      || !recv_all(fd, &camera, sizeof(camera)) || !recv_scene(fd, header.size - sizeof(camera_t), &scene)) {
+    printf("worker: no job from %s\n", address);
+    close(fd);
+    return false;
+  }
+  // the coordinator's pointers, and everything it does after the render
+  camera.checkpoint_path = NULL;
+  camera.output_path = NULL;
+  camera.stats_path = NULL;
+  camera.aov_prefix = NULL;
+  camera.samples_path = NULL;
+  if (scene.bvh != NULL) {
+    scene_build_bvh(&scene);
+  }
+  printf("worker: %dx%d at %d spp, %zu spheres\n", camera.image_width, camera.image_height, camera.samples_per_pixel,
+         scene.sphere_list->nth_sphere);
+
+  pixel_stats_t *film = malloc(DISTRIBUTED_TILE * DISTRIBUTED_TILE * sizeof(pixel_stats_t));
+  render_stats_t *thread_stats = aligned_alloc(64, pool->n_threads * sizeof(render_stats_t));
+  int tiles = 0;
+  bool ok = false;
+  while (recv_header(fd, &header)) {
+    if (header.type == MESSAGE_DONE) {
+      ok = true;
+      break;
+    }
+    work_unit_t unit;
+    if (header.type != MESSAGE_TILE || header.size != sizeof(unit) || !recv_all(fd, &unit, sizeof(unit))
+        || unit.x1 - unit.x0 > DISTRIBUTED_TILE || unit.y1 - unit.y0 > DISTRIBUTED_TILE) {
+      break;
+    }
+    size_t n = (size_t)(unit.x1 - unit.x0) * (unit.y1 - unit.y0);
+    memset(film, 0, n * sizeof(pixel_stats_t));
+    render_region(&camera, &scene, pool, unit.x0, unit.y0, unit.x1, unit.y1, film, thread_stats);
+    tile_result_t result = {.unit = unit};
+    for (int k = 0; k < pool->n_threads; k++) {
+      merge_render_stats(&result.stats, &thread_stats[k]);
+    }
+    if (!send_message(fd, MESSAGE_RESULT, &result, sizeof(result), film, n * sizeof(pixel_stats_t))) {
+      break;
+    }
+    tiles++;
+  }
+  printf("worker: rendered %d tiles\n", tiles);
+  free(thread_stats);
+  free(film);
+  free_scene(&scene);
+  close(fd);
+  return ok;
+}
+
+#endif // !DISTRIBUTED_H
@@ -0,0 +1,128 @@
+#ifndef FASTMATH_H
+#define FASTMATH_H
+
+#include <math.h>
+
+#include "simd.h"
+
+// Float-only math for the shading path. libm's sqrt, pow, fmin and fabs are
+// double functions, and calling them on floats converts to double and back
+// around every call, and pow and fmin are calls into libm on top of that.
+// What's here stays in float registers and is a handful of instructions:
+//
+//   rsqrt_float     1/sqrt(x), the cpu's estimate plus a Newton step
+//   schlick_weight  (1 - cos)^5 for Schlick's approximation, 3 multiplies
+//
+// For the rest the float versions are already single instructions: sqrtf
+// (with -fno-math-errno), fabsf, and min_float/max_float in rtweekend.h.
+//
+// Error bounds, against 1/sqrt and pow done in double and checked by
+// test_fastmath_error_bounds:
+//
+//   rsqrt_float     4 ulps for normal, finite x. 0 and denormals give inf
+//                   or NaN, infinity gives NaN
+//   schlick_weight  3 ulps, wherever the result is a normal float
+//
+// rsqrt_floats and normalize_floats are the batched versions, 4 at a time
+// with SSE or NEON, for the wavefront kernels. they give the same bits as
+// rsqrt_float one at a time, so the engines agree. NB: the estimate is the
+// cpu's own and the vendors' tables differ, so the last bit of a normalized
+// vector can differ between Intel and AMD (or Arm) machines.
+
+#if defined(SIMD_HAVE_X86)
+
+// rsqrtps is good to 1.5 * 2^-12, one Newton step squares that. the step
+// is written 3/2 y - (x/2 y) y^2 so x/2 y and y^2 go in parallel: 3 ops
+// after the estimate instead of 5 for y + y (1/2 - x/2 y y), and it rounds
+// a little better too.
+__m128 rsqrt_sse(__m128 x) {
+  __m128 y = _mm_rsqrt_ps(x);
+  __m128 half_xy = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), x), y);
+  __m128 y2 = _mm_mul_ps(y, y);
+  return _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(1.5f), y), _mm_mul_ps(half_xy, y2));
+}
+
+float rsqrt_float(float x) {
+  return _mm_cvtss_f32(rsqrt_sse(_mm_set_ss(x)));
+}
+
+#elif defined(SIMD_HAVE_NEON)
+
+// frsqrte is only good to 8 bits, so two steps. frsqrts does the
+// (3 - x y^2) / 2 part of each.
+float32x4_t rsqrt_neon(float32x4_t x) {
+  float32x4_t y = vrsqrteq_f32(x);
+  y = vmulq_f32(y, vrsqrtsq_f32(vmulq_f32(x, y), y));
+  y = vmulq_f32(y, vrsqrtsq_f32(vmulq_f32(x, y), y));
+  return y;
+}
+
+float rsqrt_float(float x) {
+  return vgetq_lane_f32(rsqrt_neon(vdupq_n_f32(x)), 0);
+}
+
+#else
+
+float rsqrt_float(float x) {
+  return 1.0f / sqrtf(x);
+}
+
+#endif
+
+// out[i] = rsqrt_float(x[i]). out may be x.
+void rsqrt_floats(const float *x, float *out, int n) {
+  int i = 0;
+#if defined(SIMD_HAVE_X86)
+  for (; i + 4 <= n; i += 4) {
+    _mm_storeu_ps(out + i, rsqrt_sse(_mm_loadu_ps(x + i)));
+  }
+#elif defined(SIMD_HAVE_NEON)
+  for (; i + 4 <= n; i += 4) {
+    vst1q_f32(out + i, rsqrt_neon(vld1q_f32(x + i)));
+  }
+#endif
+  for (; i < n; i++) {
+    out[i] = rsqrt_float(x[i]);
+  }
+}
+
+// scales each (x[i], y[i], z[i]) to unit length, in place, the way
+// normalize() in vec3.h does
+void normalize_floats(float *x, float *y, float *z, int n) {
+  int i = 0;
+#if defined(SIMD_HAVE_X86)
+  for (; i + 4 <= n; i += 4) {
+    __m128 vx = _mm_loadu_ps(x + i), vy = _mm_loadu_ps(y + i), vz = _mm_loadu_ps(z + i);
+    __m128 length_squared = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)), _mm_mul_ps(vz, vz));
+    __m128 inv_length = rsqrt_sse(length_squared);
+    _mm_storeu_ps(x + i, _mm_mul_ps(vx, inv_length));
+    _mm_storeu_ps(y + i, _mm_mul_ps(vy, inv_length));
+    _mm_storeu_ps(z + i, _mm_mul_ps(vz, inv_length));
+  }
+#elif defined(SIMD_HAVE_NEON)
+  for (; i + 4 <= n; i += 4) {
+    float32x4_t vx = vld1q_f32(x + i), vy = vld1q_f32(y + i), vz = vld1q_f32(z + i);
+    float32x4_t length_squared = vaddq_f32(vaddq_f32(vmulq_f32(vx, vx), vmulq_f32(vy, vy)), vmulq_f32(vz, vz));
+    float32x4_t inv_length = rsqrt_neon(length_squared);
+    vst1q_f32(x + i, vmulq_f32(vx, inv_length));
+    vst1q_f32(y + i, vmulq_f32(vy, inv_length));
+    vst1q_f32(z + i, vmulq_f32(vz, inv_length));
+  }
+#endif
+  for (; i < n; i++) {
+    float inv_length = rsqrt_float(x[i]*x[i] + y[i]*y[i] + z[i]*z[i]);
+    x[i] *= inv_length;
+    y[i] *= inv_length;
+    z[i] *= inv_length;
+  }
+}
+
+// (1 - cos)^5, squared twice and one more multiply. plain float arithmetic,
+// so it vectorizes where it's used in a loop.
+float schlick_weight(float cos) {
+  float m = 1.0f - cos;
+  float m2 = m*m;
+  return m2*m2*m;
+}
+
+#endif // !FASTMATH_H
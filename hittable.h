@@ -3,10 +3,11 @@
 
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
-#include <arm_neon.h>
-
+#include "arena.h"
 #include "vec3.h"
 #include "ray.h"
 #include "interval.h"
@@ -21,8 +22,13 @@ typedef struct {
   float t;
   bool front_face;
   material_t *mat;
+  // the index of the sphere hit, in the sphere list, or HIT_TRIANGLE if it
+  // was a triangle (triangle.h)
+  uint32_t sphere;
 } hit_record_t;
 
+#define HIT_TRIANGLE UINT32_MAX
+
 // sets front_face and normal depending on if aligned or anti-aligned with ray
 // outward_normal must be unit vector
 void set_face_normal(hit_record_t *rec, const ray_t *r, vec3_t outward_normal) {
@@ -30,34 +36,97 @@ void set_face_normal(hit_record_t *rec, const ray_t *r, vec3_t outward_normal) {
   rec->normal = rec->front_face ? outward_normal : scale(outward_normal, -1.0);
 }
 
+// Spheres are stored as separate x, y, z, radius^2 and 1/radius arrays, each
+// 64 byte aligned. Every array runs at least SPHERE_LIST_PAD - 1 floats past
+// the last sphere, filled with sentinel spheres no ray can hit, so the SIMD
+// kernels can load whole vectors over any range of the list and mask off
+// the lanes past its end instead of finishing with a scalar loop.
+#define SPHERE_LIST_PAD 16
+
 typedef struct {
   size_t nth_sphere;
+  // spheres that fit before the arrays have to grow
   size_t max_spheres;
   float *xs;
   float *ys;
   float *zs;
   float *r2s;
   float *recip_r;
+  // the arrays are part of a mapped scene file (scenefile.h): growing copies
+  // them out to the heap and freeing leaves them alone
+  bool mapped;
+  // the list and its arrays come from this arena if it's set, see arena.h
+  arena_t *arena;
 } sphere_list_t;
 
-sphere_list_t *new_sphere_list(size_t n_spheres) {
-  // NB: we never free()
+// floats per array for n spheres plus the padding, a whole number of cache
+// lines
+size_t sphere_list_padded(size_t n) {
+  return (n + 2*SPHERE_LIST_PAD - 2) / SPHERE_LIST_PAD * SPHERE_LIST_PAD;
+}
 
-  sphere_list_t *sphere_list = malloc(sizeof(sphere_list_t));
-  sphere_list->max_spheres = n_spheres;
-  sphere_list->nth_sphere = 0;
+// centred on the origin with radius^2 -infinity: c comes out +infinity and
+// the discriminant -infinity, so it's never hit and never a NaN
+void set_sentinel_spheres(sphere_list_t *sphere_list, size_t from, size_t to) {
+  for (size_t i = from; i < to; i++) {
+    sphere_list->xs[i] = 0.0f;
+    sphere_list->ys[i] = 0.0f;
+    sphere_list->zs[i] = 0.0f;
+    sphere_list->r2s[i] = -INFINITY;
+    sphere_list->recip_r[i] = 0.0f;
+  }
+}
 
-  sphere_list->xs = (float *)malloc(n_spheres * sizeof(float));
-  sphere_list->ys = (float *)malloc(n_spheres * sizeof(float));
-  sphere_list->zs = (float *)malloc(n_spheres * sizeof(float));
-  sphere_list->r2s = (float *)malloc(n_spheres * sizeof(float));
-  sphere_list->recip_r = (float *)malloc(n_spheres * sizeof(float));
+// moves the spheres into arrays with room for capacity of them
+void reserve_spheres(sphere_list_t *sphere_list, size_t capacity) {
+  size_t n = sphere_list->nth_sphere;
+  size_t padded = sphere_list_padded(capacity);
+  float **arrays[] = {&sphere_list->xs, &sphere_list->ys, &sphere_list->zs, &sphere_list->r2s, &sphere_list->recip_r};
+  for (size_t k = 0; k < sizeof(arrays) / sizeof(arrays[0]); k++) {
+    float *array = arena_or_heap(sphere_list->arena, padded * sizeof(float));
+    if (n > 0) {
+      memcpy(array, *arrays[k], n * sizeof(float));
+    }
+    if (!sphere_list->mapped) {
+      arena_or_heap_free(sphere_list->arena, *arrays[k]);
+    }
+    *arrays[k] = array;
+  }
+  sphere_list->mapped = false;
+  sphere_list->max_spheres = capacity;
+  set_sentinel_spheres(sphere_list, n, padded);
+}
 
+// n_spheres is only the starting capacity, add_sphere grows the list. in
+// arena if that's not NULL.
+sphere_list_t *new_sphere_list_in(arena_t *arena, size_t n_spheres) {
+  sphere_list_t *sphere_list = arena_or_heap(arena, sizeof(sphere_list_t));
+  *sphere_list = (sphere_list_t){.arena = arena};
+  reserve_spheres(sphere_list, n_spheres);
   return sphere_list;
 }
 
+sphere_list_t *new_sphere_list(size_t n_spheres) {
+  return new_sphere_list_in(NULL, n_spheres);
+}
+
+// nothing to do for a list in an arena, it goes with the arena
+void free_sphere_list(sphere_list_t *sphere_list) {
+  arena_t *arena = sphere_list->arena;
+  if (!sphere_list->mapped) {
+    arena_or_heap_free(arena, sphere_list->xs);
+    arena_or_heap_free(arena, sphere_list->ys);
+    arena_or_heap_free(arena, sphere_list->zs);
+    arena_or_heap_free(arena, sphere_list->r2s);
+    arena_or_heap_free(arena, sphere_list->recip_r);
+  }
+  arena_or_heap_free(arena, sphere_list);
+}
+
 void add_sphere(sphere_list_t *sphere_list, vec3_t center, float radius) {
-  // TODO: check how nth_sphere compares to max_spheres!
+  if (sphere_list->nth_sphere >= sphere_list->max_spheres) {
+    reserve_spheres(sphere_list, sphere_list->max_spheres > 0 ? 2 * sphere_list->max_spheres : SPHERE_LIST_PAD);
+  }
   float r2 = radius*radius;
   float recip_r = 1/radius;
   memcpy(sphere_list->xs + sphere_list->nth_sphere, &center.e[0], 4);
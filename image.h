@@ -0,0 +1,180 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "color.h"
+#include "rtweekend.h"
+#include "threadpool.h"
+#include "vec3.h"
+
+// Image output. P3 is the original ASCII PPM, written a pixel at a time by
+// write_pixels. P6 is binary PPM: gamma corrected and quantized to 8 bits
+// like P3 but a third of the size. PFM keeps the linear floats, for
+// comparing renders or feeding a denoiser.
+//
+// P6 and PFM are encoded into one buffer, header and all, with the rows
+// split across the thread pool, then go out in a single write().
+
+typedef enum {
+  IMAGE_P3,
+  IMAGE_P6,
+  IMAGE_PFM
+} image_format_t;
+
+// rows per encoding task
+#define ENCODE_ROWS 16
+
+const char *image_format_name(image_format_t format) {
+  switch (format) {
+    case IMAGE_P3: return "p3";
+    case IMAGE_P6: return "p6";
+    case IMAGE_PFM: return "pfm";
+  }
+  return "?";
+}
+
+// "p3", "p6" or "pfm"; anything else goes by the path's extension, .pfm
+// being PFM and everything else P6
+image_format_t image_format_from_name(const char *name, const char *path) {
+  if (name != NULL) {
+    if (strcmp(name, "p3") == 0) {
+      return IMAGE_P3;
+    }
+    if (strcmp(name, "p6") == 0) {
+      return IMAGE_P6;
+    }
+    if (strcmp(name, "pfm") == 0) {
+      return IMAGE_PFM;
+    }
+  }
+  size_t len = strlen(path);
+  if (len >= 4 && strcmp(path + len - 4, ".pfm") == 0) {
+    return IMAGE_PFM;
+  }
+  return IMAGE_P6;
+}
+
+// gamma 2 and 8 bits, the same mapping as write_one_pixel
+uint8_t quantize(float value) {
+  float v = encode_to_gamma(value);
+  v = v < 0.99999f ? v : 0.99999f;
+  return (uint8_t)(v * 256.0f);
+}
+
+typedef struct {
+  image_format_t format;
+  const color_t *pixels;
+  int width;
+  int height;
+  // start of the pixel data in the output buffer, past the header
+  unsigned char *data;
+} encode_args_t;
+
+void encode_rows(void *args, int task, int thread_id) {
+  encode_args_t *eargs = (encode_args_t *)args;
+  int y0 = task * ENCODE_ROWS;
+  int y1 = y0 + ENCODE_ROWS < eargs->height ? y0 + ENCODE_ROWS : eargs->height;
+
+  for (int y = y0; y < y1; y++) {
+    const color_t *row = eargs->pixels + (size_t)y * eargs->width;
+    if (eargs->format == IMAGE_P6) {
+      unsigned char *out = eargs->data + (size_t)y * eargs->width * 3;
+      for (int x = 0; x < eargs->width; x++) {
+        out[3*x + 0] = quantize(row[x].e[0]);
+        out[3*x + 1] = quantize(row[x].e[1]);
+        out[3*x + 2] = quantize(row[x].e[2]);
+      }
+    } else {
+      // PFM rows go bottom to top
+      float *out = (float *)(eargs->data + (size_t)(eargs->height - 1 - y) * eargs->width * 3 * sizeof(float));
+      for (int x = 0; x < eargs->width; x++) {
+        out[3*x + 0] = row[x].e[0];
+        out[3*x + 1] = row[x].e[1];
+        out[3*x + 2] = row[x].e[2];
+      }
+    }
+  }
+}
+
+// writes all of buffer to fd, however many write() calls the kernel wants
+bool write_all(int fd, const unsigned char *buffer, size_t size) {
+  while (size > 0) {
+    ssize_t written = write(fd, buffer, size);
+    if (written < 0) {
+      return false;
+    }
+    buffer += written;
+    size -= written;
+  }
+  return true;
+}
+
+// encodes a P6 or PFM image into a freshly malloc'd buffer, *size bytes. a
+// NULL pool encodes on the calling thread.
+unsigned char *encode_image(image_format_t format, const color_t *pixels, int width, int height, thread_pool_t *pool, size_t *size) {
+  char header[64];
+  int header_size;
+  size_t data_size;
+  if (format == IMAGE_P6) {
+    header_size = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", width, height);
+    data_size = (size_t)width * height * 3;
+  } else {
+    // negative scale means little endian, which is all we run on
+    header_size = snprintf(header, sizeof(header), "PF\n%d %d\n-1.0\n", width, height);
+    data_size = (size_t)width * height * 3 * sizeof(float);
+  }
+
+  unsigned char *buffer = malloc(header_size + data_size);
+  memcpy(buffer, header, header_size);
+  encode_args_t args = {
+    .format = format,
+    .pixels = pixels,
+    .width = width,
+    .height = height,
+    .data = buffer + header_size
+  };
+  int n_tasks = (height + ENCODE_ROWS - 1) / ENCODE_ROWS;
+  if (pool != NULL) {
+    thread_pool_run(pool, n_tasks, encode_rows, &args);
+  } else {
+    for (int task = 0; task < n_tasks; task++) {
+      encode_rows(&args, task, 0);
+    }
+  }
+
+  *size = header_size + data_size;
+  return buffer;
+}
+
+bool write_image(const char *path, image_format_t format, const color_t *pixels, int width, int height, thread_pool_t *pool) {
+  if (format == IMAGE_P3) {
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+      return false;
+    }
+    fprintf(fp, "P3\n");
+    fprintf(fp, "%d %d\n", width, height);
+    fprintf(fp, "255\n");
+    write_pixels(fp, (color_t *)pixels, width * height);
+    return fclose(fp) == 0;
+  }
+
+  size_t size;
+  unsigned char *buffer = encode_image(format, pixels, width, height, pool, &size);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  bool ok = fd >= 0 && write_all(fd, buffer, size);
+  if (fd >= 0) {
+    ok &= close(fd) == 0;
+  }
+  free(buffer);
+  return ok;
+}
+
+#endif // !IMAGE_H
@@ -1,6 +1,8 @@
 #ifndef INTERVAL_H
 #define INTERVAL_H
 
+#include <math.h>
+
 typedef struct {
   float min;
   float max;
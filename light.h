@@ -0,0 +1,116 @@
+#ifndef LIGHT_H
+#define LIGHT_H
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "arena.h"
+#include "hittable.h"
+#include "material.h"
+#include "rtweekend.h"
+#include "sampling.h"
+
+// The lights are the spheres with an emissive material, listed by index so
+// direct lighting can pick one without searching the scene. One is picked
+// uniformly, then a direction uniformly inside the cone it subtends from the
+// point being lit, which always heads for the light and, unlike a point on
+// its surface, wastes nothing on the half facing away. The pdfs are per unit
+// solid angle, the same measure as the cosine weighted bounce's, so the two
+// can be combined with multiple importance sampling.
+
+typedef struct {
+  uint32_t *spheres;
+  size_t n_lights;
+  // spheres is part of a mapped scene file, see sphere_list_t
+  bool mapped;
+  // from the material list's arena if it has one
+  arena_t *arena;
+} light_list_t;
+
+// every emissive sphere, in list order. call again if the spheres are
+// reordered.
+light_list_t *build_light_list(const material_list_t *material_list) {
+  light_list_t *lights = arena_or_heap(material_list->arena, sizeof(light_list_t));
+  *lights = (light_list_t){.arena = material_list->arena};
+  size_t n = material_list->nth_sphere;
+  for (size_t i = 0; i < n; i++) {
+    lights->n_lights += sphere_material_type(material_list, i) == EMISSIVE;
+  }
+  lights->spheres = arena_or_heap(lights->arena, (lights->n_lights > 0 ? lights->n_lights : 1) * sizeof(uint32_t));
+  size_t l = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (sphere_material_type(material_list, i) == EMISSIVE) {
+      lights->spheres[l++] = i;
+    }
+  }
+  return lights;
+}
+
+void free_light_list(light_list_t *lights) {
+  if (!lights->mapped) {
+    arena_or_heap_free(lights->arena, lights->spheres);
+  }
+  arena_or_heap_free(lights->arena, lights);
+}
+
+// 1 - cos of the half angle sphere s subtends from (px, py, pz), which is
+// the cone's solid angle over 2 pi. 0 from inside the sphere.
+float light_cone_width(const sphere_list_t *sphere_list, uint32_t s, float px, float py, float pz) {
+  float cx = sphere_list->xs[s] - px, cy = sphere_list->ys[s] - py, cz = sphere_list->zs[s] - pz;
+  float d2 = cx*cx + cy*cy + cz*cz;
+  float r2 = sphere_list->r2s[s];
+  if (d2 <= r2) {
+    return 0.0f;
+  }
+  // 1 - sqrt(1 - sin^2), rearranged so small, far lights don't cancel to 0
+  float sin2 = r2 / d2;
+  return sin2 / (1.0f + sqrtf(1.0f - sin2));
+}
+
+// the pdf of sample_light heading for sphere s from (px, py, pz), per unit
+// solid angle. 0 from inside it.
+float light_pdf(const light_list_t *lights, const sphere_list_t *sphere_list, uint32_t s, float px, float py, float pz) {
+  float width = light_cone_width(sphere_list, s, px, py, pz);
+  return width > 0 ? 1.0f / (lights->n_lights * 2*pi * width) : 0.0f;
+}
+
+// picks a light with u and a direction (*dx, *dy, *dz) toward it from
+// (px, py, pz) with v and w. *t is how far along it the light's surface is,
+// *pdf the direction's pdf and *sphere the light. false if the point is
+// inside the light.
+bool sample_light(const light_list_t *lights, const sphere_list_t *sphere_list, float px, float py, float pz, float u, float v, float w,
+                  float *dx, float *dy, float *dz, float *t, float *pdf, uint32_t *sphere) {
+  size_t l = (size_t)(u * lights->n_lights);
+  uint32_t s = lights->spheres[l < lights->n_lights ? l : lights->n_lights - 1];
+  float width = light_cone_width(sphere_list, s, px, py, pz);
+  if (width <= 0) {
+    return false;
+  }
+
+  float cx = sphere_list->xs[s] - px, cy = sphere_list->ys[s] - py, cz = sphere_list->zs[s] - pz;
+  float d2 = cx*cx + cy*cy + cz*cz;
+  float inv_d = 1.0f / sqrtf(d2);
+  float cos_theta = 1.0f - v * width;
+  float sin_theta = sqrtf(max_float(0.0f, 1.0f - cos_theta*cos_theta));
+  float sn, cs;
+  sincos_pi(2*pi*w - pi, &sn, &cs);
+  frame_to_world(cx * inv_d, cy * inv_d, cz * inv_d, sin_theta * cs, sin_theta * sn, cos_theta, dx, dy, dz);
+
+  // the near root, clamped for directions that only graze the sphere
+  float b = *dx*cx + *dy*cy + *dz*cz;
+  float disc = b*b - (d2 - sphere_list->r2s[s]);
+  *t = b - sqrtf(max_float(0.0f, disc));
+  *pdf = 1.0f / (lights->n_lights * 2*pi * width);
+  *sphere = s;
+  return true;
+}
+
+// Veach's power heuristic: the weight for a sample from the strategy with
+// pdf a when the other one would have taken it with pdf b
+float power_heuristic(float a, float b) {
+  return a*a / (a*a + b*b);
+}
+
+#endif // !LIGHT_H
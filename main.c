@@ -1,6 +1,7 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include "material.h"
@@ -10,40 +11,25 @@
 #include "ray.h"
 #include "interval.h"
 #include "hittable.h"
+#include "scene.h"
+#include "animation.h"
 #include "camera.h"
+#include "distributed.h"
+#include "render.h"
+#include "scenefile.h"
+#include "threadpool.h"
 
-int main() {
-  srand(time(NULL));   // Initialization, should only be called once.
-  //fast_srand(time(NULL));
-  fast_srand(123456);
-
-  // Camera params
-  float aspect_ratio = 16.0 / 9.0;
-  int image_width = 1200;
-  int samples_per_pixel = 500;
-  int max_depth = 50;
-
-  float vfov = 20;
-  point3_t lookfrom = new_vec3(13, 2, 3);
-  point3_t lookat = new_vec3(0, 0, 0);
-  vec3_t vup = new_vec3(0, 1, 0);
-
-  float defocus_angle = 0.6;
-  float focus_dist = 10.0;
-
-  camera_t camera = initialize_camera(aspect_ratio, image_width, samples_per_pixel, max_depth,
-                                      vfov, lookfrom, lookat, vup, defocus_angle, focus_dist);
-
-  // Materials and spheres
+// the scene from the cover of Ray Tracing in One Weekend
+scene_t cover_scene(void) {
   sphere_list_t *sphere_list = new_sphere_list(500);
   material_list_t *material_list = new_material_list(500);
-  material_t *ground_material = new_lambertian((color_t)new_vec3(0.5, 0.5, 0.5));
+  material_t ground_material = new_lambertian((color_t)new_vec3(0.5, 0.5, 0.5));
   add_sphere(sphere_list, new_vec3(0, -1000, 0), 1000);
-  add_material(material_list, *ground_material);
+  add_material(material_list, ground_material);
 
   int n_diffuse = 0, n_metal = 0, n_glass = 0;
 
-  material_t *sphere_material_glass = new_dielectric(1.5);
+  material_t sphere_material_glass = new_dielectric(1.5);
 
   for (int a = -11; a < 11; a++) {
     for (int b = -11; b < 11; b++) {
@@ -58,22 +44,22 @@ int main() {
           color_t c1 = random_vec3(0, 1);
           color_t c2 = random_vec3(0, 1);
           color_t albedo_diffuse = multiply(c1, c2);
-          material_t *sphere_material_diffuse = new_lambertian(albedo_diffuse);
+          material_t sphere_material_diffuse = new_lambertian(albedo_diffuse);
           add_sphere(sphere_list, center, 0.200001);
-          add_material(material_list, *sphere_material_diffuse);
+          add_material(material_list, sphere_material_diffuse);
         } else if (choose_mat < 0.95) {
           // metal
           n_metal++;
           color_t albedo_metal = random_vec3(0.5, 1.0);
           float fuzz = random_float_range(0, 0.5);
-          material_t *sphere_material_metal = new_metal(albedo_metal, fuzz);
+          material_t sphere_material_metal = new_metal(albedo_metal, fuzz);
           add_sphere(sphere_list, center, 0.200001);
-          add_material(material_list, *sphere_material_metal);
+          add_material(material_list, sphere_material_metal);
         } else {
           // glass
           n_glass++;
           add_sphere(sphere_list, center, 0.200001);
-          add_material(material_list, *sphere_material_glass);
+          add_material(material_list, sphere_material_glass);
         }
       }
     }
@@ -81,18 +67,212 @@ int main() {
 
   printf("diffuse: %d metal: %d glass: %d\n", n_diffuse, n_metal, n_glass);
 
-  material_t *material1 = new_dielectric(1.5);
+  material_t material1 = new_dielectric(1.5);
   add_sphere(sphere_list, new_vec3(0, 1, 0), 1.0);
-  add_material(material_list, *material1);
+  add_material(material_list, material1);
 
-  material_t *material2 = new_lambertian(new_vec3(0.4, 0.2, 0.1));
+  material_t material2 = new_lambertian(new_vec3(0.4, 0.2, 0.1));
   add_sphere(sphere_list, new_vec3(-4, 1, 0), 1.0);
-  add_material(material_list, *material2);
+  add_material(material_list, material2);
 
-  material_t *material3 = new_metal(new_vec3(0.7, 0.6, 0.5), 0.0);
+  material_t material3 = new_metal(new_vec3(0.7, 0.6, 0.5), 0.0);
   add_sphere(sphere_list, new_vec3(4, 1, 0), 1.0);
-  add_material(material_list, *material3);
+  add_material(material_list, material3);
+
+  return new_scene(sphere_list, material_list);
+}
+
+int main(int argc, char **argv) {
+  srand(time(NULL));   // Initialization, should only be called once.
+  //fast_srand(time(NULL));
+  fast_srand(123456);
+
+  select_simd_backend(simd_backend_from_env());
+  printf("simd backend: %s\n", simd_backend_name(g_simd_backend));
+
+  // --worker address renders tiles for the coordinator at address, see
+  // distributed.h. the scene and camera come from the coordinator.
+  for (int k = 1; k + 1 < argc; k++) {
+    if (strcmp(argv[k], "--worker") == 0) {
+      const char *threads = getenv("RT_THREADS");
+      thread_pool_t *pool = new_thread_pool(threads != NULL ? atoi(threads) : 0);
+      bool ok = run_worker(argv[k + 1], pool);
+      free_thread_pool(pool);
+      return ok ? 0 : 1;
+    }
+  }
+
+  // Camera params
+  float aspect_ratio = 16.0 / 9.0;
+  int image_width = 1200;
+  int samples_per_pixel = 500;
+  int max_depth = 50;
+
+  float vfov = 20;
+  point3_t lookfrom = new_vec3(13, 2, 3);
+  point3_t lookat = new_vec3(0, 0, 0);
+  vec3_t vup = new_vec3(0, 1, 0);
+
+  float defocus_angle = 0.6;
+  float focus_dist = 10.0;
+
+  camera_t camera = initialize_camera(aspect_ratio, image_width, samples_per_pixel, max_depth,
+                                      vfov, lookfrom, lookat, vup, defocus_angle, focus_dist);
+
+  // RT_SCENE=path loads a scene file (scenefile.h), otherwise it's the
+  // cover scene. --save-scene path writes the scene out, BVH included, and
+  // stops: binary unless path ends in .txt.
+  const char *scene_path = getenv("RT_SCENE");
+  const char *save_path = NULL;
+  for (int k = 1; k + 1 < argc; k++) {
+    if (strcmp(argv[k], "--save-scene") == 0) {
+      save_path = argv[k + 1];
+    }
+  }
+  scene_t scene;
+  if (scene_path != NULL) {
+    double start = now_seconds();
+    if (!load_scene_file(scene_path, &scene)) {
+      return 1;
+    }
+    printf("scene: %zu spheres from %s in %.3fs\n", scene.sphere_list->nth_sphere, scene_path, now_seconds() - start);
+  } else {
+    scene = cover_scene();
+  }
+  // a material_t each is what every sphere took before the table was shared
+  material_list_t *materials = scene.material_list;
+  if (materials->nth_sphere > 0) {
+    printf("materials: %zu distinct for %zu spheres, %.1f bytes per sphere against %zu unshared\n", materials->n_materials,
+         materials->nth_sphere, (double)material_list_bytes(materials) / materials->nth_sphere, sizeof(material_t));
+  }
+  size_t n_triangles = scene.triangles != NULL ? scene.triangles->n_triangles : 0;
+  if (n_triangles > 0) {
+    printf("triangles: %zu over %zu vertices\n", n_triangles, scene.triangles->n_vertices);
+  }
+  if (scene.sphere_list->nth_sphere >= BVH_MIN_SPHERES || n_triangles >= BVH_MIN_TRIANGLES) {
+    bool loaded = scene.bvh != NULL;
+    scene_build_bvh(&scene);
+    if (scene.bvh != NULL) {
+      printf("bvh: %zu nodes, depth %d, %s in %.3fs\n", scene.bvh->n_nodes, scene.bvh->depth, loaded ? "loaded" : "built", scene.bvh->build_seconds);
+    }
+    if (scene.triangle_bvh != NULL) {
+      printf("triangle bvh: %zu nodes, depth %d, built in %.3fs\n", scene.triangle_bvh->n_nodes, scene.triangle_bvh->depth, scene.triangle_bvh->build_seconds);
+    }
+  }
+  if (save_path != NULL) {
+    if (!save_scene_file(save_path, &scene)) {
+      printf("couldn't write %s\n", save_path);
+      return 1;
+    }
+    printf("wrote %s\n", save_path);
+    free_scene(&scene);
+    return 0;
+  }
+
+  // RT_PACKETS=1 traces primary rays in packets of the backend's width
+  const char *packets = getenv("RT_PACKETS");
+  camera.packets = packets != NULL && atoi(packets) != 0;
+  printf("packets: %s\n", camera.packets ? "on" : "off");
+  // RT_WAVEFRONT=1 switches to the wavefront engine
+  const char *wavefront = getenv("RT_WAVEFRONT");
+  camera.wavefront = wavefront != NULL && atoi(wavefront) != 0;
+  printf("engine: %s\n", camera.wavefront ? "wavefront" : "megakernel");
+  // RT_SPECIALIZE=0 renders with the generic sample_pixel rather than the
+  // variant compiled for this camera and scene
+  const char *specialize = getenv("RT_SPECIALIZE");
+  camera.specialize = specialize == NULL || atoi(specialize) != 0;
+  printf("kernel: %s\n", select_render_variant(&camera, &scene)->name);
+  // RT_ROULETTE=n starts russian roulette n rays into a path, 0 turns it off
+  const char *roulette = getenv("RT_ROULETTE");
+  if (roulette != NULL) {
+    camera.roulette_depth = atoi(roulette);
+  }
+  if (camera.roulette_depth > 0) {
+    printf("roulette: from %d rays on\n", camera.roulette_depth);
+  } else {
+    printf("roulette: off\n");
+  }
+  // RT_DENOISE=1 denoises the image before it's written, RT_AOVS=prefix
+  // writes the denoiser's guide buffers to prefix*.pfm
+  const char *denoise = getenv("RT_DENOISE");
+  camera.denoise = denoise != NULL && atoi(denoise) != 0;
+  camera.aov_prefix = getenv("RT_AOVS");
+  printf("denoiser: %s\n", camera.denoise ? "on" : "off");
+  // RT_NEE=0 turns off sampling the lights at diffuse hits
+  const char *nee = getenv("RT_NEE");
+  camera.light_sampling = nee == NULL || atoi(nee) != 0;
+  if (scene.lights->n_lights > 0) {
+    printf("lights: %zu, sampled %s\n", scene.lights->n_lights, camera.light_sampling ? "at diffuse hits" : "only when hit");
+  }
+
+  // RT_ADAPTIVE=<relative error> turns on adaptive sampling, each pixel
+  // taking between RT_MIN_SPP (default 16) and samples_per_pixel samples
+  const char *adaptive = getenv("RT_ADAPTIVE");
+  if (adaptive != NULL && atof(adaptive) > 0) {
+    const char *min_spp = getenv("RT_MIN_SPP");
+    camera.adaptive_threshold = atof(adaptive);
+    camera.min_samples = min_spp != NULL ? atoi(min_spp) : 16;
+    printf("adaptive: threshold %g, %d to %d samples per pixel\n", camera.adaptive_threshold, camera.min_samples, camera.samples_per_pixel);
+  }
+  // RT_SAMPLES=path (default samples.pgm) is where the per-pixel sample
+  // counts go
+  const char *samples = getenv("RT_SAMPLES");
+  if (samples != NULL) {
+    camera.samples_path = samples;
+  }
 
-  render(&camera, sphere_list, material_list);
+  // RT_PASS_SPP=n renders in passes of n samples per pixel, checkpointing
+  // after each to RT_CHECKPOINT (default render.ckpt). --resume carries on
+  // from that checkpoint.
+  const char *pass_spp = getenv("RT_PASS_SPP");
+  const char *checkpoint = getenv("RT_CHECKPOINT");
+  camera.pass_samples = pass_spp != NULL ? atoi(pass_spp) : 0;
+  camera.checkpoint_path = checkpoint != NULL ? checkpoint : "render.ckpt";
+  for (int k = 1; k < argc; k++) {
+    if (strcmp(argv[k], "--resume") == 0) {
+      camera.resume = true;
+    }
+  }
+  if (camera.pass_samples > 0) {
+    printf("progressive: %d samples per pass, checkpoints in %s\n", camera.pass_samples, camera.checkpoint_path);
+  } else if (camera.resume) {
+    // the checkpoint knows its pass size, this just turns passes on
+    camera.pass_samples = camera.samples_per_pixel;
+  }
+
+  // RT_OUTPUT=path (default output.ppm) and RT_FORMAT=p3|p6|pfm, which
+  // otherwise goes by the extension: .pfm for float, binary PPM for the rest
+  const char *output = getenv("RT_OUTPUT");
+  if (output != NULL) {
+    camera.output_path = output;
+  }
+  camera.output_format = image_format_from_name(getenv("RT_FORMAT"), camera.output_path);
+
+  // RT_THREADS overrides the default of one worker per core
+  const char *threads = getenv("RT_THREADS");
+  thread_pool_t *pool = new_thread_pool(threads != NULL ? atoi(threads) : 0);
+  printf("threads: %d\n", pool->n_threads);
+
+  // RT_ANIMATION=path renders the frames of an animation file (animation.h)
+  // to RT_OUTPUT with the frame number worked in
+  const char *animation_path = getenv("RT_ANIMATION");
+  // RT_COORDINATOR=address hands the render out to ./ray-tracer --worker
+  // processes that connect to address, cutting off any that go quiet for
+  // RT_WORKER_TIMEOUT seconds (default 30)
+  const char *coordinator = getenv("RT_COORDINATOR");
+  if (animation_path != NULL) {
+    animation_t *animation = load_animation(animation_path, scene.sphere_list->nth_sphere);
+    if (animation == NULL || !render_animation(&camera, &scene, pool, animation)) {
+      return 1;
+    }
+    free_animation(animation);
+  } else if (coordinator != NULL) {
+    const char *timeout = getenv("RT_WORKER_TIMEOUT");
+    render_coordinated(&camera, &scene, pool, coordinator, timeout != NULL ? atof(timeout) : 30.0);
+  } else {
+    render(&camera, &scene, pool);
+  }
+  free_thread_pool(pool);
+  free_scene(&scene);
   return 0;
 }
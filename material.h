@@ -1,6 +1,10 @@
 #ifndef MATERIAL_H
 #define MATERIAL_H
 
+#include <stdint.h>
+#include <string.h>
+
+#include "arena.h"
 #include "hittable.h"
 #include "ray.h"
 #include "rtweekend.h"
@@ -13,9 +17,21 @@
 typedef enum {
   LAMBERTIAN,
   METAL,
-  DIELECTRIC
+  DIELECTRIC,
+  EMISSIVE
 } material_type_t;
 
+#define N_MATERIAL_TYPES 4
+
+// sets of material types, one bit each, for the render variants in
+// camera.h that are compiled for the types a scene has
+#define MATERIAL_BIT(type) (1u << (type))
+#define ALL_MATERIAL_TYPES ((1u << N_MATERIAL_TYPES) - 1)
+
+// render variants are stamped out from always inlined functions, so that
+// their constant arguments fold away
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+
 typedef struct lambertian_t {
   color_t albedo;
 } lambertian_t;
@@ -29,12 +45,18 @@ typedef struct dielectric_t {
   float ir;
 } dielectric_t;
 
+// a light: gives off radiance emit from its outside and scatters nothing
+typedef struct emissive_t {
+  color_t emit;
+} emissive_t;
+
 typedef struct material_t {
   material_type_t type;
   union {
     lambertian_t lambertian;
     metal_t metal;
     dielectric_t dielectric;
+    emissive_t emissive;
   } data;
 } material_t;
 
@@ -42,120 +64,396 @@ typedef struct material_t {
 float dielectric_reflectance(float cos, float ref_idx) {
   float r0 = (1 - ref_idx) / (1 + ref_idx);
   r0 = r0*r0;
-  return r0 + (1-r0)*pow((1-cos), 5);
+  return r0 + (1-r0)*schlick_weight(cos);
 }
 
-bool scatter(const material_t *material, const ray_t *ray_in, const hit_record_t *rec, color_t *attenuation, ray_t *scattered) {
-  switch (material->type) {
-    case LAMBERTIAN: {
-      vec3_t scatter_direction = add(rec->normal, random_vec3_on_unit_sphere());
-
-      if (near_zero(scatter_direction)) {
-        scatter_direction = rec->normal;
-      }
+// true if material is of type, given that it's one of the types in
+// materials. with materials a constant that's no test at all when there's
+// only one answer.
+ALWAYS_INLINE bool material_is(const material_t *material, material_type_t type, uint32_t materials) {
+  if (!(materials & MATERIAL_BIT(type))) {
+    return false;
+  }
+  if (materials == MATERIAL_BIT(type)) {
+    return true;
+  }
+  return material->type == type;
+}
 
-      scattered->origin = rec->p;
-      scattered->direction = normalize(scatter_direction);
-      *attenuation = material->data.lambertian.albedo;
-      return true;
-      break;
-    }
-    case METAL: {
-      vec3_t scatter_direction = reflect(ray_in->direction, rec->normal);
-      if (material->data.metal.fuzz > 0) {
-        vec3_t random = scale(random_vec3_on_unit_sphere(), material->data.metal.fuzz);
-        add_equals(&scatter_direction, random);
-      }
-
-      scattered->origin = rec->p;
-      scattered->direction = normalize(scatter_direction);
-      *attenuation = material->data.metal.albedo;
-      return (dot(scatter_direction, rec->normal) > 0);
-      break;
+// scatter() for a material that's one of the types in materials
+ALWAYS_INLINE bool scatter_in(const material_t *material, const ray_t *ray_in, const hit_record_t *rec, color_t *attenuation, ray_t *scattered, uint32_t materials) {
+  if (material_is(material, LAMBERTIAN, materials)) {
+    // cosine weighted directly, no n + random unit vector that might
+    // cancel out. still normalized: the normal is only as unit length as
+    // the hit point is accurate, and grazing hits aren't very
+    scattered->origin = rec->p;
+    scattered->direction = normalize(random_vec3_cosine_direction(rec->normal));
+    *attenuation = material->data.lambertian.albedo;
+    return true;
+  }
+  if (material_is(material, METAL, materials)) {
+    vec3_t scatter_direction = reflect(ray_in->direction, rec->normal);
+    if (material->data.metal.fuzz > 0) {
+      vec3_t random = scale(random_vec3_on_unit_sphere(), material->data.metal.fuzz);
+      add_equals(&scatter_direction, random);
     }
-    case DIELECTRIC: {
-      attenuation->e[0] = 1.0;
-      attenuation->e[1] = 1.0;
-      attenuation->e[2] = 1.0;
-
-      float refraction_ratio = rec->front_face? 1.0/material->data.dielectric.ir : material->data.dielectric.ir;
-
-      vec3_t unit_direction = normalize(ray_in->direction);
-
-      float cos_theta = fmin(dot(scale(unit_direction, -1.0), rec->normal), 1.0);
-      float sin_theta = sqrt(1-cos_theta * cos_theta);
-      bool tir = refraction_ratio*sin_theta > 1;
-      if (tir || dielectric_reflectance(cos_theta, refraction_ratio) > random_float()) {
-        scattered->direction = normalize(reflect(unit_direction, rec->normal));
-      } else {
-        // refract
-        scattered->direction = normalize(refract(unit_direction, rec->normal, refraction_ratio));
-      }
-      scattered->origin = rec->p;
-      return true;
-      break;
+
+    scattered->origin = rec->p;
+    scattered->direction = normalize(scatter_direction);
+    *attenuation = material->data.metal.albedo;
+    return (dot(scatter_direction, rec->normal) > 0);
+  }
+  if (material_is(material, DIELECTRIC, materials)) {
+    attenuation->e[0] = 1.0;
+    attenuation->e[1] = 1.0;
+    attenuation->e[2] = 1.0;
+
+    float refraction_ratio = rec->front_face? 1.0f/material->data.dielectric.ir : material->data.dielectric.ir;
+
+    vec3_t unit_direction = normalize(ray_in->direction);
+
+    float cos_theta = min_float(-dot(unit_direction, rec->normal), 1.0f);
+    float sin_theta = sqrtf(1-cos_theta * cos_theta);
+    bool tir = refraction_ratio*sin_theta > 1;
+    if (tir || dielectric_reflectance(cos_theta, refraction_ratio) > random_float()) {
+      scattered->direction = normalize(reflect(unit_direction, rec->normal));
+    } else {
+      // refract
+      scattered->direction = normalize(refract(unit_direction, rec->normal, refraction_ratio));
     }
+    scattered->origin = rec->p;
+    return true;
   }
+  // emissive
+  return false;
+}
+
+bool scatter(const material_t *material, const ray_t *ray_in, const hit_record_t *rec, color_t *attenuation, ray_t *scattered) {
+  return scatter_in(material, ray_in, rec, attenuation, scattered, ALL_MATERIAL_TYPES);
 }
 
-material_t *new_lambertian(color_t albedo) {
-  material_t *mat = malloc(sizeof(material_t));
+// the colour a surface tints the light it scatters, for the denoiser's
+// albedo buffer. glass and lights don't tint anything.
+color_t material_albedo(const material_t *material) {
+  switch (material->type) {
+    case LAMBERTIAN:
+      return material->data.lambertian.albedo;
+    case METAL:
+      return material->data.metal.albedo;
+    default:
+      return new_vec3(1.0, 1.0, 1.0);
+  }
+}
 
+// materials are small and go into a material_list_t by value, so they're
+// made by value too
+material_t new_lambertian(color_t albedo) {
   lambertian_t lamb = {.albedo = albedo};
 
-  *mat = (material_t){
+  return (material_t){
     .type = LAMBERTIAN,
     .data = {.lambertian = lamb},
   };
-
-  return mat;
 }
 
-material_t *new_metal(color_t albedo, float fuzz) {
-  material_t *mat = malloc(sizeof(material_t));
-
+material_t new_metal(color_t albedo, float fuzz) {
   metal_t met = {.albedo = albedo, .fuzz = fuzz > 1 ? 1 : fuzz};
 
-  *mat = (material_t){
+  return (material_t){
     .type = METAL,
     .data = {.metal = met},
   };
-
-  return mat;
 }
 
-material_t *new_dielectric(float ir) {
-  material_t *mat = malloc(sizeof(material_t));
-
+material_t new_dielectric(float ir) {
   dielectric_t dielectric = (dielectric_t){.ir = ir};
 
-  *mat = (material_t){
+  return (material_t){
     .type = DIELECTRIC,
     .data = {.dielectric = dielectric},
   };
+}
+
+material_t new_emissive(color_t emit) {
+  emissive_t emissive = (emissive_t){.emit = emit};
 
-  return mat;
+  return (material_t){
+    .type = EMISSIVE,
+    .data = {.emissive = emissive},
+  };
 }
 
+// spheres share their materials: each distinct material is stored once, in
+// a table grouped by type, and every sphere has an index into it. indices
+// are 32 bits, or 16 with -DMATERIAL_INDEX_16 for scenes with at most 65536
+// distinct materials.
+#ifdef MATERIAL_INDEX_16
+typedef uint16_t material_index_t;
+#define MAX_MATERIALS ((size_t)UINT16_MAX + 1)
+#else
+typedef uint32_t material_index_t;
+#define MAX_MATERIALS ((size_t)UINT32_MAX + 1)
+#endif
+
 typedef struct {
+  // one index per sphere, in the same order as the sphere list
   size_t nth_sphere;
   size_t max_spheres;
-  material_t materials[];
+  material_index_t *indices;
+  // the distinct materials. once grouped, type t's are the run from
+  // type_start[t] to type_start[t + 1], so batched code can take the
+  // materials of one type at a time and tell a sphere's type from its index.
+  // adding materials ungroups the table until group_materials runs again.
+  material_t *materials;
+  size_t n_materials;
+  size_t max_materials;
+  uint32_t type_start[N_MATERIAL_TYPES + 1];
+  bool grouped;
+  // open addressing hash set of table index + 1 (0 for an empty slot), for
+  // finding duplicates while the list is built. group_materials drops it.
+  uint32_t *lookup;
+  size_t lookup_size;
+  // indices and materials are part of a mapped scene file, see sphere_list_t
+  bool mapped;
+  // the list and its arrays come from this arena if it's set
+  arena_t *arena;
 } material_list_t;
 
-material_list_t *new_material_list(size_t n_spheres) {
-  // NB: we never free()
-  material_list_t *material_list = malloc(sizeof(material_list_t) + n_spheres * sizeof(material_t));
-  material_list->max_spheres = n_spheres;
-  material_list->nth_sphere = 0;
+// m with every byte its type doesn't use zeroed, so equal materials compare
+// and hash equal bytewise
+material_t canonical_material(material_t m) {
+  material_t out;
+  memset(&out, 0, sizeof(out));
+  out.type = m.type;
+  switch (m.type) {
+    case LAMBERTIAN:
+      out.data.lambertian = m.data.lambertian;
+      break;
+    case METAL:
+      out.data.metal = m.data.metal;
+      break;
+    case DIELECTRIC:
+      out.data.dielectric = m.data.dielectric;
+      break;
+    case EMISSIVE:
+      out.data.emissive = m.data.emissive;
+      break;
+  }
+  return out;
+}
+
+// FNV-1a over the material's bytes
+uint32_t material_hash(const material_t *m) {
+  const unsigned char *bytes = (const unsigned char *)m;
+  uint32_t h = 2166136261u;
+  for (size_t k = 0; k < sizeof(material_t); k++) {
+    h = (h ^ bytes[k]) * 16777619u;
+  }
+  return h;
+}
+
+const material_t *sphere_material(const material_list_t *material_list, size_t i) {
+  return &material_list->materials[material_list->indices[i]];
+}
+
+// sphere i's material type, from the index alone when the table is grouped
+material_type_t sphere_material_type(const material_list_t *material_list, size_t i) {
+  material_index_t m = material_list->indices[i];
+  if (!material_list->grouped) {
+    return material_list->materials[m].type;
+  }
+  int t = 0;
+  while (m >= material_list->type_start[t + 1]) {
+    t++;
+  }
+  return (material_type_t)t;
+}
+
+// bytes the list takes, per-sphere indices and table
+size_t material_list_bytes(const material_list_t *material_list) {
+  return material_list->nth_sphere * sizeof(material_index_t) + material_list->n_materials * sizeof(material_t);
+}
+
+// copies indices and materials out of a mapped scene file before changing
+// them
+void unmap_materials(material_list_t *material_list) {
+  material_index_t *indices = arena_or_heap(material_list->arena, (material_list->max_spheres > 0 ? material_list->max_spheres : 1) * sizeof(material_index_t));
+  material_t *materials = arena_or_heap(material_list->arena, (material_list->max_materials > 0 ? material_list->max_materials : 1) * sizeof(material_t));
+  memcpy(indices, material_list->indices, material_list->nth_sphere * sizeof(material_index_t));
+  memcpy(materials, material_list->materials, material_list->n_materials * sizeof(material_t));
+  material_list->indices = indices;
+  material_list->materials = materials;
+  material_list->mapped = false;
+}
+
+void reserve_materials(material_list_t *material_list, size_t capacity) {
+  material_index_t *indices = arena_or_heap(material_list->arena, (capacity > 0 ? capacity : 1) * sizeof(material_index_t));
+  if (material_list->nth_sphere > 0) {
+    memcpy(indices, material_list->indices, material_list->nth_sphere * sizeof(material_index_t));
+  }
+  arena_or_heap_free(material_list->arena, material_list->indices);
+  material_list->indices = indices;
+  material_list->max_spheres = capacity;
+}
+
+void reserve_material_table(material_list_t *material_list, size_t capacity) {
+  material_t *materials = arena_or_heap(material_list->arena, (capacity > 0 ? capacity : 1) * sizeof(material_t));
+  if (material_list->n_materials > 0) {
+    memcpy(materials, material_list->materials, material_list->n_materials * sizeof(material_t));
+  }
+  arena_or_heap_free(material_list->arena, material_list->materials);
+  material_list->materials = materials;
+  material_list->max_materials = capacity;
+}
+
+// rebuilds the duplicate lookup with room for size entries, a power of two
+void rebuild_material_lookup(material_list_t *material_list, size_t size) {
+  arena_or_heap_free(material_list->arena, material_list->lookup);
+  material_list->lookup = arena_or_heap(material_list->arena, size * sizeof(uint32_t));
+  memset(material_list->lookup, 0, size * sizeof(uint32_t));
+  material_list->lookup_size = size;
+  for (size_t m = 0; m < material_list->n_materials; m++) {
+    size_t slot = material_hash(&material_list->materials[m]) & (size - 1);
+    while (material_list->lookup[slot] != 0) {
+      slot = (slot + 1) & (size - 1);
+    }
+    material_list->lookup[slot] = m + 1;
+  }
+}
+
+// the table index of material, added to the table if it isn't there yet.
+// false if it would need an index past MAX_MATERIALS.
+bool find_material(material_list_t *material_list, material_t material, material_index_t *index) {
+  material = canonical_material(material);
+  if (material_list->mapped) {
+    unmap_materials(material_list);
+  }
+  // kept at most half full
+  if (2 * (material_list->n_materials + 1) > material_list->lookup_size) {
+    size_t size = 64;
+    while (size < 4 * (material_list->n_materials + 1)) {
+      size *= 2;
+    }
+    rebuild_material_lookup(material_list, size);
+  }
+  size_t mask = material_list->lookup_size - 1;
+  size_t slot = material_hash(&material) & mask;
+  for (; material_list->lookup[slot] != 0; slot = (slot + 1) & mask) {
+    size_t m = material_list->lookup[slot] - 1;
+    if (memcmp(&material_list->materials[m], &material, sizeof(material_t)) == 0) {
+      *index = m;
+      return true;
+    }
+  }
+  if (material_list->n_materials >= MAX_MATERIALS) {
+    return false;
+  }
+  if (material_list->n_materials >= material_list->max_materials) {
+    reserve_material_table(material_list, material_list->max_materials > 0 ? 2 * material_list->max_materials : 16);
+  }
+  material_list->materials[material_list->n_materials] = material;
+  material_list->lookup[slot] = material_list->n_materials + 1;
+  *index = material_list->n_materials++;
+  material_list->grouped = false;
+  return true;
+}
 
+// n_spheres is only the starting capacity, add_material grows the list. in
+// arena if that's not NULL.
+material_list_t *new_material_list_in(arena_t *arena, size_t n_spheres) {
+  material_list_t *material_list = arena_or_heap(arena, sizeof(material_list_t));
+  *material_list = (material_list_t){.arena = arena, .grouped = true};
+  reserve_materials(material_list, n_spheres);
+  reserve_material_table(material_list, 16);
   return material_list;
 }
 
-void add_material(material_list_t *material_list, material_t material) {
-  // TODO: check how nth_sphere compares to max_spheres!
-  material_list->materials[material_list->nth_sphere] = material;
+material_list_t *new_material_list(size_t n_spheres) {
+  return new_material_list_in(NULL, n_spheres);
+}
+
+void free_material_list(material_list_t *material_list) {
+  if (!material_list->mapped) {
+    arena_or_heap_free(material_list->arena, material_list->indices);
+    arena_or_heap_free(material_list->arena, material_list->materials);
+  }
+  arena_or_heap_free(material_list->arena, material_list->lookup);
+  arena_or_heap_free(material_list->arena, material_list);
+}
+
+// the next sphere's material. false if the table is full (only possible
+// with 16 bit indices).
+bool add_material(material_list_t *material_list, material_t material) {
+  material_index_t index;
+  if (!find_material(material_list, material, &index)) {
+    return false;
+  }
+  if (material_list->nth_sphere >= material_list->max_spheres) {
+    reserve_materials(material_list, material_list->max_spheres > 0 ? 2 * material_list->max_spheres : 16);
+  }
+  material_list->indices[material_list->nth_sphere] = index;
   material_list->nth_sphere++;
+  return true;
+}
+
+// gives sphere i a different material. the old one stays in the table.
+bool set_sphere_material(material_list_t *material_list, size_t i, material_t material) {
+  material_index_t index;
+  if (!find_material(material_list, material, &index)) {
+    return false;
+  }
+  material_list->indices[i] = index;
+  return true;
+}
+
+// sets type_start from the table and grouped if it's in type order
+void find_material_types(material_list_t *material_list) {
+  size_t counts[N_MATERIAL_TYPES] = {0};
+  bool sorted = true;
+  for (size_t m = 0; m < material_list->n_materials; m++) {
+    material_type_t type = material_list->materials[m].type;
+    counts[type]++;
+    sorted = sorted && (m == 0 || type >= material_list->materials[m - 1].type);
+  }
+  material_list->type_start[0] = 0;
+  for (int t = 0; t < N_MATERIAL_TYPES; t++) {
+    material_list->type_start[t + 1] = material_list->type_start[t] + counts[t];
+  }
+  material_list->grouped = sorted;
+}
+
+// sorts the table by type (stably, a counting sort) and renumbers the
+// spheres' indices to match. called by new_scene once the list is complete.
+void group_materials(material_list_t *material_list) {
+  if (material_list->lookup != NULL) {
+    arena_or_heap_free(material_list->arena, material_list->lookup);
+    material_list->lookup = NULL;
+    material_list->lookup_size = 0;
+  }
+  find_material_types(material_list);
+  if (material_list->grouped) {
+    return;
+  }
+  if (material_list->mapped) {
+    unmap_materials(material_list);
+  }
+  size_t n = material_list->n_materials;
+  material_index_t *renumber = malloc((n > 0 ? n : 1) * sizeof(material_index_t));
+  material_t *sorted = malloc((n > 0 ? n : 1) * sizeof(material_t));
+  uint32_t next[N_MATERIAL_TYPES];
+  memcpy(next, material_list->type_start, sizeof(next));
+  for (size_t m = 0; m < n; m++) {
+    uint32_t to = next[material_list->materials[m].type]++;
+    renumber[m] = to;
+    sorted[to] = material_list->materials[m];
+  }
+  memcpy(material_list->materials, sorted, n * sizeof(material_t));
+  for (size_t i = 0; i < material_list->nth_sphere; i++) {
+    material_list->indices[i] = renumber[material_list->indices[i]];
+  }
+  free(sorted);
+  free(renumber);
+  material_list->grouped = true;
 }
 
 #endif // !MATERIAL_H
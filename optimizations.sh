@@ -1,14 +1,30 @@
 #!/bin/bash
+# builds the bench with more and more compiler flags, one set at a time, and
+# keeps each build's JSON results and disassembly. the flag sets come from
+# flags.txt, one per line, if there is one, otherwise the list below.
+# MAX_SPHERES (default 100000) caps the bench's scene sizes. if hyperfine is
+# on the PATH it also times a full render with each set of flags.
+set -e
+
+if [ -f flags.txt ]; then
+  mapfile -t flag_sets < flags.txt
+else
+  flag_sets=("-O2" "-O3" "-fno-math-errno -fno-trapping-math" "-funroll-loops" "-march=native")
+fi
+max_spheres=${MAX_SPHERES:-100000}
+commit=`git rev-parse --short HEAD 2>/dev/null || echo unknown`
+mkdir -p benchmark_data disassembly
 
 all_opt=
-for opt in `cat flags.txt`; do
-  echo $opt
-  json_out=opt_`echo $opt | tr ' ' '-'`.json
-  asm_out=opt_`echo $opt | tr ' ' '-'`.s
-  echo $json_out
+for opt in "${flag_sets[@]}"; do
+  name=opt_`echo $opt | tr ' ' '-'`
   all_opt+=" $opt"
-  echo $all_opt
-  gcc -Wall $all_opt -o ray-tracer main.c -lm -lpthread
-  objdump -d ray-tracer > disassembly/$asm_out
-  ./hyperfine-v1.18.0-aarch64-unknown-linux-gnu/hyperfine --export-json benchmark_data/$json_out --runs 5 './ray-tracer'
+  echo "$name:$all_opt"
+  gcc -Wall $all_opt -DBVH_STATS -DBENCH_COMMIT=\"$commit\" -o bench bench.c -lm -lpthread
+  objdump -d bench > disassembly/$name.s
+  ./bench $max_spheres --json benchmark_data/$name.json
+  if command -v hyperfine > /dev/null; then
+    gcc -Wall $all_opt -o ray-tracer main.c -lm -lpthread
+    hyperfine --export-json benchmark_data/${name}_render.json --runs 5 './ray-tracer'
+  fi
 done
@@ -0,0 +1,574 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "bvh.h"
+#include "hittable.h"
+#include "interval.h"
+#include "material.h"
+#include "ray.h"
+#include "rtweekend.h"
+#include "simd.h"
+#include "stats.h"
+#include "vec3.h"
+#include "vectorized.h"
+
+// Ray packets: 4, 8 or 16 coherent rays (one lane per ray, the backend's
+// native width) traced through the scene together. The single ray kernels
+// broadcast one ray and stream spheres through the lanes; here it's the
+// other way round, each sphere is broadcast once and tested against every
+// ray in the packet, so sphere loads and BVH node loads are shared by the
+// whole packet and the closest hit per lane falls out of a per-lane select
+// with no horizontal reduction.
+//
+// Traversal walks the binary BVH. Each node is first culled for the packet
+// as a whole with interval arithmetic on the packet's origin and inverse
+// direction bounds, and only then slab tested per lane. Lanes whose ray
+// misses a node are masked off for that subtree.
+
+#define PACKET_MAX_WIDTH 16
+
+typedef struct {
+  _Alignas(64) float ox[PACKET_MAX_WIDTH];
+  _Alignas(64) float oy[PACKET_MAX_WIDTH];
+  _Alignas(64) float oz[PACKET_MAX_WIDTH];
+  _Alignas(64) float dx[PACKET_MAX_WIDTH];
+  _Alignas(64) float dy[PACKET_MAX_WIDTH];
+  _Alignas(64) float dz[PACKET_MAX_WIDTH];
+  _Alignas(64) float inv_x[PACKET_MAX_WIDTH];
+  _Alignas(64) float inv_y[PACKET_MAX_WIDTH];
+  _Alignas(64) float inv_z[PACKET_MAX_WIDTH];
+  // closest hit so far per lane, starts at the interval's max
+  _Alignas(64) float t_max[PACKET_MAX_WIDTH];
+  // index of the closest sphere per lane, -1 for a miss
+  _Alignas(64) int32_t sphere[PACKET_MAX_WIDTH];
+  float t_min;
+  int width;
+
+  // interval arithmetic bounds over the packet, for whole-packet culling.
+  // only usable on axes where every ray's direction has the same sign.
+  float o_lo[3], o_hi[3];
+  float inv_lo[3], inv_hi[3];
+  bool same_sign[3];
+} ray_packet_t;
+
+// tests spheres [start, end) against the lanes set in active, shrinking
+// t_max and updating sphere for every lane that finds something closer
+typedef void (*packet_spheres_fn_t)(const sphere_list_t *sphere_list, size_t start, size_t end, ray_packet_t *packet, unsigned int active);
+// per lane slab test against a binary BVH node, returns the lanes in active
+// that hit it before their t_max. *t_near gets the nearest entry among them.
+typedef unsigned int (*packet_aabb_fn_t)(const bvh_node_t *node, const ray_packet_t *packet, unsigned int active, float *t_near);
+
+void packet_set_ray(ray_packet_t *packet, int lane, const ray_t *ray) {
+  packet->ox[lane] = ray->origin.e[0];
+  packet->oy[lane] = ray->origin.e[1];
+  packet->oz[lane] = ray->origin.e[2];
+  packet->dx[lane] = ray->direction.e[0];
+  packet->dy[lane] = ray->direction.e[1];
+  packet->dz[lane] = ray->direction.e[2];
+  packet->inv_x[lane] = 1.0f / ray->direction.e[0];
+  packet->inv_y[lane] = 1.0f / ray->direction.e[1];
+  packet->inv_z[lane] = 1.0f / ray->direction.e[2];
+}
+
+ray_t packet_get_ray(const ray_packet_t *packet, int lane) {
+  return new_ray(new_vec3(packet->ox[lane], packet->oy[lane], packet->oz[lane]),
+                 new_vec3(packet->dx[lane], packet->dy[lane], packet->dz[lane]));
+}
+
+// call once all the lanes' rays are set
+void packet_begin(ray_packet_t *packet, const interval_t *interval) {
+  packet->t_min = interval->min;
+  for (int l = 0; l < packet->width; l++) {
+    packet->t_max[l] = interval->max;
+    packet->sphere[l] = -1;
+  }
+
+  const float *os[3] = {packet->ox, packet->oy, packet->oz};
+  const float *invs[3] = {packet->inv_x, packet->inv_y, packet->inv_z};
+  for (int a = 0; a < 3; a++) {
+    packet->o_lo[a] = packet->o_hi[a] = os[a][0];
+    packet->inv_lo[a] = packet->inv_hi[a] = invs[a][0];
+    bool positive = invs[a][0] >= 0.0f;
+    packet->same_sign[a] = true;
+    for (int l = 1; l < packet->width; l++) {
+      packet->o_lo[a] = min_float(packet->o_lo[a], os[a][l]);
+      packet->o_hi[a] = max_float(packet->o_hi[a], os[a][l]);
+      packet->inv_lo[a] = min_float(packet->inv_lo[a], invs[a][l]);
+      packet->inv_hi[a] = max_float(packet->inv_hi[a], invs[a][l]);
+      packet->same_sign[a] &= (invs[a][l] >= 0.0f) == positive;
+    }
+    // an infinite inverse direction makes the interval products NaN
+    packet->same_sign[a] &= isfinite(packet->inv_lo[a]) && isfinite(packet->inv_hi[a]);
+  }
+}
+
+// lower and upper bound of (plane - o) * inv over the whole packet
+void packet_slab_interval(const ray_packet_t *packet, int a, float plane, float *lo, float *hi) {
+  float d_lo = plane - packet->o_hi[a];
+  float d_hi = plane - packet->o_lo[a];
+  float p0 = d_lo * packet->inv_lo[a];
+  float p1 = d_lo * packet->inv_hi[a];
+  float p2 = d_hi * packet->inv_lo[a];
+  float p3 = d_hi * packet->inv_hi[a];
+  *lo = min_float(min_float(p0, p1), min_float(p2, p3));
+  *hi = max_float(max_float(p0, p1), max_float(p2, p3));
+}
+
+// true if interval arithmetic proves no ray in the packet can hit the node
+// before t_max_packet. conservative: false just means "go test the lanes".
+bool packet_culls_node(const ray_packet_t *packet, const bvh_node_t *node, float t_max_packet) {
+  float entry = packet->t_min;
+  float exit = t_max_packet;
+  for (int a = 0; a < 3; a++) {
+    if (!packet->same_sign[a]) {
+      continue;
+    }
+    bool positive = packet->inv_lo[a] >= 0.0f;
+    float near = positive ? node->min[a] : node->max[a];
+    float far = positive ? node->max[a] : node->min[a];
+    float near_lo, near_hi, far_lo, far_hi;
+    packet_slab_interval(packet, a, near, &near_lo, &near_hi);
+    packet_slab_interval(packet, a, far, &far_lo, &far_hi);
+    entry = max_float(entry, near_lo);
+    exit = min_float(exit, far_hi);
+  }
+  return entry > exit;
+}
+
+unsigned int packet_lane_mask(int width) {
+  return width >= 32 ? 0xffffffffu : (1u << width) - 1;
+}
+
+void packet_closest_spheres_scalar(const sphere_list_t *sphere_list, size_t start, size_t end, ray_packet_t *packet, unsigned int active) {
+  for (size_t s = start; s < end; s++) {
+    for (int l = 0; l < packet->width; l++) {
+      if (!(active & (1u << l))) {
+        continue;
+      }
+      float ac_x = packet->ox[l] - sphere_list->xs[s];
+      float ac_y = packet->oy[l] - sphere_list->ys[s];
+      float ac_z = packet->oz[l] - sphere_list->zs[s];
+      float halfb = packet->dx[l]*ac_x + packet->dy[l]*ac_y + packet->dz[l]*ac_z;
+      float c = ac_x*ac_x + ac_y*ac_y + ac_z*ac_z - sphere_list->r2s[s];
+      float disc = halfb*halfb - c;
+      if (disc < 0.0f) {
+        continue;
+      }
+      float sqrt_disc = sqrtf(disc);
+      float t = -halfb - sqrt_disc;
+      if (t <= packet->t_min) {
+        t = -halfb + sqrt_disc;
+      }
+      if (t > packet->t_min && t < packet->t_max[l]) {
+        packet->t_max[l] = t;
+        packet->sphere[l] = s;
+      }
+    }
+  }
+}
+
+unsigned int packet_aabb_scalar(const bvh_node_t *node, const ray_packet_t *packet, unsigned int active, float *t_near) {
+  const float *os[3] = {packet->ox, packet->oy, packet->oz};
+  const float *invs[3] = {packet->inv_x, packet->inv_y, packet->inv_z};
+  unsigned int mask = 0;
+  *t_near = INFINITY;
+  for (int l = 0; l < packet->width; l++) {
+    if (!(active & (1u << l))) {
+      continue;
+    }
+    float t0 = packet->t_min, t1 = packet->t_max[l];
+    for (int a = 0; a < 3; a++) {
+      float ta = (node->min[a] - os[a][l]) * invs[a][l];
+      float tb = (node->max[a] - os[a][l]) * invs[a][l];
+      t0 = max_float(t0, min_float(ta, tb));
+      t1 = min_float(t1, max_float(ta, tb));
+    }
+    if (t0 <= t1) {
+      mask |= 1u << l;
+      *t_near = min_float(*t_near, t0);
+    }
+  }
+  return mask;
+}
+
+#if defined(SIMD_HAVE_NEON)
+
+uint32x4_t packet_active_neon(unsigned int active) {
+  const uint32_t bits[4] = {1, 2, 4, 8};
+  uint32x4_t b = vld1q_u32(bits);
+  return vceqq_u32(vandq_u32(vdupq_n_u32(active), b), b);
+}
+
+unsigned int packet_movemask_neon(uint32x4_t mask) {
+  const uint32_t bits[4] = {1, 2, 4, 8};
+  return vaddvq_u32(vandq_u32(mask, vld1q_u32(bits)));
+}
+
+void packet_closest_spheres_neon(const sphere_list_t *sphere_list, size_t start, size_t end, ray_packet_t *packet, unsigned int active) {
+  float32x4_t ox = vld1q_f32(packet->ox), oy = vld1q_f32(packet->oy), oz = vld1q_f32(packet->oz);
+  float32x4_t dx = vld1q_f32(packet->dx), dy = vld1q_f32(packet->dy), dz = vld1q_f32(packet->dz);
+  float32x4_t t_max = vld1q_f32(packet->t_max);
+  int32x4_t sphere = vld1q_s32(packet->sphere);
+  float32x4_t t_min = vdupq_n_f32(packet->t_min);
+  uint32x4_t lanes = packet_active_neon(active);
+
+  for (size_t s = start; s < end; s++) {
+    float32x4_t ac_x = vsubq_f32(ox, vdupq_n_f32(sphere_list->xs[s]));
+    float32x4_t ac_y = vsubq_f32(oy, vdupq_n_f32(sphere_list->ys[s]));
+    float32x4_t ac_z = vsubq_f32(oz, vdupq_n_f32(sphere_list->zs[s]));
+    float32x4_t halfb = vfmaq_f32(vfmaq_f32(vmulq_f32(dx, ac_x), dy, ac_y), dz, ac_z);
+    float32x4_t c = vfmaq_f32(vfmaq_f32(vmulq_f32(ac_x, ac_x), ac_y, ac_y), ac_z, ac_z);
+    c = vsubq_f32(c, vdupq_n_f32(sphere_list->r2s[s]));
+    float32x4_t disc = vfmsq_f32(vnegq_f32(c), halfb, vnegq_f32(halfb));
+    uint32x4_t hit = vandq_u32(vcgeq_f32(disc, vdupq_n_f32(0.0f)), lanes);
+    if (vmaxvq_u32(hit) == 0) {
+      continue;
+    }
+    float32x4_t sqrt_disc = vsqrtq_f32(vmaxq_f32(disc, vdupq_n_f32(0.0f)));
+    float32x4_t neg_halfb = vnegq_f32(halfb);
+    float32x4_t t0 = vsubq_f32(neg_halfb, sqrt_disc);
+    float32x4_t t1 = vaddq_f32(neg_halfb, sqrt_disc);
+    float32x4_t t = vbslq_f32(vcgtq_f32(t0, t_min), t0, t1);
+    hit = vandq_u32(hit, vandq_u32(vcgtq_f32(t, t_min), vcltq_f32(t, t_max)));
+    t_max = vbslq_f32(hit, t, t_max);
+    sphere = vbslq_s32(hit, vdupq_n_s32(s), sphere);
+  }
+  vst1q_f32(packet->t_max, t_max);
+  vst1q_s32(packet->sphere, sphere);
+}
+
+unsigned int packet_aabb_neon(const bvh_node_t *node, const ray_packet_t *packet, unsigned int active, float *t_near) {
+  const float *os[3] = {packet->ox, packet->oy, packet->oz};
+  const float *invs[3] = {packet->inv_x, packet->inv_y, packet->inv_z};
+  float32x4_t t0 = vdupq_n_f32(packet->t_min);
+  float32x4_t t1 = vld1q_f32(packet->t_max);
+  for (int a = 0; a < 3; a++) {
+    float32x4_t o = vld1q_f32(os[a]);
+    float32x4_t inv = vld1q_f32(invs[a]);
+    float32x4_t ta = vmulq_f32(vsubq_f32(vdupq_n_f32(node->min[a]), o), inv);
+    float32x4_t tb = vmulq_f32(vsubq_f32(vdupq_n_f32(node->max[a]), o), inv);
+    t0 = vmaxq_f32(t0, vminq_f32(ta, tb));
+    t1 = vminq_f32(t1, vmaxq_f32(ta, tb));
+  }
+  uint32x4_t hit = vandq_u32(vcleq_f32(t0, t1), packet_active_neon(active));
+  *t_near = vminvq_f32(vbslq_f32(hit, t0, vdupq_n_f32(INFINITY)));
+  return packet_movemask_neon(hit);
+}
+
+#endif // SIMD_HAVE_NEON
+
+#if defined(SIMD_HAVE_X86)
+
+__attribute__((target("sse4.1")))
+__m128 packet_active_sse41(unsigned int active) {
+  __m128i bits = _mm_setr_epi32(1, 2, 4, 8);
+  return _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(active), bits), bits));
+}
+
+__attribute__((target("sse4.1")))
+void packet_closest_spheres_sse41(const sphere_list_t *sphere_list, size_t start, size_t end, ray_packet_t *packet, unsigned int active) {
+  __m128 ox = _mm_load_ps(packet->ox), oy = _mm_load_ps(packet->oy), oz = _mm_load_ps(packet->oz);
+  __m128 dx = _mm_load_ps(packet->dx), dy = _mm_load_ps(packet->dy), dz = _mm_load_ps(packet->dz);
+  __m128 t_max = _mm_load_ps(packet->t_max);
+  __m128 sphere = _mm_castsi128_ps(_mm_load_si128((const __m128i *)packet->sphere));
+  __m128 t_min = _mm_set1_ps(packet->t_min);
+  __m128 lanes = packet_active_sse41(active);
+  __m128 zero = _mm_setzero_ps();
+
+  for (size_t s = start; s < end; s++) {
+    __m128 ac_x = _mm_sub_ps(ox, _mm_set1_ps(sphere_list->xs[s]));
+    __m128 ac_y = _mm_sub_ps(oy, _mm_set1_ps(sphere_list->ys[s]));
+    __m128 ac_z = _mm_sub_ps(oz, _mm_set1_ps(sphere_list->zs[s]));
+    __m128 halfb = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, ac_x), _mm_mul_ps(dy, ac_y)), _mm_mul_ps(dz, ac_z));
+    __m128 c = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ac_x, ac_x), _mm_mul_ps(ac_y, ac_y)), _mm_mul_ps(ac_z, ac_z));
+    c = _mm_sub_ps(c, _mm_set1_ps(sphere_list->r2s[s]));
+    __m128 disc = _mm_sub_ps(_mm_mul_ps(halfb, halfb), c);
+    __m128 hit = _mm_and_ps(_mm_cmpge_ps(disc, zero), lanes);
+    if (_mm_movemask_ps(hit) == 0) {
+      continue;
+    }
+    __m128 sqrt_disc = _mm_sqrt_ps(_mm_max_ps(disc, zero));
+    __m128 neg_halfb = _mm_sub_ps(zero, halfb);
+    __m128 t0 = _mm_sub_ps(neg_halfb, sqrt_disc);
+    __m128 t1 = _mm_add_ps(neg_halfb, sqrt_disc);
+    __m128 t = _mm_blendv_ps(t1, t0, _mm_cmpgt_ps(t0, t_min));
+    hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpgt_ps(t, t_min), _mm_cmplt_ps(t, t_max)));
+    t_max = _mm_blendv_ps(t_max, t, hit);
+    sphere = _mm_blendv_ps(sphere, _mm_castsi128_ps(_mm_set1_epi32(s)), hit);
+  }
+  _mm_store_ps(packet->t_max, t_max);
+  _mm_store_si128((__m128i *)packet->sphere, _mm_castps_si128(sphere));
+}
+
+__attribute__((target("sse4.1")))
+unsigned int packet_aabb_sse41(const bvh_node_t *node, const ray_packet_t *packet, unsigned int active, float *t_near) {
+  const float *os[3] = {packet->ox, packet->oy, packet->oz};
+  const float *invs[3] = {packet->inv_x, packet->inv_y, packet->inv_z};
+  __m128 t0 = _mm_set1_ps(packet->t_min);
+  __m128 t1 = _mm_load_ps(packet->t_max);
+  for (int a = 0; a < 3; a++) {
+    __m128 o = _mm_load_ps(os[a]);
+    __m128 inv = _mm_load_ps(invs[a]);
+    __m128 ta = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node->min[a]), o), inv);
+    __m128 tb = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node->max[a]), o), inv);
+    t0 = _mm_max_ps(t0, _mm_min_ps(ta, tb));
+    t1 = _mm_min_ps(t1, _mm_max_ps(ta, tb));
+  }
+  __m128 hit = _mm_and_ps(_mm_cmple_ps(t0, t1), packet_active_sse41(active));
+  unsigned int mask = _mm_movemask_ps(hit);
+  if (mask) {
+    __m128 near = _mm_blendv_ps(_mm_set1_ps(INFINITY), t0, hit);
+    near = _mm_min_ps(near, _mm_shuffle_ps(near, near, _MM_SHUFFLE(2, 3, 0, 1)));
+    near = _mm_min_ps(near, _mm_shuffle_ps(near, near, _MM_SHUFFLE(1, 0, 3, 2)));
+    *t_near = _mm_cvtss_f32(near);
+  }
+  return mask;
+}
+
+__attribute__((target("avx2,fma")))
+__m256 packet_active_avx2(unsigned int active) {
+  __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  return _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(active), bits), bits));
+}
+
+__attribute__((target("avx2,fma")))
+void packet_closest_spheres_avx2(const sphere_list_t *sphere_list, size_t start, size_t end, ray_packet_t *packet, unsigned int active) {
+  __m256 ox = _mm256_load_ps(packet->ox), oy = _mm256_load_ps(packet->oy), oz = _mm256_load_ps(packet->oz);
+  __m256 dx = _mm256_load_ps(packet->dx), dy = _mm256_load_ps(packet->dy), dz = _mm256_load_ps(packet->dz);
+  __m256 t_max = _mm256_load_ps(packet->t_max);
+  __m256 sphere = _mm256_castsi256_ps(_mm256_load_si256((const __m256i *)packet->sphere));
+  __m256 t_min = _mm256_set1_ps(packet->t_min);
+  __m256 lanes = packet_active_avx2(active);
+  __m256 zero = _mm256_setzero_ps();
+
+  for (size_t s = start; s < end; s++) {
+    __m256 ac_x = _mm256_sub_ps(ox, _mm256_set1_ps(sphere_list->xs[s]));
+    __m256 ac_y = _mm256_sub_ps(oy, _mm256_set1_ps(sphere_list->ys[s]));
+    __m256 ac_z = _mm256_sub_ps(oz, _mm256_set1_ps(sphere_list->zs[s]));
+    __m256 halfb = _mm256_fmadd_ps(dz, ac_z, _mm256_fmadd_ps(dy, ac_y, _mm256_mul_ps(dx, ac_x)));
+    __m256 c = _mm256_fmadd_ps(ac_z, ac_z, _mm256_fmadd_ps(ac_y, ac_y, _mm256_mul_ps(ac_x, ac_x)));
+    c = _mm256_sub_ps(c, _mm256_set1_ps(sphere_list->r2s[s]));
+    __m256 disc = _mm256_fmsub_ps(halfb, halfb, c);
+    __m256 hit = _mm256_and_ps(_mm256_cmp_ps(disc, zero, _CMP_GE_OQ), lanes);
+    if (_mm256_movemask_ps(hit) == 0) {
+      continue;
+    }
+    __m256 sqrt_disc = _mm256_sqrt_ps(_mm256_max_ps(disc, zero));
+    __m256 neg_halfb = _mm256_sub_ps(zero, halfb);
+    __m256 t0 = _mm256_sub_ps(neg_halfb, sqrt_disc);
+    __m256 t1 = _mm256_add_ps(neg_halfb, sqrt_disc);
+    __m256 t = _mm256_blendv_ps(t1, t0, _mm256_cmp_ps(t0, t_min, _CMP_GT_OQ));
+    hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(t, t_min, _CMP_GT_OQ), _mm256_cmp_ps(t, t_max, _CMP_LT_OQ)));
+    t_max = _mm256_blendv_ps(t_max, t, hit);
+    sphere = _mm256_blendv_ps(sphere, _mm256_castsi256_ps(_mm256_set1_epi32(s)), hit);
+  }
+  _mm256_store_ps(packet->t_max, t_max);
+  _mm256_store_si256((__m256i *)packet->sphere, _mm256_castps_si256(sphere));
+}
+
+__attribute__((target("avx2,fma")))
+unsigned int packet_aabb_avx2(const bvh_node_t *node, const ray_packet_t *packet, unsigned int active, float *t_near) {
+  const float *os[3] = {packet->ox, packet->oy, packet->oz};
+  const float *invs[3] = {packet->inv_x, packet->inv_y, packet->inv_z};
+  __m256 t0 = _mm256_set1_ps(packet->t_min);
+  __m256 t1 = _mm256_load_ps(packet->t_max);
+  for (int a = 0; a < 3; a++) {
+    __m256 o = _mm256_load_ps(os[a]);
+    __m256 inv = _mm256_load_ps(invs[a]);
+    __m256 ta = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node->min[a]), o), inv);
+    __m256 tb = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node->max[a]), o), inv);
+    t0 = _mm256_max_ps(t0, _mm256_min_ps(ta, tb));
+    t1 = _mm256_min_ps(t1, _mm256_max_ps(ta, tb));
+  }
+  __m256 hit = _mm256_and_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ), packet_active_avx2(active));
+  unsigned int mask = _mm256_movemask_ps(hit);
+  if (mask) {
+    __m256 near = _mm256_blendv_ps(_mm256_set1_ps(INFINITY), t0, hit);
+    __m128 m = _mm_min_ps(_mm256_castps256_ps128(near), _mm256_extractf128_ps(near, 1));
+    m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+    m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+    *t_near = _mm_cvtss_f32(m);
+  }
+  return mask;
+}
+
+__attribute__((target("avx512f")))
+void packet_closest_spheres_avx512(const sphere_list_t *sphere_list, size_t start, size_t end, ray_packet_t *packet, unsigned int active) {
+  __m512 ox = _mm512_load_ps(packet->ox), oy = _mm512_load_ps(packet->oy), oz = _mm512_load_ps(packet->oz);
+  __m512 dx = _mm512_load_ps(packet->dx), dy = _mm512_load_ps(packet->dy), dz = _mm512_load_ps(packet->dz);
+  __m512 t_max = _mm512_load_ps(packet->t_max);
+  __m512i sphere = _mm512_load_si512(packet->sphere);
+  __m512 t_min = _mm512_set1_ps(packet->t_min);
+  __m512 zero = _mm512_setzero_ps();
+  __mmask16 lanes = active;
+
+  for (size_t s = start; s < end; s++) {
+    __m512 ac_x = _mm512_sub_ps(ox, _mm512_set1_ps(sphere_list->xs[s]));
+    __m512 ac_y = _mm512_sub_ps(oy, _mm512_set1_ps(sphere_list->ys[s]));
+    __m512 ac_z = _mm512_sub_ps(oz, _mm512_set1_ps(sphere_list->zs[s]));
+    __m512 halfb = _mm512_fmadd_ps(dz, ac_z, _mm512_fmadd_ps(dy, ac_y, _mm512_mul_ps(dx, ac_x)));
+    __m512 c = _mm512_fmadd_ps(ac_z, ac_z, _mm512_fmadd_ps(ac_y, ac_y, _mm512_mul_ps(ac_x, ac_x)));
+    c = _mm512_sub_ps(c, _mm512_set1_ps(sphere_list->r2s[s]));
+    __m512 disc = _mm512_fmsub_ps(halfb, halfb, c);
+    __mmask16 hit = _mm512_mask_cmp_ps_mask(lanes, disc, zero, _CMP_GE_OQ);
+    if (hit == 0) {
+      continue;
+    }
+    __m512 sqrt_disc = _mm512_sqrt_ps(_mm512_max_ps(disc, zero));
+    __m512 neg_halfb = _mm512_sub_ps(zero, halfb);
+    __m512 t0 = _mm512_sub_ps(neg_halfb, sqrt_disc);
+    __m512 t1 = _mm512_add_ps(neg_halfb, sqrt_disc);
+    __m512 t = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(t0, t_min, _CMP_GT_OQ), t1, t0);
+    hit = _mm512_mask_cmp_ps_mask(hit, t, t_min, _CMP_GT_OQ);
+    hit = _mm512_mask_cmp_ps_mask(hit, t, t_max, _CMP_LT_OQ);
+    t_max = _mm512_mask_blend_ps(hit, t_max, t);
+    sphere = _mm512_mask_blend_epi32(hit, sphere, _mm512_set1_epi32(s));
+  }
+  _mm512_store_ps(packet->t_max, t_max);
+  _mm512_store_si512(packet->sphere, sphere);
+}
+
+__attribute__((target("avx512f")))
+unsigned int packet_aabb_avx512(const bvh_node_t *node, const ray_packet_t *packet, unsigned int active, float *t_near) {
+  const float *os[3] = {packet->ox, packet->oy, packet->oz};
+  const float *invs[3] = {packet->inv_x, packet->inv_y, packet->inv_z};
+  __m512 t0 = _mm512_set1_ps(packet->t_min);
+  __m512 t1 = _mm512_load_ps(packet->t_max);
+  for (int a = 0; a < 3; a++) {
+    __m512 o = _mm512_load_ps(os[a]);
+    __m512 inv = _mm512_load_ps(invs[a]);
+    __m512 ta = _mm512_mul_ps(_mm512_sub_ps(_mm512_set1_ps(node->min[a]), o), inv);
+    __m512 tb = _mm512_mul_ps(_mm512_sub_ps(_mm512_set1_ps(node->max[a]), o), inv);
+    t0 = _mm512_max_ps(t0, _mm512_min_ps(ta, tb));
+    t1 = _mm512_min_ps(t1, _mm512_max_ps(ta, tb));
+  }
+  __mmask16 hit = _mm512_mask_cmp_ps_mask(active, t0, t1, _CMP_LE_OQ);
+  if (hit) {
+    *t_near = _mm512_mask_reduce_min_ps(hit, t0);
+  }
+  return hit;
+}
+
+#endif // SIMD_HAVE_X86
+
+int packet_width = 4;
+packet_spheres_fn_t packet_closest_spheres = packet_closest_spheres_scalar;
+packet_aabb_fn_t packet_aabb = packet_aabb_scalar;
+
+// called from select_simd_backend() at startup. packets are as wide as the
+// backend's registers; the scalar backend uses 4 lanes.
+void select_packet_backend(simd_backend_t backend) {
+  packet_width = simd_backend_width(backend) >= 4 ? simd_backend_width(backend) : 4;
+  switch (backend) {
+    #if defined(SIMD_HAVE_NEON)
+    case SIMD_NEON:
+      packet_closest_spheres = packet_closest_spheres_neon;
+      packet_aabb = packet_aabb_neon;
+      break;
+    #endif
+    #if defined(SIMD_HAVE_X86)
+    case SIMD_SSE41:
+      packet_closest_spheres = packet_closest_spheres_sse41;
+      packet_aabb = packet_aabb_sse41;
+      break;
+    case SIMD_AVX2:
+      packet_closest_spheres = packet_closest_spheres_avx2;
+      packet_aabb = packet_aabb_avx2;
+      break;
+    case SIMD_AVX512:
+      packet_closest_spheres = packet_closest_spheres_avx512;
+      packet_aabb = packet_aabb_avx512;
+      break;
+    #endif
+    default:
+      packet_closest_spheres = packet_closest_spheres_scalar;
+      packet_aabb = packet_aabb_scalar;
+  }
+}
+
+typedef struct {
+  uint32_t node;
+  unsigned int active;
+  float t_near;
+} packet_stack_entry_t;
+
+// the furthest any lane still cares about
+float packet_t_max(const ray_packet_t *packet) {
+  float t_max_packet = packet->t_min;
+  for (int l = 0; l < packet->width; l++) {
+    t_max_packet = max_float(t_max_packet, packet->t_max[l]);
+  }
+  return t_max_packet;
+}
+
+// the lanes of active that hit node, culling it for the whole packet first
+unsigned int packet_test_node(const ray_packet_t *packet, const bvh_node_t *node, unsigned int active, float t_max_packet, float *t_near) {
+  if (packet_culls_node(packet, node, t_max_packet)) {
+    return 0;
+  }
+  return packet_aabb(node, packet, active, t_near);
+}
+
+// closest hit per lane through the binary BVH, or the whole list if there's
+// no BVH. results end up in packet->t_max and packet->sphere.
+void trace_packet(const bvh_t *bvh, const sphere_list_t *sphere_list, ray_packet_t *packet) {
+  unsigned int all = packet_lane_mask(packet->width);
+  if (bvh == NULL) {
+    STATS_ADD(sphere_tests, sphere_list->nth_sphere * packet->width);
+    packet_closest_spheres(sphere_list, 0, sphere_list->nth_sphere, packet, all);
+    return;
+  }
+  if (bvh->n_prims == 0) {
+    return;
+  }
+
+  // nodes are tested before they're pushed, and pushed with the lanes that
+  // hit them, so a popped node goes straight to its spheres or children
+  packet_stack_entry_t stack[BVH_STACK_SIZE];
+  int sp = 0;
+  float t_root;
+  unsigned int root_active = packet_test_node(packet, &bvh->nodes[0], all, packet_t_max(packet), &t_root);
+  if (root_active != 0) {
+    stack[sp++] = (packet_stack_entry_t){.node = 0, .active = root_active, .t_near = t_root};
+  }
+
+  while (sp > 0) {
+    packet_stack_entry_t entry = stack[--sp];
+    const bvh_node_t *node = &bvh->nodes[entry.node];
+    // lanes may have found closer hits since it was pushed
+    float t_max_packet = packet_t_max(packet);
+    if (entry.t_near > t_max_packet) {
+      continue;
+    }
+    BVH_COUNT_VISIT();
+
+    if (node->count > 0) {
+      STATS_ADD(sphere_tests, node->count * __builtin_popcount(entry.active));
+      packet_closest_spheres(sphere_list, node->left_first, node->left_first + node->count, packet, entry.active);
+      continue;
+    }
+
+    // both children get the lanes that hit this node; near one on top
+    uint32_t left = node->left_first;
+    float t_left, t_right;
+    unsigned int left_active = packet_test_node(packet, &bvh->nodes[left], entry.active, t_max_packet, &t_left);
+    unsigned int right_active = packet_test_node(packet, &bvh->nodes[left + 1], entry.active, t_max_packet, &t_right);
+    packet_stack_entry_t l = {.node = left, .active = left_active, .t_near = t_left};
+    packet_stack_entry_t r = {.node = left + 1, .active = right_active, .t_near = t_right};
+    bool left_first = left_active && (!right_active || t_left <= t_right);
+    if (right_active && left_active) {
+      stack[sp++] = left_first ? r : l;
+      stack[sp++] = left_first ? l : r;
+    } else if (left_active) {
+      stack[sp++] = l;
+    } else if (right_active) {
+      stack[sp++] = r;
+    }
+  }
+}
+
+#endif // !PACKET_H
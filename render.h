@@ -0,0 +1,419 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "camera.h"
+#include "checkpoint.h"
+#include "color.h"
+#include "denoise.h"
+#include "image.h"
+#include "scene.h"
+#include "stats.h"
+#include "threadpool.h"
+#include "vec3.h"
+#include "wavefront.h"
+
+// the image is cut into TILE_SIZE x TILE_SIZE tiles, each one a task for the
+// thread pool. small enough that there are plenty to steal when one region
+// (say, the glass spheres) is much more expensive than the rest.
+#define TILE_SIZE 16
+
+typedef struct render_args_t {
+  const camera_t *camera;
+  const scene_t *scene;
+  // the part of the image being rendered, x1 and y1 exclusive. film covers
+  // just that, so a distributed worker only holds its own piece.
+  int x0;
+  int y0;
+  int x1;
+  int y1;
+  int tiles_x;
+  int tiles_y;
+  // one TILE_SIZE x TILE_SIZE scratch tile per worker, each on its own
+  // cache lines, for the wavefront engine's sums
+  color_t **tile_buffers;
+  // running sums of every pixel of the region, row major
+  pixel_stats_t *film;
+  // how many samples a pixel may have by the end of this pass
+  int limit;
+  // one per worker when camera->wavefront is set
+  wavefront_t **wavefronts;
+  // the render variant the megakernel takes its samples with, picked once
+  // for the render by select_render_variant
+  sample_pixel_fn_t sample_pixel;
+  // tiles finished this pass, read by the progress reporter
+  atomic_int tiles_done;
+  // one per worker, each worker's counters folded in after every tile
+  render_stats_t *thread_stats;
+} render_args_t;
+
+void render_tile(void *args, int tile, int thread_id) {
+  render_args_t *rargs = (render_args_t *)args;
+  const camera_t *camera = rargs->camera;
+
+  int x0 = rargs->x0 + (tile % rargs->tiles_x) * TILE_SIZE;
+  int y0 = rargs->y0 + (tile / rargs->tiles_x) * TILE_SIZE;
+  int x1 = x0 + TILE_SIZE < rargs->x1 ? x0 + TILE_SIZE : rargs->x1;
+  int y1 = y0 + TILE_SIZE < rargs->y1 ? y0 + TILE_SIZE : rargs->y1;
+  int w = x1 - x0;
+  int stride = rargs->x1 - rargs->x0;
+  pixel_stats_t *film = rargs->film + (y0 - rargs->y0) * stride - rargs->x0;
+  #ifdef RENDER_STATS
+  double start = now_seconds();
+  #endif
+
+  // the wavefront engine deals out a fixed number of samples per pixel, so
+  // adaptive sampling always goes through sample_pixel_adaptive. without it
+  // every pixel of the tile has had the same number of samples so far.
+  if (camera->wavefront && camera->adaptive_threshold <= 0) {
+    color_t *buffer = rargs->tile_buffers[thread_id];
+    int first = film[x0].n;
+    int samples = rargs->limit - first;
+    if (samples > 0) {
+      wavefront_render_tile(rargs->wavefronts[thread_id], camera, rargs->scene, x0, y0, x1, y1, first, samples, buffer);
+      for (int j = y0; j < y1; j++) {
+        for (int i = x0; i < x1; i++) {
+          pixel_stats_t *stats = &film[(j - y0) * stride + i];
+          add_equals(&stats->sum, buffer[(j - y0) * w + (i - x0)]);
+          stats->n += samples;
+        }
+      }
+    }
+  } else {
+    for (int j = y0; j < y1; j++) {
+      for (int i = x0; i < x1; i++) {
+        // work on a copy so neighbouring tiles' workers don't fight over
+        // the cache lines where the tiles meet
+        pixel_stats_t stats = film[(j - y0) * stride + i];
+        sample_pixel_adaptive(camera, rargs->scene, rargs->sample_pixel, i, j, rargs->limit, &stats);
+        film[(j - y0) * stride + i] = stats;
+      }
+    }
+  }
+
+  #ifdef RENDER_STATS
+  double seconds = now_seconds() - start;
+  g_stats.tiles++;
+  g_stats.tile_seconds += seconds;
+  g_stats.max_tile_seconds = seconds > g_stats.max_tile_seconds ? seconds : g_stats.max_tile_seconds;
+  merge_render_stats(&rargs->thread_stats[thread_id], &g_stats);
+  memset(&g_stats, 0, sizeof(g_stats));
+  #endif
+
+  atomic_fetch_add_explicit(&rargs->tiles_done, 1, memory_order_relaxed);
+}
+
+// progress of a single pass render. one thread polls the count of finished
+// tiles and prints every 10%, so the workers never wait on stdout.
+typedef struct {
+  atomic_int *tiles_done;
+  int n_tiles;
+  atomic_bool finished;
+} progress_reporter_t;
+
+#define PROGRESS_POLL_US 20000
+
+void *report_progress(void *args) {
+  progress_reporter_t *reporter = (progress_reporter_t *)args;
+  int reported = 0;
+  for (;;) {
+    bool finished = atomic_load_explicit(&reporter->finished, memory_order_acquire);
+    int done = atomic_load_explicit(reporter->tiles_done, memory_order_relaxed);
+    if (done * 10 / reporter->n_tiles > reported) {
+      reported = done * 10 / reporter->n_tiles;
+      printf("%d/%d tiles done\n", done, reporter->n_tiles);
+    }
+    if (finished) {
+      return NULL;
+    }
+    usleep(PROGRESS_POLL_US);
+  }
+}
+
+// sets args up to render the region (x0, y0) to (x1, y1) of camera's image
+// into film on n_threads workers
+void init_render_args(render_args_t *args, const camera_t *camera, const scene_t *scene, int n_threads, int x0, int y0, int x1, int y1, pixel_stats_t *film) {
+  *args = (render_args_t){
+    .camera = camera,
+    .scene = scene,
+    .x0 = x0,
+    .y0 = y0,
+    .x1 = x1,
+    .y1 = y1,
+    .tiles_x = (x1 - x0 + TILE_SIZE - 1) / TILE_SIZE,
+    .tiles_y = (y1 - y0 + TILE_SIZE - 1) / TILE_SIZE,
+    .film = film,
+    .wavefronts = NULL,
+    .sample_pixel = select_render_variant(camera, scene)->sample_pixel,
+    .thread_stats = aligned_alloc(64, n_threads * sizeof(render_stats_t))
+  };
+  memset(args->thread_stats, 0, n_threads * sizeof(render_stats_t));
+  args->tile_buffers = malloc(n_threads * sizeof(color_t *));
+  size_t tile_bytes = (TILE_SIZE * TILE_SIZE * sizeof(color_t) + 63) & ~(size_t)63;
+  for (int k = 0; k < n_threads; k++) {
+    args->tile_buffers[k] = aligned_alloc(64, tile_bytes);
+  }
+  if (camera->wavefront) {
+    args->wavefronts = malloc(n_threads * sizeof(wavefront_t *));
+    for (int k = 0; k < n_threads; k++) {
+      args->wavefronts[k] = new_wavefront();
+    }
+  }
+}
+
+// frees what init_render_args allocated, copying the workers' statistics to
+// thread_stats first if it isn't NULL. the film is the caller's.
+void free_render_args(render_args_t *args, int n_threads, render_stats_t *thread_stats) {
+  for (int k = 0; k < n_threads; k++) {
+    free(args->tile_buffers[k]);
+    if (args->wavefronts != NULL) {
+      free_wavefront(args->wavefronts[k]);
+    }
+  }
+  if (thread_stats != NULL) {
+    memcpy(thread_stats, args->thread_stats, n_threads * sizeof(render_stats_t));
+  }
+  free(args->thread_stats);
+  free(args->wavefronts);
+  free(args->tile_buffers);
+}
+
+// renders every sample of the region (x0, y0) to (x1, y1) into film, its
+// (x1 - x0) * (y1 - y0) running sums, in one pass with no progress reports
+// or checkpoints. thread_stats as for render_to_buffer.
+void render_region(const camera_t *camera, const scene_t *scene, thread_pool_t *pool, int x0, int y0, int x1, int y1,
+                   pixel_stats_t *film, render_stats_t *thread_stats) {
+  render_args_t render_args;
+  init_render_args(&render_args, camera, scene, pool->n_threads, x0, y0, x1, y1, film);
+  render_args.limit = camera->samples_per_pixel;
+  atomic_init(&render_args.tiles_done, 0);
+  thread_pool_run(pool, render_args.tiles_x * render_args.tiles_y, render_tile, &render_args);
+  free_render_args(&render_args, pool->n_threads, thread_stats);
+}
+
+// renders the whole image into pixels (image_width * image_height, row major).
+// sample_counts, if not NULL, gets how many samples each pixel took.
+// thread_stats, if not NULL, gets each of the pool's workers' statistics
+// (all zero unless built with RENDER_STATS).
+//
+// the image is rendered in passes of camera->pass_samples samples per pixel
+// (one pass if that's 0), each pass a job for the pool. between passes the
+// running sums are handed to the checkpoint writer, which writes them out
+// while the workers get on with the next pass.
+void render_to_buffer(const camera_t *camera, const scene_t *scene, thread_pool_t *pool, color_t *pixels, int *sample_counts, render_stats_t *thread_stats) {
+  int n_pixels = camera->image_width * camera->image_height;
+  render_args_t render_args;
+  init_render_args(&render_args, camera, scene, pool->n_threads, 0, 0, camera->image_width, camera->image_height,
+                   calloc(n_pixels, sizeof(pixel_stats_t)));
+
+  int pass_samples = camera->pass_samples > 0 ? camera->pass_samples : camera->samples_per_pixel;
+  int first_pass = 0;
+  uint64_t fingerprint = camera->checkpoint_path != NULL ? checkpoint_fingerprint(camera, scene) : 0;
+  if (camera->resume && camera->checkpoint_path != NULL) {
+    first_pass = load_checkpoint(camera->checkpoint_path, camera, fingerprint, render_args.film, &pass_samples);
+    if (first_pass < 0) {
+      printf("no usable checkpoint at %s, starting from scratch\n", camera->checkpoint_path);
+      memset(render_args.film, 0, n_pixels * sizeof(pixel_stats_t));
+      pass_samples = camera->pass_samples > 0 ? camera->pass_samples : camera->samples_per_pixel;
+      first_pass = 0;
+    } else {
+      printf("resuming from %s after pass %d\n", camera->checkpoint_path, first_pass);
+    }
+  }
+  int n_passes = (camera->samples_per_pixel + pass_samples - 1) / pass_samples;
+  checkpoint_writer_t *writer = NULL;
+  if (camera->checkpoint_path != NULL && camera->pass_samples > 0) {
+    writer = new_checkpoint_writer(camera->checkpoint_path, n_pixels);
+  }
+
+  for (int pass = first_pass; pass < n_passes; pass++) {
+    render_args.limit = (pass + 1) * pass_samples;
+    atomic_init(&render_args.tiles_done, 0);
+    double start = now_seconds();
+    // progress within a pass, passes report for themselves
+    progress_reporter_t reporter = {.tiles_done = &render_args.tiles_done, .n_tiles = render_args.tiles_x * render_args.tiles_y};
+    atomic_init(&reporter.finished, false);
+    pthread_t reporter_thread;
+    bool reporting = camera->pass_samples <= 0 && pthread_create(&reporter_thread, NULL, report_progress, &reporter) == 0;
+    thread_pool_run(pool, render_args.tiles_x * render_args.tiles_y, render_tile, &render_args);
+    if (reporting) {
+      atomic_store_explicit(&reporter.finished, true, memory_order_release);
+      pthread_join(reporter_thread, NULL);
+    }
+    if (n_passes > 1) {
+      printf("pass %d/%d: up to %d samples per pixel, %.2fs\n", pass + 1, n_passes,
+             render_args.limit < camera->samples_per_pixel ? render_args.limit : camera->samples_per_pixel,
+             now_seconds() - start);
+    }
+    if (writer != NULL) {
+      // the last one has to make it to disk, the others can be skipped if
+      // the previous write hasn't finished
+      checkpoint_header_t header = new_checkpoint_header(camera, fingerprint, pass_samples, pass + 1);
+      checkpoint_submit(writer, &header, render_args.film, pass == n_passes - 1);
+    }
+  }
+  if (writer != NULL) {
+    free_checkpoint_writer(writer);
+  }
+
+  for (int p = 0; p < n_pixels; p++) {
+    pixels[p] = pixel_color(&render_args.film[p]);
+    if (sample_counts != NULL) {
+      sample_counts[p] = render_args.film[p].n;
+    }
+  }
+
+  free_render_args(&render_args, pool->n_threads, thread_stats);
+  free(render_args.film);
+}
+
+typedef struct {
+  const camera_t *camera;
+  const scene_t *scene;
+  aov_buffers_t *aovs;
+} aov_args_t;
+
+// one row of guide buffers per task
+void render_aov_row(void *args, int task, int thread_id) {
+  aov_args_t *aargs = (aov_args_t *)args;
+  const camera_t *camera = aargs->camera;
+  for (int i = 0; i < camera->image_width; i++) {
+    size_t p = (size_t)task * camera->image_width + i;
+    pixel_aovs(camera, aargs->scene, i, task, &aargs->aovs->albedo[p], &aargs->aovs->normal[p], &aargs->aovs->depth[p]);
+  }
+  #ifdef RENDER_STATS
+  // the guide rays aren't part of the render
+  memset(&g_stats, 0, sizeof(g_stats));
+  #endif
+}
+
+// traces the denoiser's guide buffers for the whole image, see pixel_aovs
+aov_buffers_t *render_aovs(const camera_t *camera, const scene_t *scene, thread_pool_t *pool) {
+  aov_args_t args = {
+    .camera = camera,
+    .scene = scene,
+    .aovs = new_aov_buffers(camera->image_width, camera->image_height)
+  };
+  thread_pool_run(pool, camera->image_height, render_aov_row, &args);
+  return args.aovs;
+}
+
+// writes the guide buffers as PFMs: prefix + albedo.pfm, normal.pfm (the
+// raw vectors, -1 to 1) and depth.pfm (grey)
+bool write_aovs(const char *prefix, const aov_buffers_t *aovs, thread_pool_t *pool) {
+  size_t n = (size_t)aovs->width * aovs->height;
+  char path[1024];
+  snprintf(path, sizeof(path), "%salbedo.pfm", prefix);
+  bool ok = write_image(path, IMAGE_PFM, aovs->albedo, aovs->width, aovs->height, pool);
+  snprintf(path, sizeof(path), "%snormal.pfm", prefix);
+  ok = ok && write_image(path, IMAGE_PFM, aovs->normal, aovs->width, aovs->height, pool);
+  color_t *depth = malloc(n * sizeof(color_t));
+  for (size_t p = 0; p < n; p++) {
+    depth[p] = new_vec3(aovs->depth[p], aovs->depth[p], aovs->depth[p]);
+  }
+  snprintf(path, sizeof(path), "%sdepth.pfm", prefix);
+  ok = ok && write_image(path, IMAGE_PFM, depth, aovs->width, aovs->height, pool);
+  free(depth);
+  return ok;
+}
+
+// the per-pixel sample counts as a P2 greymap, white being samples_per_pixel.
+// false if the file couldn't be written.
+bool write_sample_counts(const char *path, const int *sample_counts, int width, int height, int max_samples) {
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) {
+    return false;
+  }
+  fprintf(fp, "P2\n%d %d\n255\n", width, height);
+  for (int p = 0; p < width * height; p++) {
+    fprintf(fp, "%d\n", (int)(255.0 * sample_counts[p] / max_samples));
+  }
+  bool ok = !ferror(fp);
+  return fclose(fp) == 0 && ok;
+}
+
+// everything render() does once the image has been rendered into pixels in
+// render_seconds: reports the statistics of the n_stats workers in
+// thread_stats, denoises, writes the image and sums up adaptive sampling.
+// frees pixels and sample_counts.
+void finish_render(const camera_t *camera, const scene_t *scene, thread_pool_t *pool, color_t *pixels, int *sample_counts,
+                   const render_stats_t *thread_stats, int n_stats, double render_seconds) {
+  int n_pixels = camera->image_height * camera->image_width;
+  printf("rendered in %.2fs\n", render_seconds);
+  #ifdef RENDER_STATS
+  render_stats_t total = {0};
+  for (int k = 0; k < n_stats; k++) {
+    merge_render_stats(&total, &thread_stats[k]);
+  }
+  print_render_stats(&total, thread_stats, n_stats, render_seconds);
+  if (camera->stats_path != NULL) {
+    if (write_render_stats_json(camera->stats_path, &total, thread_stats, n_stats, render_seconds)) {
+      printf("wrote %s\n", camera->stats_path);
+    } else {
+      printf("couldn't write %s\n", camera->stats_path);
+    }
+  }
+  #endif
+
+  if (camera->denoise || camera->aov_prefix != NULL) {
+    double aov_start = now_seconds();
+    aov_buffers_t *aovs = render_aovs(camera, scene, pool);
+    printf("guide buffers in %.3fs\n", now_seconds() - aov_start);
+    if (camera->aov_prefix != NULL) {
+      if (write_aovs(camera->aov_prefix, aovs, pool)) {
+        printf("wrote %salbedo.pfm, %snormal.pfm and %sdepth.pfm\n", camera->aov_prefix, camera->aov_prefix, camera->aov_prefix);
+      } else {
+        printf("couldn't write the guide buffers to %s*.pfm\n", camera->aov_prefix);
+      }
+    }
+    if (camera->denoise) {
+      double denoise_start = now_seconds();
+      denoise(pixels, aovs, pool);
+      printf("denoised in %.3fs\n", now_seconds() - denoise_start);
+    }
+    free_aov_buffers(aovs);
+  }
+
+  double start = now_seconds();
+  if (!write_image(camera->output_path, camera->output_format, pixels, camera->image_width, camera->image_height, pool)) {
+    printf("couldn't write %s\n", camera->output_path);
+  }
+  printf("wrote %s (%s) in %.3fs\n", camera->output_path, image_format_name(camera->output_format), now_seconds() - start);
+  free(pixels);
+
+  if (sample_counts != NULL) {
+    long total = 0;
+    for (int p = 0; p < n_pixels; p++) {
+      total += sample_counts[p];
+    }
+    double uniform = (double)n_pixels * camera->samples_per_pixel;
+    printf("adaptive: %.1f samples per pixel on average, %.2fx fewer than %d everywhere\n",
+           (double)total / n_pixels, uniform / total, camera->samples_per_pixel);
+    if (camera->samples_path != NULL
+        && !write_sample_counts(camera->samples_path, sample_counts, camera->image_width, camera->image_height, camera->samples_per_pixel)) {
+      printf("couldn't write %s\n", camera->samples_path);
+    }
+    free(sample_counts);
+  }
+
+  printf("Done\n");
+}
+
+void render(camera_t *camera, const scene_t *scene, thread_pool_t *pool) {
+  int n_pixels = camera->image_height * camera->image_width;
+  color_t *pixels = (color_t *)malloc(sizeof(color_t) * n_pixels);
+  int *sample_counts = camera->adaptive_threshold > 0 ? malloc(n_pixels * sizeof(int)) : NULL;
+
+  render_stats_t *thread_stats = aligned_alloc(64, pool->n_threads * sizeof(render_stats_t));
+  double render_start = now_seconds();
+  render_to_buffer(camera, scene, pool, pixels, sample_counts, thread_stats);
+  finish_render(camera, scene, pool, pixels, sample_counts, thread_stats, pool->n_threads, now_seconds() - render_start);
+  free(thread_stats);
+}
+
+#endif // !RENDER_H
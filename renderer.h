@@ -0,0 +1,85 @@
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "camera.h"
+#include "color.h"
+#include "denoise.h"
+#include "render.h"
+#include "scene.h"
+#include "threadpool.h"
+
+// The renderer as a library, for programs that render many small images in
+// one long-lived process. A render context holds what outlives a single
+// render: the thread pool and the film. Scenes are built the usual way from
+// a sphere and material list, made with new_sphere_list_in and
+// new_material_list_in so that they, the lights and the BVH all come from
+// one arena, and arena_reset throws the whole scene away at once:
+//
+//   render_context_t *context = new_render_context(0);
+//   arena_t *arena = new_arena(0);
+//   sphere_list_t *spheres = new_sphere_list_in(arena, n);
+//   material_list_t *materials = new_material_list_in(arena, n);
+//   ... add_sphere / add_material ...
+//   scene_t scene = new_scene(spheres, materials);
+//   render_image(context, &camera, &scene, pixels);
+//   arena_reset(arena);
+//   ...
+//   free_arena(arena);
+//   free_render_context(context);
+//
+// Renders keep all their state in the context, the scene and the pool's
+// thread-local counters, so any number of contexts can render at once from
+// different threads. The SIMD backend is the exception: it's process wide,
+// picked with select_simd_backend before the first context is made.
+//
+// Like the rest of the renderer this is all in headers, so include it in
+// one translation unit of the program.
+
+typedef struct {
+  thread_pool_t *pool;
+  // running sums for the last image, kept to be reused by the next one
+  pixel_stats_t *film;
+  size_t film_pixels;
+} render_context_t;
+
+// n_threads workers, one per core if 0
+render_context_t *new_render_context(int n_threads) {
+  render_context_t *context = malloc(sizeof(render_context_t));
+  *context = (render_context_t){.pool = new_thread_pool(n_threads), .film = NULL, .film_pixels = 0};
+  return context;
+}
+
+void free_render_context(render_context_t *context) {
+  free_thread_pool(context->pool);
+  free(context->film);
+  free(context);
+}
+
+// renders camera's view of scene into pixels (image_width * image_height,
+// row major), denoised if camera->denoise is set. prints nothing and writes
+// no files: output_path, aov_prefix, stats_path, samples_path and the
+// progressive and checkpoint settings are ignored.
+void render_image(render_context_t *context, const camera_t *camera, const scene_t *scene, color_t *pixels) {
+  size_t n_pixels = (size_t)camera->image_width * camera->image_height;
+  if (n_pixels > context->film_pixels) {
+    free(context->film);
+    context->film = malloc(n_pixels * sizeof(pixel_stats_t));
+    context->film_pixels = n_pixels;
+  }
+  memset(context->film, 0, n_pixels * sizeof(pixel_stats_t));
+  render_region(camera, scene, context->pool, 0, 0, camera->image_width, camera->image_height, context->film, NULL);
+  for (size_t p = 0; p < n_pixels; p++) {
+    pixels[p] = pixel_color(&context->film[p]);
+  }
+  if (camera->denoise) {
+    aov_buffers_t *aovs = render_aovs(camera, scene, context->pool);
+    denoise(pixels, aovs, context->pool);
+    free_aov_buffers(aovs);
+  }
+}
+
+#endif // !RENDERER_H
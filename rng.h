@@ -0,0 +1,117 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+#include "rtweekend.h"
+#include "simd.h"
+
+// Batched counter-based random numbers: out[i] = rng_uniform(streams[i],
+// dimension) for n streams at once, 4, 8 or 16 lanes at a time. For the
+// packet and wavefront paths, where every lane or queue slot is a different
+// sample with a stream of its own. Bit for bit the same as the scalar
+// rng_uniform in rtweekend.h.
+
+void rng_uniform_fill_scalar(const uint32_t *streams, uint32_t dimension, float *out, int n) {
+  for (int i = 0; i < n; i++) {
+    out[i] = rng_uniform(streams[i], dimension);
+  }
+}
+
+#if defined(SIMD_HAVE_NEON)
+
+void rng_uniform_fill_neon(const uint32_t *streams, uint32_t dimension, float *out, int n) {
+  uint32x4_t offset = vdupq_n_u32(dimension * 0x9e3779b9u);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    uint32x4_t x = vaddq_u32(vld1q_u32(streams + i), offset);
+    x = veorq_u32(x, vshrq_n_u32(x, 16));
+    x = vmulq_u32(x, vdupq_n_u32(0x7feb352du));
+    x = veorq_u32(x, vshrq_n_u32(x, 15));
+    x = vmulq_u32(x, vdupq_n_u32(0x846ca68bu));
+    x = veorq_u32(x, vshrq_n_u32(x, 16));
+    vst1q_f32(out + i, vmulq_n_f32(vcvtq_f32_u32(vshrq_n_u32(x, 8)), 0x1p-24f));
+  }
+  rng_uniform_fill_scalar(streams + i, dimension, out + i, n - i);
+}
+
+#endif // SIMD_HAVE_NEON
+
+#if defined(SIMD_HAVE_X86)
+
+__attribute__((target("sse4.1")))
+void rng_uniform_fill_sse41(const uint32_t *streams, uint32_t dimension, float *out, int n) {
+  __m128i offset = _mm_set1_epi32(dimension * 0x9e3779b9u);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i x = _mm_add_epi32(_mm_loadu_si128((const __m128i *)(streams + i)), offset);
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+    x = _mm_mullo_epi32(x, _mm_set1_epi32(0x7feb352d));
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 15));
+    x = _mm_mullo_epi32(x, _mm_set1_epi32(0x846ca68b));
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+    _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(x, 8)), _mm_set1_ps(0x1p-24f)));
+  }
+  rng_uniform_fill_scalar(streams + i, dimension, out + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+void rng_uniform_fill_avx2(const uint32_t *streams, uint32_t dimension, float *out, int n) {
+  __m256i offset = _mm256_set1_epi32(dimension * 0x9e3779b9u);
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i x = _mm256_add_epi32(_mm256_loadu_si256((const __m256i *)(streams + i)), offset);
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+    x = _mm256_mullo_epi32(x, _mm256_set1_epi32(0x7feb352d));
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 15));
+    x = _mm256_mullo_epi32(x, _mm256_set1_epi32(0x846ca68b));
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+    _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(x, 8)), _mm256_set1_ps(0x1p-24f)));
+  }
+  rng_uniform_fill_scalar(streams + i, dimension, out + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+void rng_uniform_fill_avx512(const uint32_t *streams, uint32_t dimension, float *out, int n) {
+  __m512i offset = _mm512_set1_epi32(dimension * 0x9e3779b9u);
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512i x = _mm512_add_epi32(_mm512_loadu_si512(streams + i), offset);
+    x = _mm512_xor_si512(x, _mm512_srli_epi32(x, 16));
+    x = _mm512_mullo_epi32(x, _mm512_set1_epi32(0x7feb352d));
+    x = _mm512_xor_si512(x, _mm512_srli_epi32(x, 15));
+    x = _mm512_mullo_epi32(x, _mm512_set1_epi32(0x846ca68b));
+    x = _mm512_xor_si512(x, _mm512_srli_epi32(x, 16));
+    _mm512_storeu_ps(out + i, _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_srli_epi32(x, 8)), _mm512_set1_ps(0x1p-24f)));
+  }
+  rng_uniform_fill_scalar(streams + i, dimension, out + i, n - i);
+}
+
+#endif // SIMD_HAVE_X86
+
+void (*rng_uniform_fill)(const uint32_t *streams, uint32_t dimension, float *out, int n) = rng_uniform_fill_scalar;
+
+void select_rng_backend(simd_backend_t backend) {
+  switch (backend) {
+    #if defined(SIMD_HAVE_NEON)
+    case SIMD_NEON:
+      rng_uniform_fill = rng_uniform_fill_neon;
+      break;
+    #endif
+    #if defined(SIMD_HAVE_X86)
+    case SIMD_SSE41:
+      rng_uniform_fill = rng_uniform_fill_sse41;
+      break;
+    case SIMD_AVX2:
+      rng_uniform_fill = rng_uniform_fill_avx2;
+      break;
+    case SIMD_AVX512:
+      rng_uniform_fill = rng_uniform_fill_avx512;
+      break;
+    #endif
+    default:
+      rng_uniform_fill = rng_uniform_fill_scalar;
+  }
+}
+
+#endif // !RNG_H
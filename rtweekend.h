@@ -1,12 +1,15 @@
 #ifndef RTWEEKEND_H
 #define RTWEEKEND_H
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <math.h>
+#include <time.h>
 
-// choose a PRNG. if neither defined, uses stdlib rand()
+// choose a PRNG. if none defined, uses stdlib rand()
 //#define TWISTER // Mersenne Twister from Jacob Vosmaer
-#define LCG // Linear Congruential Generator from stackoverflow
+//#define LCG // Linear Congruential Generator from stackoverflow
+#define COUNTER // counter-based, keyed by pixel/sample/bounce, see below
 
 #if defined(TWISTER)
 #include "mt19937.h"
@@ -18,15 +21,89 @@ float degrees_to_radians(float degrees) {
   return degrees * pi / 180.0;
 }
 
+// wall clock seconds, for timing builds and renders
+double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// fminf/fmaxf have to handle NaNs, so without -ffast-math gcc turns them into
+// library calls. these compile to a single minss/maxss (or fmin/fmax on arm).
+float min_float(float a, float b) {
+  return a < b ? a : b;
+}
+
+float max_float(float a, float b) {
+  return a > b ? a : b;
+}
+
+// Counter-based random numbers: instead of stepping a generator, every
+// number is a hash of where it's used. a path's numbers are keyed by its
+// pixel, which of the pixel's samples it is, which bounce and which number
+// drawn at that bounce (the dimension). the image then doesn't depend on how
+// pixels are split between threads or what order they run in, and any
+// sample can be replayed on its own.
+//
+// the hash is lowbias32 from Chris Wellons' hash-prospector, a bijective
+// xorshift-multiply mix that only needs 32 bit shifts, xors and multiplies,
+// so rng.h can run it over 4, 8 or 16 streams at once.
+
+uint32_t rng_hash(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352du;
+  x ^= x >> 15;
+  x *= 0x846ca68bu;
+  x ^= x >> 16;
+  return x;
+}
+
+// identifies sample of pixel (a row major index over the image)
+uint32_t rng_sample_key(uint32_t pixel, uint32_t sample) {
+  return rng_hash(rng_hash(pixel ^ 0x9e3779b9u) ^ sample);
+}
+
+// one bounce of a sample's path: 0 for the camera ray, n for the nth scatter
+uint32_t rng_bounce_stream(uint32_t key, uint32_t bounce) {
+  return rng_hash(key ^ (bounce * 0x85ebca6bu));
+}
+
+// the dimension'th number of a stream, in [0, 1) with 24 bits
+float rng_uniform(uint32_t stream, uint32_t dimension) {
+  return (rng_hash(stream + dimension * 0x9e3779b9u) >> 8) * 0x1p-24f;
+}
+
+// where random_float() is drawing from on this thread
+typedef struct {
+  uint32_t key;
+  uint32_t stream;
+  uint32_t dimension;
+} rng_state_t;
+
+__thread rng_state_t g_rng;
+
+void rng_begin_sample(uint32_t pixel, uint32_t sample) {
+  g_rng.key = rng_sample_key(pixel, sample);
+  g_rng.stream = rng_bounce_stream(g_rng.key, 0);
+  g_rng.dimension = 0;
+}
+
+void rng_begin_bounce(uint32_t bounce) {
+  g_rng.stream = rng_bounce_stream(g_rng.key, bounce);
+  g_rng.dimension = 0;
+}
+
 // https://stackoverflow.com/questions/26237419/faster-than-rand/26237777#26237777
 
 __thread unsigned int g_seed;
 
 float MAX_RAND = 0x7FFF+1;
 
-// Used to seed the generator.
+// Used to seed the generator. for COUNTER that's a stream of its own, for
+// drawing outside of a render (building scenes, tests).
 void fast_srand(int seed) {
     g_seed = seed;
+    rng_begin_sample(seed, 0xffffffffu);
 }
 
 // Compute a pseudorandom integer.
@@ -48,6 +125,16 @@ float random_float_range(float min, float max) {
   return min + (max - min) * (float)random_float();
 }
 
+#elif defined(COUNTER)
+
+float random_float() {
+  return rng_uniform(g_rng.stream, g_rng.dimension++);
+}
+
+float random_float_range(float min, float max) {
+  return min + (max - min) * random_float();
+}
+
 #elif defined(LCG)
 
 float random_float() {
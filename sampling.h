@@ -0,0 +1,102 @@
+#ifndef SAMPLING_H
+#define SAMPLING_H
+
+#include <math.h>
+#include <stdbool.h>
+
+#include "rtweekend.h"
+
+// Direct mappings from two uniform numbers in [0, 1) to points on the unit
+// sphere, in the unit disk and on the cosine weighted hemisphere. Unlike
+// rejection sampling they take exactly two numbers and no loop, so every
+// bounce costs the same and the rng dimensions line up across engines.
+//
+// Each comes as a per-point function on plain floats and a batched version
+// over SoA arrays. The batched loops are the per-point functions inlined,
+// branch-free, for the auto-vectorizer (like the wavefront kernels), and
+// give the same bits as calling the per-point function n times. sin and cos
+// are polynomials rather than libm calls for the same reason.
+
+// sine and cosine of x in [-pi, pi], to within a few ulps. x is folded into
+// [-pi/2, pi/2], where Taylor series to x^13 and x^12 are plenty.
+void sincos_pi(float x, float *s, float *c) {
+  const float half_pi = 1.57079632679f;
+  bool high = x > half_pi;
+  bool low = x < -half_pi;
+  float folded = high ? 2*half_pi - x : (low ? -2*half_pi - x : x);
+  float sign = (high | low) ? -1.0f : 1.0f;
+  float x2 = folded * folded;
+  *s = folded * (1.0f + x2*(-1.0f/6 + x2*(1.0f/120 + x2*(-1.0f/5040 + x2*(1.0f/362880 + x2*(-1.0f/39916800 + x2*(1.0f/6227020800)))))));
+  *c = sign * (1.0f + x2*(-1.0f/2 + x2*(1.0f/24 + x2*(-1.0f/720 + x2*(1.0f/40320 + x2*(-1.0f/3628800 + x2*(1.0f/479001600)))))));
+}
+
+// uniform on the unit sphere: z uniform in [-1, 1], angle uniform around it
+void uniform_sphere_point(float u, float v, float *x, float *y, float *z) {
+  float cos_theta = 1.0f - 2.0f*u;
+  float sin_theta = sqrtf(max_float(0.0f, 1.0f - cos_theta*cos_theta));
+  float s, c;
+  // phi = 2 pi v - pi, which just turns the circle half way round
+  sincos_pi(2*pi*v - pi, &s, &c);
+  *x = sin_theta * c;
+  *y = sin_theta * s;
+  *z = cos_theta;
+}
+
+// Shirley and Chiu's concentric map of the square onto the unit disk, which
+// keeps neighbouring samples neighbours (handy with stratified jitter)
+void concentric_disk_point(float u, float v, float *x, float *y) {
+  float a = 2.0f*u - 1.0f;
+  float b = 2.0f*v - 1.0f;
+  bool wide = fabsf(a) > fabsf(b);
+  float r = wide ? a : b;
+  float ratio = r != 0 ? (wide ? b : a) / r : 0.0f;
+  float theta = wide ? (pi/4) * ratio : pi/2 - (pi/4) * ratio;
+  float s, c;
+  sincos_pi(theta, &s, &c);
+  *x = r * c;
+  *y = r * s;
+}
+
+// cosine weighted about +z (Malley's method: the disk lifted onto the
+// hemisphere)
+void cosine_hemisphere_point(float u, float v, float *x, float *y, float *z) {
+  concentric_disk_point(u, v, x, y);
+  *z = sqrtf(max_float(0.0f, 1.0f - *x * *x - *y * *y));
+}
+
+// (lx, ly, lz) in a frame whose z axis is the unit vector n, in world space.
+// the basis is Duff et al.'s branchless one.
+void frame_to_world(float nx, float ny, float nz, float lx, float ly, float lz, float *x, float *y, float *z) {
+  float sign = copysignf(1.0f, nz);
+  float a = -1.0f / (sign + nz);
+  float b = nx * ny * a;
+  *x = (1.0f + sign*nx*nx*a)*lx + b*ly + nx*lz;
+  *y = sign*b*lx + (sign + ny*ny*a)*ly + ny*lz;
+  *z = -sign*nx*lx - ny*ly + nz*lz;
+}
+
+// the batched versions: n points from u[i], v[i]. the outputs may be the
+// input arrays, point i only reads u[i] and v[i].
+
+void uniform_sphere_points(const float *u, const float *v, float *x, float *y, float *z, int n) {
+  #pragma GCC ivdep
+  for (int i = 0; i < n; i++) {
+    uniform_sphere_point(u[i], v[i], &x[i], &y[i], &z[i]);
+  }
+}
+
+void concentric_disk_points(const float *u, const float *v, float *x, float *y, int n) {
+  #pragma GCC ivdep
+  for (int i = 0; i < n; i++) {
+    concentric_disk_point(u[i], v[i], &x[i], &y[i]);
+  }
+}
+
+void cosine_hemisphere_points(const float *u, const float *v, float *x, float *y, float *z, int n) {
+  #pragma GCC ivdep
+  for (int i = 0; i < n; i++) {
+    cosine_hemisphere_point(u[i], v[i], &x[i], &y[i], &z[i]);
+  }
+}
+
+#endif // !SAMPLING_H
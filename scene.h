@@ -0,0 +1,296 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "interval.h"
+#include "light.h"
+#include "material.h"
+#include "packet.h"
+#include "ray.h"
+#include "rng.h"
+#include "rtweekend.h"
+#include "simd.h"
+#include "stats.h"
+#include "triangle.h"
+#include "vec3.h"
+#include "vectorized.h"
+#include "wbvh.h"
+
+// everything a ray can hit. the acceleration structures are optional,
+// without them every ray is tested against the whole sphere list (and
+// triangle list).
+typedef struct {
+  sphere_list_t *sphere_list;
+  material_list_t *material_list;
+  // the emissive spheres, see light.h
+  light_list_t *lights;
+  // scales the sky gradient rays that miss everything pick up, black for
+  // scenes lit only by their lights
+  color_t sky;
+  bvh_t *bvh;
+  // collapsed from bvh, used instead of it when present
+  wbvh_t *wbvh;
+  // triangle meshes, NULL for a scene of spheres only, and their own BVH
+  triangle_list_t *triangles;
+  bvh_t *triangle_bvh;
+  // set when the spheres, materials and maybe bvh nodes are a mapped scene
+  // file (scenefile.h) rather than heap allocations
+  void *mapping;
+  size_t mapping_size;
+} scene_t;
+
+// called once at startup, before any threads are spawned
+void select_simd_backend(simd_backend_t backend) {
+  g_simd_backend = backend;
+  select_sphere_backend(backend);
+  select_wbvh_backend(backend);
+  select_packet_backend(backend);
+  select_triangle_backend(backend);
+  select_rng_backend(backend);
+}
+
+// groups the material table and finds the lights among the materials, so
+// the lists should be complete
+scene_t new_scene(sphere_list_t *sphere_list, material_list_t *material_list) {
+  if (material_list != NULL) {
+    group_materials(material_list);
+  }
+  scene_t scene = {
+    .sphere_list = sphere_list,
+    .material_list = material_list,
+    .lights = material_list != NULL ? build_light_list(material_list) : NULL,
+    .sky = new_vec3(1.0, 1.0, 1.0),
+    .bvh = NULL,
+    .wbvh = NULL,
+    .triangles = NULL,
+    .triangle_bvh = NULL,
+    .mapping = NULL,
+    .mapping_size = 0
+  };
+  return scene;
+}
+
+// the material types the scene's spheres and triangles have, as
+// MATERIAL_BITs. a grouped table says without looking at the materials.
+uint32_t scene_material_types(const scene_t *scene) {
+  const material_list_t *lists[] = {scene->material_list, scene->triangles != NULL ? scene->triangles->materials : NULL};
+  uint32_t types = 0;
+  for (int l = 0; l < 2; l++) {
+    const material_list_t *list = lists[l];
+    if (list == NULL) {
+      continue;
+    }
+    for (size_t m = 0; !list->grouped && m < list->n_materials; m++) {
+      types |= MATERIAL_BIT(list->materials[m].type);
+    }
+    for (int t = 0; list->grouped && t < N_MATERIAL_TYPES; t++) {
+      types |= list->type_start[t + 1] > list->type_start[t] ? MATERIAL_BIT(t) : 0;
+    }
+  }
+  return types;
+}
+
+// adds triangle meshes to the scene, which then owns them. their
+// materials can't be lights: a triangle that's emissive glows when a path
+// runs into it but isn't sampled at diffuse hits.
+void scene_set_triangles(scene_t *scene, triangle_list_t *triangles) {
+  group_materials(triangles->materials);
+  scene->triangles = triangles;
+}
+
+void free_scene(scene_t *scene) {
+  if (scene->wbvh != NULL) {
+    free_wbvh(scene->wbvh);
+  }
+  if (scene->bvh != NULL) {
+    free_bvh(scene->bvh);
+  }
+  if (scene->triangle_bvh != NULL) {
+    free_bvh(scene->triangle_bvh);
+  }
+  if (scene->triangles != NULL) {
+    free_triangle_list(scene->triangles);
+  }
+  // the lists know whether their arrays are in the mapping
+  free_sphere_list(scene->sphere_list);
+  free_material_list(scene->material_list);
+  if (scene->lights != NULL) {
+    free_light_list(scene->lights);
+  }
+  if (scene->mapping != NULL) {
+    munmap(scene->mapping, scene->mapping_size);
+  }
+  *scene = new_scene(NULL, NULL);
+}
+
+// builds the acceleration structures, call once all spheres and triangles are
+// added and the simd backend is picked. the spheres' tree is collapsed to the
+// width that suits the backend; RT_BVH_WIDTH=2|4|8 overrides that, 2 keeps
+// the binary tree. a binary tree loaded with the scene is kept and only
+// collapsed. the triangles get a binary tree of their own.
+void scene_build_bvh(scene_t *scene) {
+  if (scene->triangles != NULL && scene->triangle_bvh == NULL) {
+    scene->triangle_bvh = build_triangle_bvh(scene->triangles);
+  }
+  // a mesh scene may have no spheres at all, which needs no tree
+  if (scene->bvh == NULL && scene->sphere_list->nth_sphere == 0) {
+    return;
+  }
+  if (scene->bvh == NULL) {
+    // in case materials changed since new_scene
+    group_materials(scene->material_list);
+    scene->bvh = build_bvh(scene->sphere_list, scene->material_list);
+    // which moved the lights
+    if (scene->lights != NULL) {
+      free_light_list(scene->lights);
+    }
+    scene->lights = build_light_list(scene->material_list);
+  }
+
+  int width = wbvh_width_for_backend(g_simd_backend);
+  const char *requested = getenv("RT_BVH_WIDTH");
+  if (requested != NULL) {
+    width = atoi(requested);
+  }
+  if (width == 4 || width == 8) {
+    scene->wbvh = build_wbvh(scene->bvh, width);
+  }
+}
+
+// brings the acceleration structure up to date with spheres that have moved
+// since it was built, see refit_bvh. nothing to do for the linear scan.
+void scene_refit(scene_t *scene) {
+  if (scene->bvh != NULL) {
+    refit_bvh(scene->bvh, scene->sphere_list);
+  }
+  if (scene->wbvh != NULL) {
+    refit_wbvh(scene->wbvh, scene->sphere_list);
+  }
+}
+
+// where each sphere went when the BVH was built: slots[i] is the index the
+// i'th sphere added (or the i'th in a scene file) now has. the identity
+// without a BVH or for a loaded one, whose file is already in BVH order.
+uint32_t *scene_sphere_slots(const scene_t *scene) {
+  size_t n = scene->sphere_list->nth_sphere;
+  uint32_t *slots = malloc((n > 0 ? n : 1) * sizeof(uint32_t));
+  bool moved = scene->bvh != NULL && scene->bvh->prim_ids != NULL;
+  for (size_t i = 0; i < n; i++) {
+    slots[moved ? scene->bvh->prim_ids[i] : i] = i;
+  }
+  return slots;
+}
+
+// index and distance of the closest sphere, interval->max shrinks to its t
+bool closest_hit_scene(const scene_t *scene, const ray_t *ray, interval_t *interval, size_t *closest) {
+  if (scene->wbvh != NULL) {
+    return closest_sphere_wbvh(scene->wbvh, scene->sphere_list, ray, interval, closest);
+  }
+  if (scene->bvh != NULL) {
+    return closest_sphere_bvh(scene->bvh, scene->sphere_list, ray, interval, closest);
+  }
+  STATS_ADD(sphere_tests, scene->sphere_list->nth_sphere);
+  return closest_sphere(scene->sphere_list, 0, scene->sphere_list->nth_sphere, ray, interval, closest);
+}
+
+// the same for the triangles, false if there are none
+bool closest_triangle_scene(const scene_t *scene, const ray_t *ray, interval_t *interval, size_t *closest) {
+  if (scene->triangles == NULL) {
+    return false;
+  }
+  if (scene->triangle_bvh != NULL) {
+    return closest_triangle_bvh(scene->triangle_bvh, scene->triangles, ray, interval, closest);
+  }
+  return closest_triangle_leaf(scene->triangles, 0, scene->triangles->n_triangles, ray, interval, closest);
+}
+
+// the linear scan's shadow rays stop after the first block with a hit
+#define OCCLUDED_BLOCK 64
+
+// true if anything inside interval is in the ray's way, for shadow rays: the
+// first hit found will do, closest or not
+bool occluded_scene(const scene_t *scene, const ray_t *ray, const interval_t *interval) {
+  if (scene->triangles != NULL) {
+    interval_t triangle_interval = *interval;
+    size_t closest;
+    if (scene->triangle_bvh != NULL ? occluded_triangle_bvh(scene->triangle_bvh, scene->triangles, ray, interval)
+                                    : closest_triangle_leaf(scene->triangles, 0, scene->triangles->n_triangles, ray, &triangle_interval, &closest)) {
+      return true;
+    }
+  }
+  if (scene->wbvh != NULL) {
+    return occluded_wbvh(scene->wbvh, scene->sphere_list, ray, interval);
+  }
+  if (scene->bvh != NULL) {
+    return occluded_bvh(scene->bvh, scene->sphere_list, ray, interval);
+  }
+  size_t n = scene->sphere_list->nth_sphere;
+  for (size_t start = 0; start < n; start += OCCLUDED_BLOCK) {
+    size_t end = start + OCCLUDED_BLOCK < n ? start + OCCLUDED_BLOCK : n;
+    interval_t block_interval = *interval;
+    size_t closest;
+    STATS_ADD(sphere_tests, end - start);
+    if (closest_sphere(scene->sphere_list, start, end, ray, &block_interval, &closest)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// the spheres first, then the triangles, which only have to beat the
+// nearest sphere
+bool hit_scene(const scene_t *scene, const ray_t *ray, const interval_t *interval, hit_record_t *rec) {
+  interval_t this_interval = *interval;
+  size_t closest_hit_sphere = 0;
+  bool hit = false;
+
+  if (closest_hit_scene(scene, ray, &this_interval, &closest_hit_sphere)) {
+    set_sphere_hit_record(scene->sphere_list, scene->material_list, closest_hit_sphere, this_interval.max, ray, rec);
+    hit = true;
+  }
+  size_t closest_hit_triangle = 0;
+  if (closest_triangle_scene(scene, ray, &this_interval, &closest_hit_triangle)) {
+    set_triangle_hit_record(scene->triangles, closest_hit_triangle, this_interval.max, ray, rec);
+    hit = true;
+  }
+  return hit;
+}
+
+// n_spheres random spheres in a cube, at roughly constant density so the
+// number of spheres a ray passes near grows like the cube's side. used for
+// benchmarking the acceleration structures. in arena if that's not NULL.
+scene_t new_random_scene_in(arena_t *arena, size_t n_spheres) {
+  sphere_list_t *sphere_list = new_sphere_list_in(arena, n_spheres);
+  material_list_t *material_list = new_material_list_in(arena, n_spheres);
+
+  float side = 2.0 * cbrtf((float)n_spheres);
+  for (size_t i = 0; i < n_spheres; i++) {
+    point3_t center = random_vec3(-side/2, side/2);
+    add_sphere(sphere_list, center, random_float_range(0.2, 0.5));
+
+    float choose_mat = random_float();
+    material_t mat;
+    if (choose_mat < 0.8) {
+      mat = new_lambertian(multiply(random_vec3(0, 1), random_vec3(0, 1)));
+    } else if (choose_mat < 0.95) {
+      mat = new_metal(random_vec3(0.5, 1.0), random_float_range(0, 0.5));
+    } else {
+      mat = new_dielectric(1.5);
+    }
+    add_material(material_list, mat);
+  }
+
+  return new_scene(sphere_list, material_list);
+}
+
+scene_t new_random_scene(size_t n_spheres) {
+  return new_random_scene_in(NULL, n_spheres);
+}
+
+#endif // !SCENE_H
@@ -0,0 +1,555 @@
+#ifndef SCENEFILE_H
+#define SCENEFILE_H
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bvh.h"
+#include "hittable.h"
+#include "material.h"
+#include "scene.h"
+#include "triangle.h"
+#include "vec3.h"
+
+// Scene files, in two forms.
+//
+// Text, one sphere per line, for writing scenes by hand:
+//
+//   # x y z radius material parameters
+//   sphere 0 -1000 0 1000 lambertian 0.5 0.5 0.5
+//   sphere 4 1 0 1 metal 0.7 0.6 0.5 0.0
+//   sphere 0 1 0 1 dielectric 1.5
+//   sphere 0 5 0 0.5 emissive 20 20 20
+//   sky 0 0 0
+//
+// where sky (optional, 1 1 1 if not given) scales the sky gradient. Triangle
+// meshes come from OBJ files, scaled and then moved, all in one material:
+//
+//   # path x y z scale material parameters
+//   mesh bunny.obj 0 0 0 10 lambertian 0.8 0.8 0.8
+//   triangle 0 0 0 1 0 0 0 1 0 metal 0.9 0.9 0.9 0.1
+//
+// with a relative path being relative to the scene file. A single triangle
+// can also be given by its corners, counterclockwise seen from the front,
+// which is how meshes are written back out: the text form doesn't keep the
+// OBJ.
+//
+// Binary, for big scenes: a header, then the sphere arrays exactly as
+// sphere_list_t holds them (each starting on a 64 byte boundary, sentinel
+// padding included), then the spheres' material indices and the material
+// table, then optionally the nodes of a BVH the spheres are already
+// ordered for, then the light list. Loading maps the file and points the scene straight at it, no
+// parsing and no copying; pages come in as the render touches them. The
+// mapping is private, so building a BVH over a file without one still works,
+// the reordered pages just stop being backed by the file. Binary files hold
+// spheres only, scenes with triangles have to be saved as text.
+//
+// Binary files are in native byte order with the structs as this build lays
+// them out, the header records the sizes so a mismatched file is refused
+// rather than misread. Every index in the file (material indices and types,
+// lights, BVH children and leaves) is checked once at load, so a truncated
+// or hand-edited file is refused too rather than read out of bounds.
+
+#define SCENE_FILE_MAGIC "RTSCENE4"
+#define SCENE_FILE_ALIGN 64
+#define SCENE_LINE_MAX 1024
+
+typedef struct {
+  char magic[8];
+  uint32_t material_size;
+  uint32_t node_size;
+  uint32_t index_size;
+  uint64_t n_spheres;
+  uint64_t n_materials;
+  // 0 when the file has no BVH
+  uint64_t n_nodes;
+  int32_t bvh_depth;
+  // bytes from the start of one sphere array to the next
+  uint32_t sphere_stride;
+  uint64_t spheres_offset;
+  // the per-sphere indices, then the table
+  uint64_t indices_offset;
+  uint64_t materials_offset;
+  uint64_t nodes_offset;
+  uint64_t n_lights;
+  uint64_t lights_offset;
+  float sky[3];
+} scene_file_header_t;
+
+size_t scene_file_align(size_t offset) {
+  return (offset + SCENE_FILE_ALIGN - 1) & ~(size_t)(SCENE_FILE_ALIGN - 1);
+}
+
+// true if path starts with the binary magic
+bool is_binary_scene_file(const char *path) {
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) {
+    return false;
+  }
+  char magic[8];
+  bool binary = fread(magic, 8, 1, fp) == 1 && memcmp(magic, SCENE_FILE_MAGIC, 8) == 0;
+  fclose(fp);
+  return binary;
+}
+
+// parses the material that ends a sphere, mesh or triangle line
+bool parse_scene_material(const char *line, material_t *mat) {
+  char type[32];
+  float v[4];
+  int used;
+  if (sscanf(line, " %31s%n", type, &used) != 1) {
+    return false;
+  }
+  line += used;
+
+  char extra;
+  if (strcmp(type, "lambertian") == 0 && sscanf(line, "%f %f %f %c", &v[0], &v[1], &v[2], &extra) == 3) {
+    *mat = new_lambertian(new_vec3(v[0], v[1], v[2]));
+  } else if (strcmp(type, "metal") == 0 && sscanf(line, "%f %f %f %f %c", &v[0], &v[1], &v[2], &v[3], &extra) == 4) {
+    *mat = new_metal(new_vec3(v[0], v[1], v[2]), v[3]);
+  } else if (strcmp(type, "dielectric") == 0 && sscanf(line, "%f %c", &v[0], &extra) == 1) {
+    *mat = new_dielectric(v[0]);
+  } else if (strcmp(type, "emissive") == 0 && sscanf(line, "%f %f %f %c", &v[0], &v[1], &v[2], &extra) == 3) {
+    *mat = new_emissive(new_vec3(v[0], v[1], v[2]));
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// parses one "sphere ..." line, false if it isn't one
+bool parse_scene_line(const char *line, vec3_t *center, float *radius, material_t *mat) {
+  int used;
+  if (sscanf(line, " sphere %f %f %f %f%n", &center->e[0], &center->e[1], &center->e[2], radius, &used) != 4 || *radius <= 0) {
+    return false;
+  }
+  return parse_scene_material(line + used, mat);
+}
+
+// reads a "mesh ..." line into triangles, false if it isn't one or the OBJ
+// can't be read. scene_path is the scene file, for relative paths.
+bool parse_mesh_line(const char *line, const char *scene_path, triangle_list_t *triangles) {
+  char obj[SCENE_LINE_MAX];
+  vec3_t offset;
+  float scale_by;
+  material_t mat;
+  int used;
+  if (sscanf(line, " mesh %1023s %f %f %f %f%n", obj, &offset.e[0], &offset.e[1], &offset.e[2], &scale_by, &used) != 5
+      || scale_by <= 0 || !parse_scene_material(line + used, &mat)) {
+    return false;
+  }
+  char path[2 * SCENE_LINE_MAX];
+  const char *slash = strrchr(scene_path, '/');
+  if (obj[0] == '/' || slash == NULL) {
+    snprintf(path, sizeof(path), "%s", obj);
+  } else {
+    snprintf(path, sizeof(path), "%.*s/%s", (int)(slash - scene_path), scene_path, obj);
+  }
+  return load_obj(triangles, path, offset, scale_by, mat);
+}
+
+// reads a "triangle ..." line into triangles, false if it isn't one
+bool parse_triangle_line(const char *line, triangle_list_t *triangles) {
+  float c[9];
+  material_t mat;
+  int used;
+  if (sscanf(line, " triangle %f %f %f %f %f %f %f %f %f%n", &c[0], &c[1], &c[2], &c[3], &c[4], &c[5], &c[6], &c[7], &c[8], &used) != 9
+      || !parse_scene_material(line + used, &mat)) {
+    return false;
+  }
+  uint32_t v0 = add_vertex(triangles, new_vec3(c[0], c[1], c[2]));
+  uint32_t v1 = add_vertex(triangles, new_vec3(c[3], c[4], c[5]));
+  uint32_t v2 = add_vertex(triangles, new_vec3(c[6], c[7], c[8]));
+  return add_triangle(triangles, v0, v1, v2, mat);
+}
+
+// true for lines with nothing but whitespace or a comment
+bool blank_scene_line(const char *line) {
+  line += strspn(line, " \t\r\n");
+  return *line == '\0' || *line == '#';
+}
+
+// reads a text scene. the file is read twice, once to count the spheres so
+// the lists are allocated at exactly the right size.
+bool load_scene_text(const char *path, scene_t *scene) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    printf("couldn't open %s\n", path);
+    return false;
+  }
+
+  char line[SCENE_LINE_MAX];
+  size_t n_spheres = 0;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    n_spheres += !blank_scene_line(line);
+  }
+  rewind(fp);
+
+  sphere_list_t *sphere_list = new_sphere_list(n_spheres);
+  material_list_t *material_list = new_material_list(n_spheres);
+  triangle_list_t *triangles = NULL;
+  int line_number = 0;
+  bool ok = true;
+  color_t sky = new_vec3(1.0, 1.0, 1.0);
+  while (ok && fgets(line, sizeof(line), fp) != NULL) {
+    line_number++;
+    if (blank_scene_line(line)) {
+      continue;
+    }
+    vec3_t center;
+    float radius;
+    material_t mat;
+    char extra;
+    if (sscanf(line, " sky %f %f %f %c", &sky.e[0], &sky.e[1], &sky.e[2], &extra) == 3) {
+      continue;
+    }
+    char keyword[16];
+    if (sscanf(line, " %15s", keyword) == 1 && (strcmp(keyword, "mesh") == 0 || strcmp(keyword, "triangle") == 0)) {
+      if (triangles == NULL) {
+        triangles = new_triangle_list(0, 0);
+      }
+      if (keyword[0] == 'm' ? !parse_mesh_line(line, path, triangles) : !parse_triangle_line(line, triangles)) {
+        printf("%s:%d: expected \"mesh file.obj x y z scale\" or \"triangle\" and its 3 corners, then a material\n", path, line_number);
+        ok = false;
+      }
+      continue;
+    }
+    if (!parse_scene_line(line, &center, &radius, &mat)) {
+      printf("%s:%d: expected \"sphere x y z radius\" and lambertian r g b, metal r g b fuzz, dielectric ir or emissive r g b, or \"sky r g b\"\n", path, line_number);
+      ok = false;
+    } else {
+      add_sphere(sphere_list, center, radius);
+      add_material(material_list, mat);
+    }
+  }
+  fclose(fp);
+
+  if (!ok) {
+    free_sphere_list(sphere_list);
+    free_material_list(material_list);
+    if (triangles != NULL) {
+      free_triangle_list(triangles);
+    }
+    return false;
+  }
+  *scene = new_scene(sphere_list, material_list);
+  scene->sky = sky;
+  if (triangles != NULL) {
+    scene_set_triangles(scene, triangles);
+  }
+  return true;
+}
+
+// the material part of a line, and the newline
+void write_scene_material(FILE *fp, const material_t *mat) {
+  switch (mat->type) {
+    case LAMBERTIAN: {
+      color_t a = mat->data.lambertian.albedo;
+      fprintf(fp, "lambertian %.9g %.9g %.9g\n", a.e[0], a.e[1], a.e[2]);
+      break;
+    }
+    case METAL: {
+      color_t a = mat->data.metal.albedo;
+      fprintf(fp, "metal %.9g %.9g %.9g %.9g\n", a.e[0], a.e[1], a.e[2], mat->data.metal.fuzz);
+      break;
+    }
+    case DIELECTRIC:
+      fprintf(fp, "dielectric %.9g\n", mat->data.dielectric.ir);
+      break;
+    case EMISSIVE: {
+      color_t e = mat->data.emissive.emit;
+      fprintf(fp, "emissive %.9g %.9g %.9g\n", e.e[0], e.e[1], e.e[2]);
+      break;
+    }
+  }
+}
+
+bool save_scene_text(const char *path, const scene_t *scene) {
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) {
+    return false;
+  }
+  const sphere_list_t *spheres = scene->sphere_list;
+  fprintf(fp, "# x y z radius material parameters\n");
+  color_t sky = scene->sky;
+  if (sky.e[0] != 1 || sky.e[1] != 1 || sky.e[2] != 1) {
+    fprintf(fp, "sky %.9g %.9g %.9g\n", sky.e[0], sky.e[1], sky.e[2]);
+  }
+  for (size_t i = 0; i < spheres->nth_sphere; i++) {
+    // %.9g is enough digits for every float to come back the same
+    fprintf(fp, "sphere %.9g %.9g %.9g %.9g ", spheres->xs[i], spheres->ys[i], spheres->zs[i], sqrtf(spheres->r2s[i]));
+    write_scene_material(fp, sphere_material(scene->material_list, i));
+  }
+  const triangle_list_t *triangles = scene->triangles;
+  for (size_t i = 0; triangles != NULL && i < triangles->n_triangles; i++) {
+    fprintf(fp, "triangle");
+    uint32_t corners[3] = {triangles->v0s[i], triangles->v1s[i], triangles->v2s[i]};
+    for (int k = 0; k < 3; k++) {
+      point3_t p = triangle_vertex(triangles, corners[k]);
+      fprintf(fp, " %.9g %.9g %.9g", p.e[0], p.e[1], p.e[2]);
+    }
+    fprintf(fp, " ");
+    write_scene_material(fp, sphere_material(triangles->materials, i));
+  }
+  return fclose(fp) == 0;
+}
+
+// the header for scene, with the offsets of everything after it
+scene_file_header_t new_scene_file_header(const scene_t *scene) {
+  size_t n = scene->sphere_list->nth_sphere;
+  scene_file_header_t header = {
+    .material_size = sizeof(material_t),
+    .node_size = sizeof(bvh_node_t),
+    .index_size = sizeof(material_index_t),
+    .n_spheres = n,
+    .n_materials = scene->material_list->n_materials,
+    .n_nodes = scene->bvh != NULL ? scene->bvh->n_nodes : 0,
+    .n_lights = scene->lights != NULL ? scene->lights->n_lights : 0,
+    .sky = {scene->sky.e[0], scene->sky.e[1], scene->sky.e[2]},
+    .bvh_depth = scene->bvh != NULL ? scene->bvh->depth : 0,
+    .sphere_stride = scene_file_align(sphere_list_padded(n) * sizeof(float)),
+    .spheres_offset = scene_file_align(sizeof(scene_file_header_t))
+  };
+  memcpy(header.magic, SCENE_FILE_MAGIC, 8);
+  header.indices_offset = header.spheres_offset + 5 * (uint64_t)header.sphere_stride;
+  header.materials_offset = scene_file_align(header.indices_offset + n * sizeof(material_index_t));
+  header.nodes_offset = scene_file_align(header.materials_offset + header.n_materials * sizeof(material_t));
+  header.lights_offset = scene_file_align(header.nodes_offset + header.n_nodes * sizeof(bvh_node_t));
+  return header;
+}
+
+// writes size bytes and pads with zeros up to offset *end, the start of the
+// next section
+bool write_scene_section(FILE *fp, const void *data, size_t size, uint64_t *position, uint64_t end) {
+  static const char zeros[SCENE_FILE_ALIGN] = {0};
+  if (size > 0 && fwrite(data, size, 1, fp) != 1) {
+    return false;
+  }
+  *position += size;
+  while (*position < end) {
+    size_t pad = end - *position < SCENE_FILE_ALIGN ? end - *position : SCENE_FILE_ALIGN;
+    if (fwrite(zeros, pad, 1, fp) != 1) {
+      return false;
+    }
+    *position += pad;
+  }
+  return true;
+}
+
+// writes the binary form. if the scene has a BVH its nodes go in too: the
+// spheres were put in leaf order when it was built, so the file is ready to
+// trace as soon as it's mapped.
+bool save_scene_binary(const char *path, const scene_t *scene) {
+  if (scene->triangles != NULL && scene->triangles->n_triangles > 0) {
+    printf("binary scene files can't hold triangles, save as .txt\n");
+    return false;
+  }
+  FILE *fp = fopen(path, "wb");
+  if (fp == NULL) {
+    return false;
+  }
+  const sphere_list_t *spheres = scene->sphere_list;
+  scene_file_header_t header = new_scene_file_header(scene);
+  size_t n = header.n_spheres;
+  const float *arrays[5] = {spheres->xs, spheres->ys, spheres->zs, spheres->r2s, spheres->recip_r};
+
+  uint64_t position = 0;
+  bool ok = write_scene_section(fp, &header, sizeof(header), &position, header.spheres_offset);
+  for (int k = 0; k < 5 && ok; k++) {
+    ok = write_scene_section(fp, arrays[k], sphere_list_padded(n) * sizeof(float), &position, position + header.sphere_stride);
+  }
+  bool more = header.n_nodes > 0 || header.n_lights > 0;
+  const material_list_t *materials = scene->material_list;
+  ok = ok && write_scene_section(fp, materials->indices, n * sizeof(material_index_t), &position, header.materials_offset)
+          && write_scene_section(fp, materials->materials, header.n_materials * sizeof(material_t), &position,
+                                 more ? header.nodes_offset : position)
+          && write_scene_section(fp, header.n_nodes > 0 ? scene->bvh->nodes : NULL, header.n_nodes * sizeof(bvh_node_t), &position,
+                                 header.n_lights > 0 ? header.lights_offset : position)
+          && write_scene_section(fp, header.n_lights > 0 ? scene->lights->spheres : NULL, header.n_lights * sizeof(uint32_t), &position, position);
+  ok &= fclose(fp) == 0;
+  return ok;
+}
+
+// maps a binary scene file. the scene's arrays point into the mapping, which
+// free_scene unmaps.
+// the header's sections are in the file, now what's in them: every index
+// points inside the arrays it indexes, and the BVH is a tree the traversal
+// stack can hold, children coming after their parents so it can't loop
+bool scene_file_contents_ok(const char *base, const scene_file_header_t *header) {
+  uint64_t n = header->n_spheres;
+  const material_index_t *indices = (const material_index_t *)(base + header->indices_offset);
+  for (uint64_t i = 0; i < n; i++) {
+    if (indices[i] >= header->n_materials) {
+      return false;
+    }
+  }
+  const material_t *materials = (const material_t *)(base + header->materials_offset);
+  for (uint64_t m = 0; m < header->n_materials; m++) {
+    if ((unsigned)materials[m].type >= N_MATERIAL_TYPES) {
+      return false;
+    }
+  }
+  const uint32_t *lights = (const uint32_t *)(base + header->lights_offset);
+  for (uint64_t l = 0; l < header->n_lights; l++) {
+    if (lights[l] >= n) {
+      return false;
+    }
+  }
+  if (header->n_nodes == 0) {
+    return true;
+  }
+  // depth 0 for nodes the root doesn't reach, node 1 being one
+  const bvh_node_t *nodes = (const bvh_node_t *)(base + header->nodes_offset);
+  uint8_t *depths = calloc(header->n_nodes, 1);
+  depths[0] = 1;
+  bool ok = true;
+  for (uint64_t k = 0; k < header->n_nodes && ok; k++) {
+    const bvh_node_t *node = &nodes[k];
+    if (depths[k] == 0) {
+      continue;
+    } else if (node->count > 0) {
+      ok = (uint64_t)node->left_first + node->count <= n;
+    } else {
+      ok = node->left_first > k && (uint64_t)node->left_first + 1 < header->n_nodes && depths[k] + 2 < BVH_STACK_SIZE;
+      if (ok) {
+        depths[node->left_first] = depths[node->left_first + 1] = depths[k] + 1;
+      }
+    }
+  }
+  free(depths);
+  return ok;
+}
+
+bool load_scene_binary(const char *path, scene_t *scene) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    printf("couldn't open %s\n", path);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(scene_file_header_t)) {
+    printf("%s: not a scene file\n", path);
+    close(fd);
+    return false;
+  }
+  size_t size = st.st_size;
+  char *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    printf("couldn't map %s\n", path);
+    return false;
+  }
+
+  const scene_file_header_t *header = (const scene_file_header_t *)base;
+  uint64_t n = header->n_spheres;
+  // the counts first, so the sizes below can't overflow
+  bool ok = memcmp(header->magic, SCENE_FILE_MAGIC, 8) == 0
+         && n <= size && header->n_nodes <= size && header->n_lights <= size
+         && header->material_size == sizeof(material_t)
+         && header->node_size == sizeof(bvh_node_t)
+         && header->sphere_stride >= sphere_list_padded(n) * sizeof(float)
+         && header->spheres_offset % SCENE_FILE_ALIGN == 0
+         && header->sphere_stride % SCENE_FILE_ALIGN == 0
+         && header->index_size == sizeof(material_index_t)
+         && header->n_materials <= MAX_MATERIALS
+         // sections in order and inside the file, compared without adding
+         // offsets so a huge one can't wrap around
+         && header->spheres_offset >= sizeof(scene_file_header_t)
+         && header->spheres_offset <= header->indices_offset
+         && header->sphere_stride <= (header->indices_offset - header->spheres_offset) / 5
+         && header->materials_offset % SCENE_FILE_ALIGN == 0
+         && header->indices_offset <= header->materials_offset
+         && n * sizeof(material_index_t) <= header->materials_offset - header->indices_offset
+         && header->materials_offset <= size
+         && header->n_materials * sizeof(material_t) <= size - header->materials_offset
+         && (header->n_nodes == 0 || (header->nodes_offset % SCENE_FILE_ALIGN == 0 && header->nodes_offset <= size
+                                      && header->n_nodes * sizeof(bvh_node_t) <= size - header->nodes_offset))
+         && (header->n_lights == 0 || (header->lights_offset % SCENE_FILE_ALIGN == 0 && header->lights_offset <= size
+                                       && header->n_lights * sizeof(uint32_t) <= size - header->lights_offset))
+         && scene_file_contents_ok(base, header);
+  if (!ok) {
+    printf("%s: not a scene file this build can read\n", path);
+    munmap(base, size);
+    return false;
+  }
+
+  sphere_list_t *sphere_list = malloc(sizeof(sphere_list_t));
+  sphere_list->nth_sphere = n;
+  sphere_list->max_spheres = n;
+  sphere_list->mapped = true;
+  sphere_list->arena = NULL;
+  float *arrays = (float *)(base + header->spheres_offset);
+  size_t stride = header->sphere_stride / sizeof(float);
+  sphere_list->xs = arrays;
+  sphere_list->ys = arrays + stride;
+  sphere_list->zs = arrays + 2 * stride;
+  sphere_list->r2s = arrays + 3 * stride;
+  sphere_list->recip_r = arrays + 4 * stride;
+  material_list_t *material_list = malloc(sizeof(material_list_t));
+  *material_list = (material_list_t){
+    .nth_sphere = n,
+    .max_spheres = n,
+    .indices = (material_index_t *)(base + header->indices_offset),
+    .materials = (material_t *)(base + header->materials_offset),
+    .n_materials = header->n_materials,
+    .max_materials = header->n_materials,
+    .lookup = NULL,
+    .mapped = true,
+    .arena = NULL
+  };
+  find_material_types(material_list);
+
+  // not new_scene(sphere_list, material_list), which would read through
+  // every material looking for the lights the file already lists
+  *scene = new_scene(NULL, NULL);
+  scene->sphere_list = sphere_list;
+  scene->material_list = material_list;
+  light_list_t *lights = malloc(sizeof(light_list_t));
+  lights->spheres = (uint32_t *)(base + header->lights_offset);
+  lights->n_lights = header->n_lights;
+  lights->mapped = true;
+  lights->arena = NULL;
+  scene->lights = lights;
+  scene->sky = new_vec3(header->sky[0], header->sky[1], header->sky[2]);
+  scene->mapping = base;
+  scene->mapping_size = size;
+  if (header->n_nodes > 0) {
+    bvh_t *bvh = malloc(sizeof(bvh_t));
+    bvh->nodes = (bvh_node_t *)(base + header->nodes_offset);
+    bvh->n_nodes = header->n_nodes;
+    bvh->prim_ids = NULL;
+    bvh->n_prims = n;
+    bvh->depth = header->bvh_depth;
+    bvh->build_seconds = 0;
+    bvh->mapped = true;
+    bvh->arena = NULL;
+    scene->bvh = bvh;
+  }
+  return true;
+}
+
+// either form, told apart by the magic
+bool load_scene_file(const char *path, scene_t *scene) {
+  if (is_binary_scene_file(path)) {
+    return load_scene_binary(path, scene);
+  }
+  return load_scene_text(path, scene);
+}
+
+// binary unless the path ends in .txt
+bool save_scene_file(const char *path, const scene_t *scene) {
+  size_t len = strlen(path);
+  if (len >= 4 && strcmp(path + len - 4, ".txt") == 0) {
+    return save_scene_text(path, scene);
+  }
+  return save_scene_binary(path, scene);
+}
+
+#endif // !SCENEFILE_H
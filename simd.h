@@ -0,0 +1,117 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// pulls in the intrinsics for whatever arch we're compiling for. on x86
+// we don't pass -mavx2 etc on the command line, instead each kernel is
+// compiled with __attribute__((target(...))) and we pick one at startup
+// based on CPUID, so one binary runs on every node in the farm.
+#if defined(__aarch64__) || defined(__ARM_NEON)
+#define SIMD_HAVE_NEON
+#include <arm_neon.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_HAVE_X86
+#include <immintrin.h>
+#endif
+
+typedef enum {
+  SIMD_SCALAR,
+  SIMD_NEON,
+  SIMD_SSE41,
+  SIMD_AVX2,
+  SIMD_AVX512
+} simd_backend_t;
+
+// the backend picked at startup by select_simd_backend() in scene.h
+simd_backend_t g_simd_backend = SIMD_SCALAR;
+
+const char *simd_backend_name(simd_backend_t backend) {
+  switch (backend) {
+    case SIMD_SCALAR: return "scalar";
+    case SIMD_NEON: return "neon";
+    case SIMD_SSE41: return "sse4.1";
+    case SIMD_AVX2: return "avx2";
+    case SIMD_AVX512: return "avx512";
+  }
+  return "unknown";
+}
+
+// number of float lanes the backend's kernels work on at a time
+int simd_backend_width(simd_backend_t backend) {
+  switch (backend) {
+    case SIMD_SCALAR: return 1;
+    case SIMD_NEON: return 4;
+    case SIMD_SSE41: return 4;
+    case SIMD_AVX2: return 8;
+    case SIMD_AVX512: return 16;
+  }
+  return 1;
+}
+
+bool simd_backend_supported(simd_backend_t backend) {
+  switch (backend) {
+    case SIMD_SCALAR:
+      return true;
+    case SIMD_NEON:
+      #if defined(SIMD_HAVE_NEON)
+      return true;
+      #else
+      return false;
+      #endif
+    #if defined(SIMD_HAVE_X86)
+    case SIMD_SSE41:
+      return __builtin_cpu_supports("sse4.1");
+    case SIMD_AVX2:
+      return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    case SIMD_AVX512:
+      return __builtin_cpu_supports("avx512f");
+    #else
+    default:
+      return false;
+    #endif
+  }
+  return false;
+}
+
+// best backend this cpu can run
+simd_backend_t detect_simd_backend(void) {
+  #if defined(SIMD_HAVE_X86)
+  __builtin_cpu_init();
+  #endif
+  simd_backend_t order[] = {SIMD_AVX512, SIMD_AVX2, SIMD_SSE41, SIMD_NEON};
+  for (size_t i = 0; i < sizeof(order) / sizeof(order[0]); i++) {
+    if (simd_backend_supported(order[i])) {
+      return order[i];
+    }
+  }
+  return SIMD_SCALAR;
+}
+
+// RT_SIMD=scalar|neon|sse4.1|avx2|avx512 forces a backend, handy for
+// benchmarking one against another on the same box
+simd_backend_t simd_backend_from_env(void) {
+  simd_backend_t best = detect_simd_backend();
+  const char *requested = getenv("RT_SIMD");
+  if (requested == NULL) {
+    return best;
+  }
+  for (simd_backend_t b = SIMD_SCALAR; b <= SIMD_AVX512; b++) {
+    if (strcmp(requested, simd_backend_name(b)) == 0) {
+      if (simd_backend_supported(b)) {
+        return b;
+      }
+      fprintf(stderr, "RT_SIMD=%s not supported on this cpu, using %s\n", requested, simd_backend_name(best));
+      return best;
+    }
+  }
+  fprintf(stderr, "unknown RT_SIMD=%s, using %s\n", requested, simd_backend_name(best));
+  return best;
+}
+
+#endif // !SIMD_H
@@ -0,0 +1,189 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <string.h>
+
+#include "material.h"
+
+// Render statistics, for builds with -DRENDER_STATS (make linux-stats). Each
+// thread counts into its own g_stats with plain increments; render_tile folds
+// them into the worker's slot in the render once a tile is done, and the
+// slots are summed when the render finishes. Without RENDER_STATS the
+// counting macros expand to nothing and nothing is timed, so a normal build
+// pays nothing for any of this.
+
+// path_lengths has a bin per number of rays a path traced, up to this many,
+// the last one catching everything longer
+#define STATS_MAX_PATH 64
+
+// how a path ended
+typedef enum {
+  // missed everything and picked up the sky
+  PATH_ESCAPED,
+  // scattered below the surface (fuzzy metal)
+  PATH_ABSORBED,
+  // ran out of bounces at max_depth
+  PATH_CUT_OFF,
+  // lost at russian roulette
+  PATH_ROULETTE,
+  // hit a light, which ends it
+  PATH_LIGHT,
+  N_PATH_ENDS
+} path_end_t;
+
+typedef struct {
+  _Alignas(64) unsigned long primary_rays;
+  unsigned long secondary_rays;
+  // next event estimation's, toward a light
+  unsigned long shadow_rays;
+  // ray-sphere tests, one per sphere per ray (per lane for packets)
+  unsigned long sphere_tests;
+  // ray-triangle tests, counted the same way
+  unsigned long triangle_tests;
+  unsigned long material_hits[N_MATERIAL_TYPES];
+  unsigned long path_ends[N_PATH_ENDS];
+  unsigned long path_lengths[STATS_MAX_PATH + 1];
+  unsigned long tiles;
+  double tile_seconds;
+  double max_tile_seconds;
+} render_stats_t;
+
+#ifdef RENDER_STATS
+__thread render_stats_t g_stats;
+#define STATS_ADD(field, n) (g_stats.field += (n))
+#define STATS_PATH_END(how, length) (g_stats.path_ends[how]++, g_stats.path_lengths[(length) < STATS_MAX_PATH ? (length) : STATS_MAX_PATH]++)
+#else
+#define STATS_ADD(field, n) ((void)0)
+#define STATS_PATH_END(how, length) ((void)0)
+#endif
+
+void merge_render_stats(render_stats_t *into, const render_stats_t *from) {
+  into->primary_rays += from->primary_rays;
+  into->secondary_rays += from->secondary_rays;
+  into->shadow_rays += from->shadow_rays;
+  into->sphere_tests += from->sphere_tests;
+  into->triangle_tests += from->triangle_tests;
+  for (int m = 0; m < N_MATERIAL_TYPES; m++) {
+    into->material_hits[m] += from->material_hits[m];
+  }
+  for (int e = 0; e < N_PATH_ENDS; e++) {
+    into->path_ends[e] += from->path_ends[e];
+  }
+  for (int n = 0; n <= STATS_MAX_PATH; n++) {
+    into->path_lengths[n] += from->path_lengths[n];
+  }
+  into->tiles += from->tiles;
+  into->tile_seconds += from->tile_seconds;
+  into->max_tile_seconds = from->max_tile_seconds > into->max_tile_seconds ? from->max_tile_seconds : into->max_tile_seconds;
+}
+
+const char *material_type_name(material_type_t type) {
+  switch (type) {
+    case LAMBERTIAN: return "lambertian";
+    case METAL: return "metal";
+    case DIELECTRIC: return "dielectric";
+    case EMISSIVE: return "emissive";
+  }
+  return "?";
+}
+
+const char *path_end_name(path_end_t end) {
+  switch (end) {
+    case PATH_ESCAPED: return "escaped";
+    case PATH_ABSORBED: return "absorbed";
+    case PATH_CUT_OFF: return "cut_off";
+    case PATH_ROULETTE: return "roulette";
+    case PATH_LIGHT: return "light";
+    case N_PATH_ENDS: break;
+  }
+  return "?";
+}
+
+unsigned long render_stats_paths(const render_stats_t *stats) {
+  unsigned long paths = 0;
+  for (int e = 0; e < N_PATH_ENDS; e++) {
+    paths += stats->path_ends[e];
+  }
+  return paths;
+}
+
+// rays per path, camera ray included
+double average_path_length(const render_stats_t *stats) {
+  unsigned long paths = render_stats_paths(stats);
+  return paths > 0 ? (double)(stats->primary_rays + stats->secondary_rays) / paths : 0.0;
+}
+
+// the totals, then each thread's share of the tiles and time
+void print_render_stats(const render_stats_t *total, const render_stats_t *threads, int n_threads, double seconds) {
+  unsigned long rays = total->primary_rays + total->secondary_rays;
+  unsigned long paths = render_stats_paths(total);
+  printf("stats: %lu rays (%lu primary, %lu secondary), %.2f Mrays/s\n", rays, total->primary_rays, total->secondary_rays,
+         seconds > 0 ? rays / seconds / 1e6 : 0.0);
+  printf("stats: %lu shadow rays\n", total->shadow_rays);
+  printf("stats: %lu sphere tests, %.1f per ray\n", total->sphere_tests, rays > 0 ? (double)total->sphere_tests / rays : 0.0);
+  if (total->triangle_tests > 0) {
+    printf("stats: %lu triangle tests, %.1f per ray\n", total->triangle_tests, rays > 0 ? (double)total->triangle_tests / rays : 0.0);
+  }
+  printf("stats: hits:");
+  for (int m = 0; m < N_MATERIAL_TYPES; m++) {
+    printf(" %s %lu", material_type_name(m), total->material_hits[m]);
+  }
+  printf("\nstats: %lu paths, %.2f rays long on average:", paths, average_path_length(total));
+  for (int e = 0; e < N_PATH_ENDS; e++) {
+    printf(" %s %.1f%%", path_end_name(e), paths > 0 ? 100.0 * total->path_ends[e] / paths : 0.0);
+  }
+  printf("\nstats: path lengths:");
+  for (int n = 1; n <= STATS_MAX_PATH; n++) {
+    if (total->path_lengths[n] > 0) {
+      printf(" %d%s:%lu", n, n == STATS_MAX_PATH ? "+" : "", total->path_lengths[n]);
+    }
+  }
+  printf("\nstats: %lu tiles, %.2fms each on average, %.2fms at most\n", total->tiles,
+         total->tiles > 0 ? 1e3 * total->tile_seconds / total->tiles : 0.0, 1e3 * total->max_tile_seconds);
+  for (int k = 0; k < n_threads; k++) {
+    printf("stats: thread %d: %lu tiles, %.3fs busy, %lu rays\n", k, threads[k].tiles, threads[k].tile_seconds,
+           threads[k].primary_rays + threads[k].secondary_rays);
+  }
+}
+
+void write_stats_fields(FILE *fp, const render_stats_t *stats, const char *indent) {
+  fprintf(fp, "%s\"primary_rays\": %lu,\n%s\"secondary_rays\": %lu,\n%s\"shadow_rays\": %lu,\n%s\"sphere_tests\": %lu,\n",
+          indent, stats->primary_rays, indent, stats->secondary_rays, indent, stats->shadow_rays, indent, stats->sphere_tests);
+  fprintf(fp, "%s\"triangle_tests\": %lu,\n", indent, stats->triangle_tests);
+  fprintf(fp, "%s\"material_hits\": {", indent);
+  for (int m = 0; m < N_MATERIAL_TYPES; m++) {
+    fprintf(fp, "%s\"%s\": %lu", m > 0 ? ", " : "", material_type_name(m), stats->material_hits[m]);
+  }
+  fprintf(fp, "},\n%s\"path_ends\": {", indent);
+  for (int e = 0; e < N_PATH_ENDS; e++) {
+    fprintf(fp, "%s\"%s\": %lu", e > 0 ? ", " : "", path_end_name(e), stats->path_ends[e]);
+  }
+  fprintf(fp, "},\n%s\"average_path_length\": %.4f,\n%s\"path_lengths\": [", indent, average_path_length(stats), indent);
+  for (int n = 0; n <= STATS_MAX_PATH; n++) {
+    fprintf(fp, "%s%lu", n > 0 ? ", " : "", stats->path_lengths[n]);
+  }
+  fprintf(fp, "],\n%s\"tiles\": %lu,\n%s\"tile_seconds\": %.6f,\n%s\"max_tile_seconds\": %.6f",
+          indent, stats->tiles, indent, stats->tile_seconds, indent, stats->max_tile_seconds);
+}
+
+// the same numbers as print_render_stats. path_lengths[n] is the number of
+// paths that traced n rays, the last entry counting the longer ones too.
+bool write_render_stats_json(const char *path, const render_stats_t *total, const render_stats_t *threads, int n_threads, double seconds) {
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) {
+    return false;
+  }
+  fprintf(fp, "{\n  \"seconds\": %.6f,\n", seconds);
+  write_stats_fields(fp, total, "  ");
+  fprintf(fp, ",\n  \"threads\": [");
+  for (int k = 0; k < n_threads; k++) {
+    fprintf(fp, "%s\n    {\n", k > 0 ? "," : "");
+    write_stats_fields(fp, &threads[k], "      ");
+    fprintf(fp, "\n    }");
+  }
+  fprintf(fp, "\n  ]\n}\n");
+  return fclose(fp) == 0;
+}
+
+#endif // !STATS_H
@@ -1,8 +1,29 @@
 #include <stdbool.h>
 #include <stdio.h>
+#include <sys/wait.h>
+// count render statistics, for test_render_stats_add_up
+#define RENDER_STATS
 #include "vec3.h"
 #include "color.h"
 #include "ray.h"
+#include "hittable.h"
+#include "material.h"
+#include "vectorized.h"
+#include "bvh.h"
+#include "packet.h"
+#include "scene.h"
+#include "threadpool.h"
+#include "camera.h"
+#include "animation.h"
+#include "checkpoint.h"
+#include "distributed.h"
+#include "image.h"
+#include "scenefile.h"
+#include "render.h"
+#include "renderer.h"
+#include "rng.h"
+#include "sampling.h"
+#include "wavefront.h"
 
 bool test_propagate() {
   point3_t start = new_vec3(1.0, 2.0, 3.0);
@@ -17,10 +38,1604 @@ bool test_propagate() {
   }
 }
 
+// every backend the cpu supports must pick the same sphere as the scalar
+// kernel, over the whole list and over odd sized ranges in the middle of it
+// like BVH leaves, so the masked tails see real spheres past their end as
+// well as the sentinels. the list starts with room for one and has to grow.
+bool test_simd_backends_agree() {
+  fast_srand(42);
+  sphere_list_t *sphere_list = new_sphere_list(1);
+  for (int i = 0; i < 37; i++) {
+    add_sphere(sphere_list, random_vec3(-5.0, 5.0), random_float_range(0.1, 1.5));
+  }
+
+  bool ok = sphere_list->max_spheres >= 37 && (uintptr_t)sphere_list->xs % 64 == 0
+            && (uintptr_t)sphere_list->r2s % 64 == 0 && (uintptr_t)sphere_list->recip_r % 64 == 0;
+  for (size_t i = sphere_list->nth_sphere; i < sphere_list_padded(sphere_list->max_spheres); i++) {
+    ok = ok && sphere_list->r2s[i] == -INFINITY;
+  }
+  for (simd_backend_t b = SIMD_NEON; b <= SIMD_AVX512 && ok; b++) {
+    if (!simd_backend_supported(b)) {
+      continue;
+    }
+    closest_sphere_fn_t kernel = closest_sphere_kernel(b);
+    for (int k = 0; k < 4000; k++) {
+      ray_t ray = new_ray(random_vec3(-8.0, 8.0), random_vec3_on_unit_sphere());
+      size_t start = k % 2 == 0 ? 0 : k % 11;
+      size_t end = k % 2 == 0 ? sphere_list->nth_sphere : start + 1 + k % 19;
+      interval_t ref_interval = {.min = 0.001, .max = INFINITY};
+      interval_t interval = ref_interval;
+      size_t ref_closest = 0, closest = 0;
+      bool ref_hit = closest_sphere_scalar(sphere_list, start, end, &ray, &ref_interval, &ref_closest);
+      bool hit = kernel(sphere_list, start, end, &ray, &interval, &closest);
+      if (hit != ref_hit || (hit && (closest != ref_closest || fabsf(interval.max - ref_interval.max) > 1e-3f))) {
+        printf("%s disagrees with scalar on ray %d, spheres %zu to %zu\n", simd_backend_name(b), k, start, end);
+        ok = false;
+        break;
+      }
+    }
+  }
+  free_sphere_list(sphere_list);
+  return ok;
+}
+
+// the BVH must find exactly the same closest sphere as brute force
+bool test_bvh_matches_linear() {
+  fast_srand(7);
+  scene_t scene = new_random_scene(3000);
+  scene_build_bvh(&scene);
+
+  for (int k = 0; k < 5000; k++) {
+    ray_t ray = new_ray(random_vec3(-30.0, 30.0), random_vec3_on_unit_sphere());
+    interval_t ref_interval = {.min = 0.001, .max = INFINITY};
+    interval_t interval = ref_interval;
+    size_t ref_closest = 0, closest = 0;
+    bool ref_hit = closest_sphere(scene.sphere_list, 0, scene.sphere_list->nth_sphere, &ray, &ref_interval, &ref_closest);
+    bool hit = closest_sphere_bvh(scene.bvh, scene.sphere_list, &ray, &interval, &closest);
+    if (hit != ref_hit || (hit && (closest != ref_closest || interval.max != ref_interval.max))) {
+      printf("bvh disagrees with linear search on ray %d\n", k);
+      return false;
+    }
+  }
+  return true;
+}
+
+// same for the 4 and 8 wide trees, with every node test kernel available
+bool test_wbvh_matches_linear() {
+  fast_srand(11);
+  scene_t scene = new_random_scene(3000);
+  scene_build_bvh(&scene);
+  wbvh_t *wbvhs[2] = {build_wbvh(scene.bvh, 4), build_wbvh(scene.bvh, 8)};
+
+  for (simd_backend_t b = SIMD_SCALAR; b <= SIMD_AVX512; b++) {
+    if (!simd_backend_supported(b)) {
+      continue;
+    }
+    select_wbvh_backend(b);
+    for (int w = 0; w < 2; w++) {
+      for (int k = 0; k < 3000; k++) {
+        ray_t ray = new_ray(random_vec3(-30.0, 30.0), random_vec3_on_unit_sphere());
+        interval_t ref_interval = {.min = 0.001, .max = INFINITY};
+        interval_t interval = ref_interval;
+        size_t ref_closest = 0, closest = 0;
+        bool ref_hit = closest_sphere(scene.sphere_list, 0, scene.sphere_list->nth_sphere, &ray, &ref_interval, &ref_closest);
+        bool hit = closest_sphere_wbvh(wbvhs[w], scene.sphere_list, &ray, &interval, &closest);
+        if (hit != ref_hit || (hit && (closest != ref_closest || interval.max != ref_interval.max))) {
+          printf("%d wide bvh (%s) disagrees with linear search on ray %d\n", wbvhs[w]->width, simd_backend_name(b), k);
+          return false;
+        }
+      }
+    }
+  }
+  select_wbvh_backend(SIMD_SCALAR);
+  return true;
+}
+
+// a palette of materials used over and over in no particular order is stored
+// once each, grouped by type, and every sphere still gets its own material
+// back, before and after the BVH reorders the spheres
+bool test_material_table_dedups_and_groups() {
+  fast_srand(19);
+  material_t palette[] = {
+    new_metal(new_vec3(0.7, 0.6, 0.5), 0.2),
+    new_lambertian(new_vec3(0.5, 0.5, 0.5)),
+    new_dielectric(1.5),
+    new_emissive(new_vec3(4, 4, 4)),
+    new_lambertian(new_vec3(0.1, 0.2, 0.3)),
+    new_metal(new_vec3(0.7, 0.6, 0.5), 0.0)
+  };
+  size_t n = 3000;
+  sphere_list_t *sphere_list = new_sphere_list(n);
+  material_list_t *material_list = new_material_list(n);
+  int *chosen = malloc(n * sizeof(int));
+  for (size_t i = 0; i < n; i++) {
+    chosen[i] = (int)(random_float() * 6);
+    add_sphere(sphere_list, random_vec3(-20, 20), 0.3);
+    add_material(material_list, palette[chosen[i]]);
+  }
+  scene_t scene = new_scene(sphere_list, material_list);
+  bool ok = material_list->n_materials == 6 && material_list->grouped;
+  for (int t = 0; t < N_MATERIAL_TYPES && ok; t++) {
+    for (uint32_t m = material_list->type_start[t]; m < material_list->type_start[t + 1]; m++) {
+      ok = ok && material_list->materials[m].type == (material_type_t)t;
+    }
+  }
+  ok = ok && material_list->type_start[N_MATERIAL_TYPES] == 6;
+  for (size_t i = 0; i < n && ok; i++) {
+    material_t expected = canonical_material(palette[chosen[i]]);
+    ok = memcmp(sphere_material(material_list, i), &expected, sizeof(material_t)) == 0
+      && sphere_material_type(material_list, i) == expected.type;
+  }
+  scene_build_bvh(&scene);
+  for (size_t i = 0; i < n && ok; i++) {
+    material_t expected = canonical_material(palette[chosen[scene.bvh->prim_ids[i]]]);
+    ok = memcmp(sphere_material(material_list, i), &expected, sizeof(material_t)) == 0;
+  }
+  free(chosen);
+  free_scene(&scene);
+  return ok;
+}
+
+// spheres moved after the build: the refit BVH and 4 and 8 wide trees must
+// still find what linear search finds
+bool test_refit_matches_linear() {
+  fast_srand(13);
+  scene_t scene = new_random_scene(3000);
+  scene_build_bvh(&scene);
+  wbvh_t *wbvhs[2] = {build_wbvh(scene.bvh, 4), build_wbvh(scene.bvh, 8)};
+  sphere_list_t *spheres = scene.sphere_list;
+  for (size_t i = 0; i < spheres->nth_sphere; i++) {
+    vec3_t offset = random_vec3(-3.0, 3.0);
+    spheres->xs[i] += offset.e[0];
+    spheres->ys[i] += offset.e[1];
+    spheres->zs[i] += offset.e[2];
+  }
+  refit_bvh(scene.bvh, spheres);
+  refit_wbvh(wbvhs[0], spheres);
+  refit_wbvh(wbvhs[1], spheres);
+
+  for (int k = 0; k < 3000; k++) {
+    ray_t ray = new_ray(random_vec3(-30.0, 30.0), random_vec3_on_unit_sphere());
+    interval_t ref_interval = {.min = 0.001, .max = INFINITY};
+    size_t ref_closest = 0;
+    bool ref_hit = closest_sphere(spheres, 0, spheres->nth_sphere, &ray, &ref_interval, &ref_closest);
+    for (int w = 0; w < 3; w++) {
+      interval_t interval = {.min = 0.001, .max = INFINITY};
+      size_t closest = 0;
+      bool hit = w == 0 ? closest_sphere_bvh(scene.bvh, spheres, &ray, &interval, &closest)
+                        : closest_sphere_wbvh(wbvhs[w - 1], spheres, &ray, &interval, &closest);
+      if (hit != ref_hit || (hit && (closest != ref_closest || interval.max != ref_interval.max))) {
+        printf("refit %s disagrees with linear search on ray %d\n", w == 0 ? "bvh" : w == 1 ? "4 wide bvh" : "8 wide bvh", k);
+        return false;
+      }
+    }
+  }
+  free_wbvh(wbvhs[0]);
+  free_wbvh(wbvhs[1]);
+  free_scene(&scene);
+  return true;
+}
+
+// each backend's triangle kernel against scalar over ranges that don't start
+// or end on a vector, then the triangle BVH against linear search: same
+// triangle, same t, and hit_scene's normal facing the ray
+bool test_triangle_kernels_match_scalar() {
+  fast_srand(17);
+  material_t matte = new_lambertian(new_vec3(0.5, 0.5, 0.5));
+  triangle_list_t *triangles = new_triangle_list(0, 1);
+  add_bumpy_sphere(triangles, new_vec3(0, 0, 0), 4.0, 3000, matte);
+  for (int i = 0; i < 500; i++) {
+    uint32_t v = add_vertex(triangles, random_vec3(-8.0, 8.0));
+    add_vertex(triangles, add(triangle_vertex(triangles, v), random_vec3(-1.0, 1.0)));
+    add_vertex(triangles, add(triangle_vertex(triangles, v), random_vec3(-1.0, 1.0)));
+    add_triangle(triangles, v, v + 1, v + 2, new_metal(new_vec3(0.9, 0.9, 0.9), 0.1));
+  }
+  size_t n = triangles->n_triangles;
+  bool ok = (uintptr_t)triangles->axs % 64 == 0 && (uintptr_t)triangles->e2zs % 64 == 0;
+  for (size_t i = n; i < sphere_list_padded(triangles->max_triangles); i++) {
+    ok = ok && triangles->e1xs[i] == 0 && triangles->e2zs[i] == 0;
+  }
+
+  for (simd_backend_t b = SIMD_NEON; b <= SIMD_AVX512 && ok; b++) {
+    if (!simd_backend_supported(b)) {
+      continue;
+    }
+    closest_triangle_fn_t kernel = closest_triangle_kernel(b);
+    for (int k = 0; k < 4000; k++) {
+      ray_t ray = new_ray(random_vec3(-10.0, 10.0), random_vec3_on_unit_sphere());
+      size_t start = k % 2 == 0 ? 0 : k % 11 + n - 600;
+      size_t end = k % 2 == 0 ? n : start + 1 + k % 37;
+      interval_t ref_interval = {.min = 0.001, .max = INFINITY};
+      interval_t interval = ref_interval;
+      size_t ref_closest = 0, closest = 0;
+      bool ref_hit = closest_triangle_scalar(triangles, start, end, &ray, &ref_interval, &ref_closest);
+      bool hit = kernel(triangles, start, end, &ray, &interval, &closest);
+      // a ray through an edge two triangles share hits both at the same t,
+      // and fma can tip which one a kernel picks
+      if (hit != ref_hit || (hit && fabsf(interval.max - ref_interval.max) > 1e-3f)) {
+        printf("%s triangles disagree with scalar on ray %d, triangles %zu to %zu\n", simd_backend_name(b), k, start, end);
+        ok = false;
+        break;
+      }
+    }
+  }
+
+  scene_t scene = new_scene(new_sphere_list(0), new_material_list(0));
+  scene_set_triangles(&scene, triangles);
+  ray_t rays[3000];
+  bool ref_hits[3000];
+  float ref_ts[3000];
+  size_t ref_closests[3000];
+  for (int k = 0; k < 3000; k++) {
+    rays[k] = new_ray(random_vec3(-12.0, 12.0), random_vec3_on_unit_sphere());
+    interval_t interval = {.min = 0.001, .max = INFINITY};
+    ref_hits[k] = closest_triangle(triangles, 0, n, &rays[k], &interval, &ref_closests[k]);
+    ref_ts[k] = interval.max;
+  }
+  scene_build_bvh(&scene);
+  for (int k = 0; k < 3000 && ok; k++) {
+    interval_t interval = {.min = 0.001, .max = INFINITY};
+    hit_record_t rec;
+    bool hit = hit_scene(&scene, &rays[k], &interval, &rec);
+    size_t closest = 0;
+    interval_t bvh_interval = interval;
+    closest_triangle_bvh(scene.triangle_bvh, triangles, &rays[k], &bvh_interval, &closest);
+    if (hit != ref_hits[k] || (hit && (rec.t != ref_ts[k] || scene.triangle_bvh->prim_ids[closest] != ref_closests[k]
+                                       || dot(rec.normal, rays[k].direction) > 0 || rec.sphere != HIT_TRIANGLE
+                                       || rec.mat->type != sphere_material(triangles->materials, closest)->type))) {
+      printf("triangle bvh disagrees with linear search on ray %d\n", k);
+      ok = false;
+    }
+  }
+  free_scene(&scene);
+  return ok;
+}
+
+// every lane of a packet must find the same hit as that ray traced on its
+// own, with and without the BVH and on every backend. half the packets are
+// coherent (shared origin, nearby directions), half are random rays, which
+// also exercises the lanes with mixed direction signs. t is compared with a
+// little slack since the FMA backends round differently.
+bool test_packets_match_single_rays() {
+  fast_srand(11);
+  scene_t scene = new_random_scene(3000);
+  scene_build_bvh(&scene);
+  simd_backend_t backends[] = {SIMD_SCALAR, SIMD_NEON, SIMD_SSE41, SIMD_AVX2, SIMD_AVX512};
+  bool ok = true;
+
+  for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]) && ok; b++) {
+    if (!simd_backend_supported(backends[b])) {
+      continue;
+    }
+    select_simd_backend(backends[b]);
+    for (int k = 0; k < 400 && ok; k++) {
+      ray_packet_t packet;
+      packet.width = packet_width;
+      ray_t rays[PACKET_MAX_WIDTH];
+      point3_t origin = random_vec3(-30.0, 30.0);
+      vec3_t heading = random_vec3_on_unit_sphere();
+      for (int l = 0; l < packet.width; l++) {
+        if (k % 2 == 0) {
+          rays[l] = new_ray(origin, normalize(add(heading, scale(random_vec3_on_unit_sphere(), 0.05))));
+        } else {
+          rays[l] = new_ray(random_vec3(-30.0, 30.0), random_vec3_on_unit_sphere());
+        }
+        packet_set_ray(&packet, l, &rays[l]);
+      }
+      interval_t interval = {.min = 0.001, .max = INFINITY};
+      packet_begin(&packet, &interval);
+      trace_packet(k % 4 < 2 ? scene.bvh : NULL, scene.sphere_list, &packet);
+
+      for (int l = 0; l < packet.width; l++) {
+        interval_t ref_interval = interval;
+        size_t ref_closest = 0;
+        bool ref_hit = closest_sphere_bvh(scene.bvh, scene.sphere_list, &rays[l], &ref_interval, &ref_closest);
+        bool hit = packet.sphere[l] >= 0;
+        if (hit != ref_hit || (hit && (size_t)packet.sphere[l] != ref_closest && fabsf(packet.t_max[l] - ref_interval.max) > 1e-4f * ref_interval.max)) {
+          printf("%s packet lane %d disagrees with single ray %d\n", simd_backend_name(backends[b]), l, k);
+          ok = false;
+          break;
+        }
+      }
+    }
+  }
+  select_simd_backend(SIMD_SCALAR);
+  return ok;
+}
+
+// the wavefront scatter kernels must do what scatter() does. each case is
+// run through both as the same sample and bounce, so they draw the same
+// random numbers.
+bool test_wavefront_kernels_match_scatter() {
+  material_t materials[] = {
+    new_lambertian(new_vec3(0.8, 0.5, 0.2)),
+    new_metal(new_vec3(0.7, 0.6, 0.5), 0.0),
+    new_metal(new_vec3(0.9, 0.9, 0.9), 0.3),
+    new_dielectric(1.5)
+  };
+  path_queue_t queue;
+  init_path_queue(&queue, 16);
+  bool ok = true;
+
+  for (size_t m = 0; m < sizeof(materials) / sizeof(materials[0]); m++) {
+    const material_t *mat = &materials[m];
+    for (int k = 0; k < 500 && ok; k++) {
+      vec3_t outward = random_vec3_on_unit_sphere();
+      ray_t ray_in = new_ray(random_vec3(-1.0, 1.0), random_vec3_on_unit_sphere());
+      hit_record_t rec = {.p = random_vec3(-1.0, 1.0), .t = 1.0, .mat = (material_t *)mat};
+      set_face_normal(&rec, &ray_in, outward);
+
+      queue.dx[0] = ray_in.direction.e[0];
+      queue.dy[0] = ray_in.direction.e[1];
+      queue.dz[0] = ray_in.direction.e[2];
+      queue.nx[0] = outward.e[0];
+      queue.ny[0] = outward.e[1];
+      queue.nz[0] = outward.e[2];
+      queue.tr[0] = queue.tg[0] = queue.tb[0] = 1.0f;
+      queue.depth[0] = 2;
+      queue.key[0] = rng_sample_key(77, k);
+      queue.bounce[0] = 1;
+
+      rng_begin_sample(77, k);
+      rng_begin_bounce(1);
+      color_t attenuation = new_vec3(1.0, 1.0, 1.0);
+      ray_t scattered;
+      bool alive = scatter(mat, &ray_in, &rec, &attenuation, &scattered);
+
+      if (mat->type == LAMBERTIAN) {
+        queue.ar[0] = mat->data.lambertian.albedo.e[0];
+        queue.ag[0] = mat->data.lambertian.albedo.e[1];
+        queue.ab[0] = mat->data.lambertian.albedo.e[2];
+        scatter_lambertian_kernel(&queue, 0, 1);
+      } else if (mat->type == METAL) {
+        queue.ar[0] = mat->data.metal.albedo.e[0];
+        queue.ag[0] = mat->data.metal.albedo.e[1];
+        queue.ab[0] = mat->data.metal.albedo.e[2];
+        queue.param[0] = mat->data.metal.fuzz;
+        scatter_metal_kernel(&queue, 0, 1);
+      } else {
+        queue.param[0] = mat->data.dielectric.ir;
+        scatter_dielectric_kernel(&queue, 0, 1);
+      }
+
+      vec3_t direction_error = subtract(new_vec3(queue.dx[0], queue.dy[0], queue.dz[0]), scattered.direction);
+      vec3_t throughput_error = subtract(new_vec3(queue.tr[0], queue.tg[0], queue.tb[0]), attenuation);
+      if (alive != (queue.depth[0] > 0)) {
+        printf("material %zu case %d: absorption differs\n", m, k);
+        ok = false;
+      } else if (alive && (length(&direction_error) > 1e-4 || length(&throughput_error) > 1e-6)) {
+        printf("material %zu case %d: scattered ray differs\n", m, k);
+        ok = false;
+      }
+    }
+  }
+  free(queue.ox);
+  return ok;
+}
+
+// sky pixels are about as flat as it gets and should stop at min_samples,
+// while a diffuse ground pixel asked for a tiny error runs to the maximum
+bool test_adaptive_sampling_stops_early_on_flat_pixels() {
+  fast_srand(5);
+  sphere_list_t *sphere_list = new_sphere_list(1);
+  material_list_t *material_list = new_material_list(1);
+  add_sphere(sphere_list, new_vec3(0, -1000, 0), 1000);
+  add_material(material_list, new_lambertian(new_vec3(0.5, 0.5, 0.5)));
+  scene_t scene = new_scene(sphere_list, material_list);
+
+  camera_t camera = initialize_camera(1.0, 16, 64, 10, 90, new_vec3(0, 1, 0), new_vec3(0, 1, -1), new_vec3(0, 1, 0), 0.0, 1.0);
+  camera.adaptive_threshold = 0.01;
+  camera.min_samples = 8;
+  pixel_stats_t sky = {0};
+  sample_pixel_adaptive(&camera, &scene, sample_pixel, 8, 0, camera.samples_per_pixel, &sky);
+
+  camera.adaptive_threshold = 1e-5;
+  pixel_stats_t ground_pixel = {0};
+  sample_pixel_adaptive(&camera, &scene, sample_pixel, 8, 15, camera.samples_per_pixel, &ground_pixel);
+
+  free_sphere_list(sphere_list);
+  free_material_list(material_list);
+  if (sky.n != 8 || ground_pixel.n != 64) {
+    printf("sky took %d samples, ground %d\n", sky.n, ground_pixel.n);
+    return false;
+  }
+  // and a sample count map that can't be written is reported, not a crash
+  int counts[4] = {8, 64, 8, 64};
+  return !write_sample_counts("no_such_directory/samples.pgm", counts, 2, 2, 64);
+}
+
+// a checkpoint reads back exactly as written, and isn't accepted for an
+// image of a different size
+bool test_checkpoint_round_trip() {
+  camera_t camera = initialize_camera(2.0, 8, 32, 10, 90, new_vec3(0, 0, 0), new_vec3(0, 0, -1), new_vec3(0, 1, 0), 0.0, 1.0);
+  int n_pixels = camera.image_width * camera.image_height;
+  pixel_stats_t *stats = calloc(n_pixels, sizeof(pixel_stats_t));
+  pixel_stats_t *loaded = calloc(n_pixels, sizeof(pixel_stats_t));
+  for (int p = 0; p < n_pixels; p++) {
+    pixel_add_sample(&stats[p], new_vec3(p, 0.5, 0.25));
+    pixel_add_sample(&stats[p], new_vec3(0.1, p, 0.75));
+  }
+
+  fast_srand(9);
+  scene_t scene = new_random_scene(20);
+  uint64_t fingerprint = checkpoint_fingerprint(&camera, &scene);
+  const char *path = "test_checkpoint.ckpt";
+  checkpoint_header_t header = new_checkpoint_header(&camera, fingerprint, 4, 3);
+  int pass_samples = 0;
+  bool ok = write_checkpoint(path, &header, stats)
+         && load_checkpoint(path, &camera, fingerprint, loaded, &pass_samples) == 3
+         && pass_samples == 4
+         && memcmp(stats, loaded, n_pixels * sizeof(pixel_stats_t)) == 0;
+
+  // another render's checkpoint isn't resumed: other samples per pixel,
+  // another view, another scene or another image size
+  camera_t other = camera;
+  other.samples_per_pixel = 64;
+  ok &= load_checkpoint(path, &other, fingerprint, loaded, &pass_samples) == -1;
+  other = camera;
+  camera_look(&other, new_vec3(0, 0, 1), new_vec3(0, 0, -1), new_vec3(0, 1, 0), 90, 0.0, 1.0);
+  ok &= checkpoint_fingerprint(&other, &scene) != fingerprint;
+  scene.sphere_list->xs[3] += 1.0f;
+  ok &= checkpoint_fingerprint(&camera, &scene) != fingerprint;
+  ok &= load_checkpoint(path, &camera, checkpoint_fingerprint(&camera, &scene), loaded, &pass_samples) == -1;
+  // nor one whose passes make no sense
+  checkpoint_header_t no_passes = new_checkpoint_header(&camera, fingerprint, 0, 3);
+  ok &= write_checkpoint(path, &no_passes, stats) && load_checkpoint(path, &camera, fingerprint, loaded, &pass_samples) == -1;
+  checkpoint_header_t negative = new_checkpoint_header(&camera, fingerprint, 4, -1);
+  ok &= write_checkpoint(path, &negative, stats) && load_checkpoint(path, &camera, fingerprint, loaded, &pass_samples) == -1;
+  ok &= write_checkpoint(path, &header, stats) && load_checkpoint(path, &camera, fingerprint, loaded, &pass_samples) == 3;
+  camera.image_width = 16;
+  ok &= load_checkpoint(path, &camera, fingerprint, loaded, &pass_samples) == -1;
+  remove(path);
+  free_scene(&scene);
+  free(stats);
+  free(loaded);
+  return ok;
+}
+
+// the direct samplers land where they should with the right moments, the
+// batched ones agree with the per-point ones, and sincos_pi is within a few
+// ulps of libm
+bool test_samplers() {
+  bool ok = true;
+  for (int k = -10000; k <= 10000; k++) {
+    float x = pi * k / 10000.0f;
+    float s, c;
+    sincos_pi(x, &s, &c);
+    if (fabsf(s - sinf(x)) > 4e-7f || fabsf(c - cosf(x)) > 4e-7f) {
+      printf("sincos_pi(%g) = %g, %g\n", x, s, c);
+      ok = false;
+      break;
+    }
+  }
+
+  int n = 20000;
+  float *u = malloc(n * sizeof(float)), *v = malloc(n * sizeof(float));
+  float *x = malloc(n * sizeof(float)), *y = malloc(n * sizeof(float)), *z = malloc(n * sizeof(float));
+  for (int i = 0; i < n; i++) {
+    u[i] = rng_uniform(1, i);
+    v[i] = rng_uniform(2, i);
+  }
+  // the corners and the middle too
+  u[0] = v[0] = 0.0f;
+  u[1] = v[1] = 0.5f;
+  u[2] = v[2] = 0.99999994f;
+
+  double sum_z = 0, sum_z2 = 0;
+  uniform_sphere_points(u, v, x, y, z, n);
+  for (int i = 0; i < n && ok; i++) {
+    float px, py, pz;
+    uniform_sphere_point(u[i], v[i], &px, &py, &pz);
+    ok = px == x[i] && py == y[i] && pz == z[i] && fabsf(px*px + py*py + pz*pz - 1.0f) < 1e-5f;
+    sum_z += pz;
+    sum_z2 += pz * pz;
+  }
+  ok &= fabs(sum_z / n) < 0.02 && fabs(sum_z2 / n - 1.0 / 3) < 0.02;
+
+  double sum_r2 = 0;
+  concentric_disk_points(u, v, x, y, n);
+  for (int i = 0; i < n && ok; i++) {
+    float px, py;
+    concentric_disk_point(u[i], v[i], &px, &py);
+    ok = px == x[i] && py == y[i] && px*px + py*py <= 1.0f + 1e-6f;
+    sum_r2 += px*px + py*py;
+  }
+  // uniform over the disk: E[r^2] = 1/2
+  ok &= fabs(sum_r2 / n - 0.5) < 0.02;
+
+  sum_z = 0;
+  cosine_hemisphere_points(u, v, x, y, z, n);
+  for (int i = 0; i < n && ok; i++) {
+    float px, py, pz;
+    cosine_hemisphere_point(u[i], v[i], &px, &py, &pz);
+    ok = px == x[i] && py == y[i] && pz == z[i] && pz >= 0 && fabsf(px*px + py*py + pz*pz - 1.0f) < 1e-5f;
+    sum_z += pz;
+  }
+  // cosine weighted: E[cos theta] = 2/3
+  ok &= fabs(sum_z / n - 2.0 / 3) < 0.02;
+
+  // and the frame keeps unit vectors unit and puts +z on the normal
+  for (int i = 0; i < 1000 && ok; i++) {
+    vec3_t normal = random_vec3_on_unit_sphere();
+    float wx, wy, wz;
+    frame_to_world(normal.e[0], normal.e[1], normal.e[2], 0, 0, 1, &wx, &wy, &wz);
+    vec3_t error = subtract(new_vec3(wx, wy, wz), normal);
+    vec3_t d = random_vec3_cosine_direction(normal);
+    ok = length(&error) < 1e-5f && dot(d, normal) >= -1e-6f && fabsf(length(&d) - 1.0f) < 1e-5f;
+  }
+
+  if (!ok) {
+    printf("a sampler is off\n");
+  }
+  free(u);
+  free(v);
+  free(x);
+  free(y);
+  free(z);
+  return ok;
+}
+
+// how many ulps of the float nearest ref got is out by
+double ulps_off(float got, double ref) {
+  float nearest = (float)ref;
+  double ulp = (double)nextafterf(fabsf(nearest), INFINITY) - fabsf(nearest);
+  return fabs(got - ref) / ulp;
+}
+
+float float_from_bits(uint32_t bits) {
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+// fastmath.h keeps to the error bounds it documents, against libm in
+// double, and the batched versions give the same bits as the scalar ones
+bool test_fastmath_error_bounds() {
+  bool ok = true;
+  // 1/sqrt(4x) is 1/sqrt(x) / 2, so every float in [1, 4) covers every
+  // mantissa and exponent parity. then a spread of exponents.
+  double worst = 0;
+  for (uint32_t bits = 0x3f800000u; bits < 0x40800000u; bits++) {
+    float x = float_from_bits(bits);
+    double off = ulps_off(rsqrt_float(x), 1.0 / sqrt((double)x));
+    worst = off > worst ? off : worst;
+  }
+  for (int e = -120; e <= 120; e++) {
+    for (int k = 0; k < 100; k++) {
+      float x = ldexpf(1.0f + k / 100.0f, e);
+      double off = ulps_off(rsqrt_float(x), 1.0 / sqrt((double)x));
+      worst = off > worst ? off : worst;
+    }
+  }
+  if (worst > 4.0) {
+    printf("rsqrt_float is out by %.2f ulps\n", worst);
+    ok = false;
+  }
+
+  // every 16th float in [2^-24, 1], where m^5 is still normal
+  worst = 0;
+  for (uint32_t bits = 0x33800000u; bits <= 0x3f800000u; bits += 16) {
+    float m = float_from_bits(bits);
+    double off = ulps_off(schlick_weight(1.0f - m), pow((double)(1.0f - (1.0f - m)), 5));
+    worst = off > worst ? off : worst;
+  }
+  if (worst > 3.0) {
+    printf("schlick_weight is out by %.2f ulps\n", worst);
+    ok = false;
+  }
+
+  // an odd count, so the scalar tail runs too
+  int n = 37;
+  float x[37], y[37], z[37], lengths[37], inv[37];
+  for (int i = 0; i < n; i++) {
+    vec3_t v = random_vec3(-10.0, 10.0);
+    x[i] = v.e[0];
+    y[i] = v.e[1];
+    z[i] = v.e[2];
+    lengths[i] = length_squared(&v);
+  }
+  rsqrt_floats(lengths, inv, n);
+  for (int i = 0; i < n && ok; i++) {
+    ok = inv[i] == rsqrt_float(lengths[i]);
+  }
+  vec3_t expected[37];
+  for (int i = 0; i < n; i++) {
+    expected[i] = normalize(new_vec3(x[i], y[i], z[i]));
+  }
+  normalize_floats(x, y, z, n);
+  for (int i = 0; i < n && ok; i++) {
+    ok = x[i] == expected[i].e[0] && y[i] == expected[i].e[1] && z[i] == expected[i].e[2];
+    ok &= fabsf(length(&expected[i]) - 1.0f) < 1e-6f;
+  }
+  if (!ok) {
+    printf("batched fast math differs from scalar\n");
+  }
+  return ok;
+}
+
+// the batched generators must match rng_uniform bit for bit, and a render
+// must come out the same whatever the number of threads
+bool test_rng_is_deterministic() {
+  bool ok = true;
+  uint32_t streams[37];
+  float expected[37], got[37];
+  double sum = 0;
+  for (int i = 0; i < 37; i++) {
+    streams[i] = rng_bounce_stream(rng_sample_key(i, 3), 2);
+  }
+  for (uint32_t d = 0; d < 1000; d++) {
+    for (int i = 0; i < 37; i++) {
+      expected[i] = rng_uniform(streams[i], d);
+      ok &= expected[i] >= 0.0f && expected[i] < 1.0f;
+      sum += expected[i];
+    }
+    for (simd_backend_t b = SIMD_SCALAR; b <= SIMD_AVX512 && ok; b++) {
+      if (!simd_backend_supported(b)) {
+        continue;
+      }
+      select_rng_backend(b);
+      rng_uniform_fill(streams, d, got, 37);
+      if (memcmp(got, expected, sizeof(got)) != 0) {
+        printf("%s rng differs from scalar at dimension %u\n", simd_backend_name(b), d);
+        ok = false;
+      }
+    }
+  }
+  select_rng_backend(SIMD_SCALAR);
+  double mean = sum / (37 * 1000);
+  if (fabs(mean - 0.5) > 0.01) {
+    printf("rng mean %f\n", mean);
+    ok = false;
+  }
+
+  fast_srand(9);
+  scene_t scene = new_random_scene(60);
+  camera_t camera = initialize_camera(1.5, 48, 8, 8, 40, new_vec3(0, 0, 12), new_vec3(0, 0, 0), new_vec3(0, 1, 0), 0.5, 12.0);
+  int n_pixels = camera.image_width * camera.image_height;
+  color_t *one = malloc(n_pixels * sizeof(color_t));
+  color_t *many = malloc(n_pixels * sizeof(color_t));
+  for (int mode = 0; mode < 3 && ok; mode++) {
+    camera.packets = mode == 1;
+    camera.wavefront = mode == 2;
+    thread_pool_t *pool = new_thread_pool(1);
+    render_to_buffer(&camera, &scene, pool, one, NULL, NULL);
+    free_thread_pool(pool);
+    pool = new_thread_pool(3);
+    render_to_buffer(&camera, &scene, pool, many, NULL, NULL);
+    free_thread_pool(pool);
+    if (memcmp(one, many, n_pixels * sizeof(color_t)) != 0) {
+      printf("render mode %d changes with the thread count\n", mode);
+      ok = false;
+    }
+  }
+  free(one);
+  free(many);
+  free_scene(&scene);
+  return ok;
+}
+
+// every path is counted once whatever the engine, its rays add up to the
+// totals, and every ray that didn't escape hit some material. the
+// megakernel and wavefront engines trace the same paths, so they count
+// exactly the same.
+bool test_render_stats_add_up() {
+  fast_srand(9);
+  scene_t scene = new_random_scene(60);
+  camera_t camera = initialize_camera(1.5, 40, 6, 8, 40, new_vec3(0, 0, 12), new_vec3(0, 0, 0), new_vec3(0, 1, 0), 0, 12.0);
+  int n_pixels = camera.image_width * camera.image_height;
+  int n_tiles = ((camera.image_width + TILE_SIZE - 1) / TILE_SIZE) * ((camera.image_height + TILE_SIZE - 1) / TILE_SIZE);
+  color_t *pixels = malloc(n_pixels * sizeof(color_t));
+  thread_pool_t *pool = new_thread_pool(2);
+  render_stats_t thread_stats[2];
+  render_stats_t totals[3];
+
+  bool ok = true;
+  for (int mode = 0; mode < 3 && ok; mode++) {
+    camera.packets = mode == 1;
+    camera.wavefront = mode == 2;
+    render_to_buffer(&camera, &scene, pool, pixels, NULL, thread_stats);
+    render_stats_t *total = &totals[mode];
+    *total = (render_stats_t){0};
+    merge_render_stats(total, &thread_stats[0]);
+    merge_render_stats(total, &thread_stats[1]);
+
+    unsigned long rays = total->primary_rays + total->secondary_rays;
+    unsigned long length_rays = 0, paths = 0, hits = 0;
+    for (int n = 0; n <= STATS_MAX_PATH; n++) {
+      length_rays += n * total->path_lengths[n];
+      paths += total->path_lengths[n];
+    }
+    for (int m = 0; m < N_MATERIAL_TYPES; m++) {
+      hits += total->material_hits[m];
+    }
+    ok = total->primary_rays == (unsigned long)n_pixels * camera.samples_per_pixel
+         && render_stats_paths(total) == total->primary_rays && paths == total->primary_rays
+         && length_rays == rays && hits == rays - total->path_ends[PATH_ESCAPED]
+         && total->sphere_tests == rays * 60 && total->tiles == (unsigned long)n_tiles;
+    if (!ok) {
+      printf("render mode %d: stats don't add up\n", mode);
+    }
+  }
+  // everything but the timings
+  ok = ok && memcmp(&totals[0], &totals[2], offsetof(render_stats_t, tile_seconds)) == 0;
+  free_thread_pool(pool);
+  free(pixels);
+  free_scene(&scene);
+  return ok;
+}
+
+// with roulette from the second ray on the image averages out the same as
+// without, in either engine, and traces fewer secondary rays getting there
+bool test_roulette_is_unbiased() {
+  fast_srand(9);
+  scene_t scene = new_random_scene(60);
+  camera_t camera = initialize_camera(1.0, 24, 256, 16, 40, new_vec3(0, 0, 12), new_vec3(0, 0, 0), new_vec3(0, 1, 0), 0, 12.0);
+  int n_pixels = camera.image_width * camera.image_height;
+  color_t *pixels = malloc(n_pixels * sizeof(color_t));
+  double means[3];
+  unsigned long secondary[3];
+  thread_pool_t *pool = new_thread_pool(2);
+  render_stats_t thread_stats[2];
+
+  bool ok = true;
+  for (int run = 0; run < 3; run++) {
+    camera.roulette_depth = run == 0 ? 0 : 2;
+    camera.wavefront = run == 2;
+    render_to_buffer(&camera, &scene, pool, pixels, NULL, thread_stats);
+    secondary[run] = thread_stats[0].secondary_rays + thread_stats[1].secondary_rays;
+    means[run] = 0;
+    for (int i = 0; i < n_pixels; i++) {
+      means[run] += pixels[i].e[0] + pixels[i].e[1] + pixels[i].e[2];
+    }
+    means[run] /= 3.0 * n_pixels;
+    if (fabs(means[run] - means[0]) > 0.01 * means[0] || (run > 0 && secondary[run] >= secondary[0])) {
+      printf("roulette run %d: mean %f against %f, %lu secondary rays against %lu\n", run, means[run], means[0], secondary[run], secondary[0]);
+      ok = false;
+    }
+  }
+  free(pixels);
+  free_thread_pool(pool);
+  free_scene(&scene);
+  return ok;
+}
+
+// the mean of (a - b)^2 over n pixels' channels
+double mean_squared_difference(const color_t *a, const color_t *b, int n) {
+  double sum = 0;
+  for (int i = 0; i < n; i++) {
+    for (int c = 0; c < 3; c++) {
+      double d = a[i].e[c] - b[i].e[c];
+      sum += d * d;
+    }
+  }
+  return sum / (3.0 * n);
+}
+
+// a floor and two balls lit only by a small light above them, out of view.
+// with next event estimation the image should come out the same on average
+// as without (which is much noisier, so gets more slack), in either engine,
+// and at the same sample count with at least ten times less variance
+// against a long reference render.
+bool test_light_sampling_converges_faster() {
+  sphere_list_t *sphere_list = new_sphere_list(4);
+  material_list_t *material_list = new_material_list(4);
+  material_t materials[] = {
+    new_lambertian(new_vec3(0.7, 0.7, 0.7)),
+    new_lambertian(new_vec3(0.3, 0.5, 0.8)),
+    new_emissive(new_vec3(50, 50, 50)),
+    new_lambertian(new_vec3(0.8, 0.6, 0.3))
+  };
+  add_sphere(sphere_list, new_vec3(0, -1000, 0), 1000);
+  add_sphere(sphere_list, new_vec3(-1, 0.5, 0), 0.5);
+  add_sphere(sphere_list, new_vec3(0.5, 3, 0.5), 0.3);
+  add_sphere(sphere_list, new_vec3(1, 0.5, -0.5), 0.5);
+  for (int m = 0; m < 4; m++) {
+    add_material(material_list, materials[m]);
+  }
+  scene_t scene = new_scene(sphere_list, material_list);
+  scene.sky = new_vec3(0, 0, 0);
+  camera_t camera = initialize_camera(1.0, 16, 512, 8, 60, new_vec3(0, 1.5, 4), new_vec3(0, 0.3, 0), new_vec3(0, 1, 0), 0, 4.0);
+  int n_pixels = camera.image_width * camera.image_height;
+  color_t *reference = malloc(n_pixels * sizeof(color_t));
+  color_t *pixels = malloc(n_pixels * sizeof(color_t));
+  thread_pool_t *pool = new_thread_pool(2);
+  render_stats_t thread_stats[2];
+  bool ok = scene.lights->n_lights == 1;
+  render_to_buffer(&camera, &scene, pool, reference, NULL, NULL);
+
+  double means[3], errors[3];
+  unsigned long shadow_rays[3];
+  camera.samples_per_pixel = 32;
+  for (int run = 0; run < 3; run++) {
+    camera.light_sampling = run != 1;
+    camera.wavefront = run == 2;
+    render_to_buffer(&camera, &scene, pool, pixels, NULL, thread_stats);
+    shadow_rays[run] = thread_stats[0].shadow_rays + thread_stats[1].shadow_rays;
+    errors[run] = mean_squared_difference(pixels, reference, n_pixels);
+    means[run] = 0;
+    for (int i = 0; i < n_pixels; i++) {
+      means[run] += pixels[i].e[0] + pixels[i].e[1] + pixels[i].e[2];
+    }
+    means[run] /= 3.0 * n_pixels;
+  }
+  double reference_mean = 0;
+  for (int i = 0; i < n_pixels; i++) {
+    reference_mean += reference[i].e[0] + reference[i].e[1] + reference[i].e[2];
+  }
+  reference_mean /= 3.0 * n_pixels;
+
+  ok = ok && shadow_rays[0] > 0 && shadow_rays[1] == 0 && shadow_rays[2] == shadow_rays[0]
+       && fabs(means[0] - reference_mean) < 0.02 * reference_mean && fabs(means[1] - reference_mean) < 0.1 * reference_mean
+       && fabs(means[2] - means[0]) < 1e-4 * means[0] && 10 * errors[0] < errors[1];
+  if (!ok) {
+    printf("light sampling: means %f %f %f against %f, errors %g %g %g, shadow rays %lu %lu %lu\n", means[0], means[1], means[2], reference_mean,
+           errors[0], errors[1], errors[2], shadow_rays[0], shadow_rays[1], shadow_rays[2]);
+  }
+  free_thread_pool(pool);
+  free(reference);
+  free(pixels);
+  free_scene(&scene);
+  return ok;
+}
+
+// a floor, two matte balls and a rough metal one under the sky, seen from
+// above. 16 samples denoised should have at least three times less squared
+// error against a long reference render than the 16 samples did, and come
+// out the same on one thread as on three.
+bool test_denoise_reduces_error() {
+  sphere_list_t *sphere_list = new_sphere_list(4);
+  material_list_t *material_list = new_material_list(4);
+  material_t materials[] = {
+    new_lambertian(new_vec3(0.7, 0.7, 0.7)),
+    new_lambertian(new_vec3(0.2, 0.3, 0.7)),
+    new_metal(new_vec3(0.7, 0.6, 0.5), 0.3),
+    new_lambertian(new_vec3(0.8, 0.6, 0.3))
+  };
+  add_sphere(sphere_list, new_vec3(0, -1000, 0), 1000);
+  add_sphere(sphere_list, new_vec3(-1, 0.5, 0), 0.5);
+  add_sphere(sphere_list, new_vec3(0, 0.4, -1), 0.4);
+  add_sphere(sphere_list, new_vec3(1, 0.5, -0.5), 0.5);
+  for (int m = 0; m < 4; m++) {
+    add_material(material_list, materials[m]);
+  }
+  scene_t scene = new_scene(sphere_list, material_list);
+  camera_t camera = initialize_camera(1.0, 48, 512, 8, 50, new_vec3(0, 2.5, 2.5), new_vec3(0, 0.3, -0.3), new_vec3(0, 1, 0), 0, 4.0);
+  int n_pixels = camera.image_width * camera.image_height;
+  color_t *reference = malloc(n_pixels * sizeof(color_t));
+  color_t *pixels = malloc(n_pixels * sizeof(color_t));
+  color_t *single = malloc(n_pixels * sizeof(color_t));
+  thread_pool_t *pool = new_thread_pool(3);
+  thread_pool_t *one = new_thread_pool(1);
+  render_to_buffer(&camera, &scene, pool, reference, NULL, NULL);
+
+  camera.samples_per_pixel = 16;
+  render_to_buffer(&camera, &scene, pool, pixels, NULL, NULL);
+  double noisy = mean_squared_difference(pixels, reference, n_pixels);
+  memcpy(single, pixels, n_pixels * sizeof(color_t));
+  aov_buffers_t *aovs = render_aovs(&camera, &scene, pool);
+  denoise(pixels, aovs, pool);
+  denoise(single, aovs, one);
+  double denoised = mean_squared_difference(pixels, reference, n_pixels);
+
+  bool ok = 3 * denoised < noisy && memcmp(pixels, single, n_pixels * sizeof(color_t)) == 0;
+  if (!ok) {
+    printf("denoise: error %g noisy, %g denoised\n", noisy, denoised);
+  }
+  free_aov_buffers(aovs);
+  free_thread_pool(pool);
+  free_thread_pool(one);
+  free(reference);
+  free(pixels);
+  free(single);
+  free_scene(&scene);
+  return ok;
+}
+
+// each render variant is picked for the scenes it's meant for, and renders
+// exactly what the generic sample_pixel does, one ray at a time or in
+// packets
+bool test_render_variants_match_generic() {
+  material_t materials[] = {
+    new_lambertian(new_vec3(0.7, 0.3, 0.3)),
+    new_metal(new_vec3(0.8, 0.8, 0.9), 0.2),
+    new_dielectric(1.5),
+    new_emissive(new_vec3(4, 4, 4))
+  };
+  const char *expected[][2] = {
+    {"pinhole_diffuse", "lens_diffuse"},
+    {"pinhole_opaque", "lens_opaque"},
+    {"pinhole_unlit", "lens_unlit"},
+    {"pinhole_all", "lens_all"}
+  };
+  bool ok = true;
+  thread_pool_t *pool = new_thread_pool(2);
+  for (int n_types = 1; n_types <= 4 && ok; n_types++) {
+    fast_srand(21);
+    sphere_list_t *sphere_list = new_sphere_list(40);
+    material_list_t *material_list = new_material_list(40);
+    add_sphere(sphere_list, new_vec3(0, -1000, 0), 999);
+    add_material(material_list, materials[0]);
+    for (int k = 0; k < 39; k++) {
+      add_sphere(sphere_list, random_vec3(-3, 3), random_float_range(0.2, 0.6));
+      add_material(material_list, materials[k % n_types]);
+    }
+    scene_t scene = new_scene(sphere_list, material_list);
+    for (int lens = 0; lens < 2 && ok; lens++) {
+      camera_t camera = initialize_camera(1.5, 24, 8, 8, 50, new_vec3(0, 2, 9), new_vec3(0, 0, 0), new_vec3(0, 1, 0), lens ? 2.0 : 0, 9.0);
+      int n_pixels = camera.image_width * camera.image_height;
+      color_t *generic = malloc(n_pixels * sizeof(color_t));
+      color_t *specialized = malloc(n_pixels * sizeof(color_t));
+      const char *name = select_render_variant(&camera, &scene)->name;
+      if (strcmp(name, expected[n_types - 1][lens]) != 0) {
+        printf("%d material types, lens %d: got variant %s\n", n_types, lens, name);
+        ok = false;
+      }
+      for (int packets = 0; packets < 2 && ok; packets++) {
+        camera.packets = packets;
+        camera.specialize = false;
+        render_to_buffer(&camera, &scene, pool, generic, NULL, NULL);
+        camera.specialize = true;
+        render_to_buffer(&camera, &scene, pool, specialized, NULL, NULL);
+        if (memcmp(generic, specialized, n_pixels * sizeof(color_t)) != 0) {
+          printf("variant %s renders differently from generic, packets %d\n", name, packets);
+          ok = false;
+        }
+      }
+      free(generic);
+      free(specialized);
+    }
+    free_scene(&scene);
+  }
+
+  // triangles' materials count too
+  sphere_list_t *sphere_list = new_sphere_list(1);
+  material_list_t *material_list = new_material_list(1);
+  add_sphere(sphere_list, new_vec3(0, 0, 0), 1);
+  add_material(material_list, materials[0]);
+  scene_t scene = new_scene(sphere_list, material_list);
+  triangle_list_t *triangles = new_triangle_list(3, 1);
+  add_triangle(triangles, add_vertex(triangles, new_vec3(0, 0, 2)), add_vertex(triangles, new_vec3(1, 0, 2)), add_vertex(triangles, new_vec3(0, 1, 2)), materials[2]);
+  scene_set_triangles(&scene, triangles);
+  camera_t camera = initialize_camera(1.5, 24, 8, 8, 50, new_vec3(0, 2, 9), new_vec3(0, 0, 0), new_vec3(0, 1, 0), 0, 9.0);
+  ok &= strcmp(select_render_variant(&camera, &scene)->name, "pinhole_unlit") == 0;
+  camera.specialize = false;
+  ok &= strcmp(select_render_variant(&camera, &scene)->name, "generic") == 0;
+  free_scene(&scene);
+  free_thread_pool(pool);
+  return ok;
+}
+
+// a coordinator on a unix socket and two worker processes render the same
+// image as one process does. a third worker, which connects first and then
+// never answers, has its tiles taken back after the timeout.
+bool test_distributed_render_matches() {
+  fast_srand(11);
+  scene_t scene = new_random_scene(300);
+  scene_build_bvh(&scene);
+  camera_t camera = initialize_camera(16.0 / 9.0, 160, 4, 8, 40, new_vec3(0, 0, 25), new_vec3(0, 0, 0), new_vec3(0, 1, 0), 0, 25.0);
+  int n_pixels = camera.image_width * camera.image_height;
+  const char *address = "unix:test_render.sock";
+  // the real workers wait for the stalled one to connect
+  int connected[2];
+  if (pipe(connected) != 0) {
+    return false;
+  }
+  fflush(stdout);
+  pid_t stalled = fork();
+  if (stalled == 0) {
+    int fd = -1;
+    for (int attempt = 0; attempt < DISTRIBUTED_CONNECT_TRIES && fd < 0; attempt++) {
+      fd = open_socket(address, false);
+      usleep(DISTRIBUTED_RETRY_MS * 1000);
+    }
+    char buffer[4096];
+    ssize_t signal = write(connected[1], "x", 1);
+    // reads whatever it's sent until the coordinator hangs up on it
+    while (fd >= 0 && signal == 1 && recv(fd, buffer, sizeof(buffer), 0) > 0) {
+    }
+    _exit(0);
+  }
+  pid_t workers[2];
+  for (int k = 0; k < 2; k++) {
+    workers[k] = fork();
+    if (workers[k] == 0) {
+      char go;
+      bool ok = read(connected[0], &go, 1) == 1 && write(connected[1], &go, 1) == 1;
+      thread_pool_t *pool = new_thread_pool(2);
+      ok = ok && run_worker(address, pool);
+      free_thread_pool(pool);
+      _exit(ok ? 0 : 1);
+    }
+  }
+
+  color_t *pixels = malloc(n_pixels * sizeof(color_t));
+  color_t *reference = malloc(n_pixels * sizeof(color_t));
+  render_stats_t stats;
+  int reassigned = render_distributed(&camera, &scene, address, 0.5, pixels, NULL, &stats);
+  bool ok = true;
+  for (int k = 0; k < 3; k++) {
+    int status;
+    pid_t pid = k < 2 ? workers[k] : stalled;
+    ok = ok && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  }
+  close(connected[0]);
+  close(connected[1]);
+  thread_pool_t *pool = new_thread_pool(2);
+  render_to_buffer(&camera, &scene, pool, reference, NULL, NULL);
+
+  ok = ok && reassigned > 0 && memcmp(pixels, reference, n_pixels * sizeof(color_t)) == 0
+          && stats.primary_rays == (unsigned long)n_pixels * camera.samples_per_pixel;
+  if (!ok) {
+    printf("distributed: %d tiles reassigned, %lu primary rays\n", reassigned, stats.primary_rays);
+  }
+  free_thread_pool(pool);
+  free(pixels);
+  free(reference);
+  free_scene(&scene);
+  return ok;
+}
+
+typedef struct {
+  render_context_t *context;
+  const camera_t *camera;
+  const scene_t *scene;
+  color_t *pixels;
+} library_render_t;
+
+void *library_render_thread(void *args) {
+  library_render_t *render = (library_render_t *)args;
+  render_image(render->context, render->camera, render->scene, render->pixels);
+  return NULL;
+}
+
+// the library API: a scene built in an arena and rendered by two contexts at
+// once, from threads of their own, comes out as render_to_buffer renders it.
+// after arena_reset the same scene again fits in the blocks the first left.
+bool test_library_renders_concurrently() {
+  camera_t camera = initialize_camera(16.0 / 9.0, 96, 4, 8, 40, new_vec3(0, 0, 25), new_vec3(0, 0, 0), new_vec3(0, 1, 0), 0, 25.0);
+  int n_pixels = camera.image_width * camera.image_height;
+  fast_srand(17);
+  scene_t heap_scene = new_random_scene(500);
+  scene_build_bvh(&heap_scene);
+  color_t *reference = malloc(n_pixels * sizeof(color_t));
+  thread_pool_t *pool = new_thread_pool(2);
+  render_to_buffer(&camera, &heap_scene, pool, reference, NULL, NULL);
+  free_thread_pool(pool);
+  free_scene(&heap_scene);
+
+  arena_t *arena = new_arena(0);
+  render_context_t *contexts[2] = {new_render_context(2), new_render_context(3)};
+  library_render_t renders[2];
+  size_t reserved = 0;
+  bool ok = true;
+  for (int round = 0; round < 2; round++) {
+    arena_reset(arena);
+    fast_srand(17);
+    scene_t scene = new_random_scene_in(arena, 500);
+    scene_build_bvh(&scene);
+    reserved = round == 0 ? arena->reserved : reserved;
+    pthread_t threads[2];
+    for (int k = 0; k < 2; k++) {
+      renders[k] = (library_render_t){.context = contexts[k], .camera = &camera, .scene = &scene,
+                                      .pixels = malloc(n_pixels * sizeof(color_t))};
+      pthread_create(&threads[k], NULL, library_render_thread, &renders[k]);
+    }
+    for (int k = 0; k < 2; k++) {
+      pthread_join(threads[k], NULL);
+      ok = ok && memcmp(renders[k].pixels, reference, n_pixels * sizeof(color_t)) == 0;
+      free(renders[k].pixels);
+    }
+  }
+  ok = ok && arena->reserved == reserved;
+  free_render_context(contexts[0]);
+  free_render_context(contexts[1]);
+  free_arena(arena);
+  free(reference);
+  return ok;
+}
+
+// an animation whose camera opens its lens after frame 0 renders each frame
+// as a still of that frame's view does, depth of field and all
+bool test_animation_follows_defocus() {
+  camera_t camera = initialize_camera(16.0 / 9.0, 64, 4, 8, 40, new_vec3(0, 0, 25), new_vec3(0, 0, 0), new_vec3(0, 1, 0), 0, 25.0);
+  camera.output_path = "test_animation%d.pfm";
+  camera.output_format = IMAGE_PFM;
+  camera_key_t keys[2] = {
+    {.frame = 0, .lookfrom = new_vec3(0, 0, 25), .lookat = new_vec3(0, 0, 0), .vfov = 40, .defocus_angle = 0, .focus_dist = 25},
+    {.frame = 1, .lookfrom = new_vec3(0, 0, 25), .lookat = new_vec3(0, 0, 0), .vfov = 40, .defocus_angle = 4, .focus_dist = 10}
+  };
+  animation_t animation = {.n_frames = 2, .camera_keys = keys, .n_camera_keys = 2};
+  fast_srand(19);
+  scene_t scene = new_random_scene(300);
+  scene_build_bvh(&scene);
+  thread_pool_t *pool = new_thread_pool(2);
+  bool ok = render_animation(&camera, &scene, pool, &animation);
+
+  int width = camera.image_width, height = camera.image_height;
+  color_t *reference = malloc(width * height * sizeof(color_t));
+  float *floats = malloc(width * height * 3 * sizeof(float));
+  for (int frame = 0; frame < 2 && ok; frame++) {
+    camera_t still = camera;
+    animate_camera(&animation, &still, frame);
+    render_to_buffer(&still, &scene, pool, reference, NULL, NULL);
+    char path[64], header[64];
+    snprintf(path, sizeof(path), camera.output_path, frame);
+    snprintf(header, sizeof(header), "PF\n%d %d\n-1.0\n", width, height);
+    FILE *fp = fopen(path, "rb");
+    char read_header[64] = {0};
+    ok = fp != NULL && fread(read_header, 1, strlen(header), fp) == strlen(header) && strcmp(read_header, header) == 0
+      && fread(floats, sizeof(float), width * height * 3, fp) == (size_t)(width * height * 3);
+    for (int y = 0; y < height && ok; y++) {
+      for (int x = 0; x < width; x++) {
+        const float *f = floats + ((height - 1 - y) * width + x) * 3;
+        color_t c = reference[y * width + x];
+        ok &= f[0] == c.e[0] && f[1] == c.e[1] && f[2] == c.e[2];
+      }
+    }
+    if (fp != NULL) {
+      fclose(fp);
+    }
+    remove(path);
+    if (!ok) {
+      printf("animation frame %d differs from a still of its view\n", frame);
+    }
+  }
+  free(floats);
+  free(reference);
+  free_thread_pool(pool);
+  free_scene(&scene);
+  return ok;
+}
+
+// writes bytes to path with size bytes at offset replaced by patch, and
+// tries to load it
+bool load_patched_scene(const char *path, const char *bytes, size_t size, size_t offset, const void *patch, size_t patch_size) {
+  FILE *fp = fopen(path, "wb");
+  fwrite(bytes, 1, offset, fp);
+  fwrite(patch, 1, patch_size, fp);
+  fwrite(bytes + offset + patch_size, 1, size - offset - patch_size, fp);
+  fclose(fp);
+  scene_t scene;
+  bool loaded = load_scene_file(path, &scene);
+  if (loaded) {
+    free_scene(&scene);
+  }
+  return loaded;
+}
+
+// a binary scene file with an index pointing outside what it indexes is
+// refused at load, whichever index it is
+bool test_scene_file_refuses_bad_indices() {
+  fast_srand(13);
+  scene_t scene = new_random_scene(3000);
+  set_sphere_material(scene.material_list, 10, new_emissive(new_vec3(4, 3, 2)));
+  scene_build_bvh(&scene);
+  const char *path = "test_bad_scene.rts";
+  bool ok = save_scene_file(path, &scene);
+  FILE *fp = fopen(path, "rb");
+  fseek(fp, 0, SEEK_END);
+  size_t size = ftell(fp);
+  rewind(fp);
+  char *bytes = malloc(size);
+  ok = ok && fread(bytes, 1, size, fp) == size;
+  fclose(fp);
+
+  scene_file_header_t header = new_scene_file_header(&scene);
+  material_index_t bad_index = header.n_materials;
+  uint32_t bad_light = header.n_spheres;
+  bvh_node_t root = scene.bvh->nodes[0];
+  bvh_node_t loop = root, leaf = root;
+  loop.left_first = 0;
+  leaf.count = 1;
+  leaf.left_first = header.n_spheres;
+  uint64_t bad_offset = header.lights_offset + 4;
+  // so far past the end it wraps around to before the start
+  uint64_t wrapped_offset = -(uint64_t)4 * header.sphere_stride;
+  ok = ok && load_patched_scene(path, bytes, size, 0, bytes, 0)
+          && !load_patched_scene(path, bytes, size, header.indices_offset + 7 * sizeof(material_index_t), &bad_index, sizeof(bad_index))
+          && !load_patched_scene(path, bytes, size, header.lights_offset, &bad_light, sizeof(bad_light))
+          && !load_patched_scene(path, bytes, size, header.nodes_offset, &loop, sizeof(loop))
+          && !load_patched_scene(path, bytes, size, header.nodes_offset, &leaf, sizeof(leaf))
+          && !load_patched_scene(path, bytes, size, offsetof(scene_file_header_t, lights_offset), &bad_offset, sizeof(bad_offset))
+          && !load_patched_scene(path, bytes, size, offsetof(scene_file_header_t, spheres_offset), &wrapped_offset, sizeof(wrapped_offset));
+  remove(path);
+  free(bytes);
+  free_scene(&scene);
+  return ok;
+}
+
+// spheres piled up on a few centres, so the SAH can't split the piles and
+// the builder falls back to median splits
+scene_t new_piled_scene(int n_piles, int per_pile) {
+  sphere_list_t *sphere_list = new_sphere_list(n_piles * per_pile);
+  material_list_t *material_list = new_material_list(n_piles * per_pile);
+  for (int p = 0; p < n_piles; p++) {
+    point3_t center = random_vec3(-20.0, 20.0);
+    for (int i = 0; i < per_pile; i++) {
+      add_sphere(sphere_list, center, random_float_range(0.2, 2.0));
+      add_material(material_list, new_lambertian(random_vec3(0, 1)));
+    }
+  }
+  return new_scene(sphere_list, material_list);
+}
+
+void *build_bvh_thread(void *args) {
+  scene_build_bvh((scene_t *)args);
+  return NULL;
+}
+
+// two different scenes built on two threads at once get the same trees and
+// sphere order as when they're built one after the other
+bool test_bvh_builds_concurrently() {
+  bool ok = true;
+  for (int round = 0; round < 4 && ok; round++) {
+    scene_t reference[2], scenes[2];
+    for (int k = 0; k < 2; k++) {
+      fast_srand(31 + 2 * round + k);
+      reference[k] = new_piled_scene(3 + k, 2000);
+      scene_build_bvh(&reference[k]);
+      fast_srand(31 + 2 * round + k);
+      scenes[k] = new_piled_scene(3 + k, 2000);
+    }
+    pthread_t threads[2];
+    for (int k = 0; k < 2; k++) {
+      pthread_create(&threads[k], NULL, build_bvh_thread, &scenes[k]);
+    }
+    for (int k = 0; k < 2; k++) {
+      pthread_join(threads[k], NULL);
+      size_t n = scenes[k].sphere_list->nth_sphere;
+      ok = ok && scenes[k].bvh->n_nodes == reference[k].bvh->n_nodes
+              && memcmp(scenes[k].bvh->nodes, reference[k].bvh->nodes, reference[k].bvh->n_nodes * sizeof(bvh_node_t)) == 0
+              && memcmp(scenes[k].sphere_list->xs, reference[k].sphere_list->xs, n * sizeof(float)) == 0
+              && memcmp(scenes[k].sphere_list->r2s, reference[k].sphere_list->r2s, n * sizeof(float)) == 0;
+      // and the median splits are right
+      for (int r = 0; r < 500 && ok; r++) {
+        ray_t ray = new_ray(random_vec3(-30.0, 30.0), random_vec3_on_unit_sphere());
+        interval_t ref_interval = {.min = 0.001, .max = INFINITY};
+        interval_t interval = ref_interval;
+        size_t ref_closest = 0, closest = 0;
+        bool ref_hit = closest_sphere(scenes[k].sphere_list, 0, n, &ray, &ref_interval, &ref_closest);
+        bool hit = closest_sphere_bvh(scenes[k].bvh, scenes[k].sphere_list, &ray, &interval, &closest);
+        ok = hit == ref_hit && (!hit || interval.max == ref_interval.max);
+      }
+      free_scene(&scenes[k]);
+      free_scene(&reference[k]);
+    }
+  }
+  return ok;
+}
+
+// a scene saved in either form loads back as the same spheres, the binary
+// one mapped with its BVH and tracing exactly like the original
+bool test_scene_file_round_trip() {
+  fast_srand(7);
+  scene_t scene = new_random_scene(300);
+  for (size_t i = 0; i < 300; i += 50) {
+    set_sphere_material(scene.material_list, i, new_emissive(new_vec3(4, 3, 2)));
+  }
+  scene.sky = new_vec3(0.25, 0.5, 0);
+  // which finds the lights again where the BVH moved them
+  scene_build_bvh(&scene);
+  size_t n = scene.sphere_list->nth_sphere;
+  size_t n_lights = scene.lights->n_lights;
+
+  // binary: everything comes back bit for bit, BVH included
+  const char *binary_path = "test_scene.rts";
+  scene_t mapped;
+  bool ok = save_scene_file(binary_path, &scene) && load_scene_file(binary_path, &mapped);
+  ok = ok && mapped.sphere_list->nth_sphere == n && mapped.bvh != NULL
+          && mapped.bvh->n_nodes == scene.bvh->n_nodes
+          && memcmp(mapped.bvh->nodes, scene.bvh->nodes, scene.bvh->n_nodes * sizeof(bvh_node_t)) == 0
+          && mapped.material_list->n_materials == scene.material_list->n_materials && mapped.material_list->grouped
+          && memcmp(mapped.material_list->indices, scene.material_list->indices, n * sizeof(material_index_t)) == 0
+          && memcmp(mapped.material_list->materials, scene.material_list->materials, scene.material_list->n_materials * sizeof(material_t)) == 0
+          && n_lights == 6 && mapped.lights->n_lights == n_lights
+          && memcmp(mapped.lights->spheres, scene.lights->spheres, n_lights * sizeof(uint32_t)) == 0
+          && memcmp(&mapped.sky, &scene.sky, sizeof(color_t)) == 0;
+  for (size_t l = 0; l < n_lights && ok; l++) {
+    ok = sphere_material(scene.material_list, scene.lights->spheres[l])->type == EMISSIVE;
+  }
+  const float *arrays[5] = {scene.sphere_list->xs, scene.sphere_list->ys, scene.sphere_list->zs, scene.sphere_list->r2s, scene.sphere_list->recip_r};
+  const float *mapped_arrays[5] = {mapped.sphere_list->xs, mapped.sphere_list->ys, mapped.sphere_list->zs, mapped.sphere_list->r2s, mapped.sphere_list->recip_r};
+  for (int k = 0; k < 5 && ok; k++) {
+    ok = ((uintptr_t)mapped_arrays[k] % 64) == 0 && memcmp(arrays[k], mapped_arrays[k], n * sizeof(float)) == 0;
+  }
+  if (ok) {
+    for (int i = 0; i < 100 && ok; i++) {
+      ray_t ray = new_ray(random_vec3(-5, 5), normalize(random_vec3(-1, 1)));
+      interval_t interval = {.min = 0.001, .max = INFINITY};
+      hit_record_t a, b;
+      bool hit_a = hit_scene(&scene, &ray, &interval, &a);
+      bool hit_b = hit_scene(&mapped, &ray, &interval, &b);
+      ok = hit_a == hit_b && (!hit_a || a.t == b.t);
+    }
+    free_scene(&mapped);
+  }
+  remove(binary_path);
+
+  // text: the same spheres, radii squared again on the way in
+  const char *text_path = "test_scene.txt";
+  scene_t parsed;
+  ok = ok && save_scene_file(text_path, &scene) && load_scene_file(text_path, &parsed);
+  if (ok) {
+    ok = parsed.sphere_list->nth_sphere == n
+      && memcmp(parsed.sphere_list->xs, scene.sphere_list->xs, n * sizeof(float)) == 0
+      && parsed.lights->n_lights == n_lights && memcmp(&parsed.sky, &scene.sky, sizeof(color_t)) == 0;
+    for (size_t i = 0; i < n && ok; i++) {
+      ok = fabsf(parsed.sphere_list->r2s[i] - scene.sphere_list->r2s[i]) <= 1e-6f * scene.sphere_list->r2s[i]
+        && memcmp(sphere_material(parsed.material_list, i), sphere_material(scene.material_list, i), sizeof(material_t)) == 0;
+    }
+    free_scene(&parsed);
+  }
+  remove(text_path);
+
+  // a bad line is refused
+  FILE *fp = fopen(text_path, "w");
+  fprintf(fp, "# comment\nsphere 0 0 0 1 lambertian 0.5 0.5 0.5\nsphere 0 0 0 1 plastic 1\n");
+  fclose(fp);
+  ok &= !load_scene_file(text_path, &parsed);
+  remove(text_path);
+
+  free_scene(&scene);
+  return ok;
+}
+
+// an OBJ mesh pulled into a text scene, fans, negative indices and v/vt/vn
+// corners included, lands where the mesh line puts it with its material,
+// survives a save and load as triangle lines, and can't go in a binary file
+bool test_obj_mesh_in_scene_file() {
+  FILE *fp = fopen("test_mesh.obj", "w");
+  fprintf(fp, "# a unit square in z = 0 facing +z, and a triangle behind it\n"
+              "o square\nv 0 0 0\nv 1 0 0\nv 1 1 0\nv 0 1 0\nvn 0 0 1\nvt 0 0\n"
+              "f 1/1/1 2/1/1 3/1/1 4/1/1\n"
+              "v 0 0 -1\nv 1 0 -1\nv 0 1 -1\ns off\nf -3//1 -2//1 -1//1\n");
+  fclose(fp);
+  fp = fopen("test_mesh_scene.txt", "w");
+  fprintf(fp, "sphere 0 0 -10 1 lambertian 0.5 0.5 0.5\n"
+              "mesh test_mesh.obj 1 2 3 2 metal 0.9 0.8 0.7 0\n");
+  fclose(fp);
+
+  scene_t scene;
+  bool loaded = load_scene_file("test_mesh_scene.txt", &scene);
+  bool ok = loaded && scene.triangles != NULL;
+  ok = ok && scene.triangles->n_triangles == 3 && scene.triangles->n_vertices == 7 && scene.sphere_list->nth_sphere == 1;
+  if (ok) {
+    // scaled by 2 and moved by (1, 2, 3): the square spans (1..3, 2..4) at
+    // z = 3, the triangle sits behind it at z = 1
+    ray_t ray = new_ray(new_vec3(2.5, 2.5, 10), new_vec3(0, 0, -1));
+    interval_t interval = {.min = 0.001, .max = INFINITY};
+    hit_record_t rec;
+    ok = hit_scene(&scene, &ray, &interval, &rec) && fabsf(rec.t - 7) < 1e-5f && rec.front_face
+      && fabsf(rec.normal.e[2] - 1) < 1e-6f && rec.mat->type == METAL && rec.mat->data.metal.albedo.e[1] == 0.8f;
+    // from behind, the back of the triangle
+    ray = new_ray(new_vec3(1.5, 2.5, -5), new_vec3(0, 0, 1));
+    ok = ok && hit_scene(&scene, &ray, &interval, &rec) && fabsf(rec.t - 6) < 1e-5f && !rec.front_face && rec.normal.e[2] < 0;
+    // past the edge of the square it's the sphere
+    ray = new_ray(new_vec3(0, 0, 10), new_vec3(0, 0, -1));
+    ok = ok && hit_scene(&scene, &ray, &interval, &rec) && rec.sphere == 0 && fabsf(rec.t - 19) < 1e-4f;
+    ok = ok && !save_scene_file("test_mesh_scene.rts", &scene);
+  }
+
+  scene_t saved;
+  ok = ok && save_scene_file("test_mesh_saved.txt", &scene) && load_scene_file("test_mesh_saved.txt", &saved);
+  if (ok) {
+    ok = saved.triangles != NULL && saved.triangles->n_triangles == 3;
+    float **a[9], **b[9];
+    triangle_arrays(scene.triangles, a);
+    triangle_arrays(saved.triangles, b);
+    for (int k = 0; k < 9 && ok; k++) {
+      ok = memcmp(*a[k], *b[k], 3 * sizeof(float)) == 0;
+    }
+    for (size_t i = 0; i < 3 && ok; i++) {
+      ok = memcmp(sphere_material(saved.triangles->materials, i), sphere_material(scene.triangles->materials, i), sizeof(material_t)) == 0;
+    }
+    free_scene(&saved);
+  }
+  if (loaded) {
+    free_scene(&scene);
+  }
+
+  // a face with a vertex that isn't there is refused
+  fp = fopen("test_mesh.obj", "w");
+  fprintf(fp, "v 0 0 0\nv 1 0 0\nv 1 1 0\nf 1 2 4\n");
+  fclose(fp);
+  ok = ok && !load_scene_file("test_mesh_scene.txt", &scene);
+  remove("test_mesh.obj");
+  remove("test_mesh_scene.txt");
+  remove("test_mesh_saved.txt");
+  remove("test_mesh_scene.rts");
+  return ok;
+}
+
+// P6 has to come out with the same bytes the P3 writer prints, and PFM with
+// the floats unchanged, bottom row first
+bool test_image_encoders() {
+  fast_srand(3);
+  int width = 37, height = 21;
+  color_t *pixels = malloc(width * height * sizeof(color_t));
+  for (int p = 0; p < width * height; p++) {
+    pixels[p] = random_vec3(0.0, 1.2);
+  }
+  thread_pool_t *pool = new_thread_pool(3);
+  bool ok = true;
+
+  size_t size;
+  unsigned char *p6 = encode_image(IMAGE_P6, pixels, width, height, pool, &size);
+  const char *p6_header = "P6\n37 21\n255\n";
+  ok &= size == strlen(p6_header) + width * height * 3 && memcmp(p6, p6_header, strlen(p6_header)) == 0;
+  FILE *ascii = tmpfile();
+  write_pixels(ascii, pixels, width * height);
+  rewind(ascii);
+  for (int k = 0; k < width * height * 3 && ok; k++) {
+    int value;
+    ok &= fscanf(ascii, "%d", &value) == 1 && value == p6[strlen(p6_header) + k];
+  }
+  fclose(ascii);
+  free(p6);
+
+  unsigned char *pfm = encode_image(IMAGE_PFM, pixels, width, height, pool, &size);
+  const char *pfm_header = "PF\n37 21\n-1.0\n";
+  ok &= size == strlen(pfm_header) + width * height * 3 * sizeof(float);
+  const float *floats = (const float *)(pfm + strlen(pfm_header));
+  for (int y = 0; y < height && ok; y++) {
+    for (int x = 0; x < width; x++) {
+      const float *f = floats + ((height - 1 - y) * width + x) * 3;
+      color_t c = pixels[y * width + x];
+      ok &= f[0] == c.e[0] && f[1] == c.e[1] && f[2] == c.e[2];
+    }
+  }
+  free(pfm);
+
+  free_thread_pool(pool);
+  free(pixels);
+  return ok;
+}
+
+void count_task(void *ctx, int task, int thread_id) {
+  atomic_int *counts = (atomic_int *)ctx;
+  atomic_fetch_add(&counts[task], 1);
+}
+
+// with more workers than cores and uneven runs, every task of every job still
+// has to run exactly once
+bool test_thread_pool_runs_every_task() {
+  thread_pool_t *pool = new_thread_pool(7);
+  int n_tasks = 1000;
+  atomic_int *counts = malloc(n_tasks * sizeof(atomic_int));
+  bool ok = true;
+  for (int job = 0; job < 50 && ok; job++) {
+    int n = n_tasks - job * 17;
+    for (int i = 0; i < n_tasks; i++) {
+      atomic_init(&counts[i], 0);
+    }
+    thread_pool_run(pool, n, count_task, counts);
+    for (int i = 0; i < n_tasks; i++) {
+      if (atomic_load(&counts[i]) != (i < n ? 1 : 0)) {
+        printf("job %d task %d ran %d times\n", job, i, atomic_load(&counts[i]));
+        ok = false;
+        break;
+      }
+    }
+  }
+  free(counts);
+  free_thread_pool(pool);
+  return ok;
+}
+
 int main() {
+  int failures = 0;
   bool prop = test_propagate();
   if (!prop) {
     printf("test_propagate FAILED\n");
+    failures++;
+  }
+  if (!test_simd_backends_agree()) {
+    printf("test_simd_backends_agree FAILED\n");
+    failures++;
+  }
+  if (!test_bvh_matches_linear()) {
+    printf("test_bvh_matches_linear FAILED\n");
+    failures++;
+  }
+  if (!test_wbvh_matches_linear()) {
+    printf("test_wbvh_matches_linear FAILED\n");
+    failures++;
+  }
+  if (!test_material_table_dedups_and_groups()) {
+    printf("test_material_table_dedups_and_groups FAILED\n");
+    failures++;
+  }
+  if (!test_refit_matches_linear()) {
+    printf("test_refit_matches_linear FAILED\n");
+    failures++;
+  }
+  if (!test_triangle_kernels_match_scalar()) {
+    printf("test_triangle_kernels_match_scalar FAILED\n");
+    failures++;
+  }
+  if (!test_packets_match_single_rays()) {
+    printf("test_packets_match_single_rays FAILED\n");
+    failures++;
+  }
+  if (!test_wavefront_kernels_match_scatter()) {
+    printf("test_wavefront_kernels_match_scatter FAILED\n");
+    failures++;
+  }
+  if (!test_adaptive_sampling_stops_early_on_flat_pixels()) {
+    printf("test_adaptive_sampling_stops_early_on_flat_pixels FAILED\n");
+    failures++;
+  }
+  if (!test_checkpoint_round_trip()) {
+    printf("test_checkpoint_round_trip FAILED\n");
+    failures++;
+  }
+  if (!test_samplers()) {
+    printf("test_samplers FAILED\n");
+    failures++;
+  }
+  if (!test_fastmath_error_bounds()) {
+    printf("test_fastmath_error_bounds FAILED\n");
+    failures++;
+  }
+  if (!test_rng_is_deterministic()) {
+    printf("test_rng_is_deterministic FAILED\n");
+    failures++;
+  }
+  if (!test_render_stats_add_up()) {
+    printf("test_render_stats_add_up FAILED\n");
+    failures++;
+  }
+  if (!test_roulette_is_unbiased()) {
+    printf("test_roulette_is_unbiased FAILED\n");
+    failures++;
+  }
+  if (!test_light_sampling_converges_faster()) {
+    printf("test_light_sampling_converges_faster FAILED\n");
+    failures++;
+  }
+  if (!test_denoise_reduces_error()) {
+    printf("test_denoise_reduces_error FAILED\n");
+    failures++;
+  }
+  if (!test_render_variants_match_generic()) {
+    printf("test_render_variants_match_generic FAILED\n");
+    failures++;
+  }
+  if (!test_distributed_render_matches()) {
+    printf("test_distributed_render_matches FAILED\n");
+    failures++;
+  }
+  if (!test_library_renders_concurrently()) {
+    printf("test_library_renders_concurrently FAILED\n");
+    failures++;
+  }
+  if (!test_animation_follows_defocus()) {
+    printf("test_animation_follows_defocus FAILED\n");
+    failures++;
+  }
+  if (!test_scene_file_refuses_bad_indices()) {
+    printf("test_scene_file_refuses_bad_indices FAILED\n");
+    failures++;
+  }
+  if (!test_bvh_builds_concurrently()) {
+    printf("test_bvh_builds_concurrently FAILED\n");
+    failures++;
+  }
+  if (!test_scene_file_round_trip()) {
+    printf("test_scene_file_round_trip FAILED\n");
+    failures++;
+  }
+  if (!test_obj_mesh_in_scene_file()) {
+    printf("test_obj_mesh_in_scene_file FAILED\n");
+    failures++;
+  }
+  if (!test_image_encoders()) {
+    printf("test_image_encoders FAILED\n");
+    failures++;
+  }
+  if (!test_thread_pool_runs_every_task()) {
+    printf("test_thread_pool_runs_every_task FAILED\n");
+    failures++;
   }
-  return 0;
+  return failures;
 }
@@ -0,0 +1,282 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Persistent pool of worker threads running parallel-for jobs. Each job is
+// n_tasks calls of fn(ctx, task, thread_id). The tasks are dealt out to the
+// workers in contiguous runs, one work-stealing deque per worker: a worker
+// pops from the bottom of its own deque and, once that's empty, steals from
+// the top of a random other worker's. Neighbouring tasks (image tiles) tend
+// to cost about the same, so contiguous runs keep the expensive regions
+// clumped on a few workers, and stealing from the far end of their runs is
+// what spreads them back out.
+//
+// The deques are Chase-Lev, minus the growing: all tasks are pushed before the
+// workers are woken and nobody pushes while a job runs.
+
+typedef void (*task_fn_t)(void *ctx, int task, int thread_id);
+
+#define DEQUE_EMPTY -1
+#define DEQUE_ABORT -2
+
+typedef struct {
+  // own a cache line each, the owner hammers bottom and thieves hammer top
+  _Alignas(64) atomic_long top;
+  _Alignas(64) atomic_long bottom;
+  _Alignas(64) int *tasks;
+  long capacity;
+} ws_deque_t;
+
+typedef struct thread_pool_t {
+  int n_threads;
+  pthread_t *threads;
+  ws_deque_t *deques;
+
+  pthread_mutex_t lock;
+  pthread_cond_t work_ready;
+  pthread_cond_t work_done;
+  // bumped for every job so sleeping workers can tell a new one arrived
+  unsigned long generation;
+  int busy_workers;
+  bool shutdown;
+
+  task_fn_t fn;
+  void *ctx;
+} thread_pool_t;
+
+typedef struct {
+  thread_pool_t *pool;
+  int thread_id;
+} worker_args_t;
+
+// number of cores we can run on
+int hardware_concurrency(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int)n : 1;
+}
+
+void deque_reset(ws_deque_t *deque, long capacity) {
+  if (capacity > deque->capacity) {
+    free(deque->tasks);
+    deque->tasks = malloc(capacity * sizeof(int));
+    deque->capacity = capacity;
+  }
+  atomic_store_explicit(&deque->top, 0, memory_order_relaxed);
+  atomic_store_explicit(&deque->bottom, 0, memory_order_relaxed);
+}
+
+// only called by the pool before the workers are woken up
+void deque_push(ws_deque_t *deque, int task) {
+  long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+  deque->tasks[b] = task;
+  atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+}
+
+// owner end
+int deque_pop(ws_deque_t *deque) {
+  long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+  atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  long t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+  if (t > b) {
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    return DEQUE_EMPTY;
+  }
+  int task = deque->tasks[b];
+  if (t == b) {
+    // last one left, race the thieves for it
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+      task = DEQUE_EMPTY;
+    }
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+  }
+  return task;
+}
+
+// thief end. DEQUE_ABORT means we lost a race and should try again.
+int deque_steal(ws_deque_t *deque) {
+  long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  long b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+  if (t >= b) {
+    return DEQUE_EMPTY;
+  }
+  int task = deque->tasks[t];
+  if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+    return DEQUE_ABORT;
+  }
+  return task;
+}
+
+// xorshift, only used to pick victims so it doesn't touch the render's RNG
+unsigned int victim_rand(unsigned int *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+// grabs the next task for thread_id, stealing if need be. returns -1 once
+// every deque is empty, which (since nothing is pushed mid-job) means the
+// job has no work left to hand out.
+int next_task(thread_pool_t *pool, int thread_id, unsigned int *rng) {
+  int task = deque_pop(&pool->deques[thread_id]);
+  if (task >= 0) {
+    return task;
+  }
+
+  int n = pool->n_threads;
+  for (;;) {
+    bool aborted = false;
+    int start = victim_rand(rng) % n;
+    for (int k = 0; k < n; k++) {
+      int victim = (start + k) % n;
+      if (victim == thread_id) {
+        continue;
+      }
+      task = deque_steal(&pool->deques[victim]);
+      if (task >= 0) {
+        return task;
+      }
+      aborted |= task == DEQUE_ABORT;
+    }
+    if (!aborted) {
+      return -1;
+    }
+  }
+}
+
+void *pool_worker(void *args) {
+  worker_args_t *wargs = (worker_args_t *)args;
+  thread_pool_t *pool = wargs->pool;
+  int thread_id = wargs->thread_id;
+  free(wargs);
+
+  unsigned int rng = 2654435761u * (thread_id + 1);
+  unsigned long seen_generation = 0;
+
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->generation == seen_generation && !pool->shutdown) {
+      pthread_cond_wait(&pool->work_ready, &pool->lock);
+    }
+    if (pool->shutdown) {
+      pthread_mutex_unlock(&pool->lock);
+      return NULL;
+    }
+    seen_generation = pool->generation;
+    task_fn_t fn = pool->fn;
+    void *ctx = pool->ctx;
+    pthread_mutex_unlock(&pool->lock);
+
+    int task;
+    while ((task = next_task(pool, thread_id, &rng)) >= 0) {
+      fn(ctx, task, thread_id);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->busy_workers--;
+    if (pool->busy_workers == 0) {
+      pthread_cond_signal(&pool->work_done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+// n_threads <= 0 means one per core
+thread_pool_t *new_thread_pool(int n_threads) {
+  if (n_threads <= 0) {
+    n_threads = hardware_concurrency();
+  }
+
+  thread_pool_t *pool = malloc(sizeof(thread_pool_t));
+  pool->n_threads = n_threads;
+  pool->threads = malloc(n_threads * sizeof(pthread_t));
+  pool->deques = aligned_alloc(64, n_threads * sizeof(ws_deque_t));
+  for (int i = 0; i < n_threads; i++) {
+    pool->deques[i].tasks = NULL;
+    pool->deques[i].capacity = 0;
+    deque_reset(&pool->deques[i], 0);
+  }
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work_ready, NULL);
+  pthread_cond_init(&pool->work_done, NULL);
+  pool->generation = 0;
+  pool->busy_workers = 0;
+  pool->shutdown = false;
+
+  for (int k = 0; k < n_threads; k++) {
+    worker_args_t *wargs = malloc(sizeof(worker_args_t));
+    wargs->pool = pool;
+    wargs->thread_id = k;
+    int result_code = pthread_create(&pool->threads[k], NULL, pool_worker, wargs);
+    if (result_code != 0) {
+      printf("**************** problem creating thread *****************\n");
+      abort();
+    }
+  }
+  return pool;
+}
+
+// runs fn(ctx, task, thread_id) for task in [0, n_tasks) across the pool
+// and returns once they've all finished. not reentrant: one job at a time.
+void thread_pool_run(thread_pool_t *pool, int n_tasks, task_fn_t fn, void *ctx) {
+  int n = pool->n_threads;
+  for (int k = 0; k < n; k++) {
+    int begin = (long)n_tasks * k / n;
+    int end = (long)n_tasks * (k + 1) / n;
+    ws_deque_t *deque = &pool->deques[k];
+    deque_reset(deque, end - begin);
+    // pushed in reverse so the owner pops its run front to back and
+    // thieves take from the back end
+    for (int task = end - 1; task >= begin; task--) {
+      deque_push(deque, task);
+    }
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->fn = fn;
+  pool->ctx = ctx;
+  pool->busy_workers = n;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->work_ready);
+  while (pool->busy_workers > 0) {
+    pthread_cond_wait(&pool->work_done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void free_thread_pool(thread_pool_t *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = true;
+  pthread_cond_broadcast(&pool->work_ready);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int k = 0; k < pool->n_threads; k++) {
+    int result_code = pthread_join(pool->threads[k], NULL);
+    if (result_code != 0) {
+      printf("*************** problem joining thread *****************\n");
+      printf("%d\n", result_code);
+      abort();
+    }
+  }
+  for (int k = 0; k < pool->n_threads; k++) {
+    free(pool->deques[k].tasks);
+  }
+  free(pool->deques);
+  free(pool->threads);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->work_ready);
+  pthread_cond_destroy(&pool->work_done);
+  free(pool);
+}
+
+#endif // !THREADPOOL_H
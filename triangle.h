@@ -0,0 +1,755 @@
+#ifndef TRIANGLE_H
+#define TRIANGLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "interval.h"
+#include "material.h"
+#include "ray.h"
+#include "rtweekend.h"
+#include "simd.h"
+#include "stats.h"
+#include "vec3.h"
+#include "vectorized.h"
+
+// Triangle meshes. A triangle_list_t holds any number of indexed meshes:
+// the vertices as x, y and z arrays like the sphere arrays, and each
+// triangle as the indices of its three corners. The intersection kernels
+// don't read the indexed form though, gathering nine floats per lane is
+// most of the cost of a test. Every triangle is also kept as its first
+// corner and the two edges from it, nine SoA arrays padded past the last
+// triangle like the sphere arrays are (see sphere_list_t), so the kernels
+// run Möller-Trumbore on whole vectors of 4, 8 or 16 triangles with plain
+// loads. The padding is degenerate triangles, all zeros, whose determinant
+// is 0 and which no ray hits.
+//
+// Triangles sit in their own binary BVH (build_triangle_bvh) built by the
+// same SAH builder as the spheres', which puts each leaf's triangles next to
+// each other in the arrays. The scene asks both trees and keeps the nearer
+// hit, see hit_scene.
+
+// below this many triangles the SIMD linear scan beats walking the tree
+#define BVH_MIN_TRIANGLES 1000
+
+typedef struct {
+  size_t n_vertices;
+  size_t max_vertices;
+  float *vxs;
+  float *vys;
+  float *vzs;
+  // corners of each triangle, as indices into the vertex arrays
+  size_t n_triangles;
+  size_t max_triangles;
+  uint32_t *v0s;
+  uint32_t *v1s;
+  uint32_t *v2s;
+  // what the kernels read: corner 0, and the edges from it to corners 1
+  // and 2
+  float *axs;
+  float *ays;
+  float *azs;
+  float *e1xs;
+  float *e1ys;
+  float *e1zs;
+  float *e2xs;
+  float *e2ys;
+  float *e2zs;
+  // the triangles' materials, one entry per triangle the way the sphere
+  // list's has one per sphere (its nth_sphere counts triangles)
+  material_list_t *materials;
+  // the list and its arrays come from this arena if it's set
+  arena_t *arena;
+} triangle_list_t;
+
+// moves the vertices into arrays with room for capacity of them
+void reserve_vertices(triangle_list_t *triangles, size_t capacity) {
+  size_t n = triangles->n_vertices;
+  float **arrays[] = {&triangles->vxs, &triangles->vys, &triangles->vzs};
+  for (size_t k = 0; k < sizeof(arrays) / sizeof(arrays[0]); k++) {
+    float *array = arena_or_heap(triangles->arena, (capacity > 0 ? capacity : 1) * sizeof(float));
+    if (n > 0) {
+      memcpy(array, *arrays[k], n * sizeof(float));
+    }
+    arena_or_heap_free(triangles->arena, *arrays[k]);
+    *arrays[k] = array;
+  }
+  triangles->max_vertices = capacity;
+}
+
+// the per-triangle arrays of the kernels' form, in the order they're laid out
+void triangle_arrays(triangle_list_t *triangles, float **arrays[9]) {
+  float **all[9] = {
+    &triangles->axs, &triangles->ays, &triangles->azs,
+    &triangles->e1xs, &triangles->e1ys, &triangles->e1zs,
+    &triangles->e2xs, &triangles->e2ys, &triangles->e2zs,
+  };
+  memcpy(arrays, all, sizeof(all));
+}
+
+// moves the triangles into arrays with room for capacity of them, plus
+// the padding
+void reserve_triangles(triangle_list_t *triangles, size_t capacity) {
+  size_t n = triangles->n_triangles;
+  size_t padded = sphere_list_padded(capacity);
+  float **arrays[9];
+  triangle_arrays(triangles, arrays);
+  for (size_t k = 0; k < 9; k++) {
+    float *array = arena_or_heap(triangles->arena, padded * sizeof(float));
+    if (n > 0) {
+      memcpy(array, *arrays[k], n * sizeof(float));
+    }
+    memset(array + n, 0, (padded - n) * sizeof(float));
+    arena_or_heap_free(triangles->arena, *arrays[k]);
+    *arrays[k] = array;
+  }
+  uint32_t **corners[] = {&triangles->v0s, &triangles->v1s, &triangles->v2s};
+  for (size_t k = 0; k < 3; k++) {
+    uint32_t *array = arena_or_heap(triangles->arena, (capacity > 0 ? capacity : 1) * sizeof(uint32_t));
+    if (n > 0) {
+      memcpy(array, *corners[k], n * sizeof(uint32_t));
+    }
+    arena_or_heap_free(triangles->arena, *corners[k]);
+    *corners[k] = array;
+  }
+  triangles->max_triangles = capacity;
+}
+
+// the counts are only starting capacities, the lists grow. in arena if
+// that's not NULL.
+triangle_list_t *new_triangle_list_in(arena_t *arena, size_t n_vertices, size_t n_triangles) {
+  triangle_list_t *triangles = arena_or_heap(arena, sizeof(triangle_list_t));
+  *triangles = (triangle_list_t){.arena = arena};
+  reserve_vertices(triangles, n_vertices);
+  reserve_triangles(triangles, n_triangles);
+  triangles->materials = new_material_list_in(arena, n_triangles);
+  return triangles;
+}
+
+triangle_list_t *new_triangle_list(size_t n_vertices, size_t n_triangles) {
+  return new_triangle_list_in(NULL, n_vertices, n_triangles);
+}
+
+void free_triangle_list(triangle_list_t *triangles) {
+  arena_t *arena = triangles->arena;
+  float **arrays[9];
+  triangle_arrays(triangles, arrays);
+  for (size_t k = 0; k < 9; k++) {
+    arena_or_heap_free(arena, *arrays[k]);
+  }
+  arena_or_heap_free(arena, triangles->vxs);
+  arena_or_heap_free(arena, triangles->vys);
+  arena_or_heap_free(arena, triangles->vzs);
+  arena_or_heap_free(arena, triangles->v0s);
+  arena_or_heap_free(arena, triangles->v1s);
+  arena_or_heap_free(arena, triangles->v2s);
+  free_material_list(triangles->materials);
+  arena_or_heap_free(arena, triangles);
+}
+
+// index of the new vertex
+uint32_t add_vertex(triangle_list_t *triangles, point3_t p) {
+  if (triangles->n_vertices >= triangles->max_vertices) {
+    reserve_vertices(triangles, triangles->max_vertices > 0 ? 2 * triangles->max_vertices : 16);
+  }
+  size_t i = triangles->n_vertices++;
+  triangles->vxs[i] = p.e[0];
+  triangles->vys[i] = p.e[1];
+  triangles->vzs[i] = p.e[2];
+  return i;
+}
+
+point3_t triangle_vertex(const triangle_list_t *triangles, uint32_t v) {
+  return new_vec3(triangles->vxs[v], triangles->vys[v], triangles->vzs[v]);
+}
+
+// fills in triangle i's corner and edges from its vertices
+void bake_triangle(triangle_list_t *triangles, size_t i) {
+  point3_t a = triangle_vertex(triangles, triangles->v0s[i]);
+  vec3_t e1 = subtract(triangle_vertex(triangles, triangles->v1s[i]), a);
+  vec3_t e2 = subtract(triangle_vertex(triangles, triangles->v2s[i]), a);
+  triangles->axs[i] = a.e[0];
+  triangles->ays[i] = a.e[1];
+  triangles->azs[i] = a.e[2];
+  triangles->e1xs[i] = e1.e[0];
+  triangles->e1ys[i] = e1.e[1];
+  triangles->e1zs[i] = e1.e[2];
+  triangles->e2xs[i] = e2.e[0];
+  triangles->e2ys[i] = e2.e[1];
+  triangles->e2zs[i] = e2.e[2];
+}
+
+// a triangle over three vertices already added, wound counterclockwise
+// seen from the front. false if the material table is full, see
+// add_material.
+bool add_triangle(triangle_list_t *triangles, uint32_t v0, uint32_t v1, uint32_t v2, material_t material) {
+  if (!add_material(triangles->materials, material)) {
+    return false;
+  }
+  if (triangles->n_triangles >= triangles->max_triangles) {
+    reserve_triangles(triangles, triangles->max_triangles > 0 ? 2 * triangles->max_triangles : SPHERE_LIST_PAD);
+  }
+  size_t i = triangles->n_triangles++;
+  triangles->v0s[i] = v0;
+  triangles->v1s[i] = v1;
+  triangles->v2s[i] = v2;
+  bake_triangle(triangles, i);
+  return true;
+}
+
+// the unit normal on triangle i's front, counterclockwise side
+vec3_t triangle_normal(const triangle_list_t *triangles, size_t i) {
+  vec3_t e1 = new_vec3(triangles->e1xs[i], triangles->e1ys[i], triangles->e1zs[i]);
+  vec3_t e2 = new_vec3(triangles->e2xs[i], triangles->e2ys[i], triangles->e2zs[i]);
+  return normalize(cross(e1, e2));
+}
+
+// Each kernel has closest_sphere()'s contract, over triangles [start, end):
+// on a hit it shrinks interval->max to the hit's t, writes the triangle's
+// index to *closest and returns true. A triangle edge-on to the ray (a zero
+// determinant) never hits, which takes care of the padding too.
+typedef bool (*closest_triangle_fn_t)(const triangle_list_t *triangles, size_t start, size_t end, const ray_t *ray, interval_t *interval, size_t *closest);
+
+// scalar version of one triangle test, for the reference kernel
+bool hit_one_triangle(const triangle_list_t *triangles, size_t i, const ray_t *ray, interval_t *interval) {
+  float dx = ray->direction.e[0], dy = ray->direction.e[1], dz = ray->direction.e[2];
+  float e1x = triangles->e1xs[i], e1y = triangles->e1ys[i], e1z = triangles->e1zs[i];
+  float e2x = triangles->e2xs[i], e2y = triangles->e2ys[i], e2z = triangles->e2zs[i];
+
+  // p = direction x e2, det = e1 . p
+  float px = dy*e2z - dz*e2y;
+  float py = dz*e2x - dx*e2z;
+  float pz = dx*e2y - dy*e2x;
+  float det = e1x*px + e1y*py + e1z*pz;
+  if (det == 0.0f) {
+    return false;
+  }
+  float inv_det = 1.0f / det;
+
+  // s = origin - corner 0, u = (s . p) / det
+  float sx = ray->origin.e[0] - triangles->axs[i];
+  float sy = ray->origin.e[1] - triangles->ays[i];
+  float sz = ray->origin.e[2] - triangles->azs[i];
+  float u = (sx*px + sy*py + sz*pz) * inv_det;
+  if (!(u >= 0.0f && u <= 1.0f)) {
+    return false;
+  }
+
+  // q = s x e1, v = (direction . q) / det
+  float qx = sy*e1z - sz*e1y;
+  float qy = sz*e1x - sx*e1z;
+  float qz = sx*e1y - sy*e1x;
+  float v = (dx*qx + dy*qy + dz*qz) * inv_det;
+  if (!(v >= 0.0f && u + v <= 1.0f)) {
+    return false;
+  }
+
+  float t = (e2x*qx + e2y*qy + e2z*qz) * inv_det;
+  if (!interval_surrounds(interval, t)) {
+    return false;
+  }
+  interval->max = t;
+  return true;
+}
+
+bool closest_triangle_scalar(const triangle_list_t *triangles, size_t start, size_t end, const ray_t *ray, interval_t *interval, size_t *closest) {
+  bool hit = false;
+  for (size_t i = start; i < end; i++) {
+    if (hit_one_triangle(triangles, i, ray, interval)) {
+      *closest = i;
+      hit = true;
+    }
+  }
+  return hit;
+}
+
+// The vector kernels work like the sphere ones: whole vectors from start,
+// lanes past end masked off, the nearest t and its index kept per lane and
+// reduced once at the end, ties going to the lowest index.
+
+#if defined(SIMD_HAVE_NEON)
+
+bool closest_triangle_neon(const triangle_list_t *triangles, size_t start, size_t end, const ray_t *ray, interval_t *interval, size_t *closest) {
+  float32x4_t dx = vdupq_n_f32(ray->direction.e[0]);
+  float32x4_t dy = vdupq_n_f32(ray->direction.e[1]);
+  float32x4_t dz = vdupq_n_f32(ray->direction.e[2]);
+  float32x4_t ox = vdupq_n_f32(ray->origin.e[0]);
+  float32x4_t oy = vdupq_n_f32(ray->origin.e[1]);
+  float32x4_t oz = vdupq_n_f32(ray->origin.e[2]);
+  float32x4_t t_min = vdupq_n_f32(interval->min);
+  float32x4_t zero = vdupq_n_f32(0.0f);
+  float32x4_t one = vdupq_n_f32(1.0f);
+  const uint32_t lane_ids[4] = {0, 1, 2, 3};
+  uint32x4_t lanes = vld1q_u32(lane_ids);
+
+  float32x4_t best_t = vdupq_n_f32(interval->max);
+  uint32x4_t best_i = vdupq_n_u32(0);
+
+  for (size_t block = start; block < end; block += 4) {
+    float32x4_t e1x = vld1q_f32(triangles->e1xs + block);
+    float32x4_t e1y = vld1q_f32(triangles->e1ys + block);
+    float32x4_t e1z = vld1q_f32(triangles->e1zs + block);
+    float32x4_t e2x = vld1q_f32(triangles->e2xs + block);
+    float32x4_t e2y = vld1q_f32(triangles->e2ys + block);
+    float32x4_t e2z = vld1q_f32(triangles->e2zs + block);
+
+    // p = direction x e2, det = e1 . p
+    float32x4_t px = vfmsq_f32(vmulq_f32(dy, e2z), dz, e2y);
+    float32x4_t py = vfmsq_f32(vmulq_f32(dz, e2x), dx, e2z);
+    float32x4_t pz = vfmsq_f32(vmulq_f32(dx, e2y), dy, e2x);
+    float32x4_t det = vfmaq_f32(vfmaq_f32(vmulq_f32(e1x, px), e1y, py), e1z, pz);
+    float32x4_t inv_det = vdivq_f32(one, det);
+
+    // s = origin - corner 0, u = (s . p) / det
+    float32x4_t sx = vsubq_f32(ox, vld1q_f32(triangles->axs + block));
+    float32x4_t sy = vsubq_f32(oy, vld1q_f32(triangles->ays + block));
+    float32x4_t sz = vsubq_f32(oz, vld1q_f32(triangles->azs + block));
+    float32x4_t u = vmulq_f32(vfmaq_f32(vfmaq_f32(vmulq_f32(sx, px), sy, py), sz, pz), inv_det);
+
+    // q = s x e1, v = (direction . q) / det
+    float32x4_t qx = vfmsq_f32(vmulq_f32(sy, e1z), sz, e1y);
+    float32x4_t qy = vfmsq_f32(vmulq_f32(sz, e1x), sx, e1z);
+    float32x4_t qz = vfmsq_f32(vmulq_f32(sx, e1y), sy, e1x);
+    float32x4_t v = vmulq_f32(vfmaq_f32(vfmaq_f32(vmulq_f32(dx, qx), dy, qy), dz, qz), inv_det);
+
+    uint32x4_t in_range = vcltq_u32(lanes, vdupq_n_u32(end - block < 4 ? end - block : 4));
+    uint32x4_t valid = vandq_u32(in_range, vmvnq_u32(vceqq_f32(det, zero)));
+    valid = vandq_u32(valid, vandq_u32(vcgeq_f32(u, zero), vcgeq_f32(v, zero)));
+    valid = vandq_u32(valid, vcleq_f32(vaddq_f32(u, v), one));
+    if (vmaxvq_u32(valid) == 0) {
+      continue;
+    }
+
+    float32x4_t t = vmulq_f32(vfmaq_f32(vfmaq_f32(vmulq_f32(e2x, qx), e2y, qy), e2z, qz), inv_det);
+    uint32x4_t nearer = vandq_u32(valid, vandq_u32(vcgtq_f32(t, t_min), vcltq_f32(t, best_t)));
+    best_t = vbslq_f32(nearer, t, best_t);
+    best_i = vbslq_u32(nearer, vaddq_u32(lanes, vdupq_n_u32(block - start)), best_i);
+  }
+
+  float t = vminvq_f32(best_t);
+  if (!(t < interval->max)) {
+    return false;
+  }
+  uint32x4_t candidates = vbslq_u32(vceqq_f32(best_t, vdupq_n_f32(t)), best_i, vdupq_n_u32(UINT32_MAX));
+  interval->max = t;
+  *closest = start + vminvq_u32(candidates);
+  return true;
+}
+
+#endif // SIMD_HAVE_NEON
+
+#if defined(SIMD_HAVE_X86)
+
+__attribute__((target("sse4.1")))
+bool closest_triangle_sse41(const triangle_list_t *triangles, size_t start, size_t end, const ray_t *ray, interval_t *interval, size_t *closest) {
+  __m128 dx = _mm_set1_ps(ray->direction.e[0]);
+  __m128 dy = _mm_set1_ps(ray->direction.e[1]);
+  __m128 dz = _mm_set1_ps(ray->direction.e[2]);
+  __m128 ox = _mm_set1_ps(ray->origin.e[0]);
+  __m128 oy = _mm_set1_ps(ray->origin.e[1]);
+  __m128 oz = _mm_set1_ps(ray->origin.e[2]);
+  __m128 t_min = _mm_set1_ps(interval->min);
+  __m128 zero = _mm_setzero_ps();
+  __m128 one = _mm_set1_ps(1.0f);
+  __m128i lanes = _mm_setr_epi32(0, 1, 2, 3);
+
+  __m128 best_t = _mm_set1_ps(interval->max);
+  __m128i best_i = _mm_setzero_si128();
+
+  for (size_t block = start; block < end; block += 4) {
+    __m128 e1x = _mm_loadu_ps(triangles->e1xs + block);
+    __m128 e1y = _mm_loadu_ps(triangles->e1ys + block);
+    __m128 e1z = _mm_loadu_ps(triangles->e1zs + block);
+    __m128 e2x = _mm_loadu_ps(triangles->e2xs + block);
+    __m128 e2y = _mm_loadu_ps(triangles->e2ys + block);
+    __m128 e2z = _mm_loadu_ps(triangles->e2zs + block);
+
+    // p = direction x e2, det = e1 . p
+    __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+    __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+    __m128 inv_det = _mm_div_ps(one, det);
+
+    // s = origin - corner 0, u = (s . p) / det
+    __m128 sx = _mm_sub_ps(ox, _mm_loadu_ps(triangles->axs + block));
+    __m128 sy = _mm_sub_ps(oy, _mm_loadu_ps(triangles->ays + block));
+    __m128 sz = _mm_sub_ps(oz, _mm_loadu_ps(triangles->azs + block));
+    __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inv_det);
+
+    // q = s x e1, v = (direction . q) / det
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+    __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv_det);
+
+    __m128 in_range = _mm_castsi128_ps(_mm_cmplt_epi32(lanes, _mm_set1_epi32(end - block < 4 ? end - block : 4)));
+    __m128 valid = _mm_and_ps(in_range, _mm_cmpneq_ps(det, zero));
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmpge_ps(v, zero)));
+    valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(u, v), one));
+    if (_mm_movemask_ps(valid) == 0) {
+      continue;
+    }
+
+    __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+    __m128 nearer = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(t, t_min), _mm_cmplt_ps(t, best_t)));
+    best_t = _mm_blendv_ps(best_t, t, nearer);
+    best_i = _mm_blendv_epi8(best_i, _mm_add_epi32(lanes, _mm_set1_epi32(block - start)), _mm_castps_si128(nearer));
+  }
+
+  return reduce_closest_sse41(best_t, best_i, start, interval, closest);
+}
+
+__attribute__((target("avx2,fma")))
+bool closest_triangle_avx2(const triangle_list_t *triangles, size_t start, size_t end, const ray_t *ray, interval_t *interval, size_t *closest) {
+  __m256 dx = _mm256_set1_ps(ray->direction.e[0]);
+  __m256 dy = _mm256_set1_ps(ray->direction.e[1]);
+  __m256 dz = _mm256_set1_ps(ray->direction.e[2]);
+  __m256 ox = _mm256_set1_ps(ray->origin.e[0]);
+  __m256 oy = _mm256_set1_ps(ray->origin.e[1]);
+  __m256 oz = _mm256_set1_ps(ray->origin.e[2]);
+  __m256 t_min = _mm256_set1_ps(interval->min);
+  __m256 zero = _mm256_setzero_ps();
+  __m256 one = _mm256_set1_ps(1.0f);
+  __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+  __m256 best_t = _mm256_set1_ps(interval->max);
+  __m256i best_i = _mm256_setzero_si256();
+
+  for (size_t block = start; block < end; block += 8) {
+    __m256 e1x = _mm256_loadu_ps(triangles->e1xs + block);
+    __m256 e1y = _mm256_loadu_ps(triangles->e1ys + block);
+    __m256 e1z = _mm256_loadu_ps(triangles->e1zs + block);
+    __m256 e2x = _mm256_loadu_ps(triangles->e2xs + block);
+    __m256 e2y = _mm256_loadu_ps(triangles->e2ys + block);
+    __m256 e2z = _mm256_loadu_ps(triangles->e2zs + block);
+
+    // p = direction x e2, det = e1 . p
+    __m256 px = _mm256_fmsub_ps(dy, e2z, _mm256_mul_ps(dz, e2y));
+    __m256 py = _mm256_fmsub_ps(dz, e2x, _mm256_mul_ps(dx, e2z));
+    __m256 pz = _mm256_fmsub_ps(dx, e2y, _mm256_mul_ps(dy, e2x));
+    __m256 det = _mm256_fmadd_ps(e1z, pz, _mm256_fmadd_ps(e1y, py, _mm256_mul_ps(e1x, px)));
+    __m256 inv_det = _mm256_div_ps(one, det);
+
+    // s = origin - corner 0, u = (s . p) / det
+    __m256 sx = _mm256_sub_ps(ox, _mm256_loadu_ps(triangles->axs + block));
+    __m256 sy = _mm256_sub_ps(oy, _mm256_loadu_ps(triangles->ays + block));
+    __m256 sz = _mm256_sub_ps(oz, _mm256_loadu_ps(triangles->azs + block));
+    __m256 u = _mm256_mul_ps(_mm256_fmadd_ps(sz, pz, _mm256_fmadd_ps(sy, py, _mm256_mul_ps(sx, px))), inv_det);
+
+    // q = s x e1, v = (direction . q) / det
+    __m256 qx = _mm256_fmsub_ps(sy, e1z, _mm256_mul_ps(sz, e1y));
+    __m256 qy = _mm256_fmsub_ps(sz, e1x, _mm256_mul_ps(sx, e1z));
+    __m256 qz = _mm256_fmsub_ps(sx, e1y, _mm256_mul_ps(sy, e1x));
+    __m256 v = _mm256_mul_ps(_mm256_fmadd_ps(dz, qz, _mm256_fmadd_ps(dy, qy, _mm256_mul_ps(dx, qx))), inv_det);
+
+    __m256 in_range = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(end - block < 8 ? end - block : 8), lanes));
+    __m256 valid = _mm256_and_ps(in_range, _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ));
+    valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ), _mm256_cmp_ps(v, zero, _CMP_GE_OQ)));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+    if (_mm256_movemask_ps(valid) == 0) {
+      continue;
+    }
+
+    __m256 t = _mm256_mul_ps(_mm256_fmadd_ps(e2z, qz, _mm256_fmadd_ps(e2y, qy, _mm256_mul_ps(e2x, qx))), inv_det);
+    __m256 nearer = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t, t_min, _CMP_GT_OQ), _mm256_cmp_ps(t, best_t, _CMP_LT_OQ)));
+    best_t = _mm256_blendv_ps(best_t, t, nearer);
+    best_i = _mm256_blendv_epi8(best_i, _mm256_add_epi32(lanes, _mm256_set1_epi32(block - start)), _mm256_castps_si256(nearer));
+  }
+
+  // fold the top half onto the bottom, keeping the lower index on a tie
+  __m128 lo_t = _mm256_castps256_ps128(best_t);
+  __m128 hi_t = _mm256_extractf128_ps(best_t, 1);
+  __m128i lo_i = _mm256_castsi256_si128(best_i);
+  __m128i hi_i = _mm256_extracti128_si256(best_i, 1);
+  __m128 take_hi = _mm_cmplt_ps(hi_t, lo_t);
+  return reduce_closest_sse41(_mm_blendv_ps(lo_t, hi_t, take_hi), _mm_blendv_epi8(lo_i, hi_i, _mm_castps_si128(take_hi)),
+                              start, interval, closest);
+}
+
+__attribute__((target("avx512f")))
+bool closest_triangle_avx512(const triangle_list_t *triangles, size_t start, size_t end, const ray_t *ray, interval_t *interval, size_t *closest) {
+  __m512 dx = _mm512_set1_ps(ray->direction.e[0]);
+  __m512 dy = _mm512_set1_ps(ray->direction.e[1]);
+  __m512 dz = _mm512_set1_ps(ray->direction.e[2]);
+  __m512 ox = _mm512_set1_ps(ray->origin.e[0]);
+  __m512 oy = _mm512_set1_ps(ray->origin.e[1]);
+  __m512 oz = _mm512_set1_ps(ray->origin.e[2]);
+  __m512 t_min = _mm512_set1_ps(interval->min);
+  __m512 zero = _mm512_setzero_ps();
+  __m512 one = _mm512_set1_ps(1.0f);
+  __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+
+  __m512 best_t = _mm512_set1_ps(interval->max);
+  __m512i best_i = _mm512_setzero_si512();
+
+  for (size_t block = start; block < end; block += 16) {
+    __m512 e1x = _mm512_loadu_ps(triangles->e1xs + block);
+    __m512 e1y = _mm512_loadu_ps(triangles->e1ys + block);
+    __m512 e1z = _mm512_loadu_ps(triangles->e1zs + block);
+    __m512 e2x = _mm512_loadu_ps(triangles->e2xs + block);
+    __m512 e2y = _mm512_loadu_ps(triangles->e2ys + block);
+    __m512 e2z = _mm512_loadu_ps(triangles->e2zs + block);
+
+    // p = direction x e2, det = e1 . p
+    __m512 px = _mm512_fmsub_ps(dy, e2z, _mm512_mul_ps(dz, e2y));
+    __m512 py = _mm512_fmsub_ps(dz, e2x, _mm512_mul_ps(dx, e2z));
+    __m512 pz = _mm512_fmsub_ps(dx, e2y, _mm512_mul_ps(dy, e2x));
+    __m512 det = _mm512_fmadd_ps(e1z, pz, _mm512_fmadd_ps(e1y, py, _mm512_mul_ps(e1x, px)));
+    __m512 inv_det = _mm512_div_ps(one, det);
+
+    // s = origin - corner 0, u = (s . p) / det
+    __m512 sx = _mm512_sub_ps(ox, _mm512_loadu_ps(triangles->axs + block));
+    __m512 sy = _mm512_sub_ps(oy, _mm512_loadu_ps(triangles->ays + block));
+    __m512 sz = _mm512_sub_ps(oz, _mm512_loadu_ps(triangles->azs + block));
+    __m512 u = _mm512_mul_ps(_mm512_fmadd_ps(sz, pz, _mm512_fmadd_ps(sy, py, _mm512_mul_ps(sx, px))), inv_det);
+
+    // q = s x e1, v = (direction . q) / det
+    __m512 qx = _mm512_fmsub_ps(sy, e1z, _mm512_mul_ps(sz, e1y));
+    __m512 qy = _mm512_fmsub_ps(sz, e1x, _mm512_mul_ps(sx, e1z));
+    __m512 qz = _mm512_fmsub_ps(sx, e1y, _mm512_mul_ps(sy, e1x));
+    __m512 v = _mm512_mul_ps(_mm512_fmadd_ps(dz, qz, _mm512_fmadd_ps(dy, qy, _mm512_mul_ps(dx, qx))), inv_det);
+
+    __mmask16 in_range = end - block >= 16 ? 0xffff : (__mmask16)((1u << (end - block)) - 1);
+    __mmask16 valid = _mm512_mask_cmp_ps_mask(in_range, det, zero, _CMP_NEQ_OQ);
+    valid = _mm512_mask_cmp_ps_mask(valid, u, zero, _CMP_GE_OQ);
+    valid = _mm512_mask_cmp_ps_mask(valid, v, zero, _CMP_GE_OQ);
+    valid = _mm512_mask_cmp_ps_mask(valid, _mm512_add_ps(u, v), one, _CMP_LE_OQ);
+    if (valid == 0) {
+      continue;
+    }
+
+    __m512 t = _mm512_mul_ps(_mm512_fmadd_ps(e2z, qz, _mm512_fmadd_ps(e2y, qy, _mm512_mul_ps(e2x, qx))), inv_det);
+    __mmask16 nearer = _mm512_mask_cmp_ps_mask(_mm512_mask_cmp_ps_mask(valid, t, t_min, _CMP_GT_OQ), t, best_t, _CMP_LT_OQ);
+    best_t = _mm512_mask_mov_ps(best_t, nearer, t);
+    best_i = _mm512_mask_add_epi32(best_i, nearer, lanes, _mm512_set1_epi32(block - start));
+  }
+
+  float t = _mm512_reduce_min_ps(best_t);
+  if (!(t < interval->max)) {
+    return false;
+  }
+  __mmask16 nearest = _mm512_cmp_ps_mask(best_t, _mm512_set1_ps(t), _CMP_EQ_OQ);
+  interval->max = t;
+  *closest = start + _mm512_mask_reduce_min_epi32(nearest, best_i);
+  return true;
+}
+
+#endif // SIMD_HAVE_X86
+
+closest_triangle_fn_t closest_triangle = closest_triangle_scalar;
+
+closest_triangle_fn_t closest_triangle_kernel(simd_backend_t backend) {
+  switch (backend) {
+    #if defined(SIMD_HAVE_NEON)
+    case SIMD_NEON: return closest_triangle_neon;
+    #endif
+    #if defined(SIMD_HAVE_X86)
+    case SIMD_SSE41: return closest_triangle_sse41;
+    case SIMD_AVX2: return closest_triangle_avx2;
+    case SIMD_AVX512: return closest_triangle_avx512;
+    #endif
+    default: return closest_triangle_scalar;
+  }
+}
+
+// called from select_simd_backend() at startup
+void select_triangle_backend(simd_backend_t backend) {
+  closest_triangle = closest_triangle_kernel(backend);
+}
+
+// fills in rec for a hit at distance t on triangle i. the normal is the
+// flat one of the triangle's plane, and rec->sphere is HIT_TRIANGLE.
+void set_triangle_hit_record(const triangle_list_t *triangles, size_t i, float t, const ray_t *ray, hit_record_t *rec) {
+  rec->t = t;
+  rec->p = propagate(*ray, t);
+  set_face_normal(rec, ray, triangle_normal(triangles, i));
+  rec->mat = &triangles->materials->materials[triangles->materials->indices[i]];
+  rec->sphere = HIT_TRIANGLE;
+}
+
+bool closest_triangle_leaf(const void *triangles, size_t start, size_t end, const ray_t *ray, interval_t *interval, size_t *closest) {
+  STATS_ADD(triangle_tests, end - start);
+  return closest_triangle(triangles, start, end, ray, interval, closest);
+}
+
+bool closest_triangle_bvh(const bvh_t *bvh, const triangle_list_t *triangles, const ray_t *ray, interval_t *interval, size_t *closest) {
+  return closest_prim_bvh(bvh, closest_triangle_leaf, triangles, ray, interval, closest);
+}
+
+bool occluded_triangle_bvh(const bvh_t *bvh, const triangle_list_t *triangles, const ray_t *ray, const interval_t *interval) {
+  return occluded_prim_bvh(bvh, closest_triangle_leaf, triangles, ray, interval);
+}
+
+// applies the permutation prim_ids to every per-triangle array
+void reorder_triangles(triangle_list_t *triangles, const uint32_t *prim_ids) {
+  size_t n = triangles->n_triangles;
+  float *tmp = malloc((n > 0 ? n : 1) * sizeof(float));
+  float **arrays[9];
+  triangle_arrays(triangles, arrays);
+  for (size_t k = 0; k < 9; k++) {
+    for (size_t i = 0; i < n; i++) {
+      tmp[i] = (*arrays[k])[prim_ids[i]];
+    }
+    memcpy(*arrays[k], tmp, n * sizeof(float));
+  }
+  free(tmp);
+
+  uint32_t *tmp_index = malloc((n > 0 ? n : 1) * sizeof(uint32_t));
+  uint32_t *corners[] = {triangles->v0s, triangles->v1s, triangles->v2s};
+  for (size_t k = 0; k < 3; k++) {
+    for (size_t i = 0; i < n; i++) {
+      tmp_index[i] = corners[k][prim_ids[i]];
+    }
+    memcpy(corners[k], tmp_index, n * sizeof(uint32_t));
+  }
+  free(tmp_index);
+
+  material_index_t *tmp_material = malloc((n > 0 ? n : 1) * sizeof(material_index_t));
+  for (size_t i = 0; i < n; i++) {
+    tmp_material[i] = triangles->materials->indices[prim_ids[i]];
+  }
+  memcpy(triangles->materials->indices, tmp_material, n * sizeof(material_index_t));
+  free(tmp_material);
+}
+
+// builds a BVH over every triangle in the list, with the sphere BVH's
+// builder. NB: like build_bvh this reorders the triangles, though not the
+// vertices they index.
+bvh_t *build_triangle_bvh(triangle_list_t *triangles) {
+  double start_time = now_seconds();
+
+  size_t n = triangles->n_triangles;
+  bvh_prim_t *prims = malloc((n > 0 ? n : 1) * sizeof(bvh_prim_t));
+  for (size_t i = 0; i < n; i++) {
+    float a[3] = {triangles->axs[i], triangles->ays[i], triangles->azs[i]};
+    float e1[3] = {triangles->e1xs[i], triangles->e1ys[i], triangles->e1zs[i]};
+    float e2[3] = {triangles->e2xs[i], triangles->e2ys[i], triangles->e2zs[i]};
+    for (int k = 0; k < 3; k++) {
+      float b = a[k] + e1[k];
+      float c = a[k] + e2[k];
+      prims[i].bounds.min[k] = min_float(a[k], min_float(b, c));
+      prims[i].bounds.max[k] = max_float(a[k], max_float(b, c));
+      prims[i].centroid[k] = (a[k] + b + c) * (1.0f / 3.0f);
+    }
+  }
+  bvh_t *bvh = build_bvh_over(triangles->arena, prims, n);
+  free(prims);
+
+  reorder_triangles(triangles, bvh->prim_ids);
+  bvh->build_seconds = now_seconds() - start_time;
+  return bvh;
+}
+
+// one OBJ face corner, "v", "v/vt", "v//vn" or "v/vt/vn", negative
+// counting back from the last vertex. only the position is used. false if
+// it isn't a vertex of this file (first to n_vertices).
+bool parse_obj_corner(const char *token, size_t first, size_t n_vertices, uint32_t *vertex) {
+  char *end;
+  long index = strtol(token, &end, 10);
+  if (end == token || (*end != '\0' && *end != '/')) {
+    return false;
+  }
+  long v = index > 0 ? (long)first + index - 1 : (long)n_vertices + index;
+  if (index == 0 || v < (long)first || v >= (long)n_vertices) {
+    return false;
+  }
+  *vertex = v;
+  return true;
+}
+
+#define OBJ_LINE_MAX 4096
+#define OBJ_MAX_CORNERS 64
+
+// appends the mesh in the OBJ file at path to triangles, every vertex
+// scaled by scale and then moved by offset, every triangle made of
+// material. only v and f lines are read, faces with more than three
+// corners are split into a fan, and anything else (normals, texture
+// coordinates, groups, materials) is skipped.
+bool load_obj(triangle_list_t *triangles, const char *path, vec3_t offset, float scale_by, material_t material) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    printf("couldn't open %s\n", path);
+    return false;
+  }
+
+  size_t first = triangles->n_vertices;
+  char line[OBJ_LINE_MAX];
+  int line_number = 0;
+  bool ok = true;
+  while (ok && fgets(line, sizeof(line), fp) != NULL) {
+    line_number++;
+    char *p = line + strspn(line, " \t");
+    if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+      float x, y, z;
+      if (sscanf(p + 1, "%f %f %f", &x, &y, &z) != 3) {
+        printf("%s:%d: expected \"v x y z\"\n", path, line_number);
+        ok = false;
+        break;
+      }
+      add_vertex(triangles, add(scale(new_vec3(x, y, z), scale_by), offset));
+    } else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+      uint32_t corners[OBJ_MAX_CORNERS];
+      int n_corners = 0;
+      char *save = NULL;
+      for (char *token = strtok_r(p + 1, " \t\r\n", &save); token != NULL; token = strtok_r(NULL, " \t\r\n", &save)) {
+        if (n_corners == OBJ_MAX_CORNERS || !parse_obj_corner(token, first, triangles->n_vertices, &corners[n_corners])) {
+          ok = false;
+          break;
+        }
+        n_corners++;
+      }
+      if (!ok || n_corners < 3) {
+        printf("%s:%d: expected a face of 3 to %d vertices defined before it\n", path, line_number, OBJ_MAX_CORNERS);
+        ok = false;
+        break;
+      }
+      for (int k = 1; k + 1 < n_corners; k++) {
+        if (!add_triangle(triangles, corners[0], corners[k], corners[k + 1], material)) {
+          printf("%s:%d: too many materials\n", path, line_number);
+          ok = false;
+          break;
+        }
+      }
+    }
+  }
+  fclose(fp);
+  return ok;
+}
+
+// a sphere tessellated into about n_triangles triangles, rows of quads from
+// pole to pole, with its radius rippled by bumps so neighbouring triangles
+// aren't coplanar. for benchmarks and tests.
+void add_bumpy_sphere(triangle_list_t *triangles, point3_t center, float radius, size_t n_triangles, material_t material) {
+  int rows = (int)sqrtf(n_triangles / 4.0f);
+  rows = rows < 2 ? 2 : rows;
+  int columns = 2 * rows;
+  uint32_t first = triangles->n_vertices;
+  for (int i = 0; i <= rows; i++) {
+    float theta = pi * i / rows;
+    for (int j = 0; j < columns; j++) {
+      float phi = 2 * pi * j / columns;
+      float r = radius * (1.0f + 0.05f * sinf(7 * theta) * sinf(5 * phi));
+      add_vertex(triangles, add(center, new_vec3(r * sinf(theta) * cosf(phi), r * cosf(theta), r * sinf(theta) * sinf(phi))));
+    }
+  }
+  for (int i = 0; i < rows; i++) {
+    for (int j = 0; j < columns; j++) {
+      uint32_t a = first + i * columns + j;
+      uint32_t b = first + i * columns + (j + 1) % columns;
+      uint32_t c = a + columns;
+      uint32_t d = b + columns;
+      // counterclockwise seen from outside
+      add_triangle(triangles, a, b, c, material);
+      add_triangle(triangles, b, d, c, material);
+    }
+  }
+}
+
+#endif // !TRIANGLE_H
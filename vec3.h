@@ -1,11 +1,12 @@
 #ifndef VEC3_H
 #define VEC3_H
 
+#include "fastmath.h"
 #include "rtweekend.h"
+#include "sampling.h"
 #include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
-#include <arm_neon.h>
 
 // vector is only 3 dimensions but i think this
 // makes sure the vectorized operations work okay
@@ -35,7 +36,7 @@ bool equals(vec3_t a, vec3_t b) {
 
 bool near_zero(vec3_t a) {
   float s = 1e-8;
-  return (fabs(a.e[0]) < s) && (fabs(a.e[1]) < s) && (fabs(a.e[2]) < s);
+  return (fabsf(a.e[0]) < s) && (fabsf(a.e[1]) < s) && (fabsf(a.e[2]) < s);
 }
 
 void add_equals(vec3_t *a, vec3_t b) {
@@ -61,7 +62,7 @@ float length_squared(const vec3_t *a) {
 }
 
 float length(const vec3_t *a) {
-  return sqrt(length_squared(a));
+  return sqrtf(length_squared(a));
 }
 
 void print_vec3(FILE *fp, const vec3_t *a) {
@@ -115,7 +116,7 @@ vec3_t cross(vec3_t a, vec3_t b) {
 }
 
 vec3_t normalize(vec3_t a) {
-  return scale(a, 1/length(&a));
+  return scale(a, rsqrt_float(length_squared(&a)));
 }
 
 vec3_t random_vec3(float min, float max) {
@@ -123,12 +124,11 @@ vec3_t random_vec3(float min, float max) {
 }
 
 vec3_t random_vec3_on_unit_sphere() {
-  for (;;) {
-    vec3_t vec = random_vec3(-1.0, 1.0);
-    if (length_squared(&vec) < 1) {
-      return normalize(vec);
-    }
-  }
+  float u = random_float();
+  float v = random_float();
+  vec3_t vec;
+  uniform_sphere_point(u, v, &vec.e[0], &vec.e[1], &vec.e[2]);
+  return vec;
 }
 
 vec3_t random_vec3_on_hemisphere(vec3_t normal) {
@@ -141,13 +141,21 @@ vec3_t random_vec3_on_hemisphere(vec3_t normal) {
 }
 
 vec3_t random_vec3_in_unit_disk() {
-  for (;;) {
-    vec3_t vec = random_vec3(-1.0, 1.0);
-    vec.e[2] = 0.0;
-    if (length_squared(&vec) < 1) {
-      return vec;
-    }
-  }
+  float u = random_float();
+  float v = random_float();
+  vec3_t vec = new_vec3(0.0, 0.0, 0.0);
+  concentric_disk_point(u, v, &vec.e[0], &vec.e[1]);
+  return vec;
+}
+
+// cosine weighted about the unit vector normal
+vec3_t random_vec3_cosine_direction(vec3_t normal) {
+  float u = random_float();
+  float v = random_float();
+  vec3_t local, vec;
+  cosine_hemisphere_point(u, v, &local.e[0], &local.e[1], &local.e[2]);
+  frame_to_world(normal.e[0], normal.e[1], normal.e[2], local.e[0], local.e[1], local.e[2], &vec.e[0], &vec.e[1], &vec.e[2]);
+  return vec;
 }
 
 vec3_t reflect(vec3_t v, vec3_t n) {
@@ -155,11 +163,11 @@ vec3_t reflect(vec3_t v, vec3_t n) {
 }
 
 vec3_t refract(vec3_t uv, vec3_t n, float eta_over_eta_prime) {
-  float cos_theta = fmin(dot(scale(uv, -1.0), n), 1.0);
+  float cos_theta = min_float(-dot(uv, n), 1.0f);
   vec3_t r_prime_perp = scale(n, cos_theta);
   add_equals(&r_prime_perp, uv);
   r_prime_perp = scale(r_prime_perp, eta_over_eta_prime);
-  vec3_t r_prime_parallel = scale(n, -1*sqrt(fabs(1 - length_squared(&r_prime_perp))));
+  vec3_t r_prime_parallel = scale(n, -sqrtf(fabsf(1 - length_squared(&r_prime_perp))));
   return add(r_prime_perp, r_prime_parallel);
 }
 
@@ -2,161 +2,368 @@
 #define VECTORIZED_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
-#include <arm_neon.h>
-
+#include "simd.h"
 #include "vec3.h"
 #include "ray.h"
 #include "interval.h"
 #include "material.h"
 
-bool hit_sphere_list_vectorized(sphere_list_t *sphere_list, material_list_t *material_list, const ray_t *ray, const interval_t *interval, hit_record_t *rec) {
-  float closest_so_far = interval->max;
-  interval_t this_interval = {.min = interval->min, .max = closest_so_far};
+// Each backend below finds the closest hit among spheres [start, end) of the
+// list for a ray inside interval. On a hit it shrinks interval->max to the
+// hit's t, writes the sphere's index to *closest and returns true.
+// hit_sphere_list_vectorized() turns that into a hit_record_t so the kernels
+// only have to do the quadratic formula. Taking a range instead of the whole
+// list lets the BVH run the same kernels over each leaf's block of spheres.
+typedef bool (*closest_sphere_fn_t)(const sphere_list_t *sphere_list, size_t start, size_t end, const ray_t *ray, interval_t *interval, size_t *closest);
+
+// scalar version of one sphere test, for the reference kernel
+bool hit_one_sphere(const sphere_list_t *sphere_list, size_t i, const ray_t *ray, interval_t *interval) {
+  float ac_x = ray->origin.e[0] - sphere_list->xs[i];
+  float ac_y = ray->origin.e[1] - sphere_list->ys[i];
+  float ac_z = ray->origin.e[2] - sphere_list->zs[i];
 
+  float halfb = ray->direction.e[0]*ac_x + ray->direction.e[1]*ac_y + ray->direction.e[2]*ac_z;
+  float c = ac_x*ac_x + ac_y*ac_y + ac_z*ac_z - sphere_list->r2s[i];
+  float disc = halfb*halfb - c;
+  if (disc < 0.0f) {
+    return false;
+  }
+
+  float sqrt_disc = sqrtf(disc);
+  float t = -halfb - sqrt_disc;
+  if (!interval_surrounds(interval, t)) {
+    t = -halfb + sqrt_disc;
+    if (!interval_surrounds(interval, t)) {
+      return false;
+    }
+  }
+  interval->max = t;
+  return true;
+}
+
+bool closest_sphere_scalar(const sphere_list_t *sphere_list, size_t start, size_t end, const ray_t *ray, interval_t *interval, size_t *closest) {
+  bool hit = false;
+  for (size_t i = start; i < end; i++) {
+    if (hit_one_sphere(sphere_list, i, ray, interval)) {
+      *closest = i;
+      hit = true;
+    }
+  }
+  return hit;
+}
+
+// The vector kernels run whole vectors from start until they pass end, which
+// the list's padding makes safe (see sphere_list_t), and mask off the lanes
+// past end, which are sentinels or the next leaf's spheres. Each lane keeps
+// the nearest t it has seen and that sphere's index relative to start; a
+// sphere replaces them only if strictly nearer, like the scalar loop. At the
+// end the nearest t across lanes wins, ties going to the lowest index, so the
+// answer is the scalar kernel's without ever leaving the vector registers.
+
+#if defined(SIMD_HAVE_NEON)
+
+bool closest_sphere_neon(const sphere_list_t *sphere_list, size_t start, size_t end, const ray_t *ray, interval_t *interval, size_t *closest) {
   float32x4_t ray_dirx = vdupq_n_f32(ray->direction.e[0]);
   float32x4_t ray_diry = vdupq_n_f32(ray->direction.e[1]);
   float32x4_t ray_dirz = vdupq_n_f32(ray->direction.e[2]);
   float32x4_t ray_orx = vdupq_n_f32(ray->origin.e[0]);
   float32x4_t ray_ory = vdupq_n_f32(ray->origin.e[1]);
   float32x4_t ray_orz = vdupq_n_f32(ray->origin.e[2]);
+  float32x4_t t_min = vdupq_n_f32(interval->min);
+  float32x4_t zero = vdupq_n_f32(0.0f);
+  const uint32_t lane_ids[4] = {0, 1, 2, 3};
+  uint32x4_t lanes = vld1q_u32(lane_ids);
 
-  float32x4_t t_big;
-  float32x4_t t_big2;
+  float32x4_t best_t = vdupq_n_f32(interval->max);
+  uint32x4_t best_i = vdupq_n_u32(0);
 
-  float *sphere_xs = sphere_list->xs;
-  float *sphere_ys = sphere_list->ys;
-  float *sphere_zs = sphere_list->zs;
-  float *sphere_r2s = sphere_list->r2s;
+  for (size_t block = start; block < end; block += 4) {
+    // a_c = origin - center
+    float32x4_t ac_x = vsubq_f32(ray_orx, vld1q_f32(sphere_list->xs + block));
+    float32x4_t ac_y = vsubq_f32(ray_ory, vld1q_f32(sphere_list->ys + block));
+    float32x4_t ac_z = vsubq_f32(ray_orz, vld1q_f32(sphere_list->zs + block));
 
-  size_t closest_hit_sphere = 0;
+    // half_b = direction dot a_c
+    float32x4_t halfb = vmulq_f32(ray_dirx, ac_x);
+    halfb = vfmaq_f32(halfb, ray_diry, ac_y);
+    halfb = vfmaq_f32(halfb, ray_dirz, ac_z);
 
-  int block = 0;
-  for (int count = sphere_list->nth_sphere - 1; count >= 0; count -= 8) {
-    float32x4x2_t vec_spheres_xs = vld1q_f32_x2(sphere_xs);
-    float32x4x2_t vec_spheres_ys = vld1q_f32_x2(sphere_ys);
-    float32x4x2_t vec_spheres_zs = vld1q_f32_x2(sphere_zs);
-    float32x4x2_t vec_spheres_r2s = vld1q_f32_x2(sphere_r2s);
+    // c = length_squared(a_c) - radius^2
+    float32x4_t c = vmulq_f32(ac_x, ac_x);
+    c = vfmaq_f32(c, ac_y, ac_y);
+    c = vfmaq_f32(c, ac_z, ac_z);
+    c = vsubq_f32(c, vld1q_f32(sphere_list->r2s + block));
 
-    // a_c = origin - center
-    float32x4_t ac_x = vsubq_f32(ray_orx, vec_spheres_xs.val[0]);
-    float32x4_t ac_y = vsubq_f32(ray_ory, vec_spheres_ys.val[0]);
-    float32x4_t ac_z = vsubq_f32(ray_orz, vec_spheres_zs.val[0]);
+    // discriminant = half_b*half_b - c
+    float32x4_t disc = vsubq_f32(vmulq_f32(halfb, halfb), c);
+    uint32x4_t valid = vandq_u32(vcgeq_f32(disc, zero), vcltq_u32(lanes, vdupq_n_u32(end - block < 4 ? end - block : 4)));
+    if (vmaxvq_u32(valid) == 0) {
+      continue;
+    }
 
-    // a_c = origin - center
-    float32x4_t ac_x2 = vsubq_f32(ray_orx, vec_spheres_xs.val[1]);
-    float32x4_t ac_y2 = vsubq_f32(ray_ory, vec_spheres_ys.val[1]);
-    float32x4_t ac_z2 = vsubq_f32(ray_orz, vec_spheres_zs.val[1]);
+    // the near root if it's past t_min, otherwise the far one
+    float32x4_t sqrt_disc = vsqrtq_f32(disc);
+    float32x4_t neg_halfb = vnegq_f32(halfb);
+    float32x4_t t_small = vsubq_f32(neg_halfb, sqrt_disc);
+    float32x4_t t = vbslq_f32(vcgtq_f32(t_small, t_min), t_small, vaddq_f32(neg_halfb, sqrt_disc));
+    uint32x4_t nearer = vandq_u32(valid, vandq_u32(vcgtq_f32(t, t_min), vcltq_f32(t, best_t)));
+    best_t = vbslq_f32(nearer, t, best_t);
+    best_i = vbslq_u32(nearer, vaddq_u32(lanes, vdupq_n_u32(block - start)), best_i);
+  }
 
-    // half_b = direction dot a_c
-    float32x4_t halfb_x = vmulq_f32(ray_dirx, ac_x);
-    float32x4_t halfb_y = vmulq_f32(ray_diry, ac_y);
-    float32x4_t halfb_z = vmulq_f32(ray_dirz, ac_z);
-    float32x4_t halfb = vaddq_f32(halfb_x, halfb_y);
-    halfb = vaddq_f32(halfb, halfb_z);
+  float t = vminvq_f32(best_t);
+  if (!(t < interval->max)) {
+    return false;
+  }
+  uint32x4_t candidates = vbslq_u32(vceqq_f32(best_t, vdupq_n_f32(t)), best_i, vdupq_n_u32(UINT32_MAX));
+  interval->max = t;
+  *closest = start + vminvq_u32(candidates);
+  return true;
+}
+
+#endif // SIMD_HAVE_NEON
+
+#if defined(SIMD_HAVE_X86)
+
+// nearest t across the lanes and the lowest index holding it
+__attribute__((target("sse4.1")))
+bool reduce_closest_sse41(__m128 best_t, __m128i best_i, size_t start, interval_t *interval, size_t *closest) {
+  __m128 m = _mm_min_ps(best_t, _mm_shuffle_ps(best_t, best_t, _MM_SHUFFLE(2, 3, 0, 1)));
+  m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+  float t = _mm_cvtss_f32(m);
+  if (!(t < interval->max)) {
+    return false;
+  }
+  __m128i candidates = _mm_blendv_epi8(_mm_set1_epi32(INT32_MAX), best_i, _mm_castps_si128(_mm_cmpeq_ps(best_t, m)));
+  candidates = _mm_min_epi32(candidates, _mm_shuffle_epi32(candidates, _MM_SHUFFLE(2, 3, 0, 1)));
+  candidates = _mm_min_epi32(candidates, _mm_shuffle_epi32(candidates, _MM_SHUFFLE(1, 0, 3, 2)));
+  interval->max = t;
+  *closest = start + _mm_cvtsi128_si32(candidates);
+  return true;
+}
+
+__attribute__((target("sse4.1")))
+bool closest_sphere_sse41(const sphere_list_t *sphere_list, size_t start, size_t end, const ray_t *ray, interval_t *interval, size_t *closest) {
+  __m128 ray_dirx = _mm_set1_ps(ray->direction.e[0]);
+  __m128 ray_diry = _mm_set1_ps(ray->direction.e[1]);
+  __m128 ray_dirz = _mm_set1_ps(ray->direction.e[2]);
+  __m128 ray_orx = _mm_set1_ps(ray->origin.e[0]);
+  __m128 ray_ory = _mm_set1_ps(ray->origin.e[1]);
+  __m128 ray_orz = _mm_set1_ps(ray->origin.e[2]);
+  __m128 t_min = _mm_set1_ps(interval->min);
+  __m128 zero = _mm_setzero_ps();
+  __m128i lanes = _mm_setr_epi32(0, 1, 2, 3);
+
+  __m128 best_t = _mm_set1_ps(interval->max);
+  __m128i best_i = _mm_setzero_si128();
+
+  for (size_t block = start; block < end; block += 4) {
+    // a_c = origin - center
+    __m128 ac_x = _mm_sub_ps(ray_orx, _mm_loadu_ps(sphere_list->xs + block));
+    __m128 ac_y = _mm_sub_ps(ray_ory, _mm_loadu_ps(sphere_list->ys + block));
+    __m128 ac_z = _mm_sub_ps(ray_orz, _mm_loadu_ps(sphere_list->zs + block));
 
     // half_b = direction dot a_c
-    float32x4_t halfb_x2 = vmulq_f32(ray_dirx, ac_x2);
-    float32x4_t halfb_y2 = vmulq_f32(ray_diry, ac_y2);
-    float32x4_t halfb_z2 = vmulq_f32(ray_dirz, ac_z2);
-    float32x4_t halfb2 = vaddq_f32(halfb_x2, halfb_y2);
-    halfb2 = vaddq_f32(halfb2, halfb_z2);
+    __m128 halfb = _mm_add_ps(_mm_mul_ps(ray_dirx, ac_x), _mm_mul_ps(ray_diry, ac_y));
+    halfb = _mm_add_ps(halfb, _mm_mul_ps(ray_dirz, ac_z));
 
     // c = length_squared(a_c) - radius^2
-    float32x4_t cx = vmulq_f32(ac_x, ac_x);
-    float32x4_t cy = vmulq_f32(ac_y, ac_y);
-    float32x4_t cz = vmulq_f32(ac_z, ac_z);
-    float32x4_t c = vaddq_f32(cx, cy);
-    c = vaddq_f32(c, cz);
-    c = vsubq_f32(c, vec_spheres_r2s.val[0]);
+    __m128 c = _mm_add_ps(_mm_mul_ps(ac_x, ac_x), _mm_mul_ps(ac_y, ac_y));
+    c = _mm_add_ps(c, _mm_mul_ps(ac_z, ac_z));
+    c = _mm_sub_ps(c, _mm_loadu_ps(sphere_list->r2s + block));
+
+    // discriminant = half_b*half_b - c
+    __m128 disc = _mm_sub_ps(_mm_mul_ps(halfb, halfb), c);
+    __m128 in_range = _mm_castsi128_ps(_mm_cmplt_epi32(lanes, _mm_set1_epi32(end - block < 4 ? end - block : 4)));
+    __m128 valid = _mm_and_ps(_mm_cmpge_ps(disc, zero), in_range);
+    if (_mm_movemask_ps(valid) == 0) {
+      continue;
+    }
+
+    // the near root if it's past t_min, otherwise the far one
+    __m128 sqrt_disc = _mm_sqrt_ps(disc);
+    __m128 neg_halfb = _mm_sub_ps(zero, halfb);
+    __m128 t_small = _mm_sub_ps(neg_halfb, sqrt_disc);
+    __m128 t = _mm_blendv_ps(_mm_add_ps(neg_halfb, sqrt_disc), t_small, _mm_cmpgt_ps(t_small, t_min));
+    __m128 nearer = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(t, t_min), _mm_cmplt_ps(t, best_t)));
+    best_t = _mm_blendv_ps(best_t, t, nearer);
+    best_i = _mm_blendv_epi8(best_i, _mm_add_epi32(lanes, _mm_set1_epi32(block - start)), _mm_castps_si128(nearer));
+  }
+
+  return reduce_closest_sse41(best_t, best_i, start, interval, closest);
+}
+
+__attribute__((target("avx2,fma")))
+bool closest_sphere_avx2(const sphere_list_t *sphere_list, size_t start, size_t end, const ray_t *ray, interval_t *interval, size_t *closest) {
+  __m256 ray_dirx = _mm256_set1_ps(ray->direction.e[0]);
+  __m256 ray_diry = _mm256_set1_ps(ray->direction.e[1]);
+  __m256 ray_dirz = _mm256_set1_ps(ray->direction.e[2]);
+  __m256 ray_orx = _mm256_set1_ps(ray->origin.e[0]);
+  __m256 ray_ory = _mm256_set1_ps(ray->origin.e[1]);
+  __m256 ray_orz = _mm256_set1_ps(ray->origin.e[2]);
+  __m256 t_min = _mm256_set1_ps(interval->min);
+  __m256 zero = _mm256_setzero_ps();
+  __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+  __m256 best_t = _mm256_set1_ps(interval->max);
+  __m256i best_i = _mm256_setzero_si256();
+
+  for (size_t block = start; block < end; block += 8) {
+    // a_c = origin - center
+    __m256 ac_x = _mm256_sub_ps(ray_orx, _mm256_loadu_ps(sphere_list->xs + block));
+    __m256 ac_y = _mm256_sub_ps(ray_ory, _mm256_loadu_ps(sphere_list->ys + block));
+    __m256 ac_z = _mm256_sub_ps(ray_orz, _mm256_loadu_ps(sphere_list->zs + block));
+
+    // half_b = direction dot a_c
+    __m256 halfb = _mm256_mul_ps(ray_dirx, ac_x);
+    halfb = _mm256_fmadd_ps(ray_diry, ac_y, halfb);
+    halfb = _mm256_fmadd_ps(ray_dirz, ac_z, halfb);
 
     // c = length_squared(a_c) - radius^2
-    float32x4_t cx2 = vmulq_f32(ac_x2, ac_x2);
-    float32x4_t cy2 = vmulq_f32(ac_y2, ac_y2);
-    float32x4_t cz2 = vmulq_f32(ac_z2, ac_z2);
-    float32x4_t c2 = vaddq_f32(cx2, cy2);
-    c2 = vaddq_f32(c2, cz2);
-    c2 = vsubq_f32(c2, vec_spheres_r2s.val[1]);
+    __m256 c = _mm256_mul_ps(ac_x, ac_x);
+    c = _mm256_fmadd_ps(ac_y, ac_y, c);
+    c = _mm256_fmadd_ps(ac_z, ac_z, c);
+    c = _mm256_sub_ps(c, _mm256_loadu_ps(sphere_list->r2s + block));
 
     // discriminant = half_b*half_b - c
-    float32x4_t disc = vmulq_f32(halfb, halfb);
-    disc = vsubq_f32(disc, c);
+    __m256 disc = _mm256_fmsub_ps(halfb, halfb, c);
+    __m256 in_range = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(end - block < 8 ? end - block : 8), lanes));
+    __m256 valid = _mm256_and_ps(_mm256_cmp_ps(disc, zero, _CMP_GE_OQ), in_range);
+    if (_mm256_movemask_ps(valid) == 0) {
+      continue;
+    }
+
+    // the near root if it's past t_min, otherwise the far one
+    __m256 sqrt_disc = _mm256_sqrt_ps(disc);
+    __m256 neg_halfb = _mm256_sub_ps(zero, halfb);
+    __m256 t_small = _mm256_sub_ps(neg_halfb, sqrt_disc);
+    __m256 t = _mm256_blendv_ps(_mm256_add_ps(neg_halfb, sqrt_disc), t_small, _mm256_cmp_ps(t_small, t_min, _CMP_GT_OQ));
+    __m256 nearer = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t, t_min, _CMP_GT_OQ), _mm256_cmp_ps(t, best_t, _CMP_LT_OQ)));
+    best_t = _mm256_blendv_ps(best_t, t, nearer);
+    best_i = _mm256_blendv_epi8(best_i, _mm256_add_epi32(lanes, _mm256_set1_epi32(block - start)), _mm256_castps_si256(nearer));
+  }
+
+  // fold the top half onto the bottom, keeping the lower index on a tie
+  __m128 lo_t = _mm256_castps256_ps128(best_t);
+  __m128 hi_t = _mm256_extractf128_ps(best_t, 1);
+  __m128i lo_i = _mm256_castsi256_si128(best_i);
+  __m128i hi_i = _mm256_extracti128_si256(best_i, 1);
+  __m128 take_hi = _mm_cmplt_ps(hi_t, lo_t);
+  return reduce_closest_sse41(_mm_blendv_ps(lo_t, hi_t, take_hi), _mm_blendv_epi8(lo_i, hi_i, _mm_castps_si128(take_hi)),
+                              start, interval, closest);
+}
+
+__attribute__((target("avx512f")))
+bool closest_sphere_avx512(const sphere_list_t *sphere_list, size_t start, size_t end, const ray_t *ray, interval_t *interval, size_t *closest) {
+  __m512 ray_dirx = _mm512_set1_ps(ray->direction.e[0]);
+  __m512 ray_diry = _mm512_set1_ps(ray->direction.e[1]);
+  __m512 ray_dirz = _mm512_set1_ps(ray->direction.e[2]);
+  __m512 ray_orx = _mm512_set1_ps(ray->origin.e[0]);
+  __m512 ray_ory = _mm512_set1_ps(ray->origin.e[1]);
+  __m512 ray_orz = _mm512_set1_ps(ray->origin.e[2]);
+  __m512 t_min = _mm512_set1_ps(interval->min);
+  __m512 zero = _mm512_setzero_ps();
+  __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+
+  __m512 best_t = _mm512_set1_ps(interval->max);
+  __m512i best_i = _mm512_setzero_si512();
+
+  for (size_t block = start; block < end; block += 16) {
+    // a_c = origin - center
+    __m512 ac_x = _mm512_sub_ps(ray_orx, _mm512_loadu_ps(sphere_list->xs + block));
+    __m512 ac_y = _mm512_sub_ps(ray_ory, _mm512_loadu_ps(sphere_list->ys + block));
+    __m512 ac_z = _mm512_sub_ps(ray_orz, _mm512_loadu_ps(sphere_list->zs + block));
+
+    // half_b = direction dot a_c
+    __m512 halfb = _mm512_mul_ps(ray_dirx, ac_x);
+    halfb = _mm512_fmadd_ps(ray_diry, ac_y, halfb);
+    halfb = _mm512_fmadd_ps(ray_dirz, ac_z, halfb);
+
+    // c = length_squared(a_c) - radius^2
+    __m512 c = _mm512_mul_ps(ac_x, ac_x);
+    c = _mm512_fmadd_ps(ac_y, ac_y, c);
+    c = _mm512_fmadd_ps(ac_z, ac_z, c);
+    c = _mm512_sub_ps(c, _mm512_loadu_ps(sphere_list->r2s + block));
 
     // discriminant = half_b*half_b - c
-    float32x4_t disc2 = vmulq_f32(halfb2, halfb2);
-    disc2 = vsubq_f32(disc2, c2);
-    // maybe different branches for 1 hit or more than one hit?
-    sphere_xs += 8;
-    sphere_ys += 8;
-    sphere_zs += 8;
-    sphere_r2s += 8;
-    block += 8;
-
-    if (vmaxvq_f32(vpmaxq_f32(disc, disc2)) < 0.0f) {
+    __m512 disc = _mm512_fmsub_ps(halfb, halfb, c);
+    __mmask16 in_range = end - block >= 16 ? 0xffff : (__mmask16)((1u << (end - block)) - 1);
+    __mmask16 valid = _mm512_mask_cmp_ps_mask(in_range, disc, zero, _CMP_GE_OQ);
+    if (valid == 0) {
       continue;
     }
 
-    if (vmaxvq_f32(disc) >= 0.0f) {
-      float32x4_t sqrt_disc = vsqrtq_f32(disc);
-      float32x4_t t_small = vsubq_f32(vnegq_f32(halfb), sqrt_disc);
-
-      for (int i = 0; i < 4; i++) {
-        if (disc[i] < 0) {
-          continue;
-        }
-        float t = t_small[i];
-        if (!interval_surrounds(&this_interval, t_small[i])) {
-          t_big = vaddq_f32(vnegq_f32(halfb), sqrt_disc);
-          t = t_big[i];
-          if (!interval_surrounds(&this_interval, t_big[i])) {
-            continue;
-          }
-        }
-
-        this_interval.max = t;
-        closest_hit_sphere = block - 8 + i;
-      }
-    }
+    // the near root if it's past t_min, otherwise the far one
+    __m512 sqrt_disc = _mm512_sqrt_ps(disc);
+    __m512 neg_halfb = _mm512_sub_ps(zero, halfb);
+    __m512 t_small = _mm512_sub_ps(neg_halfb, sqrt_disc);
+    __m512 t = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(t_small, t_min, _CMP_GT_OQ), _mm512_add_ps(neg_halfb, sqrt_disc), t_small);
+    __mmask16 nearer = _mm512_mask_cmp_ps_mask(_mm512_mask_cmp_ps_mask(valid, t, t_min, _CMP_GT_OQ), t, best_t, _CMP_LT_OQ);
+    best_t = _mm512_mask_mov_ps(best_t, nearer, t);
+    best_i = _mm512_mask_add_epi32(best_i, nearer, lanes, _mm512_set1_epi32(block - start));
+  }
 
-    if (vmaxvq_f32(disc2) >= 0.0f) {
-      float32x4_t sqrt_disc2 = vsqrtq_f32(disc2);
-      float32x4_t t_small2 = vsubq_f32(vnegq_f32(halfb2), sqrt_disc2);
-
-      for (int i = 0; i < 4; i++) {
-        if (disc2[i] < 0) {
-          continue;
-        }
-        float t = t_small2[i];
-        if (!interval_surrounds(&this_interval, t)) {
-          t_big2 = vaddq_f32(vnegq_f32(halfb2), sqrt_disc2);
-          t = t_big2[i];
-          if (!interval_surrounds(&this_interval, t)) {
-            continue;
-          }
-        }
-
-        this_interval.max = t;
-        closest_hit_sphere = block - 4 + i;
-      }
-    }
+  float t = _mm512_reduce_min_ps(best_t);
+  if (!(t < interval->max)) {
+    return false;
+  }
+  __mmask16 nearest = _mm512_cmp_ps_mask(best_t, _mm512_set1_ps(t), _CMP_EQ_OQ);
+  interval->max = t;
+  *closest = start + _mm512_mask_reduce_min_epi32(nearest, best_i);
+  return true;
+}
+
+#endif // SIMD_HAVE_X86
+
+closest_sphere_fn_t closest_sphere = closest_sphere_scalar;
+
+closest_sphere_fn_t closest_sphere_kernel(simd_backend_t backend) {
+  switch (backend) {
+    #if defined(SIMD_HAVE_NEON)
+    case SIMD_NEON: return closest_sphere_neon;
+    #endif
+    #if defined(SIMD_HAVE_X86)
+    case SIMD_SSE41: return closest_sphere_sse41;
+    case SIMD_AVX2: return closest_sphere_avx2;
+    case SIMD_AVX512: return closest_sphere_avx512;
+    #endif
+    default: return closest_sphere_scalar;
   }
+}
+
+// called from select_simd_backend() at startup
+void select_sphere_backend(simd_backend_t backend) {
+  closest_sphere = closest_sphere_kernel(backend);
+}
+
+// fills in rec for a hit at distance t on sphere i
+void set_sphere_hit_record(const sphere_list_t *sphere_list, material_list_t *material_list, size_t i, float t, const ray_t *ray, hit_record_t *rec) {
+  point3_t center = {
+    .e = {
+      *(sphere_list->xs + i),
+      *(sphere_list->ys + i),
+      *(sphere_list->zs + i),
+    }
+  };
+  float recip_r = *(sphere_list->recip_r + i);
+
+  rec->t = t;
+  rec->p = propagate(*ray, rec->t);
+  vec3_t outward_normal = scale(subtract(rec->p, center), recip_r);
+  set_face_normal(rec, ray, outward_normal);
+  rec->mat = &material_list->materials[material_list->indices[i]];
+  rec->sphere = i;
+}
+
+bool hit_sphere_list_vectorized(sphere_list_t *sphere_list, material_list_t *material_list, const ray_t *ray, const interval_t *interval, hit_record_t *rec) {
+  interval_t this_interval = *interval;
+  size_t closest_hit_sphere = 0;
 
-  if (this_interval.max != interval->max) {
-    point3_t center = {
-      .e = {
-        *(sphere_list->xs + closest_hit_sphere),
-        *(sphere_list->ys + closest_hit_sphere),
-        *(sphere_list->zs + closest_hit_sphere),
-      }
-    };
-    float recip_r = *(sphere_list->recip_r + closest_hit_sphere);
-
-    rec->t = this_interval.max;
-    rec->p = propagate(*ray, rec->t);
-    vec3_t outward_normal = scale(subtract(rec->p, center), recip_r);
-    set_face_normal(rec, ray, outward_normal);
-    rec->mat = &material_list->materials[closest_hit_sphere];
+  if (closest_sphere(sphere_list, 0, sphere_list->nth_sphere, ray, &this_interval, &closest_hit_sphere)) {
+    set_sphere_hit_record(sphere_list, material_list, closest_hit_sphere, this_interval.max, ray, rec);
     return true;
   }
   return false;
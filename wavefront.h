@@ -0,0 +1,525 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "camera.h"
+#include "color.h"
+#include "material.h"
+#include "ray.h"
+#include "rng.h"
+#include "rtweekend.h"
+#include "sampling.h"
+#include "scene.h"
+#include "stats.h"
+#include "vec3.h"
+
+// Wavefront path tracing. Instead of following one path to the end like
+// ray_color does, a queue of WAVEFRONT_QUEUE_SIZE paths in flight is pushed
+// through the bounces together, one stage at a time:
+//
+//   intersect  closest hit for every path in the queue
+//   sort       misses pick up the sky and light hits their light, and
+//              both leave; the other hits are counting sorted by material
+//              type into the other queue, which also gathers their hit
+//              point, normal and material parameters
+//   direct     next event estimation for the diffuse hits, shadow rays
+//              and all, adding straight to their pixels
+//   scatter    one kernel per material over its contiguous run of the
+//              queue, straight-line SoA code with no switch on the type
+//   roulette   russian roulette for the paths deep enough to play it
+//   compact    drops the paths that were absorbed, lost at roulette or ran
+//              out of depth
+//   refill     tops the queue back up with new camera samples
+//
+// Random numbers and the direction samples made from them are batched in
+// front of each kernel (rng.h, sampling.h), so the kernels themselves are
+// plain loops over float arrays that the compiler can vectorize. Each path keeps
+// its sample's rng key and bounce number, so it draws exactly the numbers
+// ray_color would have for the same sample.
+
+#define WAVEFRONT_QUEUE_SIZE 4096
+
+// one array of capacity floats (or int32s) per field
+typedef struct {
+  int capacity;
+  int count;
+  // the ray. after sorting, origin is the hit point
+  float *ox, *oy, *oz;
+  float *dx, *dy, *dz;
+  // product of the attenuations so far
+  float *tr, *tg, *tb;
+  // the last bounce's pdf for light_hit, 0 unless it was a diffuse one
+  float *pdf;
+  // from intersect: distance and sphere hit, -1 for a miss and -2 - i
+  // for triangle i
+  float *t;
+  int32_t *sphere;
+  // index into the tile's accumulation buffer
+  int32_t *pixel;
+  // bounces left
+  int32_t *depth;
+  // rng_sample_key of the path's sample and the bounce it's on; stream is
+  // filled in from them right before a scatter kernel runs
+  uint32_t *key;
+  uint32_t *bounce;
+  uint32_t *stream;
+  // filled in by sort for the scatter kernels: outward normal, material
+  // albedo and fuzz (metal) or index of refraction (dielectric)
+  float *nx, *ny, *nz;
+  float *ar, *ag, *ab;
+  float *param;
+  // per path random numbers, drawn right before a kernel runs
+  float *rx, *ry, *rz;
+} path_queue_t;
+
+typedef struct {
+  path_queue_t queues[2];
+  // which of the two holds the live paths
+  int current;
+  // rays traced so far, camera rays and bounces, a queue at a time so it
+  // costs nothing without RENDER_STATS. the bench counts with it.
+  unsigned long rays;
+} wavefront_t;
+
+// carves all the fields out of one allocation. capacity should be a
+// multiple of 16 so every field starts on a cache line.
+void init_path_queue(path_queue_t *queue, int capacity) {
+  float **fields[] = {
+    &queue->ox, &queue->oy, &queue->oz, &queue->dx, &queue->dy, &queue->dz,
+    &queue->tr, &queue->tg, &queue->tb, &queue->pdf, &queue->t,
+    (float **)&queue->sphere, (float **)&queue->pixel, (float **)&queue->depth,
+    (float **)&queue->key, (float **)&queue->bounce, (float **)&queue->stream,
+    &queue->nx, &queue->ny, &queue->nz, &queue->ar, &queue->ag, &queue->ab,
+    &queue->param, &queue->rx, &queue->ry, &queue->rz
+  };
+  size_t n_fields = sizeof(fields) / sizeof(fields[0]);
+  float *block = aligned_alloc(64, n_fields * capacity * sizeof(float));
+  for (size_t f = 0; f < n_fields; f++) {
+    *fields[f] = block + f * capacity;
+  }
+  queue->capacity = capacity;
+  queue->count = 0;
+}
+
+wavefront_t *new_wavefront(void) {
+  wavefront_t *wavefront = malloc(sizeof(wavefront_t));
+  init_path_queue(&wavefront->queues[0], WAVEFRONT_QUEUE_SIZE);
+  init_path_queue(&wavefront->queues[1], WAVEFRONT_QUEUE_SIZE);
+  wavefront->current = 0;
+  wavefront->rays = 0;
+  return wavefront;
+}
+
+void free_wavefront(wavefront_t *wavefront) {
+  // ox is the start of the block
+  free(wavefront->queues[0].ox);
+  free(wavefront->queues[1].ox);
+  free(wavefront);
+}
+
+// moves path from into slot to, only the fields that survive a bounce
+void copy_path(path_queue_t *dst, int to, const path_queue_t *src, int from) {
+  dst->ox[to] = src->ox[from];
+  dst->oy[to] = src->oy[from];
+  dst->oz[to] = src->oz[from];
+  dst->dx[to] = src->dx[from];
+  dst->dy[to] = src->dy[from];
+  dst->dz[to] = src->dz[from];
+  dst->tr[to] = src->tr[from];
+  dst->tg[to] = src->tg[from];
+  dst->tb[to] = src->tb[from];
+  dst->pdf[to] = src->pdf[from];
+  dst->pixel[to] = src->pixel[from];
+  dst->depth[to] = src->depth[from];
+  dst->key[to] = src->key[from];
+  dst->bounce[to] = src->bounce[from];
+}
+
+void wavefront_intersect(const scene_t *scene, path_queue_t *queue) {
+  for (int i = 0; i < queue->count; i++) {
+    ray_t ray = new_ray(new_vec3(queue->ox[i], queue->oy[i], queue->oz[i]),
+                        new_vec3(queue->dx[i], queue->dy[i], queue->dz[i]));
+    interval_t interval = {.min = 0.001, .max = INFINITY};
+    size_t closest = 0;
+    STATS_ADD(primary_rays, queue->bounce[i] == 1);
+    STATS_ADD(secondary_rays, queue->bounce[i] != 1);
+    bool hit = closest_hit_scene(scene, &ray, &interval, &closest);
+    queue->sphere[i] = hit ? (int32_t)closest : -1;
+    if (closest_triangle_scene(scene, &ray, &interval, &closest)) {
+      queue->sphere[i] = -2 - (int32_t)closest;
+    }
+    queue->t[i] = interval.max;
+  }
+}
+
+// misses add throughput * sky to their pixel and light hits throughput *
+// light_hit (weighted only if sample_lights, like trace_path), and both are
+// dropped. the other hits are counting sorted into
+// dst by material type. starts[type] and ends[type] get each type's run in
+// dst, the lights' run being empty.
+void wavefront_sort(const scene_t *scene, bool sample_lights, const path_queue_t *src, path_queue_t *dst, color_t *accum, int starts[N_MATERIAL_TYPES], int ends[N_MATERIAL_TYPES]) {
+  const sphere_list_t *sphere_list = scene->sphere_list;
+  const material_list_t *material_list = scene->material_list;
+  const color_t sky = scene->sky;
+  int counts[N_MATERIAL_TYPES] = {0};
+
+  for (int i = 0; i < src->count; i++) {
+    int32_t s = src->sphere[i];
+    color_t *pixel = &accum[src->pixel[i]];
+    if (s == -1) {
+      STATS_PATH_END(PATH_ESCAPED, src->bounce[i]);
+      float a = 0.5 * (1.0 + src->dy[i]);
+      pixel->e[0] += src->tr[i] * (sky.e[0] * ((1 - a) + 0.5 * a));
+      pixel->e[1] += src->tg[i] * (sky.e[1] * ((1 - a) + 0.7 * a));
+      pixel->e[2] += src->tb[i] * sky.e[2];
+      continue;
+    }
+    material_type_t type = s >= 0 ? sphere_material_type(material_list, s) : sphere_material_type(scene->triangles->materials, -2 - s);
+    counts[type]++;
+    if (type == EMISSIVE) {
+      STATS_PATH_END(PATH_LIGHT, src->bounce[i]);
+      ray_t ray = new_ray(new_vec3(src->ox[i], src->oy[i], src->oz[i]), new_vec3(src->dx[i], src->dy[i], src->dz[i]));
+      hit_record_t rec;
+      if (s >= 0) {
+        set_sphere_hit_record(sphere_list, scene->material_list, s, src->t[i], &ray, &rec);
+      } else {
+        set_triangle_hit_record(scene->triangles, -2 - s, src->t[i], &ray, &rec);
+      }
+      color_t light = light_hit(scene, &rec, ray.origin, sample_lights ? src->pdf[i] : 0.0f);
+      pixel->e[0] += src->tr[i] * light.e[0];
+      pixel->e[1] += src->tg[i] * light.e[1];
+      pixel->e[2] += src->tb[i] * light.e[2];
+    }
+  }
+  for (int m = 0; m < N_MATERIAL_TYPES; m++) {
+    STATS_ADD(material_hits[m], counts[m]);
+  }
+  counts[EMISSIVE] = 0;
+  int next[N_MATERIAL_TYPES];
+  for (int m = 0; m < N_MATERIAL_TYPES; m++) {
+    starts[m] = m > 0 ? ends[m - 1] : 0;
+    ends[m] = starts[m] + counts[m];
+    next[m] = starts[m];
+  }
+
+  for (int i = 0; i < src->count; i++) {
+    int32_t s = src->sphere[i];
+    if (s == -1) {
+      continue;
+    }
+    const material_t *mat = s >= 0 ? sphere_material(material_list, s) : sphere_material(scene->triangles->materials, -2 - s);
+    if (mat->type == EMISSIVE) {
+      continue;
+    }
+    int j = next[mat->type]++;
+    copy_path(dst, j, src, i);
+
+    float t = src->t[i];
+    dst->ox[j] = src->ox[i] + t * src->dx[i];
+    dst->oy[j] = src->oy[i] + t * src->dy[i];
+    dst->oz[j] = src->oz[i] + t * src->dz[i];
+    if (s >= 0) {
+      float recip_r = sphere_list->recip_r[s];
+      dst->nx[j] = (dst->ox[j] - sphere_list->xs[s]) * recip_r;
+      dst->ny[j] = (dst->oy[j] - sphere_list->ys[s]) * recip_r;
+      dst->nz[j] = (dst->oz[j] - sphere_list->zs[s]) * recip_r;
+    } else {
+      vec3_t n = triangle_normal(scene->triangles, -2 - s);
+      dst->nx[j] = n.e[0];
+      dst->ny[j] = n.e[1];
+      dst->nz[j] = n.e[2];
+    }
+
+    switch (mat->type) {
+      case LAMBERTIAN:
+        dst->ar[j] = mat->data.lambertian.albedo.e[0];
+        dst->ag[j] = mat->data.lambertian.albedo.e[1];
+        dst->ab[j] = mat->data.lambertian.albedo.e[2];
+        break;
+      case METAL:
+        dst->ar[j] = mat->data.metal.albedo.e[0];
+        dst->ag[j] = mat->data.metal.albedo.e[1];
+        dst->ab[j] = mat->data.metal.albedo.e[2];
+        dst->param[j] = mat->data.metal.fuzz;
+        break;
+      case DIELECTRIC:
+        dst->param[j] = mat->data.dielectric.ir;
+        break;
+      case EMISSIVE:
+        break;
+    }
+  }
+  dst->count = ends[N_MATERIAL_TYPES - 1];
+}
+
+// the rng stream of each path's current bounce over [start, end), and on
+// to the next bounce
+void wavefront_streams(path_queue_t *queue, int start, int end) {
+  #pragma GCC ivdep
+  for (int i = start; i < end; i++) {
+    queue->stream[i] = rng_bounce_stream(queue->key[i], queue->bounce[i]);
+    queue->bounce[i]++;
+  }
+}
+
+// draws the two numbers each path's sampler takes into rx and ry
+void wavefront_random_pairs(path_queue_t *queue, int start, int end) {
+  wavefront_streams(queue, start, end);
+  rng_uniform_fill(queue->stream + start, 0, queue->rx + start, end - start);
+  rng_uniform_fill(queue->stream + start, 1, queue->ry + start, end - start);
+}
+
+// direct_light for the diffuse hits in [start, end) that have a bounce left
+// after this one, before they scatter, added to their pixels. the shadow
+// rays make it a plain loop rather than a kernel; it draws from the stream
+// of the bounce the path is on, like trace_path.
+void wavefront_direct_light(const scene_t *scene, const path_queue_t *queue, int start, int end, color_t *accum) {
+  for (int i = start; i < end; i++) {
+    if (queue->depth[i] <= 1) {
+      continue;
+    }
+    float flip = queue->dx[i]*queue->nx[i] + queue->dy[i]*queue->ny[i] + queue->dz[i]*queue->nz[i] < 0 ? 1.0f : -1.0f;
+    point3_t p = new_vec3(queue->ox[i], queue->oy[i], queue->oz[i]);
+    vec3_t n = new_vec3(queue->nx[i] * flip, queue->ny[i] * flip, queue->nz[i] * flip);
+    color_t light = direct_light(scene, p, n, rng_bounce_stream(queue->key[i], queue->bounce[i]));
+    color_t *pixel = &accum[queue->pixel[i]];
+    pixel->e[0] += queue->tr[i] * (queue->ar[i] * light.e[0]);
+    pixel->e[1] += queue->tg[i] * (queue->ag[i] * light.e[1]);
+    pixel->e[2] += queue->tb[i] * (queue->ab[i] * light.e[2]);
+  }
+}
+
+// the kernels below are scatter() for one material over a run of the
+// queue, written out on the SoA fields. the fields never overlap, ivdep
+// tells the compiler as much so it vectorizes the loops without emitting
+// alias checks for every pair of arrays. directions are normalized in a
+// pass of their own with normalize_floats (fastmath.h), which gives the
+// same bits as normalize() in scatter().
+
+void scatter_lambertian_kernel(path_queue_t *queue, int start, int end) {
+  wavefront_random_pairs(queue, start, end);
+  cosine_hemisphere_points(queue->rx + start, queue->ry + start, queue->rx + start, queue->ry + start, queue->rz + start, end - start);
+  float *dx = queue->dx, *dy = queue->dy, *dz = queue->dz;
+  float *tr = queue->tr, *tg = queue->tg, *tb = queue->tb;
+  float *pdf = queue->pdf;
+  int32_t *depth = queue->depth;
+  const float *nxs = queue->nx, *nys = queue->ny, *nzs = queue->nz;
+  const float *rx = queue->rx, *ry = queue->ry, *rz = queue->rz;
+  const float *ar = queue->ar, *ag = queue->ag, *ab = queue->ab;
+
+  #pragma GCC ivdep
+  for (int i = start; i < end; i++) {
+    // normal against the ray, then the sample turned to face along it
+    float flip = dx[i]*nxs[i] + dy[i]*nys[i] + dz[i]*nzs[i] < 0 ? 1.0f : -1.0f;
+    float nx = nxs[i] * flip, ny = nys[i] * flip, nz = nzs[i] * flip;
+    float sx, sy, sz;
+    frame_to_world(nx, ny, nz, rx[i], ry[i], rz[i], &sx, &sy, &sz);
+    dx[i] = sx;
+    dy[i] = sy;
+    dz[i] = sz;
+    // the flip until the direction's normalized
+    pdf[i] = flip;
+    tr[i] *= ar[i];
+    tg[i] *= ag[i];
+    tb[i] *= ab[i];
+    depth[i] -= 1;
+  }
+  normalize_floats(dx + start, dy + start, dz + start, end - start);
+  #pragma GCC ivdep
+  for (int i = start; i < end; i++) {
+    float nx = nxs[i] * pdf[i], ny = nys[i] * pdf[i], nz = nzs[i] * pdf[i];
+    pdf[i] = max_float(0.0f, dx[i]*nx + dy[i]*ny + dz[i]*nz) / pi;
+  }
+}
+
+void scatter_metal_kernel(path_queue_t *queue, int start, int end) {
+  wavefront_random_pairs(queue, start, end);
+  uniform_sphere_points(queue->rx + start, queue->ry + start, queue->rx + start, queue->ry + start, queue->rz + start, end - start);
+  float *dx = queue->dx, *dy = queue->dy, *dz = queue->dz;
+  float *tr = queue->tr, *tg = queue->tg, *tb = queue->tb;
+  float *pdf = queue->pdf;
+  int32_t *depth = queue->depth;
+  const float *nxs = queue->nx, *nys = queue->ny, *nzs = queue->nz;
+  const float *rx = queue->rx, *ry = queue->ry, *rz = queue->rz;
+  const float *ar = queue->ar, *ag = queue->ag, *ab = queue->ab;
+  const float *fuzz = queue->param;
+
+  #pragma GCC ivdep
+  for (int i = start; i < end; i++) {
+    float d_dot_n = dx[i]*nxs[i] + dy[i]*nys[i] + dz[i]*nzs[i];
+    float flip = d_dot_n < 0 ? 1.0f : -1.0f;
+    float nx = nxs[i] * flip, ny = nys[i] * flip, nz = nzs[i] * flip;
+    d_dot_n *= flip;
+    float sx = dx[i] - 2*d_dot_n*nx + rx[i]*fuzz[i];
+    float sy = dy[i] - 2*d_dot_n*ny + ry[i]*fuzz[i];
+    float sz = dz[i] - 2*d_dot_n*nz + rz[i]*fuzz[i];
+    // scattered below the surface: absorbed, which leaves depth at -1 so
+    // compact can tell it from running out
+    bool absorbed = sx*nx + sy*ny + sz*nz <= 0;
+    dx[i] = sx;
+    dy[i] = sy;
+    dz[i] = sz;
+    tr[i] *= ar[i];
+    tg[i] *= ag[i];
+    tb[i] *= ab[i];
+    pdf[i] = 0.0f;
+    depth[i] = absorbed ? -1 : depth[i] - 1;
+  }
+  normalize_floats(dx + start, dy + start, dz + start, end - start);
+}
+
+void scatter_dielectric_kernel(path_queue_t *queue, int start, int end) {
+  wavefront_streams(queue, start, end);
+  rng_uniform_fill(queue->stream + start, 0, queue->rx + start, end - start);
+  float *dx = queue->dx, *dy = queue->dy, *dz = queue->dz;
+  float *pdf = queue->pdf;
+  int32_t *depth = queue->depth;
+  const float *nxs = queue->nx, *nys = queue->ny, *nzs = queue->nz;
+  const float *rand = queue->rx, *irs = queue->param;
+
+  normalize_floats(dx + start, dy + start, dz + start, end - start);
+  #pragma GCC ivdep
+  for (int i = start; i < end; i++) {
+    float ux = dx[i], uy = dy[i], uz = dz[i];
+    float u_dot_n = ux*nxs[i] + uy*nys[i] + uz*nzs[i];
+    bool front_face = u_dot_n < 0;
+    float flip = front_face ? 1.0f : -1.0f;
+    float nx = nxs[i] * flip, ny = nys[i] * flip, nz = nzs[i] * flip;
+    float inv_ir = 1.0f / irs[i];
+    float ratio = front_face ? inv_ir : irs[i];
+
+    float cos_theta = min_float(-u_dot_n * flip, 1.0f);
+    float sin_theta = sqrtf(1 - cos_theta*cos_theta);
+    // Schlick's approximation
+    float r0 = (1 - ratio) / (1 + ratio);
+    r0 = r0*r0;
+    float reflectance = r0 + (1 - r0)*schlick_weight(cos_theta);
+    bool reflects = (ratio*sin_theta > 1) | (reflectance > rand[i]);
+
+    float rx = ux + 2*cos_theta*nx, ry = uy + 2*cos_theta*ny, rz = uz + 2*cos_theta*nz;
+    float px = ratio * (ux + cos_theta*nx), py = ratio * (uy + cos_theta*ny), pz = ratio * (uz + cos_theta*nz);
+    float parallel = -sqrtf(fabsf(1 - (px*px + py*py + pz*pz)));
+    px += parallel * nx;
+    py += parallel * ny;
+    pz += parallel * nz;
+
+    dx[i] = reflects ? rx : px;
+    dy[i] = reflects ? ry : py;
+    dz[i] = reflects ? rz : pz;
+    pdf[i] = 0.0f;
+    depth[i] -= 1;
+  }
+  normalize_floats(dx + start, dy + start, dz + start, end - start);
+}
+
+// russian roulette for the paths that have traced roulette_depth rays and
+// have some left, the same rounds trace_path plays. the losers' depth goes
+// to -2 for compact. every path in the queue has just scattered, so stream
+// is its last bounce's.
+void wavefront_roulette(path_queue_t *queue, int roulette_depth) {
+  if (roulette_depth <= 0) {
+    return;
+  }
+  float *tr = queue->tr, *tg = queue->tg, *tb = queue->tb;
+  int32_t *depth = queue->depth;
+  const uint32_t *bounce = queue->bounce, *stream = queue->stream;
+
+  #pragma GCC ivdep
+  for (int i = 0; i < queue->count; i++) {
+    // bounce has moved on to the next one, so it's one past the rays traced
+    bool plays = depth[i] > 0 && bounce[i] > (uint32_t)roulette_depth;
+    float p = roulette_survival(tr[i], tg[i], tb[i]);
+    bool loses = plays && rng_uniform(stream[i], ROULETTE_DIMENSION) >= p;
+    float weight = plays ? 1.0f / p : 1.0f;
+    tr[i] *= weight;
+    tg[i] *= weight;
+    tb[i] *= weight;
+    depth[i] = loses ? -2 : depth[i];
+  }
+}
+
+// drops paths with no depth left, in place, keeping the order
+void wavefront_compact(path_queue_t *queue) {
+  int n = 0;
+  for (int i = 0; i < queue->count; i++) {
+    if (queue->depth[i] > 0) {
+      if (n != i) {
+        copy_path(queue, n, queue, i);
+      }
+      n++;
+    } else {
+      // bounce has already moved on past the last ray
+      STATS_PATH_END(queue->depth[i] == -2 ? PATH_ROULETTE : (queue->depth[i] == -1 ? PATH_ABSORBED : PATH_CUT_OFF),
+                     queue->bounce[i] - 1);
+    }
+  }
+  queue->count = n;
+}
+
+// traces samples samples for each pixel of the tile [x0, x1) x [y0, y1),
+// numbered from first_sample, and leaves their sums in accum (row major,
+// x1 - x0 wide). samples are handed out in pixel order, so the paths in
+// flight come from a few neighbouring pixels.
+void wavefront_render_tile(wavefront_t *wavefront, const camera_t *camera, const scene_t *scene, int x0, int y0, int x1, int y1, int first_sample, int samples, color_t *accum) {
+  int w = x1 - x0;
+  int n_pixels = w * (y1 - y0);
+  long n_samples = camera->max_depth > 0 ? (long)n_pixels * samples : 0;
+  long next_sample = 0;
+  memset(accum, 0, n_pixels * sizeof(color_t));
+
+  bool sample_lights = samples_lights(camera, scene);
+  path_queue_t *queue = &wavefront->queues[wavefront->current];
+  queue->count = 0;
+  for (;;) {
+    while (queue->count < queue->capacity && next_sample < n_samples) {
+      int p = next_sample / samples;
+      int sample = first_sample + next_sample % samples;
+      next_sample++;
+      int x = x0 + p % w, y = y0 + p / w;
+      point3_t pixel_center = add(camera->pixel00_loc, scale(camera->pixel_delta_u, x));
+      add_equals(&pixel_center, scale(camera->pixel_delta_v, y));
+      rng_begin_sample(y * camera->image_width + x, sample);
+      ray_t ray = sample_ray(camera, pixel_center);
+
+      int i = queue->count++;
+      queue->ox[i] = ray.origin.e[0];
+      queue->oy[i] = ray.origin.e[1];
+      queue->oz[i] = ray.origin.e[2];
+      queue->dx[i] = ray.direction.e[0];
+      queue->dy[i] = ray.direction.e[1];
+      queue->dz[i] = ray.direction.e[2];
+      queue->tr[i] = queue->tg[i] = queue->tb[i] = 1.0f;
+      queue->pdf[i] = 0.0f;
+      queue->pixel[i] = p;
+      queue->depth[i] = camera->max_depth;
+      queue->key[i] = g_rng.key;
+      queue->bounce[i] = 1;
+    }
+    if (queue->count == 0) {
+      break;
+    }
+
+    wavefront->rays += queue->count;
+    wavefront_intersect(scene, queue);
+
+    path_queue_t *sorted = &wavefront->queues[1 - wavefront->current];
+    int starts[N_MATERIAL_TYPES], ends[N_MATERIAL_TYPES];
+    wavefront_sort(scene, sample_lights, queue, sorted, accum, starts, ends);
+    wavefront->current = 1 - wavefront->current;
+    queue = sorted;
+
+    if (sample_lights) {
+      wavefront_direct_light(scene, queue, starts[LAMBERTIAN], ends[LAMBERTIAN], accum);
+    }
+    scatter_lambertian_kernel(queue, starts[LAMBERTIAN], ends[LAMBERTIAN]);
+    scatter_metal_kernel(queue, starts[METAL], ends[METAL]);
+    scatter_dielectric_kernel(queue, starts[DIELECTRIC], ends[DIELECTRIC]);
+    wavefront_roulette(queue, camera->roulette_depth);
+    wavefront_compact(queue);
+  }
+}
+
+#endif // !WAVEFRONT_H
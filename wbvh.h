@@ -0,0 +1,469 @@
+#ifndef WBVH_H
+#define WBVH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "interval.h"
+#include "material.h"
+#include "ray.h"
+#include "rtweekend.h"
+#include "simd.h"
+#include "stats.h"
+#include "vec3.h"
+#include "vectorized.h"
+
+// Wide (4 or 8 way) BVH collapsed from the binary one in bvh.h. Each node
+// stores its children's bounds SoA, one row per plane, so a single SIMD pass
+// slab-tests the ray against every child at once:
+//
+//   float min_x[W], min_y[W], min_z[W], max_x[W], max_y[W], max_z[W];
+//   int32_t child[W];   // inner: wide node index, leaf: first sphere, -1: empty
+//   uint32_t count[W];  // leaf: number of spheres, inner/empty: 0
+//
+// that's 32*W bytes, so a BVH4 node is two cache lines and a BVH8 node four.
+// Leaves still point at contiguous SoA runs of the (BVH-ordered) sphere list
+// and are tested with closest_sphere(). Width 4 goes with the 128-bit
+// backends (SSE4.1, NEON) and width 8 with AVX2 and AVX-512.
+
+#define WBVH_MAX_WIDTH 8
+#define WBVH_STACK_SIZE (BVH_STACK_SIZE * (WBVH_MAX_WIDTH - 1))
+
+enum {
+  WBVH_MIN_X, WBVH_MIN_Y, WBVH_MIN_Z,
+  WBVH_MAX_X, WBVH_MAX_Y, WBVH_MAX_Z,
+  WBVH_ROWS
+};
+
+typedef struct {
+  float *nodes;
+  int width;
+  size_t n_nodes;
+  // floats per node
+  size_t node_stride;
+  int depth;
+  double build_seconds;
+  // the binary tree's arena, which this one is in too if it's set
+  arena_t *arena;
+} wbvh_t;
+
+// ray set up once per traversal: near[a]/far[a] are the bounds rows to use
+// for the entry and exit planes on axis a, picked from the direction's sign,
+// so the slab test needs no min/max per axis
+typedef struct {
+  float org_inv[3];
+  float inv_dir[3];
+  int near[3];
+  int far[3];
+} wbvh_ray_t;
+
+// slab tests a ray against every child of a node. returns a bitmask of the
+// children hit within [t_min, t_max] and writes their entry distances
+typedef unsigned int (*wbvh_node_test_fn_t)(const float *node, const wbvh_ray_t *ray, float t_min, float t_max, float *t_near);
+
+float *wbvh_node(const wbvh_t *wbvh, size_t i) {
+  return wbvh->nodes + i * wbvh->node_stride;
+}
+
+int32_t *wbvh_children(const float *node, int width) {
+  return (int32_t *)(node + WBVH_ROWS * width);
+}
+
+uint32_t *wbvh_counts(const float *node, int width) {
+  return (uint32_t *)(node + (WBVH_ROWS + 1) * width);
+}
+
+// index of the wide node just created for binary node b_index
+uint32_t wbvh_collapse(wbvh_t *wbvh, const bvh_t *bvh, uint32_t b_index, int depth) {
+  int width = wbvh->width;
+  uint32_t index = wbvh->n_nodes++;
+  float *node = wbvh_node(wbvh, index);
+  int32_t *child = wbvh_children(node, width);
+  uint32_t *count = wbvh_counts(node, width);
+  wbvh->depth = depth > wbvh->depth ? depth : wbvh->depth;
+
+  // start from the two children and keep opening up the inner child with
+  // the biggest surface area until the node is full
+  uint32_t gathered[WBVH_MAX_WIDTH];
+  int n = 0;
+  const bvh_node_t *b_node = &bvh->nodes[b_index];
+  if (b_node->count > 0) {
+    gathered[n++] = b_index;
+  } else {
+    gathered[n++] = b_node->left_first;
+    gathered[n++] = b_node->left_first + 1;
+  }
+  while (n < width) {
+    int best = -1;
+    float best_area = -1.0f;
+    for (int i = 0; i < n; i++) {
+      const bvh_node_t *c = &bvh->nodes[gathered[i]];
+      if (c->count > 0) {
+        continue;
+      }
+      aabb_t box;
+      memcpy(box.min, c->min, sizeof(box.min));
+      memcpy(box.max, c->max, sizeof(box.max));
+      float area = aabb_half_area(&box);
+      if (area > best_area) {
+        best_area = area;
+        best = i;
+      }
+    }
+    if (best < 0) {
+      break;
+    }
+    uint32_t left = bvh->nodes[gathered[best]].left_first;
+    gathered[best] = left;
+    gathered[n++] = left + 1;
+  }
+
+  for (int i = 0; i < width; i++) {
+    if (i >= n) {
+      for (int r = 0; r < WBVH_ROWS; r++) {
+        node[r * width + i] = 0.0f;
+      }
+      child[i] = -1;
+      count[i] = 0;
+      continue;
+    }
+    const bvh_node_t *c = &bvh->nodes[gathered[i]];
+    for (int a = 0; a < 3; a++) {
+      node[(WBVH_MIN_X + a) * width + i] = c->min[a];
+      node[(WBVH_MAX_X + a) * width + i] = c->max[a];
+    }
+    if (c->count > 0) {
+      child[i] = c->left_first;
+      count[i] = c->count;
+    } else {
+      count[i] = 0;
+      child[i] = wbvh_collapse(wbvh, bvh, gathered[i], depth + 1);
+    }
+  }
+  return index;
+}
+
+wbvh_t *build_wbvh(const bvh_t *bvh, int width) {
+  double start_time = now_seconds();
+
+  wbvh_t *wbvh = arena_or_heap(bvh->arena, sizeof(wbvh_t));
+  wbvh->arena = bvh->arena;
+  wbvh->width = width;
+  wbvh->node_stride = (WBVH_ROWS + 2) * width;
+  wbvh->n_nodes = 0;
+  wbvh->depth = 0;
+
+  // every wide node eats at least one binary inner node, so this is plenty
+  size_t max_nodes = bvh->n_nodes;
+  size_t bytes = (max_nodes * wbvh->node_stride * sizeof(float) + 63) & ~(size_t)63;
+  wbvh->nodes = aligned_alloc(64, bytes);
+
+  if (bvh->n_prims > 0) {
+    wbvh_collapse(wbvh, bvh, 0, 0);
+  }
+  if (wbvh->arena != NULL) {
+    // only the nodes used go in the arena
+    size_t used = (wbvh->n_nodes * wbvh->node_stride * sizeof(float) + 63) & ~(size_t)63;
+    float *nodes = arena_alloc(wbvh->arena, used);
+    memcpy(nodes, wbvh->nodes, used);
+    free(wbvh->nodes);
+    wbvh->nodes = nodes;
+  }
+  wbvh->build_seconds = now_seconds() - start_time;
+  return wbvh;
+}
+
+void free_wbvh(wbvh_t *wbvh) {
+  arena_or_heap_free(wbvh->arena, wbvh->nodes);
+  arena_or_heap_free(wbvh->arena, wbvh);
+}
+
+// refit_bvh for the wide tree: recomputes every child's bounds from the
+// spheres as they are now. wide nodes also come after their parent, so a
+// sweep from the back has each inner child's own bounds ready, kept in
+// node_bounds (one per node) until its parent picks them up.
+void refit_wbvh(wbvh_t *wbvh, const sphere_list_t *sphere_list) {
+  int width = wbvh->width;
+  aabb_t *node_bounds = malloc((wbvh->n_nodes > 0 ? wbvh->n_nodes : 1) * sizeof(aabb_t));
+  for (size_t i = wbvh->n_nodes - 1; i != (size_t)-1; i--) {
+    float *node = wbvh_node(wbvh, i);
+    const int32_t *child = wbvh_children(node, width);
+    const uint32_t *count = wbvh_counts(node, width);
+    aabb_reset(&node_bounds[i]);
+    for (int c = 0; c < width; c++) {
+      if (child[c] < 0) {
+        continue;
+      }
+      aabb_t box;
+      if (count[c] > 0) {
+        aabb_reset(&box);
+        for (uint32_t k = child[c]; k < child[c] + count[c]; k++) {
+          aabb_t sphere = sphere_aabb(sphere_list, k);
+          aabb_grow(&box, &sphere);
+        }
+      } else {
+        box = node_bounds[child[c]];
+      }
+      for (int a = 0; a < 3; a++) {
+        node[(WBVH_MIN_X + a) * width + c] = box.min[a];
+        node[(WBVH_MAX_X + a) * width + c] = box.max[a];
+      }
+      aabb_grow(&node_bounds[i], &box);
+    }
+  }
+  free(node_bounds);
+}
+
+// the wide node width that suits a backend's vector registers
+int wbvh_width_for_backend(simd_backend_t backend) {
+  return simd_backend_width(backend) >= 8 ? 8 : 4;
+}
+
+unsigned int wbvh_node_test_scalar(const float *node, const wbvh_ray_t *ray, float t_min, float t_max, float *t_near, int width) {
+  const int32_t *child = wbvh_children(node, width);
+  unsigned int mask = 0;
+  for (int i = 0; i < width; i++) {
+    float t0 = t_min, t1 = t_max;
+    for (int a = 0; a < 3; a++) {
+      t0 = max_float(t0, node[ray->near[a] * width + i] * ray->inv_dir[a] - ray->org_inv[a]);
+      t1 = min_float(t1, node[ray->far[a] * width + i] * ray->inv_dir[a] - ray->org_inv[a]);
+    }
+    t_near[i] = t0;
+    if (t0 <= t1 && child[i] >= 0) {
+      mask |= 1u << i;
+    }
+  }
+  return mask;
+}
+
+unsigned int wbvh_node_test_4_scalar(const float *node, const wbvh_ray_t *ray, float t_min, float t_max, float *t_near) {
+  return wbvh_node_test_scalar(node, ray, t_min, t_max, t_near, 4);
+}
+
+unsigned int wbvh_node_test_8_scalar(const float *node, const wbvh_ray_t *ray, float t_min, float t_max, float *t_near) {
+  return wbvh_node_test_scalar(node, ray, t_min, t_max, t_near, 8);
+}
+
+#if defined(SIMD_HAVE_NEON)
+
+unsigned int wbvh_node_test_4_neon(const float *node, const wbvh_ray_t *ray, float t_min, float t_max, float *t_near) {
+  float32x4_t t0 = vdupq_n_f32(t_min);
+  float32x4_t t1 = vdupq_n_f32(t_max);
+  for (int a = 0; a < 3; a++) {
+    float32x4_t inv = vdupq_n_f32(ray->inv_dir[a]);
+    float32x4_t org_inv = vdupq_n_f32(ray->org_inv[a]);
+    float32x4_t near = vsubq_f32(vmulq_f32(vld1q_f32(node + ray->near[a] * 4), inv), org_inv);
+    float32x4_t far = vsubq_f32(vmulq_f32(vld1q_f32(node + ray->far[a] * 4), inv), org_inv);
+    t0 = vmaxq_f32(t0, near);
+    t1 = vminq_f32(t1, far);
+  }
+  vst1q_f32(t_near, t0);
+  uint32x4_t valid = vcgeq_s32(vld1q_s32(wbvh_children(node, 4)), vdupq_n_s32(0));
+  uint32x4_t hit = vandq_u32(vcleq_f32(t0, t1), valid);
+  // squash the 4 lane masks down to 4 bits
+  const uint32_t bits[4] = {1, 2, 4, 8};
+  return vaddvq_u32(vandq_u32(hit, vld1q_u32(bits)));
+}
+
+#endif // SIMD_HAVE_NEON
+
+#if defined(SIMD_HAVE_X86)
+
+__attribute__((target("sse4.1")))
+unsigned int wbvh_node_test_4_sse41(const float *node, const wbvh_ray_t *ray, float t_min, float t_max, float *t_near) {
+  __m128 t0 = _mm_set1_ps(t_min);
+  __m128 t1 = _mm_set1_ps(t_max);
+  for (int a = 0; a < 3; a++) {
+    __m128 inv = _mm_set1_ps(ray->inv_dir[a]);
+    __m128 org_inv = _mm_set1_ps(ray->org_inv[a]);
+    __m128 near = _mm_sub_ps(_mm_mul_ps(_mm_load_ps(node + ray->near[a] * 4), inv), org_inv);
+    __m128 far = _mm_sub_ps(_mm_mul_ps(_mm_load_ps(node + ray->far[a] * 4), inv), org_inv);
+    t0 = _mm_max_ps(t0, near);
+    t1 = _mm_min_ps(t1, far);
+  }
+  _mm_storeu_ps(t_near, t0);
+  __m128i valid = _mm_cmpgt_epi32(_mm_load_si128((const __m128i *)wbvh_children(node, 4)), _mm_set1_epi32(-1));
+  __m128 hit = _mm_and_ps(_mm_cmple_ps(t0, t1), _mm_castsi128_ps(valid));
+  return _mm_movemask_ps(hit);
+}
+
+__attribute__((target("avx2,fma")))
+unsigned int wbvh_node_test_8_avx2(const float *node, const wbvh_ray_t *ray, float t_min, float t_max, float *t_near) {
+  __m256 t0 = _mm256_set1_ps(t_min);
+  __m256 t1 = _mm256_set1_ps(t_max);
+  for (int a = 0; a < 3; a++) {
+    __m256 inv = _mm256_set1_ps(ray->inv_dir[a]);
+    __m256 org_inv = _mm256_set1_ps(ray->org_inv[a]);
+    __m256 near = _mm256_fmsub_ps(_mm256_load_ps(node + ray->near[a] * 8), inv, org_inv);
+    __m256 far = _mm256_fmsub_ps(_mm256_load_ps(node + ray->far[a] * 8), inv, org_inv);
+    t0 = _mm256_max_ps(t0, near);
+    t1 = _mm256_min_ps(t1, far);
+  }
+  _mm256_storeu_ps(t_near, t0);
+  __m256i valid = _mm256_cmpgt_epi32(_mm256_load_si256((const __m256i *)wbvh_children(node, 8)), _mm256_set1_epi32(-1));
+  __m256 hit = _mm256_and_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ), _mm256_castsi256_ps(valid));
+  return _mm256_movemask_ps(hit);
+}
+
+#endif // SIMD_HAVE_X86
+
+wbvh_node_test_fn_t wbvh_node_test_kernel(simd_backend_t backend, int width) {
+  switch (backend) {
+    #if defined(SIMD_HAVE_NEON)
+    case SIMD_NEON:
+      return width == 4 ? wbvh_node_test_4_neon : wbvh_node_test_8_scalar;
+    #endif
+    #if defined(SIMD_HAVE_X86)
+    case SIMD_SSE41:
+      return width == 4 ? wbvh_node_test_4_sse41 : wbvh_node_test_8_scalar;
+    case SIMD_AVX2:
+    case SIMD_AVX512:
+      return width == 4 ? wbvh_node_test_4_sse41 : wbvh_node_test_8_avx2;
+    #endif
+    default:
+      return width == 4 ? wbvh_node_test_4_scalar : wbvh_node_test_8_scalar;
+  }
+}
+
+wbvh_node_test_fn_t wbvh_node_test_4 = wbvh_node_test_4_scalar;
+wbvh_node_test_fn_t wbvh_node_test_8 = wbvh_node_test_8_scalar;
+
+// called from select_simd_backend() at startup
+void select_wbvh_backend(simd_backend_t backend) {
+  wbvh_node_test_4 = wbvh_node_test_kernel(backend, 4);
+  wbvh_node_test_8 = wbvh_node_test_kernel(backend, 8);
+}
+
+typedef struct {
+  uint32_t ref;
+  // 0 for an inner node, otherwise ref is a leaf's first sphere
+  uint32_t count;
+  float t;
+} wbvh_stack_entry_t;
+
+wbvh_ray_t new_wbvh_ray(const ray_t *ray) {
+  wbvh_ray_t r;
+  for (int a = 0; a < 3; a++) {
+    r.inv_dir[a] = 1.0f / ray->direction.e[a];
+    r.org_inv[a] = ray->origin.e[a] * r.inv_dir[a];
+    r.near[a] = r.inv_dir[a] >= 0.0f ? WBVH_MIN_X + a : WBVH_MAX_X + a;
+    r.far[a] = r.inv_dir[a] >= 0.0f ? WBVH_MAX_X + a : WBVH_MIN_X + a;
+  }
+  return r;
+}
+
+// same contract as closest_sphere_bvh()
+bool closest_sphere_wbvh(const wbvh_t *wbvh, const sphere_list_t *sphere_list, const ray_t *ray, interval_t *interval, size_t *closest) {
+  if (wbvh->n_nodes == 0) {
+    return false;
+  }
+
+  int width = wbvh->width;
+  wbvh_node_test_fn_t node_test = width == 4 ? wbvh_node_test_4 : wbvh_node_test_8;
+  wbvh_ray_t wray = new_wbvh_ray(ray);
+
+  wbvh_stack_entry_t stack[WBVH_STACK_SIZE];
+  int sp = 0;
+  stack[sp++] = (wbvh_stack_entry_t){.ref = 0, .count = 0, .t = interval->min};
+  bool hit = false;
+
+  while (sp > 0) {
+    wbvh_stack_entry_t entry = stack[--sp];
+    if (entry.t > interval->max) {
+      continue;
+    }
+    if (entry.count > 0) {
+      STATS_ADD(sphere_tests, entry.count);
+      if (closest_sphere(sphere_list, entry.ref, entry.ref + entry.count, ray, interval, closest)) {
+        hit = true;
+      }
+      continue;
+    }
+
+    const float *node = wbvh_node(wbvh, entry.ref);
+    BVH_COUNT_VISIT();
+    float t_near[WBVH_MAX_WIDTH];
+    unsigned int mask = node_test(node, &wray, interval->min, interval->max, t_near);
+    if (mask == 0) {
+      continue;
+    }
+
+    const int32_t *child = wbvh_children(node, width);
+    const uint32_t *count = wbvh_counts(node, width);
+
+    // push the hit children far to near so the nearest is popped first.
+    // it's at most 8 entries so an insertion sort into the stack is fine.
+    int base = sp;
+    while (mask) {
+      int i = __builtin_ctz(mask);
+      mask &= mask - 1;
+      wbvh_stack_entry_t e = {.ref = child[i], .count = count[i], .t = t_near[i]};
+      int j = sp++;
+      while (j > base && stack[j - 1].t < e.t) {
+        stack[j] = stack[j - 1];
+        j--;
+      }
+      stack[j] = e;
+    }
+  }
+  return hit;
+}
+
+// same contract as occluded_bvh()
+bool occluded_wbvh(const wbvh_t *wbvh, const sphere_list_t *sphere_list, const ray_t *ray, const interval_t *interval) {
+  if (wbvh->n_nodes == 0) {
+    return false;
+  }
+
+  int width = wbvh->width;
+  wbvh_node_test_fn_t node_test = width == 4 ? wbvh_node_test_4 : wbvh_node_test_8;
+  wbvh_ray_t wray = new_wbvh_ray(ray);
+
+  wbvh_stack_entry_t stack[WBVH_STACK_SIZE];
+  int sp = 0;
+  stack[sp++] = (wbvh_stack_entry_t){.ref = 0, .count = 0, .t = interval->min};
+
+  while (sp > 0) {
+    wbvh_stack_entry_t entry = stack[--sp];
+    if (entry.count > 0) {
+      interval_t leaf_interval = *interval;
+      size_t closest;
+      STATS_ADD(sphere_tests, entry.count);
+      if (closest_sphere(sphere_list, entry.ref, entry.ref + entry.count, ray, &leaf_interval, &closest)) {
+        return true;
+      }
+      continue;
+    }
+
+    const float *node = wbvh_node(wbvh, entry.ref);
+    BVH_COUNT_VISIT();
+    float t_near[WBVH_MAX_WIDTH];
+    unsigned int mask = node_test(node, &wray, interval->min, interval->max, t_near);
+    const int32_t *child = wbvh_children(node, width);
+    const uint32_t *count = wbvh_counts(node, width);
+    while (mask) {
+      int i = __builtin_ctz(mask);
+      mask &= mask - 1;
+      stack[sp++] = (wbvh_stack_entry_t){.ref = child[i], .count = count[i], .t = t_near[i]};
+    }
+  }
+  return false;
+}
+
+bool hit_wbvh(const wbvh_t *wbvh, sphere_list_t *sphere_list, material_list_t *material_list, const ray_t *ray, const interval_t *interval, hit_record_t *rec) {
+  interval_t this_interval = *interval;
+  size_t closest_hit_sphere = 0;
+
+  if (closest_sphere_wbvh(wbvh, sphere_list, ray, &this_interval, &closest_hit_sphere)) {
+    set_sphere_hit_record(sphere_list, material_list, closest_hit_sphere, this_interval.max, ray, rec);
+    return true;
+  }
+  return false;
+}
+
+#endif // !WBVH_H